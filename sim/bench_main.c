@@ -0,0 +1,29 @@
+/* Host build of the hot path benchmarks (src/bench.c): the ADC reads come
+ * from the replay backend with a constant input, and the external ADC is
+ * the mock on the bus.
+ *
+ *   bench > bench.jsonl
+ */
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+#include "hal_replay.h"
+#include "hal_mock_bus.h"
+#include "bench.h"
+
+#define SPAN_START_MS   1685577600000LL
+
+
+int main(void) {
+    const int32_t constant[TRACE_N_COLUMNS] = { [TRACE_PANEL] = 1000, [TRACE_BIAS] = 500, [TRACE_BATTERY] = 2000 };
+    const int ext_inputs[MOCK_BUS_INPUTS] = { HAL_ADC_PANEL, HAL_ADC_BIAS, -1, -1 };
+
+    if (hal_replay_span(SPAN_START_MS, 1000, constant)
+            || hal_replay_bind(HAL_ADC_PANEL, TRACE_PANEL)
+            || hal_replay_bind(HAL_ADC_BIAS, TRACE_BIAS)
+            || hal_replay_bind(HAL_ADC_BATTERY, TRACE_BATTERY)
+            || hal_mock_bus_attach(CONFIG_EXT_ADC_I2C_ADDRESS, CONFIG_EXT_ADC_READY_PIN, ext_inputs))
+        return 1;
+    return bench_run();
+}
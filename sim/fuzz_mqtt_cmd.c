@@ -0,0 +1,141 @@
+/* libFuzzer target of the MQTT command parser (src/mqtt_cmd.c). The input
+ * is a sequence of MQTT_EVENT_DATA events as the client could deliver them,
+ * each one
+ *   [flags][topic_len][topic...][offset u16][total_len u16][data_len][data...]
+ * (topic only when flags & 1, lengths cut to what is left of the input), so
+ * the fuzzer drives current_data_offset freely: chunks in order, repeated,
+ * skipped, with a topic when they should have none, or a new message in the
+ * middle of one. Every reassembled message goes through mqtt_cmd_parse, and
+ * each field through mqtt_cmd_parse_uint as backfill reads it. Topic and data
+ * are copied to buffers of their exact size, so any read past them is caught.
+ *
+ *   pio run -e fuzz && .pio/build/fuzz/program -max_total_time=300 corpus/
+ *
+ * Without libFuzzer (gcc), -DFUZZ_REPLAY adds a main that runs the files
+ * given on the command line, to replay a crash or a corpus.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_cmd.h"
+
+const int IRRADIATION_ADC_INDEX = 0;
+const int BATTERY_ADC_INDEX = 1;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); abort(); } } while (0)
+
+struct input {
+    const uint8_t *p;
+    size_t left;
+};
+
+
+static unsigned take_u8(struct input *in) {
+    if (in->left == 0)
+        return 0;
+    in->left--;
+    return *in->p++;
+}
+
+
+static unsigned take_u16(struct input *in) {
+    unsigned lo = take_u8(in);
+    return lo | take_u8(in) << 8;
+}
+
+
+/* The next `len` bytes of the input in a heap buffer of exactly that size */
+static char *take_bytes(struct input *in, unsigned *len) {
+    if (*len > in->left)
+        *len = in->left;
+    char *copy = malloc(*len ? *len : 1);
+    memcpy(copy, in->p, *len);
+    in->p += *len;
+    in->left -= *len;
+    return copy;
+}
+
+
+static void check_message(const struct mqtt_message *msg) {
+    struct mqtt_cmd cmd;
+    uint32_t value;
+
+    CHECK(msg->topic_len >= 0 && msg->data_len >= 0);
+    switch (mqtt_cmd_parse(msg, &cmd)) {
+        case 0:
+            CHECK(strcmp(mqtt_cmd_name(cmd.kind), "?") != 0);
+            CHECK(cmd.adc == -1 || cmd.adc == IRRADIATION_ADC_INDEX || cmd.adc == BATTERY_ADC_INDEX);
+            if (cmd.kind == MQTT_CMD_SAMPLE_FREQUENCY || cmd.kind == MQTT_CMD_SEND_FREQUENCY)
+                CHECK(cmd.value >= 1 && cmd.value <= 86400);
+            if (cmd.kind == MQTT_CMD_SAMPLE_NUMBER)
+                CHECK(cmd.value >= 1 && cmd.value <= 1000);
+            break;
+        case 1:
+        case 2:
+            break;
+        default:
+            CHECK(!"unexpected result");
+    }
+
+    // both halves of a backfill range
+    const char *dash = memchr(msg->data, '-', msg->data_len);
+    int first_len = dash ? (int)(dash - msg->data) : msg->data_len;
+    if (mqtt_cmd_parse_uint(msg->data, first_len, 0, UINT32_MAX, &value) == 0)
+        CHECK(first_len > 0);
+    if (dash != NULL && mqtt_cmd_parse_uint(dash + 1, msg->data + msg->data_len - dash - 1, 10, 1000, &value) == 0)
+        CHECK(value >= 10 && value <= 1000);
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    struct input in = { data, size };
+
+    // a message left half way by the previous input must not leak into this one
+    mqtt_cmd_feed("", 0, "", 0, 0, 0);
+
+    while (in.left > 0) {
+        unsigned flags = take_u8(&in);
+        unsigned topic_len = (flags & 1) ? take_u8(&in) : 0;
+        char *topic = take_bytes(&in, &topic_len);
+        unsigned offset = take_u16(&in);
+        unsigned total_len = take_u16(&in);
+        unsigned data_len = take_u8(&in);
+        char *payload = take_bytes(&in, &data_len);
+
+        const struct mqtt_message *msg = mqtt_cmd_feed((flags & 1) ? topic : NULL, topic_len, payload, data_len,
+                                                       offset, total_len);
+        if (msg != NULL) {
+            // a reassembled message is bounded, a single chunk one is the event itself
+            CHECK(msg->data_len == (int)total_len);
+            if (data_len != total_len)
+                CHECK(msg->topic_len <= MQTT_CMD_MAX_TOPIC && msg->data_len <= MQTT_CMD_MAX_DATA);
+            check_message(msg);
+        }
+        free(topic);
+        free(payload);
+    }
+    return 0;
+}
+
+
+#ifdef FUZZ_REPLAY
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        static uint8_t buf[1 << 16];
+        size_t len;
+
+        if (f == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        len = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,4 @@
+#pragma once
+
+/* The simulated node keeps its RAM across deep sleep anyway */
+#define RTC_DATA_ATTR
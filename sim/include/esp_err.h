@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef int32_t esp_err_t;
+
+#define ESP_OK      0
+#define ESP_FAIL    -1
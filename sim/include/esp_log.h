@@ -0,0 +1,34 @@
+/* ESP_LOGx for the host build: lines go to stderr stamped with the virtual
+ * clock, filtered by sim_log_level */
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+extern esp_log_level_t sim_log_level;
+int64_t hal_time_us(void);
+
+#define SIM_LOG(level, letter, tag, format, ...) do {                                   \
+        if (sim_log_level >= (level))                                                   \
+            fprintf(stderr, letter " (%lld) %s: " format "\n",                          \
+                    (long long)(hal_time_us() / 1000), tag, ##__VA_ARGS__);             \
+    } while (0)
+
+// the level stays the one given with -v
+static inline void esp_log_level_set(const char *tag, esp_log_level_t level) {
+}
+
+#define ESP_LOGE(tag, format, ...) SIM_LOG(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) SIM_LOG(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) SIM_LOG(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) SIM_LOG(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) SIM_LOG(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
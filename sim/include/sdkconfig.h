@@ -0,0 +1,57 @@
+/* Configuration of the host simulation build: the sampling settings of the
+ * node (see ../sdkconfig), without the modules that need the radio or the
+ * flash */
+#pragma once
+
+#define CONFIG_SAMPLE_FREQ_IRRAD 2
+#define CONFIG_SEND_FREQ_IRRAD 10
+#define CONFIG_N_SAMPLES_IRRAD 10
+#define CONFIG_WINDOW_SIZE_IRRAD 10
+#define CONFIG_SAMPLE_FREQ_BATTERY 2
+#define CONFIG_SEND_FREQ_BATTERY 10
+#define CONFIG_N_SAMPLES_BATTERY 10
+#define CONFIG_WINDOW_SIZE_BATTERY 10
+#define CONFIG_ARENA_SIZE 1024
+#define CONFIG_LOG_RUNTIME_LEVEL 3
+
+#define CONFIG_BATTERY_SCHED 1
+#define CONFIG_BATTERY_DIVIDER_X1000 2000
+#define CONFIG_BATTERY_SAVING_SOC 40
+#define CONFIG_BATTERY_CRITICAL_SOC 15
+#define CONFIG_BATTERY_HYSTERESIS_SOC 5
+#define CONFIG_BATTERY_SAVING_SLOWDOWN 2
+#define CONFIG_BATTERY_CRITICAL_SLOWDOWN 6
+#define CONFIG_BATTERY_REPORT_PERIOD_S 900
+#define CONFIG_ADC_WAKE_SLACK_MS 500
+
+#define CONFIG_DEEP_SLEEP 1
+#define CONFIG_SLEEP_SCHEDULE_SOLAR 1
+#define CONFIG_SUN_LATITUDE_MDEG 40450
+#define CONFIG_SUN_LONGITUDE_MDEG -3730
+#define CONFIG_SUN_MARGIN_MIN 30
+#define CONFIG_LWIP_SNTP_UPDATE_DELAY 3600000
+
+// the converter is only there with -E (sim) or in the ext_adc_round benchmark
+#define CONFIG_EXT_ADC 1
+#define CONFIG_EXT_ADC_I2C_ADDRESS 0x48
+#define CONFIG_EXT_ADC_READY_PIN 26
+#define CONFIG_EXT_ADC_PGA 2
+#define CONFIG_EXT_ADC_DATA_RATE 4
+
+// currents and frequencies of the energy estimate, as in ../sdkconfig
+#define CONFIG_ENERGY_CPU_MAX_UA 50000
+#define CONFIG_ENERGY_APB_MAX_UA 25000
+#define CONFIG_ENERGY_APB_MIN_UA 15000
+#define CONFIG_ENERGY_LIGHT_SLEEP_UA 800
+#define CONFIG_ENERGY_WIFI_UA 25000
+#define CONFIG_ENERGY_POWER_PIN_UA 2000
+#define CONFIG_ENERGY_DEEP_SLEEP_UA 25
+#define CONFIG_ENERGY_SUPPLY_MV 3300
+#define CONFIG_MIN_CPU_FREQ_MHZ 40
+#define CONFIG_MAX_CPU_FREQ_MHZ 240
+
+#define CONFIG_LATENCY_STATS 1
+#define CONFIG_HTTP_LOCAL 1
+
+#define CONFIG_BENCH 1
+#define CONFIG_BENCH_ITERATIONS 10000
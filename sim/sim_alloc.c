@@ -0,0 +1,50 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sim_alloc.h"
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+static int steady;
+static uint64_t count, first_size;
+
+
+static void counted(size_t size) {
+    if (!steady)
+        return;
+    if (count++ == 0)
+        first_size = size;
+}
+
+
+void *__wrap_malloc(size_t size) {
+    counted(size);
+    return __real_malloc(size);
+}
+
+
+void *__wrap_calloc(size_t n, size_t size) {
+    counted(n * size);
+    return __real_calloc(n, size);
+}
+
+
+void *__wrap_realloc(void *p, size_t size) {
+    counted(size);
+    return __real_realloc(p, size);
+}
+
+
+void sim_alloc_steady(void) {
+    steady = 1;
+    count = 0;
+}
+
+
+uint64_t sim_alloc_count(uint64_t *size) {
+    if (size != NULL)
+        *size = first_size;
+    return count;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Heap use of the node's code in the host builds, which link with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc: only calls made from
+ * our objects go through the wrappers, not the ones inside libc */
+
+/**
+ * @brief   Setup is over: every later allocation is counted
+ */
+void sim_alloc_steady(void);
+
+/**
+ * @brief   Allocations since sim_alloc_steady, and the first caller's size
+ */
+uint64_t sim_alloc_count(uint64_t *first_size);
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hal_replay.h"
+#include "battery_sched.h"
+#include "sim_energy.h"
+#include "sim_battery.h"
+
+#define CHECK_PERIOD_US (300 * 1000000LL)
+#define MAX_CHECKS      16384   // 8 weeks
+// runtime is only scored while more than this is left, near the end any error is a large fraction
+#define MIN_RUNTIME_US  (3600 * 1000000LL)
+
+struct check {
+    int64_t true_us;
+    int64_t spent_uj;
+    int32_t soc_permille;
+    int64_t runtime_s;
+};
+
+struct error_sum {
+    int64_t count;
+    double sum, max;
+};
+
+static hal_timer_t check_timer;
+static struct check checks[MAX_CHECKS];
+static int n_checks;
+
+
+static void add_error(struct error_sum *e, double error) {
+    if (error < 0)
+        error = -error;
+    e->count++;
+    e->sum += error;
+    if (error > e->max)
+        e->max = error;
+}
+
+
+static void check_callback(void *arg) {
+    const struct battery_state *s = battery_sched_state();
+
+    if (s->filtered_mv == 0 || n_checks == MAX_CHECKS)
+        return; // no reading yet, or the run is longer than the cell should last
+    checks[n_checks++] = (struct check) {
+        .true_us = hal_replay_true_us(),
+        .spent_uj = sim_energy_spent_uj(),
+        .soc_permille = s->soc_permille,
+        .runtime_s = battery_runtime_s(s),
+    };
+}
+
+
+int sim_battery_start(void) {
+    const struct hal_timer_args check_args = { .callback = check_callback, .name = "battery_check" };
+
+    return hal_timer_create(&check_args, &check_timer)
+        || hal_timer_start_periodic(check_timer, CHECK_PERIOD_US);
+}
+
+
+int sim_battery_report(FILE *f, double soc_points, double runtime_pct) {
+    struct error_sum soc = { 0 }, runtime = { 0 };
+    int64_t end_us = hal_replay_end_us();
+    int64_t total_uj = sim_energy_spent_uj();
+
+    for (int i = 0; i < n_checks; i++) {
+        const struct check *c = &checks[i];
+        int64_t left_us = end_us - c->true_us;
+
+        if (total_uj > 0)
+            add_error(&soc, c->soc_permille / 10.0 - 100.0 * (total_uj - c->spent_uj) / total_uj);
+        if (c->runtime_s >= 0 && left_us > MIN_RUNTIME_US)
+            add_error(&runtime, (c->runtime_s * 1e6 - left_us) * 100 / left_us);
+    }
+
+    double soc_mean = soc.count ? soc.sum / soc.count : 0;
+    double runtime_mean = runtime.count ? runtime.sum / runtime.count : 0;
+    fprintf(f, "battery charge error mean %.1f max %.1f points (%lld checks), runtime error mean %.1f%% max %.1f%% (%lld checks)\n",
+            soc_mean, soc.max, (long long)soc.count, runtime_mean, runtime.max, (long long)runtime.count);
+    return soc.count == 0 || soc_mean > soc_points || runtime_mean > runtime_pct;
+}
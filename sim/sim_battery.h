@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+
+/* Check of the battery model (battery_sched.h) against a recorded discharge:
+ * a trace whose battery column runs from a full cell to an empty one under
+ * the node's own load. The true runtime is the time left to the last row;
+ * the true charge is the share of the run's energy (sim_energy.h) still to
+ * be spent, so the nights in deep sleep barely move it. */
+
+/**
+ * @brief   Takes the estimates every few minutes of true time
+ *
+ * @return  0 on success
+ */
+int sim_battery_start(void);
+
+/**
+ * @brief   Scores the estimates once the run is over and prints the errors
+ *
+ * @return  1 if the mean charge error is above `soc_points` or the mean
+ *          runtime error above `runtime_pct` percent
+ */
+int sim_battery_report(FILE *f, double soc_points, double runtime_pct);
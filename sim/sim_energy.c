@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hal_replay.h"
+#include "energy_model.h"
+#include "pm_stats.h"
+#include "sim_energy.h"
+
+/* Residency as pm_stats.c builds it without PM_PROFILING: the time inside
+ * callbacks is charged at APB_MAX and the rest of the awake time is light
+ * sleep. Wi-Fi is on from boot or wake-up to deep sleep. Times are true
+ * time, deep sleep as the node planned it. */
+
+static int64_t deep_sleep_us;
+static int64_t power_pin_since = -1, power_pin_total;
+static int64_t published;
+
+
+void pm_stats_power_pin(bool on) {
+    int64_t now = hal_replay_true_us();
+
+    if (on && power_pin_since < 0) {
+        power_pin_since = now;
+    } else if (!on && power_pin_since >= 0) {
+        power_pin_total += now - power_pin_since;
+        power_pin_since = -1;
+    }
+}
+
+
+void pm_stats_published(void) {
+    published++;
+}
+
+
+void pm_stats_deep_sleep(int64_t sleep_us) {
+    deep_sleep_us += sleep_us;
+}
+
+
+void pm_stats_residency(struct residency *r) {
+    int64_t now = hal_replay_true_us();
+    int64_t awake = now - deep_sleep_us;
+    int64_t busy = hal_replay_busy_us();
+
+    memset(r, 0, sizeof(*r));
+    r->mode_us[PM_MODE_APB_MAX] = busy;
+    r->mode_us[PM_MODE_LIGHT_SLEEP] = awake > busy ? awake - busy : 0;
+    r->wifi_us = awake;
+    r->power_pin_us = power_pin_total + (power_pin_since >= 0 ? now - power_pin_since : 0);
+}
+
+
+int64_t sim_energy_spent_uj(void) {
+    struct current_model model;
+    struct residency r;
+
+    energy_model_default(&model);
+    pm_stats_residency(&r);
+    return energy_uj(&model, &r) + deep_sleep_energy_uj(&model, deep_sleep_us);
+}
+
+
+void sim_energy_report(FILE *f) {
+    static const char *keys[PM_N_MODES] = {
+        [PM_MODE_LIGHT_SLEEP] = "sleep",
+        [PM_MODE_APB_MIN] = "apb_min",
+        [PM_MODE_APB_MAX] = "apb_max",
+        [PM_MODE_CPU_MAX] = "cpu_max",
+    };
+    struct residency r;
+    double total = hal_replay_true_us();
+
+    if (total <= 0)
+        return;
+    pm_stats_residency(&r);
+
+    fprintf(f, "residency");
+    for (int i = 0; i < PM_N_MODES; i++)
+        fprintf(f, " %s %.2f%%", keys[i], r.mode_us[i] * 100 / total);
+    fprintf(f, " deep_sleep %.2f%% | wifi %.2f%% power_pin %.2f%%\n", deep_sleep_us * 100 / total,
+            r.wifi_us * 100 / total, r.power_pin_us * 100 / total);
+
+    int64_t uj = sim_energy_spent_uj();
+    fprintf(f, "energy %.1f mJ/day, %.3f mJ per record (%lld records)\n", uj / 1000.0 / (total / 86400e6),
+            published ? uj / 1000.0 / published : 0.0, (long long)published);
+}
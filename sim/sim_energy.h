@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* pm_stats.h over the simulated clock, so the energy estimate of the node
+ * (energy_model.h, currents of sdkconfig.h) can be read off a run */
+
+/**
+ * @brief   Energy spent since the start of the run, deep sleep included
+ */
+int64_t sim_energy_spent_uj(void);
+
+/**
+ * @brief   Prints the residency of the run and its energy per day and per record
+ */
+void sim_energy_report(FILE *f);
@@ -0,0 +1,327 @@
+/* Host simulation of the node: adc_reader.c runs unchanged on top of the
+ * replay HAL, with the clock, broker and deep sleep of sim_node.c, under a
+ * virtual clock. Every record that reaches the broker is printed as
+ *   arrival_time_ms,topic,payload
+ * and the timer lateness, arrival jitter and clock error histograms go to
+ * stderr at the end, with the power state residency and the energy per day
+ * (sim_energy.h), so two builds can be compared on identical input.
+ * Once set up the node must not touch the heap: the run fails (exit 3) if
+ * it does.
+ *
+ *   sim [options] trace.csv|trace.bin
+ *   sim [options] -d days
+ *
+ *   -s speedup         virtual seconds per real second (default unpaced)
+ *   -d days            constant input instead of a trace
+ *   -c ppm             node clock error while awake
+ *   -r ppm             RTC error over deep sleep
+ *   -k prefix=us[:us]  cost of the callbacks of timers named prefix*, plus jitter
+ *   -n ms[:ms]         publish delay plus jitter
+ *   -C s               time to connect to the broker after boot or wake-up
+ *   -x h:what:adc:val  at hour h call change_<what> (sample|send|number)
+ *   -W ms              slack of the shared wake-ups (default CONFIG_ADC_WAKE_SLACK_MS)
+ *   -H port            serve http_local.h on loopback, during the run and after it until interrupted
+ *   -E                 irradiation from the mock external ADC (AIN0 panel, AIN1 bias)
+ *   -b soc:runtime     check the battery estimates against the trace, a discharge
+ *                      from full to empty (sim_battery.h); fails (exit 4) when the
+ *                      mean charge error is above soc points or the mean runtime
+ *                      error above runtime percent
+ *   -S seed            seed of every random draw
+ *   -N                 no deep sleep
+ *   -q                 do not print the records
+ *   -v                 more log lines (repeat)
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "hal_replay.h"
+#include "hal_mock_bus.h"
+#include "arena.h"
+#include "sim_alloc.h"
+#include "latency.h"
+#include "wake_sched.h"
+#include "http_local.h"
+#include "sim_node.h"
+#include "sim_stats.h"
+#include "sim_energy.h"
+#include "sim_battery.h"
+
+extern int setup_adc_reader();
+extern int change_sample_frequency(int sample_freq, int adc);
+extern int change_broker_sender_frequency(int send_freq, int adc);
+extern int change_sample_number(int n_samples, int adc);
+
+#define MAX_COST_RULES  8
+#define MAX_RECONFIG    32
+#define SPAN_START_MS   1685577600000LL // 2023-06-01 00:00 UTC
+#define HTTP_POLL_US    250000
+
+struct cost_rule {
+    char prefix[24];
+    int64_t mean_us, jitter_us;
+};
+
+struct reconfig {
+    int64_t at_us;  // true time
+    char what[8];
+    int adc, value;
+};
+
+static struct cost_rule cost_rules[MAX_COST_RULES];
+static int n_cost_rules;
+static struct reconfig reconfigs[MAX_RECONFIG];
+static int n_reconfigs, next_reconfig;
+static hal_timer_t reconfig_timer;
+static int http_fd = -1;
+
+
+static int64_t callback_cost(const char *timer, void *arg) {
+    for (int i = 0; i < n_cost_rules; i++)
+        if (strncmp(timer, cost_rules[i].prefix, strlen(cost_rules[i].prefix)) == 0)
+            return cost_rules[i].mean_us + sim_random(cost_rules[i].jitter_us);
+    return 0;
+}
+
+
+static void callback_dispatched(const char *timer, int64_t period_us, int64_t late_us, void *arg) {
+    sim_stats_dispatch(timer, period_us, late_us);
+}
+
+
+/* Configuration messages, as if they came from the broker */
+static void arm_reconfig(void) {
+    if (next_reconfig < n_reconfigs) {
+        int64_t wait = reconfigs[next_reconfig].at_us - hal_replay_true_us();
+        hal_timer_stop(reconfig_timer);
+        hal_timer_start_once(reconfig_timer, wait > 0 ? wait : 0);
+    }
+}
+
+
+/* The timer runs on the node clock, so with clock error it can fire a bit
+ * before the true time it was armed for: the first change is due anyway */
+/* A request, answered in the timer task as on the node */
+static void http_serve(int timeout_ms) {
+    struct http_request req;
+    int fd = http_local_accept(http_fd, timeout_ms);
+
+    if (fd < 0)
+        return;
+    if (http_local_read_request(fd, &req) == 0)
+        http_local_respond(fd, &req);
+    close(fd);
+}
+
+
+static void http_callback(void *arg) {
+    http_serve(0);
+}
+
+
+/* The reboot after a deep sleep starts the channel timers again */
+static void node_woke(void) {
+    wake_sched_restart();
+    arm_reconfig();
+}
+
+
+static void reconfig_callback(void *arg) {
+    if (next_reconfig == n_reconfigs)
+        return;
+    do {
+        struct reconfig *r = &reconfigs[next_reconfig++];
+        if (strcmp(r->what, "sample") == 0)
+            change_sample_frequency(r->value, r->adc);
+        else if (strcmp(r->what, "send") == 0)
+            change_broker_sender_frequency(r->value, r->adc);
+        else if (strcmp(r->what, "number") == 0)
+            change_sample_number(r->value, r->adc);
+    } while (next_reconfig < n_reconfigs && reconfigs[next_reconfig].at_us <= hal_replay_true_us());
+    arm_reconfig();
+}
+
+
+static int parse_cost(const char *s) {
+    struct cost_rule *r = &cost_rules[n_cost_rules];
+    long long mean, jitter = 0;
+
+    if (n_cost_rules == MAX_COST_RULES || sscanf(s, "%23[^=]=%lld:%lld", r->prefix, &mean, &jitter) < 2)
+        return 1;
+    r->mean_us = mean;
+    r->jitter_us = jitter;
+    n_cost_rules++;
+    return 0;
+}
+
+
+static int parse_reconfig(const char *s) {
+    struct reconfig *r = &reconfigs[n_reconfigs];
+    double hours;
+
+    if (n_reconfigs == MAX_RECONFIG || sscanf(s, "%lf:%7[a-z]:%d:%d", &hours, r->what, &r->adc, &r->value) != 4)
+        return 1;
+    r->at_us = (int64_t)(hours * 3600e6);
+    // kept in time order
+    for (int i = n_reconfigs; i > 0 && reconfigs[i - 1].at_us > reconfigs[i].at_us; i--) {
+        struct reconfig tmp = reconfigs[i];
+        reconfigs[i] = reconfigs[i - 1];
+        reconfigs[i - 1] = tmp;
+    }
+    n_reconfigs++;
+    return 0;
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s speedup] [-c ppm] [-r ppm] [-k prefix=us[:us]] [-n ms[:ms]] [-C s]\n"
+                    "          [-x h:sample|send|number:adc:value] [-W ms] [-H port] [-E] [-b soc:runtime] [-S seed] [-N] [-q] [-v]\n"
+                    "          trace | -d days\n", prog);
+}
+
+
+int main(int argc, char *argv[]) {
+    struct sim_node_config node = {
+        .connect_us = 5000000,
+        .net_delay_us = 20000,
+        .net_jitter_us = 30000,
+        .deep_sleep = true,
+        .print_records = true,
+        .on_wake = node_woke,
+    };
+    const struct hal_timer_args reconfig_args = { .callback = reconfig_callback, .name = "reconfig" };
+    const struct hal_replay_hooks hooks = { .cost = callback_cost, .dispatch = callback_dispatched };
+    const int ext_inputs[MOCK_BUS_INPUTS] = { HAL_ADC_PANEL, HAL_ADC_BIAS, -1, -1 };
+    const struct hal_timer_args http_args = { .callback = http_callback, .name = "http" };
+    int speedup = 0, slack_ms = -1, http_port = 0, opt;
+    hal_timer_t http_timer;
+    bool ext_adc = false, battery_check = false;
+    double days = 0, delay_ms, jitter_ms, soc_points = 0, runtime_pct = 0;
+    unsigned long long seed = 1;
+    struct timespec start, end;
+
+    while ((opt = getopt(argc, argv, "s:d:c:r:k:n:C:x:W:H:b:S:ENqv")) != -1) {
+        switch (opt) {
+            case 's': speedup = atoi(optarg); break;
+            case 'd': days = atof(optarg); break;
+            case 'c': node.clock_ppm = atoi(optarg); break;
+            case 'r': node.rtc_ppm = atoi(optarg); break;
+            case 'C': node.connect_us = (int64_t)(atof(optarg) * 1e6); break;
+            case 'S': seed = strtoull(optarg, NULL, 0); break;
+            case 'W': slack_ms = atoi(optarg); break;
+            case 'H': http_port = atoi(optarg); break;
+            case 'E': ext_adc = true; break;
+            case 'N': node.deep_sleep = false; break;
+            case 'q': node.print_records = false; break;
+            case 'v': sim_log_level++; break;
+            case 'n':
+                jitter_ms = 0;
+                if (sscanf(optarg, "%lf:%lf", &delay_ms, &jitter_ms) < 1) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                node.net_delay_us = (int64_t)(delay_ms * 1000);
+                node.net_jitter_us = (int64_t)(jitter_ms * 1000);
+                break;
+            case 'b':
+                if (sscanf(optarg, "%lf:%lf", &soc_points, &runtime_pct) != 2) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                battery_check = true;
+                break;
+            case 'k':
+                if (parse_cost(optarg)) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'x':
+                if (parse_reconfig(optarg)) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (days > 0 && optind == argc) {
+        const int32_t constant[TRACE_N_COLUMNS] = { [TRACE_PANEL] = 1000, [TRACE_BIAS] = 500, [TRACE_BATTERY] = 2000 };
+        if (hal_replay_span(SPAN_START_MS, (int64_t)(days * 86400e3), constant))
+            return 1;
+    } else if (days == 0 && optind == argc - 1) {
+        if (hal_replay_load(argv[optind]))
+            return 1;
+    } else {
+        usage(argv[0]);
+        return 2;
+    }
+
+    hal_replay_set_hooks(&hooks);
+    if (hal_replay_bind(HAL_ADC_PANEL, TRACE_PANEL)
+            || hal_replay_bind(HAL_ADC_BIAS, TRACE_BIAS)
+            || hal_replay_bind(HAL_ADC_BATTERY, TRACE_BATTERY)
+            || (ext_adc && hal_mock_bus_attach(CONFIG_EXT_ADC_I2C_ADDRESS, CONFIG_EXT_ADC_READY_PIN, ext_inputs))
+            || setup_adc_reader()
+            || sim_node_setup(&node, seed)
+            || hal_timer_create(&reconfig_args, &reconfig_timer)
+            || (battery_check && sim_battery_start()))
+        return 1;
+    if (slack_ms >= 0)
+        wake_sched_set_slack((int64_t)slack_ms * 1000);
+    // polled: the simulation has no other task to block in accept
+    if (http_port && ((http_fd = http_local_listen(http_port, 1)) < 0
+                      || hal_timer_create(&http_args, &http_timer)
+                      || hal_timer_start_periodic(http_timer, HTTP_POLL_US)))
+        return 1;
+    arm_reconfig();
+    arena_seal();
+    sim_alloc_steady();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int64_t callbacks = hal_replay_run(speedup);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    sim_stats_report(stderr);
+#ifdef CONFIG_LATENCY_STATS
+    // both against the simulated clock, so run times are the modelled ones
+    char latency[2048];
+    latency_report(latency, sizeof(latency));
+    fprintf(stderr, "latency %s\n", latency);
+#endif
+    sim_energy_report(stderr);
+    int battery_failed = battery_check && sim_battery_report(stderr, soc_points, runtime_pct);
+    struct wake_sched_stats wakes;
+    wake_sched_get_stats(&wakes);
+    fprintf(stderr, "%u channel timer runs in %u wake-ups (%.1f per hour), %u ahead of their deadline\n",
+            wakes.runs, wakes.wakes, wakes.wakes / (hal_replay_true_us() / 3.6e9), wakes.pulled);
+    fprintf(stderr, "%.1f h simulated in %.3f s, %lld timer callbacks\n",
+            hal_replay_true_us() / 3.6e9,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+            (long long)callbacks);
+
+    uint64_t first_size, allocations = sim_alloc_count(&first_size);
+    if (allocations) {
+        fprintf(stderr, "%llu heap allocations after setup, the first of %llu bytes\n",
+                (unsigned long long)allocations, (unsigned long long)first_size);
+        return 3;
+    }
+    if (battery_failed)
+        return 4;
+    if (http_fd >= 0) {
+        fprintf(stderr, "serving the final state on http://127.0.0.1:%d/\n", http_port);
+        for (;;)
+            http_serve(-1);
+    }
+    return 0;
+}
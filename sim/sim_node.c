@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "hal_replay.h"
+#include "ephemeris.h"
+#include "pm_stats.h"
+#include "mqtt.h"
+#include "sim_node.h"
+#include "sim_stats.h"
+
+extern void shift_sample_timestamps(int64_t delta_us);
+
+static const char *TAG = "node";
+
+static struct sim_node_config cfg;
+static uint64_t rng_state;
+static hal_timer_t connect_timer, sntp_timer, deep_sleep_timer;
+
+/* Wall clock = node clock + offset, provisional (1970) until the first sync */
+static int64_t offset_us;
+static bool synced, connected;
+static int64_t published;
+
+
+int64_t sim_random(int64_t range) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return range > 0 ? (int64_t)((rng_state * 0x2545F4914F6CDD1DULL) % (uint64_t)range) : 0;
+}
+
+
+static int64_t true_epoch_us(void) {
+    return hal_replay_start_ms() * 1000 + hal_replay_true_us();
+}
+
+
+int64_t sample_timestamp_us(void) {
+    return hal_time_us() + offset_us;
+}
+
+
+bool time_is_valid(void) {
+    return synced;
+}
+
+
+bool mqtt_is_connected(void) {
+    return connected;
+}
+
+
+int enviar_al_broker(const char *topic, const char *data, int len, int qos, int retain) {
+    if (!connected)
+        return -1;
+
+    // esp_mqtt_client_publish writes to the socket from the caller
+    hal_replay_consume(cfg.net_delay_us + sim_random(cfg.net_jitter_us));
+    sim_stats_publish(topic, hal_replay_true_us());
+    if (cfg.print_records)
+        printf("%lld,%s,%.*s\n", (long long)(true_epoch_us() / 1000), topic, len ? len : (int)strlen(data), data);
+    return (int)++published;
+}
+
+
+/* usHastaDormir in sincTime.c */
+static int64_t us_until_sleep(void) {
+    int64_t now = sample_timestamp_us();
+    time_t now_s = (time_t)(now / 1000000);
+    time_t sleep_s = ephemeris_next_sleep(now_s);
+
+    if (ephemeris_next_wakeup(now_s) < sleep_s)
+        return 0;
+    return (int64_t)sleep_s * 1000000 - now;
+}
+
+
+static void arm_deep_sleep(void) {
+    if (!cfg.deep_sleep)
+        return;
+    hal_timer_stop(deep_sleep_timer);
+    hal_timer_start_once(deep_sleep_timer, us_until_sleep());
+}
+
+
+static void sntp_sync(void) {
+    int64_t error = sim_random(cfg.net_jitter_us + 1) - cfg.net_jitter_us / 2;
+    int64_t new_offset = true_epoch_us() + error - hal_time_us();
+    int64_t step = new_offset - offset_us;
+
+    offset_us = new_offset;
+    if (!synced) {
+        shift_sample_timestamps(step);
+        synced = true;
+    } else {
+        sim_stats_sync(step);
+    }
+    arm_deep_sleep();
+}
+
+
+static void connect_callback(void *arg) {
+    connected = true;
+    sntp_sync();
+    hal_timer_stop(sntp_timer);
+    hal_timer_start_periodic(sntp_timer, (int64_t)CONFIG_LWIP_SNTP_UPDATE_DELAY * 1000);
+}
+
+
+static void sntp_callback(void *arg) {
+    if (connected)
+        sntp_sync();
+}
+
+
+/* deep_sleep_timer_callback in sincTime.c, then the reboot */
+static void deep_sleep_callback(void *arg) {
+    int64_t now = sample_timestamp_us();
+    time_t wake_s = ephemeris_next_wakeup((time_t)(now / 1000000));
+    int64_t sleep_us = (int64_t)wake_s * 1000000 - now;
+
+    ESP_LOGI(TAG, "Sleeping %lld s", (long long)(sleep_us / 1000000));
+    pm_stats_deep_sleep(sleep_us);
+    hal_replay_deep_sleep(sleep_us, cfg.rtc_ppm);
+    sim_stats_wake(true_epoch_us() - (int64_t)wake_s * 1000000);
+
+    // the RTC clock is trusted on a timer wake-up, the connection starts over
+    connected = false;
+    hal_timer_stop(sntp_timer);
+    hal_timer_start_once(connect_timer, cfg.connect_us);
+    arm_deep_sleep();
+    if (cfg.on_wake)
+        cfg.on_wake();
+}
+
+
+int sim_node_setup(const struct sim_node_config *config, uint64_t seed) {
+    const struct hal_timer_args connect_args = { .callback = connect_callback, .name = "connect" };
+    const struct hal_timer_args sntp_args = { .callback = sntp_callback, .name = "sntp" };
+    const struct hal_timer_args deep_sleep_args = { .callback = deep_sleep_callback, .name = "deep_sleep" };
+
+    cfg = *config;
+    rng_state = seed ? seed : 1;
+    hal_replay_set_clock_error(cfg.clock_ppm);
+    if (cfg.deep_sleep && ephemeris_setup())
+        return 1;
+
+    return hal_timer_create(&connect_args, &connect_timer)
+        || hal_timer_create(&sntp_args, &sntp_timer)
+        || hal_timer_create(&deep_sleep_args, &deep_sleep_timer)
+        || hal_timer_start_once(connect_timer, cfg.connect_us);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The rest of the node as adc_reader.c sees it: wall clock with SNTP,
+ * broker connection, publishing over a network with delay, and the
+ * nightly deep sleep, following sincTime.c and mqtt.c */
+
+struct sim_node_config {
+    int32_t clock_ppm;          // node clock error while awake
+    int32_t rtc_ppm;            // RTC error over deep sleep
+    int64_t connect_us;         // from boot or wake-up to broker connected
+    int64_t net_delay_us;       // a publish blocks the timer task this long...
+    int64_t net_jitter_us;      // ...plus up to this much; SNTP is off by up to half of it
+    bool deep_sleep;
+    bool print_records;
+    void (*on_wake)(void);
+};
+
+int sim_node_setup(const struct sim_node_config *config, uint64_t seed);
+
+/**
+ * @brief   Uniform pseudo-random value in [0, range), reproducible from the seed
+ */
+int64_t sim_random(int64_t range);
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sim_stats.h"
+
+#define MAX_SERIES  16
+#define N_BUCKETS   12  // <1 ms, then powers of two up to >= 1024 ms
+
+struct series {
+    const char *name;
+    int64_t count;
+    int64_t missed;
+    int64_t max_us;
+    int64_t hist[N_BUCKETS];
+    int64_t last_us, last_interval_us;  // publish series only
+};
+
+struct error_stats {
+    int64_t count;
+    int64_t sum_abs_us;
+    int64_t max_abs_us;
+    int64_t hist[N_BUCKETS];
+};
+
+static struct series timers[MAX_SERIES], topics[MAX_SERIES];
+static struct error_stats syncs, wakes;
+
+
+static int bucket(int64_t us) {
+    int b = 0;
+
+    if (us < 0)
+        us = -us;
+    for (int64_t ms = us / 1000; ms > 0 && b < N_BUCKETS - 1; ms >>= 1)
+        b++;
+    return b;
+}
+
+
+static struct series *find(struct series *set, const char *name) {
+    for (int i = 0; i < MAX_SERIES; i++) {
+        if (set[i].name == NULL)
+            set[i].name = name;
+        if (strcmp(set[i].name, name) == 0)
+            return &set[i];
+    }
+    return NULL;
+}
+
+
+static void add_sample(struct series *s, int64_t us) {
+    int64_t abs_us = us < 0 ? -us : us;
+
+    s->count++;
+    s->hist[bucket(us)]++;
+    if (abs_us > s->max_us)
+        s->max_us = abs_us;
+}
+
+
+void sim_stats_dispatch(const char *timer, int64_t period_us, int64_t late_us) {
+    struct series *s = find(timers, timer);
+
+    if (s == NULL)
+        return;
+    add_sample(s, late_us);
+    if (period_us && late_us >= period_us)
+        s->missed++;
+}
+
+
+/* Jitter of a topic: change of the interval between consecutive arrivals,
+ * so it does not depend on the configured period */
+void sim_stats_publish(const char *topic, int64_t true_us) {
+    struct series *s = find(topics, topic);
+
+    if (s == NULL)
+        return;
+    if (s->last_us) {
+        int64_t interval = true_us - s->last_us;
+        if (s->last_interval_us)
+            add_sample(s, interval - s->last_interval_us);
+        s->last_interval_us = interval;
+    }
+    s->last_us = true_us;
+}
+
+
+static void add_error(struct error_stats *e, int64_t us) {
+    int64_t abs_us = us < 0 ? -us : us;
+
+    e->count++;
+    e->sum_abs_us += abs_us;
+    e->hist[bucket(us)]++;
+    if (abs_us > e->max_abs_us)
+        e->max_abs_us = abs_us;
+}
+
+
+void sim_stats_sync(int64_t step_us) {
+    add_error(&syncs, step_us);
+}
+
+
+/* Arrivals across a deep sleep are not jitter, the series start over */
+void sim_stats_wake(int64_t error_us) {
+    add_error(&wakes, error_us);
+    for (int i = 0; i < MAX_SERIES; i++)
+        topics[i].last_us = topics[i].last_interval_us = 0;
+}
+
+
+static void print_header(FILE *f, const char *what) {
+    fprintf(f, "%-28s %9s %7s %10s |", what, "count", "missed", "max ms");
+    fprintf(f, " %6s", "<1ms");
+    for (int b = 1; b < N_BUCKETS - 1; b++) {
+        char label[8];
+        snprintf(label, sizeof(label), "%dms", 1 << (b - 1));
+        fprintf(f, " %6s", label);
+    }
+    fprintf(f, " %6s\n", ">1s");
+}
+
+
+static void print_hist(FILE *f, const int64_t *hist) {
+    for (int b = 0; b < N_BUCKETS; b++)
+        fprintf(f, " %6lld", (long long)hist[b]);
+    fprintf(f, "\n");
+}
+
+
+static void print_series(FILE *f, const struct series *set) {
+    for (int i = 0; i < MAX_SERIES && set[i].name != NULL; i++) {
+        fprintf(f, "%-28s %9lld %7lld %10.1f |", set[i].name, (long long)set[i].count,
+                (long long)set[i].missed, set[i].max_us / 1000.0);
+        print_hist(f, set[i].hist);
+    }
+}
+
+
+static void print_error(FILE *f, const char *what, const struct error_stats *e) {
+    fprintf(f, "%-28s %9lld %7s %10.1f |", what, (long long)e->count, "-", e->max_abs_us / 1000.0);
+    print_hist(f, e->hist);
+}
+
+
+void sim_stats_report(FILE *f) {
+    print_header(f, "timer dispatch lateness");
+    print_series(f, timers);
+    print_header(f, "arrival jitter");
+    print_series(f, topics);
+    print_header(f, "clock error");
+    print_error(f, "sntp step", &syncs);
+    print_error(f, "wake-up error", &wakes);
+    if (syncs.count)
+        fprintf(f, "mean sntp step %.1f ms\n", syncs.sum_abs_us / 1000.0 / syncs.count);
+    if (wakes.count)
+        fprintf(f, "mean wake-up error %.1f ms\n", wakes.sum_abs_us / 1000.0 / wakes.count);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Scheduling figures gathered over a simulation run */
+
+/**
+ * @brief   A timer callback started `late_us` after its deadline
+ */
+void sim_stats_dispatch(const char *timer, int64_t period_us, int64_t late_us);
+
+/**
+ * @brief   A record of `topic` reached the broker at true time `true_us`
+ */
+void sim_stats_publish(const char *topic, int64_t true_us);
+
+/**
+ * @brief   An SNTP sync stepped the node's wall clock by `step_us`
+ */
+void sim_stats_sync(int64_t step_us);
+
+/**
+ * @brief   The node woke up `error_us` after the instant it meant to (true time);
+ *          arrival jitter starts over
+ */
+void sim_stats_wake(int64_t error_us);
+
+/**
+ * @brief   Prints the histograms and totals
+ */
+void sim_stats_report(FILE *f);
@@ -0,0 +1,25 @@
+/* Parts of the node that the host builds leave out */
+
+#include "esp_log.h"
+#include "boot_timing.h"
+#include "pm_policy.h"
+
+esp_log_level_t sim_log_level = ESP_LOG_WARN;
+
+
+esp_log_level_t get_log_level(void) {
+    return sim_log_level;
+}
+
+
+void boot_mark(enum boot_phase phase) {
+}
+
+
+void pm_policy_acquire(enum pm_activity activity) {
+}
+
+
+void pm_policy_release(enum pm_activity activity) {
+}
+
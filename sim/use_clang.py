@@ -0,0 +1,8 @@
+# Extra script of [env:fuzz] in platformio.ini: libFuzzer comes with clang,
+# and the sanitizers have to be linked in as well as compiled in
+Import("env")
+
+SANITIZE = "-fsanitize=fuzzer,address,undefined"
+
+env.Replace(CC="clang", CXX="clang++", LINK="clang")
+env.Append(CCFLAGS=[SANITIZE, "-fno-sanitize-recover=undefined"], LINKFLAGS=[SANITIZE])
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "sdkconfig.h"
+#include "hal.h"
+
+/* The measures sampled by adc_reader.c, described once. Each row gives
+ *   X(name, index, timer tag, hal channel, channel subtracted or -1,
+ *     window size, sample period s, send period s, conversions per sample, topic)
+ * and expands into the parameter table, the timer tables and one burst
+ * routine per measure in which everything but the conversions per sample
+ * (changed over MQTT) is a compile-time constant. The index order is that
+ * of the send buffers and the store channels. */
+#define ADC_CHANNELS(X) \
+    X(irradiation, 0, "irra_adc", HAL_ADC_PANEL, HAL_ADC_BIAS, \
+      CONFIG_WINDOW_SIZE_IRRAD, CONFIG_SAMPLE_FREQ_IRRAD, CONFIG_SEND_FREQ_IRRAD, CONFIG_N_SAMPLES_IRRAD, \
+      TOPIC_IRRADIATION) \
+    X(battery, 1, "battery_adc", HAL_ADC_BATTERY, -1, \
+      CONFIG_WINDOW_SIZE_BATTERY, CONFIG_SAMPLE_FREQ_BATTERY, CONFIG_SEND_FREQ_BATTERY, CONFIG_N_SAMPLES_BATTERY, \
+      TOPIC_BATTERY_LEVEL)
@@ -1,7 +1,11 @@
 #include "adc_reader.h"
+#include "mqtt.h"
 
 static const char *TAG = "adc_reader";
-extern void enviar_al_broker(const char *topic, const char *data, int len, int qos, int retain);
+extern int64_t sample_timestamp_us(void);
+extern bool time_is_valid(void);
+extern bool mqtt_is_connected(void);
+extern int backfill_enqueue(int adc, uint32_t first, uint32_t last);
 
 const int IRRADIATION_ADC_INDEX = 0;
 const int BATTERY_ADC_INDEX = 1;
@@ -9,36 +13,71 @@ const int BIAS_ADC_INDEX = 2; // used for irradiation, always keep it with the h
 
 esp_err_t power_pin_down(void);
 esp_err_t power_pin_up(void);
-
-// inizialise for each adc its parameters
-static struct adc_config_params adc_params[N_ADC] = {
-    // solar panel params
-    {
-        .window_size = CONFIG_WINDOW_SIZE_IRRAD,
-        .sample_frequency = CONFIG_SAMPLE_FREQ_IRRAD,
-        .send_frenquency = CONFIG_SEND_FREQ_IRRAD,
-        .n_samples = CONFIG_N_SAMPLES_IRRAD,
-        .channel = ADC1_CHANNEL_0,
-        .mqtt_topic = TOPIC_IRRADIATION,
-        .get_mv = get_irradiation_mv,
+#ifdef CONFIG_ADC_RUNTIME_DISPATCH
+static void sampling_timer_callback(void *);
+#endif
+static void broker_sender_callback(void *);
+
+// schedule and run time of the timer callbacks, named after their timers
+static struct latency *sampling_latency[N_ADC_MEASURES], *sender_latency[N_ADC_MEASURES];
+
+// last readings behind the irradiation sample, for the fault checks
+static int last_panel_mv, last_bias_mv;
+// newest sample of each measure, also once its window has been sent
+static struct sample latest_sample[N_ADC_MEASURES];
+
+#ifdef CONFIG_TSDB
+// samples taken before the clock is valid, for the store, see shift_sample_timestamps
+static struct sample *boot_backlog[N_ADC_MEASURES];
+static int boot_backlog_count[N_ADC_MEASURES];
+#endif
+
+#ifdef CONFIG_EXT_ADC
+static void ext_adc_done(struct ext_adc *adc, int status, void *arg);
+static void ext_adc_sample_callback(void *args);
+
+// irradiation as panel against bias in one differential conversion, and the bias alone
+static struct ext_adc ext_adc = {
+    .address = CONFIG_EXT_ADC_I2C_ADDRESS,
+    .data_rate = CONFIG_EXT_ADC_DATA_RATE,
+    .n_channels = 2,
+    .channels = {
+        { .mux = EXT_ADC_AIN0_AIN1, .pga = CONFIG_EXT_ADC_PGA },
+        { .mux = EXT_ADC_AIN1, .pga = 2 },
     },
-    // battery params
-    {
-        .window_size = CONFIG_WINDOW_SIZE_BATTERY,
-        .sample_frequency = CONFIG_SAMPLE_FREQ_BATTERY,
-        .send_frenquency = CONFIG_SEND_FREQ_BATTERY,
-        .n_samples = CONFIG_N_SAMPLES_BATTERY,
-        .channel = ADC1_CHANNEL_1,
-        .mqtt_topic = TOPIC_BATTERY_LEVEL,
-        .get_mv = get_adc_mv,
+    .done = ext_adc_done,
+};
+static bool ext_adc_present;
+static volatile int ext_adc_status;
+static int64_t ext_adc_timestamp;
+static hal_timer_t ext_adc_timer;
+static const struct hal_timer_args ext_adc_timer_args = {
+    .callback = ext_adc_sample_callback,
+    .name = "ext_adc_sample",
+};
+#endif
+
+#define ADC_PARAMS(measure, index, tag, input, reference, window, sample_s, send_s, conversions, topic) \
+    [index] = { \
+        .window_size = window, \
+        .sample_frequency = sample_s, \
+        .send_frenquency = send_s, \
+        .n_samples = conversions, \
+        .channel = input, \
+        .mqtt_topic = topic, \
+        .get_mv = (reference) >= 0 ? get_irradiation_mv : get_adc_mv, \
     },
+
+// inizialise for each adc its parameters, the measures from adc_channels.h
+static struct adc_config_params adc_params[N_ADC] = {
+    ADC_CHANNELS(ADC_PARAMS)
     // bias params. Many of its parameters are not used, it is used to calculate irradiation value
     {
         .window_size = CONFIG_WINDOW_SIZE_IRRAD,
         .sample_frequency = CONFIG_SAMPLE_FREQ_IRRAD,
         .send_frenquency = CONFIG_SEND_FREQ_IRRAD,
         .n_samples = CONFIG_N_SAMPLES_IRRAD,
-        .channel = ADC1_CHANNEL_6,
+        .channel = HAL_ADC_BIAS,
         .mqtt_topic = "",
         .get_mv = get_adc_mv,
     },
@@ -55,38 +94,53 @@ struct send_sample_buffer adcs_send_buffers[N_ADC_MEASURES] = {
     },
 };
 
-esp_timer_handle_t sampling_timer[N_ADC_MEASURES];
-esp_timer_create_args_t sample_timer_args[] = {
-    {
-        .callback = &sampling_timer_callback,
-        .name = "sampling_timer_irra_adc",
-        .arg = (void *)&IRRADIATION_ADC_INDEX,
+// sample and send periods are stretched by this factor when the battery runs low
+static int rate_slowdown = 1;
+
+#ifdef CONFIG_TSDB
+// records made while the broker was unreachable, first sequence number of the run
+static bool offline_pending[N_ADC_MEASURES];
+static uint32_t offline_first_seq[N_ADC_MEASURES];
+#endif
+
+#define MEASURE_INDEX(measure, index, ...) [index] = index,
+static const int measure_index[N_ADC_MEASURES] = { ADC_CHANNELS(MEASURE_INDEX) };
+
+// one callback per measure, specialized below, unless the runtime table is asked for
+#ifdef CONFIG_ADC_RUNTIME_DISPATCH
+#define SAMPLING_CALLBACK(measure) sampling_timer_callback
+#else
+#define SAMPLING_CALLBACK(measure) sampling_callback_##measure
+#define DECLARE_SAMPLING_CALLBACK(measure, ...) static void sampling_callback_##measure(void *);
+ADC_CHANNELS(DECLARE_SAMPLING_CALLBACK)
+#endif
+
+#define SAMPLE_TIMER_ARGS(measure, index, tag, ...) \
+    [index] = { \
+        .callback = &SAMPLING_CALLBACK(measure), \
+        .name = "sampling_timer_" tag, \
+        .arg = (void *)&measure_index[index], \
     },
-    {
-        .callback = &sampling_timer_callback,
-        .name = "sampling_timer_battery_adc",
-        .arg = (void *)&BATTERY_ADC_INDEX,
+#define BROKER_TIMER_ARGS(measure, index, tag, ...) \
+    [index] = { \
+        .callback = &broker_sender_callback, \
+        .name = "broker_timer_" tag, \
+        .arg = (void *)&measure_index[index], \
     },
+
+// the four timers share their wake-ups through wake_sched.h
+struct wake_event sampling_timer[N_ADC_MEASURES];
+struct hal_timer_args sample_timer_args[] = {
+    ADC_CHANNELS(SAMPLE_TIMER_ARGS)
 };
-esp_timer_handle_t broker_sender_timer[N_ADC_MEASURES];
-esp_timer_create_args_t broker_sender_timer_args[] = {
-    {
-        .callback = &broker_sender_callback,
-        .name = "broker_timer_irra_adc",
-        .arg = (void *)&IRRADIATION_ADC_INDEX,
-    },
-    {
-        .callback = &broker_sender_callback,
-        .name = "broker_timer_battery_adc",
-        .arg = (void *)&BATTERY_ADC_INDEX,
-    },
+struct wake_event broker_sender_timer[N_ADC_MEASURES];
+struct hal_timer_args broker_sender_timer_args[] = {
+    ADC_CHANNELS(BROKER_TIMER_ARGS)
 };
 
 
 int get_adc_mv(int *value, int adc_index) {
-    int adc_val = adc1_get_raw(adc_params[adc_index].channel);
-    *value = esp_adc_cal_raw_to_voltage(adc_val, &adc_params[adc_index].adc_chars);
-    return 0;
+    return hal_adc_read_mv(adc_params[adc_index].channel, value);
 }
 
 
@@ -97,54 +151,340 @@ int get_irradiation_mv(int *value, int adc_index) {
     get_adc_mv(&bias_mv, BIAS_ADC_INDEX);
 
     *value = panel_mv - bias_mv;
+    last_panel_mv = panel_mv;
+    last_bias_mv = bias_mv;
 
     return 0;
 }
 
 
-static void sampling_timer_callback(void * args){
-    int *adc_index = (int *) args;
-
+int adc_burst_mean(int adc_index) {
     int data, sample = 0;
-    if (*adc_index == IRRADIATION_ADC_INDEX)
-        power_pin_up();
-    for(int i= 0 ; i < adc_params[*adc_index].n_samples; i++){
-        if (adc_params[*adc_index].get_mv(&data, *adc_index))
-            ESP_LOGE(TAG, "Error reading ADC with index %d", *adc_index);
+
+    for(int i= 0 ; i < adc_params[adc_index].n_samples; i++){
+        if (adc_params[adc_index].get_mv(&data, adc_index))
+            ESP_LOGE(TAG, "Error reading ADC with index %d", adc_index);
         else
             sample += data;
     }
-    sample = (int) sample / adc_params[*adc_index].n_samples;
-    if (*adc_index == IRRADIATION_ADC_INDEX)
-        power_pin_down();
-    ESP_LOGI(TAG, "Sample from ADC(%d) = %d", *adc_index, sample);    
+    return (int) sample / adc_params[adc_index].n_samples;
+}
+
+
+/* Burst of one measure with its channels as constants: no call through
+ * get_mv, no lookups in adc_params but the conversion count */
+#define BURST(measure, index, tag, input, reference, ...) \
+static inline int burst_##measure(int adc_index) { \
+    int n = adc_params[index].n_samples, sum = 0, mv, reference_mv = 0; \
+    for (int i = 0; i < n; i++) { \
+        if (hal_adc_read_mv(input, &mv) || ((reference) >= 0 && hal_adc_read_mv(reference, &reference_mv))) { \
+            ESP_LOGE(TAG, "Error reading ADC with index %d", index); \
+            continue; \
+        } \
+        sum += mv - reference_mv; \
+        if ((reference) >= 0) { \
+            last_panel_mv = mv; \
+            last_bias_mv = reference_mv; \
+        } \
+    } \
+    return sum / n; \
+}
+ADC_CHANNELS(BURST)
+
+
+#define BURST_CASE(measure, index, ...) case index: return burst_##measure(index);
+
+int adc_burst_mean_fixed(int adc_index) {
+    switch (adc_index) {
+        ADC_CHANNELS(BURST_CASE)
+    }
+    return adc_burst_mean(adc_index);
+}
+
+
+void sample_ring_push(struct send_sample_buffer *buffer, int window_size, int64_t timestamp_us, int value) {
+    struct sample *slot = &buffer->samples[buffer->cont % window_size];
+
+    slot->timestamp_us = timestamp_us;
+    slot->value = value;
+    buffer->cont++;
+}
+
+
+int sample_window_mean(const struct send_sample_buffer *buffer, int window_size, int *mean, long long *timestamp_ms) {
+    int nsamples = (buffer->cont > window_size) ? window_size : buffer->cont;
+    int sum = 0;
+
+    if (nsamples == 0)
+        return 0;
+    for (int i = 0; i < nsamples; i++)
+        sum += buffer->samples[i].value;
+    *mean = sum / nsamples;
+
+    // the window is stamped at its centre, between its oldest and newest samples
+    int64_t oldest = buffer->samples[(buffer->cont > window_size) ? buffer->cont % window_size : 0].timestamp_us;
+    int64_t newest = buffer->samples[(buffer->cont - 1) % window_size].timestamp_us;
+    *timestamp_ms = (oldest + (newest - oldest) / 2) / 1000;
+    return nsamples;
+}
+
+
+int format_record(char *payload, size_t size, uint32_t seq, int mean, long long timestamp_ms) {
+#ifdef CONFIG_TSDB
+    return snprintf(payload, size, "{\"s\":%u,\"v\":%d,\"t\":%lld}", seq, mean, timestamp_ms);
+#else
+    return snprintf(payload, size, "{\"v\":%d,\"t\":%lld}", mean, timestamp_ms);
+#endif
+}
+
+
+int sample_window_walk(int adc_index, int (*cb)(const struct sample *s, void *arg), void *arg) {
+    const struct send_sample_buffer *buffer = &adcs_send_buffers[adc_index];
+    int window_size = adc_params[adc_index].window_size;
+    int n = (buffer->cont > window_size) ? window_size : buffer->cont;
+    int oldest = (buffer->cont > window_size) ? buffer->cont % window_size : 0;
+
+    if (buffer->samples == NULL)
+        return 0;
+    for (int i = 0; i < n; i++)
+        if (cb(&buffer->samples[(oldest + i) % window_size], arg))
+            return i + 1;
+    return n;
+}
+
+
+int sample_latest(int adc_index, struct sample *s) {
+    if (latest_sample[adc_index].timestamp_us == 0)
+        return 1;
+    *s = latest_sample[adc_index];
+    return 0;
+}
+
+
+/* Everything a new sample goes through, in the esp_timer task */
+static void store_sample(int adc_index, int window_size, int64_t timestamp, int sample) {
+    ESP_LOGD(TAG, "Sample from ADC(%d) = %d", adc_index, sample);    
+    boot_mark(BOOT_FIRST_SAMPLE);
     
     //Save the taken sample in the circular buffer
-    adcs_send_buffers[*adc_index].samples[ adcs_send_buffers[*adc_index].cont % adc_params[*adc_index].window_size   ] = sample;
-    adcs_send_buffers[*adc_index].cont++;
+    sample_ring_push(&adcs_send_buffers[adc_index], window_size, timestamp, sample);
+    latest_sample[adc_index].timestamp_us = timestamp;
+    latest_sample[adc_index].value = sample;
+
+#ifdef CONFIG_TSDB
+    // until the clock is valid the samples stay in RAM, see shift_sample_timestamps
+    if (time_is_valid()) {
+        tsdb_append(adc_index, timestamp / 1000, sample, NULL);
+    } else {
+        struct sample *s = &boot_backlog[adc_index][boot_backlog_count[adc_index]++ % CONFIG_TSDB_BOOT_BACKLOG];
+        s->timestamp_us = timestamp;
+        s->value = sample;
+    }
+#endif
+#ifdef CONFIG_BATTERY_SCHED
+    if (adc_index == BATTERY_ADC_INDEX && time_is_valid())
+        battery_sched_sample(timestamp / 1000, sample);
+#endif
+#ifdef CONFIG_INSOLATION
+    if (adc_index == IRRADIATION_ADC_INDEX && time_is_valid())
+        insolation_sample(timestamp / 1000, sample);
+#endif
+#ifdef CONFIG_FAULT_DETECT
+    if (adc_index == IRRADIATION_ADC_INDEX)
+        fault_alerts_irradiation(timestamp / 1000, sample, last_panel_mv, last_bias_mv);
+    else if (adc_index == BATTERY_ADC_INDEX)
+        fault_alerts_battery(timestamp / 1000, sample);
+#endif
 }
 
 
-static void broker_sender_callback(void * args){
+#ifdef CONFIG_EXT_ADC
+static int uv_to_mv(int32_t uv) {
+    return uv >= 0 ? (uv + 500) / 1000 : -((-uv + 500) / 1000);
+}
+
+
+/* Ready handler context (a task on the node): hand the round over to the esp_timer task */
+static void ext_adc_done(struct ext_adc *adc, int status, void *arg) {
+    ext_adc_status = status;
+    hal_timer_start_once(ext_adc_timer, 0);
+}
+
+
+static void ext_adc_sample_callback(void *args) {
+    power_pin_down();
+    pm_policy_release(PM_ACTIVITY_ADC_BURST);
+    if (ext_adc_status) {
+        ESP_LOGE(TAG, "Error reading the external ADC");
+        return;
+    }
+
+    last_panel_mv = uv_to_mv(ext_adc.mean_uv[0] + ext_adc.mean_uv[1]);
+    last_bias_mv = uv_to_mv(ext_adc.mean_uv[1]);
+    store_sample(IRRADIATION_ADC_INDEX, adc_params[IRRADIATION_ADC_INDEX].window_size, ext_adc_timestamp,
+                 uv_to_mv(ext_adc.mean_uv[0]));
+}
+
+
+/* The conversions run on their own; the sample is stored by ext_adc_sample_callback */
+static void ext_adc_sample(int64_t timestamp) {
+    if (ext_adc.busy)   // the round is dropped, its lock with it
+        pm_policy_release(PM_ACTIVITY_ADC_BURST);
+    pm_policy_acquire(PM_ACTIVITY_ADC_BURST);
+    power_pin_up();
+    ext_adc.n_samples = adc_params[IRRADIATION_ADC_INDEX].n_samples;
+    ext_adc_timestamp = timestamp;
+    if (ext_adc_start(&ext_adc)) {
+        ESP_LOGE(TAG, "Error starting the external ADC (%u errors)", ext_adc.errors);
+        power_pin_down();
+        pm_policy_release(PM_ACTIVITY_ADC_BURST);
+    }
+}
+
+
+static int ext_adc_attach(void) {
+    if (hal_bus_setup() || ext_adc_setup(&ext_adc, CONFIG_EXT_ADC_READY_PIN)
+            || hal_timer_create(&ext_adc_timer_args, &ext_adc_timer)) {
+        ESP_LOGW(TAG, "No external ADC at 0x%02x, irradiation from ADC1", CONFIG_EXT_ADC_I2C_ADDRESS);
+        return 1;
+    }
+    ESP_LOGI(TAG, "Irradiation from the external ADC at 0x%02x", CONFIG_EXT_ADC_I2C_ADDRESS);
+    return 0;
+}
+#endif
+
+
+/* Inlined into each sampling callback with its burst routine and window */
+static inline __attribute__((always_inline))
+void take_sample(int adc_index, int window_size, int (*burst)(int adc_index)) {
+    int64_t start = latency_enter(sampling_latency[adc_index]);
+    int64_t timestamp = sample_timestamp_us();
+#ifdef CONFIG_EXT_ADC
+    if (adc_index == IRRADIATION_ADC_INDEX && ext_adc_present) {
+        ext_adc_sample(timestamp);
+        latency_exit(sampling_latency[adc_index], start);
+        return;
+    }
+#endif
+    pm_policy_acquire(PM_ACTIVITY_ADC_BURST);
+    if (adc_index == IRRADIATION_ADC_INDEX)
+        power_pin_up();
+    int sample = burst(adc_index);
+    if (adc_index == IRRADIATION_ADC_INDEX)
+        power_pin_down();
+    pm_policy_release(PM_ACTIVITY_ADC_BURST);
+    store_sample(adc_index, window_size, timestamp, sample);
+    latency_exit(sampling_latency[adc_index], start);
+}
+
+
+#ifdef CONFIG_ADC_RUNTIME_DISPATCH
+static void sampling_timer_callback(void * args){
     int *adc_index = (int *) args;
-    int nsamples;
-    //See if there are samples to send
-    if (adcs_send_buffers[*adc_index].cont > 0){
-        int mean = 0;
 
-        nsamples  = (adcs_send_buffers[*adc_index].cont > adc_params[*adc_index].window_size  )?adc_params[*adc_index].window_size :adcs_send_buffers[*adc_index].cont;
-        // made the sample mean
-        for (int i = 0; i < nsamples; i++)
-            mean += adcs_send_buffers[*adc_index].samples[i];
+    take_sample(*adc_index, adc_params[*adc_index].window_size, adc_burst_mean);
+}
+#else
+#define SAMPLING_CALLBACK_BODY(measure, index, tag, input, reference, window, ...) \
+static void sampling_callback_##measure(void *args) { \
+    take_sample(index, window, burst_##measure); \
+}
+ADC_CHANNELS(SAMPLING_CALLBACK_BODY)
+#endif
+
+
+/* Called from the esp_timer task (same as sampling/sending) on the first
+ * SNTP sync (or with 0 when the RTC clock is trusted): samples stamped with
+ * the provisional clock are moved to real time */
+void shift_sample_timestamps(int64_t delta_us) {
+    for (int i = 0; i < N_ADC_MEASURES; i++) {
+        if (latest_sample[i].timestamp_us != 0)
+            latest_sample[i].timestamp_us += delta_us;
+        if (adcs_send_buffers[i].samples == NULL)
+            continue;
+
+        int window_size = adc_params[i].window_size;
+        int cont = adcs_send_buffers[i].cont;
+        int stored = (cont > window_size) ? window_size : cont;
+        for (int j = 0; j < stored; j++)
+            adcs_send_buffers[i].samples[j].timestamp_us += delta_us;
+
+#ifdef CONFIG_TSDB
+        // the first time the clock is accepted the whole backlog goes to flash, oldest first
+        if (!time_is_valid()) {
+            int count = boot_backlog_count[i];
+            int kept = (count > CONFIG_TSDB_BOOT_BACKLOG) ? CONFIG_TSDB_BOOT_BACKLOG : count;
+            if (count > kept)
+                ESP_LOGW(TAG, "%d samples of ADC %d taken before the clock was valid are not stored", count - kept, i);
+            for (int j = count - kept; j < count; j++) {
+                const struct sample *s = &boot_backlog[i][j % CONFIG_TSDB_BOOT_BACKLOG];
+                tsdb_append(i, (s->timestamp_us + delta_us) / 1000, s->value, NULL);
+            }
+            boot_backlog_count[i] = 0;
+        }
+#endif
+    }
+}
 
-        mean = mean / nsamples;
 
+static void send_window(const int *adc_index){
+#ifdef CONFIG_INSOLATION_ONLY
+    //The energy reports replace the window means
+    if (*adc_index == IRRADIATION_ADC_INDEX) {
         adcs_send_buffers[*adc_index].cont = 0;
+        return;
+    }
+#endif
+    //Keep buffering until timestamps can be trusted
+    if (!time_is_valid()) {
+        ESP_LOGW(TAG, "Time not synchronized yet, keeping samples of ADC %d", *adc_index);
+        return;
+    }
+#ifndef CONFIG_TSDB
+    //Without the store the window is kept until the broker is back
+    if (!mqtt_is_connected()) {
+        ESP_LOGD(TAG, "Broker not connected, keeping samples of ADC %d", *adc_index);
+        return;
+    }
+#endif
+    //See if there are samples to send
+    int mean;
+    long long timestamp_ms;
+    struct send_sample_buffer *buffer = &adcs_send_buffers[*adc_index];
+    if (sample_window_mean(buffer, adc_params[*adc_index].window_size, &mean, &timestamp_ms) > 0){
+        buffer->cont = 0;
         
        
-        sprintf(adcs_send_buffers[*adc_index].payload, "%d", mean);
-        ESP_LOGI(TAG, "Send it to the broker: %s (int %d)\n", adcs_send_buffers[*adc_index].payload, mean);
-        enviar_al_broker(adc_params[*adc_index].mqtt_topic, (char *)&adcs_send_buffers[*adc_index].payload, 0, 1, 0);
+#ifdef CONFIG_TSDB
+        // the record is kept too, so the server can ask for it again by its number
+        uint32_t seq;
+        tsdb_append(RECORD_CHANNEL(*adc_index), timestamp_ms, mean, &seq);
+        format_record(buffer->payload, sizeof(buffer->payload), seq, mean, timestamp_ms);
+
+        if (!mqtt_is_connected()) {
+            if (!offline_pending[*adc_index]) {
+                offline_pending[*adc_index] = true;
+                offline_first_seq[*adc_index] = seq;
+            }
+            ESP_LOGD(TAG, "Broker not connected, record %u of ADC %d kept in flash", seq, *adc_index);
+            return;
+        }
+        if (offline_pending[*adc_index]) {
+            offline_pending[*adc_index] = false;
+            ESP_LOGI(TAG, "Back online, records %u-%u of ADC %d were made offline", offline_first_seq[*adc_index], seq - 1, *adc_index);
+#ifdef CONFIG_BACKFILL
+            backfill_enqueue(*adc_index, offline_first_seq[*adc_index], seq - 1);
+#endif
+        }
+#else
+        format_record(buffer->payload, sizeof(buffer->payload), 0, mean, timestamp_ms);
+#endif
+        ESP_LOGD(TAG, "Send it to the broker: %s (int %d)\n", adcs_send_buffers[*adc_index].payload, mean);
+        pm_policy_acquire(PM_ACTIVITY_PUBLISH);
+        if (enviar_al_broker(adc_params[*adc_index].mqtt_topic, (char *)&adcs_send_buffers[*adc_index].payload, 0, 1, 0) >= 0)
+            pm_stats_published();
+        pm_policy_release(PM_ACTIVITY_PUBLISH);
+        boot_mark(BOOT_FIRST_PUBLISH);
     } 
     else {
         ESP_LOGW(TAG, "There are still not data to send\n");
@@ -152,57 +492,82 @@ static void broker_sender_callback(void * args){
 }
 
 
+static void broker_sender_callback(void * args){
+    int *adc_index = (int *) args;
+    int64_t start = latency_enter(sender_latency[*adc_index]);
+
+    send_window(adc_index);
+    latency_exit(sender_latency[*adc_index], start);
+}
+
+
+const char *get_mqtt_topic(int adc) {
+    return adc_params[adc].mqtt_topic;
+}
+
+
 esp_err_t power_pin_setup(void) {
-    gpio_config_t io_conf;
-    
-    io_conf.intr_type = GPIO_INTR_DISABLE;
-    io_conf.mode = GPIO_MODE_OUTPUT;
-    io_conf.pin_bit_mask = (1ULL << POWER_PIN);
-    io_conf.pull_down_en = 0;
-    io_conf.pull_up_en = 0;
-    return gpio_config(&io_conf);
+    return hal_gpio_output(POWER_PIN);
 }
 
 
 esp_err_t power_pin_down(void) {
-    return gpio_set_level(POWER_PIN, 0);
+    pm_stats_power_pin(false);
+    return hal_gpio_set(POWER_PIN, 0);
 }
 
 
 esp_err_t power_pin_up(void) {
-    return gpio_set_level(POWER_PIN, 1);
+    pm_stats_power_pin(true);
+    return hal_gpio_set(POWER_PIN, 1);
 }
 
 
 esp_err_t set_bias(void) {
-    dac_output_enable(DAC_CHANNEL);
-    return dac_output_voltage(DAC_CHANNEL, BIAS_DAC_VALUE);
-}
-
-
-int adc1_channel_setup(uint32_t channel, esp_adc_cal_characteristics_t *chars) {
-    int ret = 0;
-    ret |= adc1_config_channel_atten(channel, ADC_ATTENUATION);
-    ret |= esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTENUATION, ADC_WIDTH_BIT_12, ADC_VREF, chars);
-    return ret;
+    return hal_dac_output(DAC_CHANNEL, BIAS_DAC_VALUE);
 }
 
 
 int adcs_setup(void) {
     int ret = 0;
-    adc1_config_width(ADC_WIDTH_BIT_12);
 
     for(int i = 0; i < N_ADC; i++)
-        ret |= adc1_channel_setup(adc_params[i].channel, &adc_params[i].adc_chars);
+        ret |= hal_adc_setup(adc_params[i].channel);
     
     return ret;
 }
 
 
 int setup_adc_reader(){
-    // allocate memory for send buffers
-    for(int i = 0; i < N_ADC_MEASURES; i++)
-        adcs_send_buffers[i].samples = malloc(sizeof(int) * adc_params[i].window_size);
+#ifdef CONFIG_TSDB
+    if (tsdb_setup())
+        ESP_LOGW(TAG, "Samples will not be kept in flash");
+#endif
+#ifdef CONFIG_BATTERY_SCHED
+    battery_sched_setup();
+#endif
+#ifdef CONFIG_INSOLATION
+    insolation_setup();
+#endif
+#ifdef CONFIG_FAULT_DETECT
+    fault_alerts_setup();
+#endif
+
+    // send buffers, for good: they come from the arena
+    for(int i = 0; i < N_ADC_MEASURES; i++) {
+        adcs_send_buffers[i].samples = arena_alloc(sizeof(struct sample) * adc_params[i].window_size, "adc_windows");
+        if (adcs_send_buffers[i].samples == NULL) {
+            ESP_LOGE(TAG, "No room in the arena for the sample windows, see CONFIG_ARENA_SIZE");
+            return 1;
+        }
+#ifdef CONFIG_TSDB
+        boot_backlog[i] = arena_alloc(sizeof(struct sample) * CONFIG_TSDB_BOOT_BACKLOG, "boot_backlog");
+        if (boot_backlog[i] == NULL) {
+            ESP_LOGE(TAG, "No room in the arena for the boot backlog, see CONFIG_ARENA_SIZE");
+            return 1;
+        }
+#endif
+    }
 
     //power pin configuration
     if(power_pin_setup() != ESP_OK || power_pin_up() != ESP_OK) {
@@ -221,48 +586,55 @@ int setup_adc_reader(){
         ESP_LOGE(TAG, "Failed configuring ADCs.");
         return 1;
     }
+#ifdef CONFIG_EXT_ADC
+    ext_adc_present = ext_adc_attach() == 0;
+#endif
 
-    // timers configuration
+    // timers configuration: every sampling first, so a shared wake-up samples before it sends
+    wake_sched_set_slack((int64_t)CONFIG_ADC_WAKE_SLACK_MS * 1000);
+    for(int i = 0; i < N_ADC_MEASURES; i++) {
+        sampling_latency[i] = latency_path(sample_timer_args[i].name);
+        if (wake_sched_add(&sampling_timer[i], &sample_timer_args[i])) {
+            ESP_LOGE(TAG, "Failed creating the sampling timer of ADC %d", i);
+            return 1;
+        }
+    }
     for(int i = 0; i < N_ADC_MEASURES; i++) {
-
-    
-        // sampling adc timer
-        esp_timer_create(&sample_timer_args[i], &sampling_timer[i]);
-        esp_timer_start_periodic(sampling_timer[i], adc_params[i].sample_frequency*1000000);
-
-        // broker sender timer
         ESP_LOGD(TAG, "Inicialazing broker sender timer\n");
-        esp_timer_create(&broker_sender_timer_args[i], &broker_sender_timer[i]);
-        esp_timer_start_periodic(broker_sender_timer[i], adc_params[i].send_frenquency*1000000);
+        sender_latency[i] = latency_path(broker_sender_timer_args[i].name);
+        if (wake_sched_add(&broker_sender_timer[i], &broker_sender_timer_args[i])) {
+            ESP_LOGE(TAG, "Failed creating the broker sender timer of ADC %d", i);
+            return 1;
+        }
+    }
+    for(int i = 0; i < N_ADC_MEASURES; i++) {
+        int64_t sample_us = (int64_t)adc_params[i].sample_frequency * 1000000;
+        int64_t send_us = (int64_t)adc_params[i].send_frenquency * 1000000;
+
+        wake_sched_start(&sampling_timer[i], sample_us);
+        latency_arm(sampling_latency[i], sample_us, sample_us);
+        wake_sched_start(&broker_sender_timer[i], send_us);
+        latency_arm(sender_latency[i], send_us, send_us);
     }
 
     return 0;
 }
 
 
-int start_timer(int adc, esp_timer_handle_t timer, int freq){
-    esp_err_t ret = esp_timer_start_periodic(timer, freq*1000000);
-    if (ret != ESP_OK){
+int start_timer(int adc, struct wake_event *timer, int freq){
+    int64_t period_us = (int64_t)freq * rate_slowdown * 1000000;
+
+    if (wake_sched_start(timer, period_us)){
         ESP_LOGE(TAG, "Error starting timer from ADC %d", adc);
         return 1;
     }
+    latency_arm(timer == &sampling_timer[adc] ? sampling_latency[adc] : sender_latency[adc], period_us, period_us);
     return 0;
 }
 
 
-int start_broker_send_timers() {
-    int ret = 0;
-    
-    for(int i = 0; i < N_ADC_MEASURES; i++)
-        ret |= start_timer(i, broker_sender_timer[i], adc_params[i].send_frenquency);
-
-    return ret;
-}
-
-
-int stop_timer(int adc, esp_timer_handle_t timer){
-    esp_err_t ret = esp_timer_stop(timer);
-    if (ret != ESP_OK){
+int stop_timer(int adc, struct wake_event *timer){
+    if (wake_sched_stop(timer)){
         ESP_LOGE(TAG, "Error stopping timer from ADC %d", adc);
         return 1;
     }
@@ -271,24 +643,15 @@ int stop_timer(int adc, esp_timer_handle_t timer){
 }
 
 
-int stop_broker_send_timers() {
-    int ret = 0;
-    for(int i = 0; i < N_ADC_MEASURES; i++)
-        ret |= stop_timer(i, broker_sender_timer[i]);
-
-    return ret;
-}
-
-
 int change_sample_frequency(int sample_freq, int adc){
-    if (stop_timer(adc, sampling_timer[adc]))
+    if (stop_timer(adc, &sampling_timer[adc]))
         return 1;
 
     vTaskDelay(pdMS_TO_TICKS(500));
 
     adc_params[adc].sample_frequency = sample_freq;
 
-    if (start_timer(adc, sampling_timer[adc], adc_params[adc].sample_frequency))
+    if (start_timer(adc, &sampling_timer[adc], adc_params[adc].sample_frequency))
         return 1;
 
     ESP_LOGI(TAG, "Changed sample frequency to %d s in ADC %d", sample_freq, adc);
@@ -297,14 +660,14 @@ int change_sample_frequency(int sample_freq, int adc){
 
 
 int change_broker_sender_frequency(int send_freq, int adc) {
-    if (stop_timer(adc, broker_sender_timer[adc]))
+    if (stop_timer(adc, &broker_sender_timer[adc]))
         return 1;
 
     vTaskDelay(pdMS_TO_TICKS(500));
 
     adc_params[adc].send_frenquency = send_freq;
 
-    if (start_timer(adc, broker_sender_timer[adc], adc_params[adc].send_frenquency))
+    if (start_timer(adc, &broker_sender_timer[adc], adc_params[adc].send_frenquency))
         return 1;
 
     ESP_LOGI(TAG, "Changed broker send frequency to %d s in ADC %d", send_freq, adc);
@@ -313,16 +676,33 @@ int change_broker_sender_frequency(int send_freq, int adc) {
 
 
 int change_sample_number(int n_samples, int adc) {
-    if (stop_timer(adc, sampling_timer[adc]))
+    if (stop_timer(adc, &sampling_timer[adc]))
         return 1;
     
     vTaskDelay(pdMS_TO_TICKS(500));
 
     adc_params[adc].n_samples = n_samples;
 
-    if (start_timer(adc, sampling_timer[adc], adc_params[adc].sample_frequency))
+    if (start_timer(adc, &sampling_timer[adc], adc_params[adc].sample_frequency))
         return 1;
 
     ESP_LOGI(TAG, "Changed sample number to %d in ADC %d", n_samples, adc);
     return 0;
 }
+
+
+int set_rate_slowdown(int factor) {
+    int ret = 0;
+
+    if (factor == rate_slowdown)
+        return 0;
+
+    rate_slowdown = factor;
+    for (int i = 0; i < N_ADC_MEASURES; i++) {
+        ret |= stop_timer(i, &sampling_timer[i]) || start_timer(i, &sampling_timer[i], adc_params[i].sample_frequency);
+        ret |= stop_timer(i, &broker_sender_timer[i]) || start_timer(i, &broker_sender_timer[i], adc_params[i].send_frenquency);
+    }
+
+    ESP_LOGI(TAG, "Sample and send periods now %d times the configured ones", factor);
+    return ret;
+}
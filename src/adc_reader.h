@@ -1,21 +1,35 @@
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "esp_err.h"
 #include "esp_log.h"
 #include "sdkconfig.h"
-#include "mqtt_client.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "esp_system.h"
-#include "esp_spi_flash.h"
-#include <driver/adc.h>
-#include <driver/dac.h>
-#include <esp_adc_cal.h>
 #include <string.h>
+#include "hal.h"
+#include "tsdb.h"
+#include "boot_timing.h"
+#include "pm_stats.h"
+#include "pm_policy.h"
+#include "battery_sched.h"
+#include "insolation.h"
+#include "fault_alerts.h"
+#include "ext_adc.h"
+#include "arena.h"
+#include "adc_channels.h"
+#include "latency.h"
+#include "wake_sched.h"
 
 // define number of ADCs to read, and its indices
 #define N_ADC 3 // ADC channels used
 #define N_ADC_MEASURES 2 // number of ADCs used for own measures (different
                         //channels could be used to calculate the same measure)
 
+// store channels: raw samples use the ADC index, published records follow them
+#define RECORD_CHANNEL(adc) (N_ADC_MEASURES + (adc))
+
 #define POWER_PIN 21  // GPIO 21, P12 from LoPy4
 
 /* BIAS for the measuring circuit
@@ -25,10 +39,7 @@
 #define VDD  3300 // mv
 #define BIAS 500  // mv
 #define BIAS_DAC_VALUE (((BIAS * 255) + VDD/2)/ VDD)
-#define DAC_CHANNEL DAC_CHANNEL_1
-
-#define ADC_VREF 1100
-#define ADC_ATTENUATION ADC_ATTEN_DB_11
+#define DAC_CHANNEL 0 // DAC_CHANNEL_1, GPIO25
 
 // MQTT topics
 #define TOPIC_IRRADIATION "/ciu/lopy4/irradiation/1"
@@ -36,8 +47,7 @@
 
 int get_adc_mv(int *value, int adc_index);
 int get_irradiation_mv(int *value, int adc_index);
-static void sampling_timer_callback(void *);
-static void broker_sender_callback(void *);
+void shift_sample_timestamps(int64_t delta_us);
 
 struct adc_config_params {
     int window_size;
@@ -46,13 +56,41 @@ struct adc_config_params {
     int n_samples;
     int channel;
     char *mqtt_topic;
-    esp_adc_cal_characteristics_t adc_chars;
     int (*get_mv)(int *, int);
 };
 
+struct sample {
+    int64_t timestamp_us; // microseconds since epoch, provisional until SNTP syncs
+    int value;
+};
+
 struct send_sample_buffer {
     int ini;
     int cont;
-    int *samples;
-    char payload[20];
-};
\ No newline at end of file
+    struct sample *samples;
+    char payload[64];
+};
+
+/* Steps of the sampling and sending callbacks, also run by bench.c */
+int adc_burst_mean(int adc_index);
+int adc_burst_mean_fixed(int adc_index);
+void sample_ring_push(struct send_sample_buffer *buffer, int window_size, int64_t timestamp_us, int value);
+int sample_window_mean(const struct send_sample_buffer *buffer, int window_size, int *mean, long long *timestamp_ms);
+int format_record(char *payload, size_t size, uint32_t seq, int mean, long long timestamp_ms);
+
+/* Readers of the samples, from the esp_timer task like the writers */
+
+/**
+ * @brief   Calls `cb` for the samples of the current window, oldest first,
+ *          until it returns non-zero
+ *
+ * @return  number of samples passed
+ */
+int sample_window_walk(int adc_index, int (*cb)(const struct sample *s, void *arg), void *arg);
+
+/**
+ * @brief   Newest sample of the measure, kept after its window is sent
+ *
+ * @return  1 if there is none yet
+ */
+int sample_latest(int adc_index, struct sample *s);
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+
+#include "arena.h"
+
+#define ALIGNMENT   8
+
+static uint8_t buffer[CONFIG_ARENA_SIZE] __attribute__((aligned(ALIGNMENT)));
+static struct arena_usage usage = { .size = sizeof(buffer) };
+
+
+static void account(const char *owner, size_t bytes) {
+    for (int i = 0; i < usage.n_owners; i++) {
+        if (strcmp(usage.owners[i].name, owner) == 0) {
+            usage.owners[i].bytes += bytes;
+            return;
+        }
+    }
+    // past the table the bytes still count in `used`
+    if (usage.n_owners < ARENA_MAX_OWNERS) {
+        usage.owners[usage.n_owners].name = owner;
+        usage.owners[usage.n_owners].bytes = bytes;
+        usage.n_owners++;
+    }
+}
+
+
+void *arena_alloc(size_t size, const char *owner) {
+    size_t rounded = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+    if (usage.sealed || rounded < size || rounded > usage.size - usage.used) {
+        usage.failed++;
+        return NULL;
+    }
+
+    void *p = buffer + usage.used;
+    usage.used += rounded;
+    account(owner, rounded);
+    return p;
+}
+
+
+void arena_note_outside(const char *owner) {
+    for (int i = 0; i < usage.n_outside; i++)
+        if (strcmp(usage.outside[i], owner) == 0)
+            return;
+    if (usage.n_outside < ARENA_MAX_OUTSIDE)
+        usage.outside[usage.n_outside++] = owner;
+}
+
+
+void arena_seal(void) {
+    usage.sealed = 1;
+}
+
+
+void arena_get_usage(struct arena_usage *u) {
+    *u = usage;
+}
+
+
+int arena_report(char *buf, size_t size) {
+    int len = snprintf(buf, size, "{\"size\":%u,\"used\":%u,\"failed\":%u,\"owners\":{",
+                       (unsigned)usage.size, (unsigned)usage.used, (unsigned)usage.failed);
+
+    for (int i = 0; i < usage.n_owners && len < (int)size; i++)
+        len += snprintf(buf + len, size - len, "%s\"%s\":%u", i ? "," : "",
+                        usage.owners[i].name, (unsigned)usage.owners[i].bytes);
+    if (len < (int)size)
+        len += snprintf(buf + len, size - len, "},\"outside\":[");
+    for (int i = 0; i < usage.n_outside && len < (int)size; i++)
+        len += snprintf(buf + len, size - len, "%s\"%s\"", i ? "," : "", usage.outside[i]);
+    if (len < (int)size)
+        len += snprintf(buf + len, size - len, "]}");
+    return len;
+}
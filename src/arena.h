@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Static arena for the buffers the sampling pipeline keeps for its whole
+ * life: sample windows, store index, query block. Allocations only happen
+ * during setup and are never freed; arena_seal closes the arena once the
+ * node is up, so a steady state allocation shows up as a failure instead
+ * of slowly fragmenting the heap shared with the MQTT client. */
+
+#define ARENA_MAX_OWNERS    8
+#define ARENA_MAX_OUTSIDE   4
+
+struct arena_usage {
+    size_t size, used;
+    uint32_t failed;            // requests that did not fit or came after the seal
+    int sealed;
+    int n_owners;
+    struct {
+        const char *name;
+        size_t bytes;
+    } owners[ARENA_MAX_OWNERS];
+    int n_outside;
+    const char *outside[ARENA_MAX_OUTSIDE];  // pipeline parts that still use the heap
+};
+
+/**
+ * @brief   Zeroed memory aligned to 8 bytes, accounted to `owner`
+ *
+ * @return  NULL if it does not fit or the arena is sealed
+ */
+void *arena_alloc(size_t size, const char *owner);
+
+/**
+ * @brief   Notes a part of the sampling pipeline that keeps allocating from
+ *          the heap after the seal, because its driver leaves no other way
+ */
+void arena_note_outside(const char *owner);
+
+/**
+ * @brief   Ends the setup: every later arena_alloc fails
+ */
+void arena_seal(void);
+
+void arena_get_usage(struct arena_usage *usage);
+
+/**
+ * @brief   {"size":B,"used":B,"failed":n,"owners":{"name":B,...},"outside":["name",...]}
+ *
+ * @return  length written, as snprintf
+ */
+int arena_report(char *buf, size_t size);
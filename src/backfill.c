@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "sdkconfig.h"
+
+#include "adc_reader.h"
+#include "mqtt_cmd.h"
+#include "mqtt.h"
+
+#ifdef CONFIG_BACKFILL
+
+/* Re-sends published records the server missed. The server publishes
+ * "<first>-<last>" (sequence numbers, inclusive) on <sensor topic>/backfill and
+ * the node answers on <sensor topic>/backfill/data with chunks like
+ *   {"r":[[seq,timestamp_ms,value],...]}
+ * followed by {"done":[first,last],"sent":n}. Records no longer in the store
+ * are simply absent. Chunks are spaced by CONFIG_BACKFILL_INTERVAL_MS from a
+ * low priority task, so live sampling and publishing go first. Each chunk
+ * is a query of its own: the store is only locked while a chunk is filled,
+ * never while it is published or paced. */
+
+static const char *TAG = "backfill";
+extern const char *get_mqtt_topic(int adc);
+
+#define BACKFILL_QUEUE_LEN  4
+#define CHUNK_SIZE          768
+#define RECORD_MAX_LEN      48 // "[4294967295,1700000000000,-2147483648],"
+
+struct backfill_request {
+    int adc;
+    uint32_t first;
+    uint32_t last;
+};
+
+struct chunk {
+    char topic[64];
+    char data[CHUNK_SIZE];
+    int len;
+    int records;
+    int sent;
+    int full;           // stopped at `resume`, which did not fit
+    uint32_t resume;
+};
+
+static QueueHandle_t backfill_queue;
+
+
+static int publish_chunk(struct chunk *c) {
+    if (c->records == 0)
+        return 0;
+
+    c->len += snprintf(c->data + c->len, sizeof(c->data) - c->len, "]}");
+    pm_policy_acquire(PM_ACTIVITY_PUBLISH);
+    int msg_id = enviar_al_broker(c->topic, c->data, c->len, 1, 0);
+    pm_policy_release(PM_ACTIVITY_PUBLISH);
+    if (msg_id < 0) {
+        ESP_LOGW(TAG, "Backfill interrupted, the broker is not reachable");
+        return 1;
+    }
+    c->sent += c->records;
+    c->records = 0;
+    c->len = 0;
+    return 0;
+}
+
+
+static int add_record(int channel, uint32_t seq, int64_t timestamp_ms, int32_t value, void *arg) {
+    struct chunk *c = (struct chunk *)arg;
+
+    if (c->len + RECORD_MAX_LEN + 2 > (int)sizeof(c->data)) {
+        c->full = 1;
+        c->resume = seq;
+        return 1;
+    }
+    c->len += snprintf(c->data + c->len, sizeof(c->data) - c->len, "%s[%u,%lld,%d]",
+                       c->records ? "," : "{\"r\":[", seq, (long long)timestamp_ms, value);
+    c->records++;
+    return 0;
+}
+
+
+static void backfill_task(void *args) {
+    static struct chunk c;
+    struct backfill_request req;
+
+    while (1) {
+        xQueueReceive(backfill_queue, &req, portMAX_DELAY);
+
+        memset(&c, 0, sizeof(c));
+        snprintf(c.topic, sizeof(c.topic), "%s/backfill/data", get_mqtt_topic(req.adc));
+        ESP_LOGI(TAG, "Sending records %u-%u of ADC %d", req.first, req.last, req.adc);
+
+        uint32_t from = req.first;
+        int failed;
+        do {
+            c.full = 0;
+            tsdb_query_seq(RECORD_CHANNEL(req.adc), from, req.last, add_record, &c);
+            failed = publish_chunk(&c);
+            if (c.full && !failed)
+                vTaskDelay(pdMS_TO_TICKS(CONFIG_BACKFILL_INTERVAL_MS));
+            from = c.resume;
+        } while (c.full && !failed);
+        if (failed)
+            continue;
+
+        c.len = snprintf(c.data, sizeof(c.data), "{\"done\":[%u,%u],\"sent\":%d}", req.first, req.last, c.sent);
+        enviar_al_broker(c.topic, c.data, c.len, 1, 0);
+        ESP_LOGI(TAG, "Backfill of ADC %d done, %d records sent", req.adc, c.sent);
+    }
+}
+
+
+int backfill_setup(void) {
+    if (backfill_queue != NULL)
+        return 0;
+
+    backfill_queue = xQueueCreate(BACKFILL_QUEUE_LEN, sizeof(struct backfill_request));
+    if (backfill_queue == NULL || xTaskCreate(backfill_task, "backfill", 3072, NULL, tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed creating the backfill task");
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Queues records first..last of `adc` to be sent. Also used by the sender to
+ * push the records made while the broker was unreachable */
+int backfill_enqueue(int adc, uint32_t first, uint32_t last) {
+    struct backfill_request req = { .adc = adc, .first = first, .last = last };
+
+    if (backfill_queue == NULL)
+        return 1;
+    if (req.last - req.first >= CONFIG_BACKFILL_MAX_RECORDS) {
+        ESP_LOGW(TAG, "Backfill limited to %d records", CONFIG_BACKFILL_MAX_RECORDS);
+        req.last = req.first + CONFIG_BACKFILL_MAX_RECORDS - 1;
+    }
+    if (xQueueSend(backfill_queue, &req, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Too many backfill requests pending, dropping %u-%u", req.first, req.last);
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Called from the MQTT task with the payload of a backfill request */
+int backfill_request(int adc, const char *data, int len) {
+    const char *dash = memchr(data, '-', len > 0 ? len : 0);
+    uint32_t first, last;
+
+    if (mqtt_cmd_parse_uint(data, dash ? dash - data : len, 0, UINT32_MAX, &first))
+        return 1;
+    // a single number asks for everything from there on
+    if (dash == NULL)
+        last = tsdb_next_seq(RECORD_CHANNEL(adc)) - 1;
+    else if (mqtt_cmd_parse_uint(dash + 1, data + len - dash - 1, 0, UINT32_MAX, &last))
+        return 1;
+    if (last < first)
+        return 1;
+
+    return backfill_enqueue(adc, first, last);
+}
+
+#endif // CONFIG_BACKFILL
@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "battery_model.h"
+
+#define BATTERY_MAGIC   0x54414242 // "BBAT"
+#define MIN_CELL_MV     2500
+#define MAX_CELL_MV     4500
+#define RATE_WINDOW_MS  (3600 * 1000LL)
+
+/* Typical 1S LiPo at low current, fully charged to empty */
+static const struct {
+    int32_t mv;
+    int32_t permille;
+} discharge_curve[] = {
+    {4200, 1000}, {4110, 900}, {4020, 800}, {3950, 700}, {3870, 600},
+    {3840, 500}, {3800, 400}, {3770, 300}, {3730, 200}, {3690, 100},
+    {3610, 50}, {3270, 0},
+};
+
+#define CURVE_POINTS ((int)(sizeof(discharge_curve) / sizeof(discharge_curve[0])))
+
+
+int32_t battery_soc_permille(int32_t cell_mv) {
+    if (cell_mv >= discharge_curve[0].mv)
+        return 1000;
+
+    for (int i = 1; i < CURVE_POINTS; i++) {
+        if (cell_mv >= discharge_curve[i].mv) {
+            int32_t dmv = discharge_curve[i - 1].mv - discharge_curve[i].mv;
+            int32_t dsoc = discharge_curve[i - 1].permille - discharge_curve[i].permille;
+            return discharge_curve[i].permille + (cell_mv - discharge_curve[i].mv) * dsoc / dmv;
+        }
+    }
+    return 0;
+}
+
+
+void battery_model_init(struct battery_state *s) {
+    memset(s, 0, sizeof(*s));
+    s->magic = BATTERY_MAGIC;
+    s->tier = BATTERY_TIER_NORMAL;
+}
+
+
+int battery_model_valid(const struct battery_state *s) {
+    return s->magic == BATTERY_MAGIC;
+}
+
+
+static int32_t next_tier(const struct battery_state *s, const struct battery_tiers *t) {
+    int32_t soc = s->soc_permille;
+    int32_t down = soc < t->critical_permille ? BATTERY_TIER_CRITICAL
+                 : soc < t->saving_permille ? BATTERY_TIER_SAVING : BATTERY_TIER_NORMAL;
+    int32_t up = soc >= t->saving_permille + t->hysteresis_permille ? BATTERY_TIER_NORMAL
+               : soc >= t->critical_permille + t->hysteresis_permille ? BATTERY_TIER_SAVING : BATTERY_TIER_CRITICAL;
+
+    if (down > s->tier)
+        return down;
+    if (up < s->tier)
+        return up;
+    return s->tier;
+}
+
+
+int battery_model_update(struct battery_state *s, const struct battery_tiers *tiers, int64_t now_ms, int32_t cell_mv) {
+    // readings far off the curve are glitches of the ADC, not the battery
+    if (cell_mv < MIN_CELL_MV || cell_mv > MAX_CELL_MV)
+        return 1;
+
+    if (s->filtered_mv == 0)
+        s->filtered_mv = cell_mv * 16;
+    else
+        s->filtered_mv += cell_mv - s->filtered_mv / 16;
+    s->soc_permille = battery_soc_permille(s->filtered_mv / 16);
+
+    int64_t elapsed = now_ms - s->anchor_ms;
+    if (s->anchor_ms == 0 || elapsed < 0) {
+        s->anchor_ms = now_ms;
+        s->anchor_soc = s->soc_permille;
+    } else if (elapsed >= RATE_WINDOW_MS) {
+        int32_t rate = (int32_t)((int64_t)(s->anchor_soc - s->soc_permille) * 1000 * 3600000 / elapsed);
+        if (rate < 0)
+            rate = 0; // charging
+        s->rate = s->rate ? (3 * s->rate + rate) / 4 : rate;
+        s->anchor_ms = now_ms;
+        s->anchor_soc = s->soc_permille;
+    }
+
+    s->tier = next_tier(s, tiers);
+    return 0;
+}
+
+
+int64_t battery_runtime_s(const struct battery_state *s) {
+    if (s->rate <= 0)
+        return -1;
+    return (int64_t)s->soc_permille * 1000 * 3600 / s->rate;
+}
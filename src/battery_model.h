@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+/* State of charge, discharge rate and service tier from the battery
+ * voltage. Plain C, no ESP-IDF dependency, so recorded discharge traces can
+ * be replayed through it on the host. */
+
+enum battery_tier {
+    BATTERY_TIER_NORMAL,
+    BATTERY_TIER_SAVING,
+    BATTERY_TIER_CRITICAL,
+    BATTERY_N_TIERS
+};
+
+/* Thresholds in permille of charge. A tier is entered below its threshold
+ * and left only once the charge is `hysteresis` above it */
+struct battery_tiers {
+    int32_t saving_permille;
+    int32_t critical_permille;
+    int32_t hysteresis_permille;
+};
+
+struct battery_state {
+    uint32_t magic;
+    int32_t filtered_mv;        // cell voltage, x16 fixed point
+    int32_t soc_permille;
+    int32_t rate;               // discharge, thousandths of permille per hour
+    int64_t anchor_ms;          // start of the current rate window
+    int32_t anchor_soc;
+    int32_t tier;
+};
+
+/**
+ * @brief   Charge (0-1000) of a single LiPo cell at `cell_mv`, from its discharge curve
+ */
+int32_t battery_soc_permille(int32_t cell_mv);
+
+/**
+ * @brief   Starts with no history, in the normal tier
+ */
+void battery_model_init(struct battery_state *s);
+
+/**
+ * @brief   Whether `s` holds a history started by battery_model_init
+ */
+int battery_model_valid(const struct battery_state *s);
+
+/**
+ * @brief   Adds a cell voltage reading taken at `now_ms` (wall clock)
+ *
+ * @return 0 if used, 1 if rejected as implausible
+ */
+int battery_model_update(struct battery_state *s, const struct battery_tiers *tiers, int64_t now_ms, int32_t cell_mv);
+
+/**
+ * @brief   Predicted time until the cell is empty at the measured discharge rate
+ *
+ * @return seconds, or -1 while the rate is unknown or the cell is charging
+ */
+int64_t battery_runtime_s(const struct battery_state *s);
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_wifi.h"
+#include "sdkconfig.h"
+
+#include "battery_sched.h"
+#include "mqtt.h"
+
+/* Duty cycle driven by the battery. Each reading moves the battery model
+ * (battery_model.c); when the tier changes the sample and send periods are
+ * stretched, Wi-Fi goes to a deeper power save and, in the reduced tiers,
+ * the level of every tag is capped; back in the normal tier it returns to
+ * the one set at boot or over MQTT. The charge and the predicted runtime are published on the
+ * diagnostics topic on every tier change and every
+ * CONFIG_BATTERY_REPORT_PERIOD_S. Runs in the esp_timer task. */
+
+#ifdef CONFIG_BATTERY_SCHED
+
+static const char *TAG = "battery";
+extern int set_rate_slowdown(int factor);
+extern esp_log_level_t get_log_level(void);
+
+#define TOPIC_BATTERY   "/ciu/lopy4/diagnostics/battery"
+
+static const struct battery_tiers tiers = {
+    .saving_permille = CONFIG_BATTERY_SAVING_SOC * 10,
+    .critical_permille = CONFIG_BATTERY_CRITICAL_SOC * 10,
+    .hysteresis_permille = CONFIG_BATTERY_HYSTERESIS_SOC * 10,
+};
+
+static const struct {
+    const char *name;
+    int slowdown;
+    wifi_ps_type_t wifi_ps;
+    esp_log_level_t log_level;  // cap in the reduced tiers
+} tier_actions[BATTERY_N_TIERS] = {
+    [BATTERY_TIER_NORMAL] = {"normal", 1, WIFI_PS_MIN_MODEM, ESP_LOG_VERBOSE},
+    [BATTERY_TIER_SAVING] = {"saving", CONFIG_BATTERY_SAVING_SLOWDOWN, WIFI_PS_MAX_MODEM, ESP_LOG_WARN},
+    [BATTERY_TIER_CRITICAL] = {"critical", CONFIG_BATTERY_CRITICAL_SLOWDOWN, WIFI_PS_MAX_MODEM, ESP_LOG_ERROR},
+};
+
+RTC_DATA_ATTR static struct battery_state state;
+static int applied_tier = -1;
+static int64_t last_report_ms;
+
+
+static void apply_tier(int tier) {
+    ESP_LOGW(TAG, "Battery at %d.%d%%, entering %s tier", state.soc_permille / 10, state.soc_permille % 10, tier_actions[tier].name);
+
+    if (set_rate_slowdown(tier_actions[tier].slowdown))
+        ESP_LOGE(TAG, "Could not change the sampling rates");
+    esp_wifi_set_ps(tier_actions[tier].wifi_ps); // fails harmlessly before Wi-Fi starts
+
+    // "*" also drops the per-tag levels, so the first sample after boot leaves them alone
+    esp_log_level_t level = get_log_level();
+    if (tier != BATTERY_TIER_NORMAL)
+        esp_log_level_set("*", level < tier_actions[tier].log_level ? level : tier_actions[tier].log_level);
+    else if (applied_tier > BATTERY_TIER_NORMAL)
+        esp_log_level_set("*", level);
+    applied_tier = tier;
+}
+
+
+static void publish_report(int64_t now_ms) {
+    char payload[128];
+
+    int len = snprintf(payload, sizeof(payload), "{\"mv\":%d,\"soc\":%d.%d,\"tier\":\"%s\",\"runtime_s\":%lld,\"t\":%lld}",
+                       state.filtered_mv / 16, state.soc_permille / 10, state.soc_permille % 10,
+                       tier_actions[state.tier].name, (long long)battery_runtime_s(&state), (long long)now_ms);
+    if (len >= (int)sizeof(payload))
+        return;
+
+    ESP_LOGI(TAG, "%s", payload);
+    if (enviar_al_broker(TOPIC_BATTERY, payload, len, 0, 0) >= 0)
+        last_report_ms = now_ms;
+}
+
+
+void battery_sched_sample(int64_t timestamp_ms, int adc_mv) {
+    int32_t cell_mv = (int32_t)((int64_t)adc_mv * CONFIG_BATTERY_DIVIDER_X1000 / 1000);
+
+    if (battery_model_update(&state, &tiers, timestamp_ms, cell_mv)) {
+        ESP_LOGD(TAG, "Ignoring battery reading of %d mV", cell_mv);
+        return;
+    }
+
+    int changed = state.tier != applied_tier;
+    if (changed)
+        apply_tier(state.tier);
+    if (changed || timestamp_ms - last_report_ms >= CONFIG_BATTERY_REPORT_PERIOD_S * 1000LL)
+        publish_report(timestamp_ms);
+}
+
+
+const struct battery_state *battery_sched_state(void) {
+    return &state;
+}
+
+
+int battery_sched_setup(void) {
+    if (!battery_model_valid(&state))
+        battery_model_init(&state);
+    return 0;
+}
+
+#endif
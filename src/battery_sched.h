@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "battery_model.h"
+
+/**
+ * @brief   Restores the battery history kept across deep sleep
+ *
+ * @return 0 on success
+ */
+int battery_sched_setup(void);
+
+/**
+ * @brief   Feeds a battery reading (mV at the ADC pin) and applies the tier it leads to
+ */
+void battery_sched_sample(int64_t timestamp_ms, int adc_mv);
+
+/**
+ * @brief   Charge, rate and tier after the last reading
+ */
+const struct battery_state *battery_sched_state(void);
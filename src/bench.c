@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+
+#include "adc_reader.h"
+#include "hal.h"
+#include "mqtt_cmd.h"
+#include "latency.h"
+#include "energy_model.h"
+#include "pm_policy.h"
+#include "bench.h"
+
+/* Cost of the steps every sample and every send goes through, measured
+ * with the CPU cycle counter: CCOUNT on the node, the cycles PMU counter
+ * (user space only) on Linux, or nanoseconds when perf events are not
+ * allowed. Each step runs CONFIG_BENCH_ITERATIONS times (`batch` calls per
+ * reading for the short ones) and is printed as
+ *   {"bench":"name","batch":n,"min":c,"p50":c,"p90":c,"max":c,"mean":c}
+ * in counts per call, after a first line with the platform, the unit and
+ * the settings that scale the results; with nanoseconds, 1e9 / p50 of the
+ * mqtt_cmd steps is the command throughput in messages per second.
+ * adc_burst goes through the get_mv table, adc_burst_fixed through the
+ * routine generated for the measure; both read the same channels.
+ * latency_probe is what latency.h adds to every timer callback.
+ * tools/bench_compare.py diffs two runs.
+ *
+ * Last, the energy of a sample/send cycle (SEND_FREQ / SAMPLE_FREQ samples
+ * of the irradiation channel, then its send) under each PM lock policy:
+ *   {"energy":"cycle","policy":"name","samples":n,"us":t,"uj":e}
+ * built from the p50 of the steps, taken as CPU cycles, with energy_uj and
+ * the currents of menuconfig. ADC burst and ring push run as
+ * PM_ACTIVITY_ADC_BURST with the sensor supply on, window mean and format
+ * as PM_ACTIVITY_PUBLISH. Light sleep and Wi-Fi between cycles are the same
+ * for every policy and left out. With nanoseconds the counts are taken as
+ * time at CONFIG_MAX_CPU_FREQ_MHZ. */
+
+#ifdef CONFIG_BENCH
+
+#ifdef ESP_PLATFORM
+#include "esp_pm.h"
+#include "soc/cpu.h"
+#include "esp32/clk.h"
+#else
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "hal_mock_bus.h"
+#endif
+
+#define WARMUP      8
+
+extern const int IRRADIATION_ADC_INDEX;
+extern int adcs_setup(void);
+
+struct bench_case {
+    const char *name;
+    int batch;
+    void (*run)(void);
+};
+
+#define MESSAGE(topic, data) { topic, sizeof(topic) - 1, data, sizeof(data) - 1 }
+
+static const struct mqtt_message messages[] = {
+    MESSAGE("/ciu/lopy4/irradiation/1/sample_frequency", "5"),
+    MESSAGE("/ciu/lopy4/battery_level/1/send_frequency", "600"),
+    MESSAGE("/ciu/lopy4/irradiation/1/sample_number", "20"),
+    MESSAGE("/ciu/lopy4/log_level", "adc_reader=D"),
+    MESSAGE("/ciu/lopy4/battery_level/1/backfill", "100-200"),
+};
+
+/* The policies of pm_policy.c, as the mode each activity runs at. Wi-Fi
+ * holds APB_MAX while it is on, so without a frequency lock the CPU runs
+ * at 80 MHz, not at APB_MIN */
+static const struct {
+    const char *name;
+    enum pm_mode mode[PM_N_ACTIVITIES];
+} policies[] = {
+    { "dfs", { PM_MODE_APB_MAX, PM_MODE_APB_MAX, PM_MODE_APB_MAX } },
+    { "split", { PM_MODE_APB_MAX, PM_MODE_CPU_MAX, PM_MODE_CPU_MAX } },
+    { "boost", { PM_MODE_CPU_MAX, PM_MODE_CPU_MAX, PM_MODE_CPU_MAX } },
+};
+
+static const int mode_mhz[PM_N_MODES] = {
+    [PM_MODE_APB_MIN] = CONFIG_MIN_CPU_FREQ_MHZ,
+    [PM_MODE_APB_MAX] = 80,
+    [PM_MODE_CPU_MAX] = CONFIG_MAX_CPU_FREQ_MHZ,
+};
+
+static struct sample ring_samples[CONFIG_WINDOW_SIZE_IRRAD];
+static struct send_sample_buffer ring = { .samples = ring_samples };
+static int64_t ring_time_us;
+static uint32_t seq;
+static int raw, next_message;
+static volatile int sink;   // keeps the results alive
+
+
+#ifdef ESP_PLATFORM
+typedef uint32_t bench_count_t;
+
+static const char *counter_open(void) {
+    return "cycles";
+}
+
+
+static inline bench_count_t counter_read(void) {
+    return esp_cpu_get_ccount();
+}
+
+
+static void counter_close(void) {
+}
+#else
+typedef uint64_t bench_count_t;
+
+static int perf_fd = -1;
+
+
+static const char *counter_open(void) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CPU_CYCLES,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    return perf_fd >= 0 ? "cycles" : "ns";
+}
+
+
+static inline bench_count_t counter_read(void) {
+    uint64_t count;
+    struct timespec t;
+
+    if (perf_fd >= 0 && read(perf_fd, &count, sizeof(count)) == sizeof(count))
+        return count;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+static void counter_close(void) {
+    if (perf_fd >= 0)
+        close(perf_fd);
+    perf_fd = -1;
+}
+#endif
+
+
+static void run_adc_burst(void) {
+    sink += adc_burst_mean(IRRADIATION_ADC_INDEX);
+}
+
+
+static void run_adc_burst_fixed(void) {
+    sink += adc_burst_mean_fixed(IRRADIATION_ADC_INDEX);
+}
+
+
+static void run_adc_raw_to_mv(void) {
+    raw = (raw + 37) & 4095;
+    sink += hal_adc_raw_to_mv(HAL_ADC_BATTERY, raw);
+}
+
+
+static void run_ring_push(void) {
+    ring_time_us += CONFIG_SAMPLE_FREQ_IRRAD * 1000000LL;
+    sample_ring_push(&ring, CONFIG_WINDOW_SIZE_IRRAD, ring_time_us, (int)(ring_time_us >> 10) & 4095);
+}
+
+
+static void run_window_mean(void) {
+    int mean;
+    long long timestamp_ms;
+
+    sample_window_mean(&ring, CONFIG_WINDOW_SIZE_IRRAD, &mean, &timestamp_ms);
+    sink += mean;
+}
+
+
+static void run_format_record(void) {
+    seq++;
+    sink += format_record(ring.payload, sizeof(ring.payload), seq, 1000 + (seq & 1023), 1685577600000LL + seq * 10000LL);
+}
+
+
+#if defined(CONFIG_EXT_ADC) && !defined(ESP_PLATFORM)
+static void ext_round_done(struct ext_adc *adc, int status, void *arg) {
+    sink += adc->mean_uv[0];
+}
+
+
+static struct ext_adc ext_adc = {
+    .address = CONFIG_EXT_ADC_I2C_ADDRESS,
+    .data_rate = CONFIG_EXT_ADC_DATA_RATE,
+    .n_channels = 2,
+    .channels = { { EXT_ADC_AIN0_AIN1, CONFIG_EXT_ADC_PGA }, { EXT_ADC_AIN1, 2 } },
+    .n_samples = CONFIG_N_SAMPLES_IRRAD,
+    .done = ext_round_done,
+};
+
+
+/* A whole round of the external ADC on the mock bus, conversions ending at once */
+static void run_ext_adc_round(void) {
+    if (ext_adc_start(&ext_adc) == 0)
+        while (hal_mock_bus_complete())
+            ;
+}
+#endif
+
+
+static void run_mqtt_cmd_parse(void) {
+    const struct mqtt_message *m = &messages[next_message];
+    struct mqtt_cmd cmd;
+
+    next_message = (next_message + 1) % (sizeof(messages) / sizeof(messages[0]));
+    if (mqtt_cmd_parse(m, &cmd) == 0)
+        sink += cmd.kind;
+}
+
+
+/* A message in three chunks, as the client delivers one larger than its buffer */
+static void run_mqtt_cmd_chunks(void) {
+    const struct mqtt_message *m = &messages[4];
+    const struct mqtt_message *whole = NULL;
+    struct mqtt_cmd cmd;
+
+    for (int offset = 0; offset < m->data_len; offset += 3) {
+        int len = m->data_len - offset < 3 ? m->data_len - offset : 3;
+        whole = mqtt_cmd_feed(offset ? NULL : m->topic, offset ? 0 : m->topic_len, m->data + offset, len,
+                              offset, m->data_len);
+    }
+    if (whole != NULL && mqtt_cmd_parse(whole, &cmd) == 0)
+        sink += cmd.adc;
+}
+
+
+#ifdef CONFIG_LATENCY_STATS
+static void run_latency_probe(void) {
+    static struct latency *path;
+
+    if (path == NULL) {
+        path = latency_path("bench");
+        latency_arm(path, 0, 1000);
+    }
+    latency_exit(path, latency_enter(path));
+}
+#endif
+
+
+// in the order the data goes through them; window_mean reads the ring filled by ring_push
+static const struct bench_case cases[] = {
+#ifdef CONFIG_LATENCY_STATS
+    { "latency_probe", 16, run_latency_probe },
+#endif
+    { "adc_burst", 1, run_adc_burst },
+    { "adc_burst_fixed", 1, run_adc_burst_fixed },
+    { "adc_raw_to_mv", 16, run_adc_raw_to_mv },
+    { "ring_push", 16, run_ring_push },
+    { "window_mean", 16, run_window_mean },
+    { "format_record", 16, run_format_record },
+#if defined(CONFIG_EXT_ADC) && !defined(ESP_PLATFORM)
+    { "ext_adc_round", 1, run_ext_adc_round },
+#endif
+    { "mqtt_cmd_parse", 16, run_mqtt_cmd_parse },
+    { "mqtt_cmd_chunks", 16, run_mqtt_cmd_chunks },
+};
+
+
+static int compare_counts(const void *a, const void *b) {
+    bench_count_t x = *(const bench_count_t *)a, y = *(const bench_count_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+/* Least cost of reading the counter twice, taken off every reading */
+static bench_count_t counter_overhead(void) {
+    bench_count_t least = (bench_count_t)-1;
+
+    for (int i = 0; i < CONFIG_BENCH_ITERATIONS; i++) {
+        bench_count_t t0 = counter_read();
+        bench_count_t t1 = counter_read();
+        if ((bench_count_t)(t1 - t0) < least)
+            least = t1 - t0;
+    }
+    return least;
+}
+
+
+/* Median count per call of each case, in the order of `cases` */
+static double medians[sizeof(cases) / sizeof(cases[0])];
+
+
+static void run_case(const struct bench_case *c, bench_count_t *counts, bench_count_t overhead) {
+    const int n = CONFIG_BENCH_ITERATIONS;
+    double sum = 0;
+
+    for (int i = 0; i < WARMUP; i++)
+        c->run();
+
+    for (int i = 0; i < n; i++) {
+        bench_count_t t0 = counter_read();
+        for (int j = 0; j < c->batch; j++)
+            c->run();
+        bench_count_t t1 = counter_read();
+        bench_count_t elapsed = t1 - t0;
+        counts[i] = elapsed > overhead ? elapsed - overhead : 0;
+        sum += counts[i];
+    }
+    qsort(counts, n, sizeof(counts[0]), compare_counts);
+
+    double per_call = 1.0 / c->batch;
+    printf("{\"bench\":\"%s\",\"batch\":%d,\"min\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"max\":%.1f,\"mean\":%.1f}\n",
+           c->name, c->batch, counts[0] * per_call, counts[n / 2] * per_call,
+           counts[n * 9 / 10] * per_call, counts[n - 1] * per_call, sum / n * per_call);
+    medians[c - cases] = counts[n / 2] * per_call;
+}
+
+
+static double median_of(const char *name) {
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        if (strcmp(cases[i].name, name) == 0)
+            return medians[i];
+    return 0;
+}
+
+
+/* Residency of a thousand cycles, so energy_uj keeps the fractions of a uJ */
+static void print_cycle_energy(const char *unit) {
+    const int samples = CONFIG_SEND_FREQ_IRRAD / CONFIG_SAMPLE_FREQ_IRRAD > 0
+                        ? CONFIG_SEND_FREQ_IRRAD / CONFIG_SAMPLE_FREQ_IRRAD : 1;
+    const double scale = strcmp(unit, "ns") == 0 ? CONFIG_MAX_CPU_FREQ_MHZ / 1000.0 : 1;
+    double cycles[PM_N_ACTIVITIES] = {
+        [PM_ACTIVITY_ADC_BURST] = samples * (median_of("adc_burst") + median_of("ring_push")) * scale,
+        [PM_ACTIVITY_PUBLISH] = (median_of("window_mean") + median_of("format_record")) * scale,
+    };
+    struct current_model model;
+
+    energy_model_default(&model);
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        struct residency r = { 0 };
+        double us = 0;
+
+        for (int a = 0; a < PM_N_ACTIVITIES; a++) {
+            double activity_us = cycles[a] / mode_mhz[policies[p].mode[a]];
+            r.mode_us[policies[p].mode[a]] += (int64_t)(activity_us * 1000);
+            if (a == PM_ACTIVITY_ADC_BURST)
+                r.power_pin_us += (int64_t)(activity_us * 1000);
+            us += activity_us;
+        }
+        printf("{\"energy\":\"cycle\",\"policy\":\"%s\",\"samples\":%d,\"us\":%.2f,\"uj\":%.3f}\n",
+               policies[p].name, samples, us, energy_uj(&model, &r) / 1000.0);
+    }
+}
+
+
+int bench_run(void) {
+    bench_count_t *counts = malloc(CONFIG_BENCH_ITERATIONS * sizeof(*counts));
+
+    if (counts == NULL || adcs_setup()) {
+        free(counts);
+        return 1;
+    }
+#if defined(CONFIG_EXT_ADC) && !defined(ESP_PLATFORM)
+    if (ext_adc_setup(&ext_adc, CONFIG_EXT_ADC_READY_PIN)) {
+        free(counts);
+        return 1;
+    }
+#endif
+
+#if defined(ESP_PLATFORM) && defined(CONFIG_PM_ENABLE)
+    // the clock must not change under the measurements
+    esp_pm_lock_handle_t lock;
+    if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "bench", &lock) == ESP_OK)
+        esp_pm_lock_acquire(lock);
+    else
+        lock = NULL;
+#endif
+
+    const char *unit = counter_open();
+    bench_count_t overhead = counter_overhead();
+#ifdef ESP_PLATFORM
+    printf("{\"platform\":\"esp32\",\"cpu_mhz\":%d,", esp_clk_cpu_freq() / 1000000);
+#else
+    printf("{\"platform\":\"host\",");
+#endif
+    printf("\"unit\":\"%s\",\"iterations\":%d,\"overhead\":%u,\"n_samples\":%d,\"window_size\":%d}\n",
+           unit, CONFIG_BENCH_ITERATIONS, (unsigned)overhead, CONFIG_N_SAMPLES_IRRAD, CONFIG_WINDOW_SIZE_IRRAD);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        run_case(&cases[i], counts, overhead);
+    print_cycle_energy(unit);
+    fflush(stdout);
+
+    counter_close();
+#if defined(ESP_PLATFORM) && defined(CONFIG_PM_ENABLE)
+    if (lock != NULL) {
+        esp_pm_lock_release(lock);
+        esp_pm_lock_delete(lock);
+    }
+#endif
+    free(counts);
+    return 0;
+}
+
+#endif
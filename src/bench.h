@@ -0,0 +1,10 @@
+#pragma once
+
+/**
+ * @brief   Times the per-sample and per-send steps and prints one JSON line
+ *          per step to stdout
+ *
+ * On the node (CONFIG_BENCH) it runs once at boot, before the sampling timers
+ * start; on the host it is the whole of the bench build, see sim/bench_main.c
+ */
+int bench_run(void);
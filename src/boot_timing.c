@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+
+#include "boot_timing.h"
+#include "mqtt.h"
+
+/* Microseconds since startup at which each boot phase was reached, published
+ * once as {"reset":r,"wake":w,"fast":f,"ms":{"app_main":t,...}}. Phases
+ * not reached by the first publish are left out */
+
+static const char *TAG = "boot";
+
+#define TOPIC_BOOT_TIMING "/ciu/lopy4/diagnostics/boot"
+
+static const char *phase_names[BOOT_N_PHASES] = {
+    [BOOT_APP_MAIN] = "app_main",
+    [BOOT_STACK_READY] = "stack",
+    [BOOT_NVS_READY] = "nvs",
+    [BOOT_WIFI_STARTED] = "wifi",
+    [BOOT_GOT_IP] = "ip",
+    [BOOT_MQTT_CONNECTED] = "mqtt",
+    [BOOT_TIME_VALID] = "time",
+    [BOOT_FIRST_SAMPLE] = "sample",
+    [BOOT_FIRST_PUBLISH] = "publish",
+};
+
+static int64_t phase_us[BOOT_N_PHASES];
+static bool fast_path;
+
+
+static void publish_report(void) {
+    char payload[256];
+    int len, first = 1;
+
+    len = snprintf(payload, sizeof(payload), "{\"reset\":%d,\"wake\":%d,\"fast\":%d,\"ms\":{",
+                   esp_reset_reason(), esp_sleep_get_wakeup_cause(), fast_path);
+    for (int i = 0; i < BOOT_N_PHASES && len < (int)sizeof(payload); i++) {
+        if (phase_us[i] == 0)
+            continue;
+        len += snprintf(payload + len, sizeof(payload) - len, "%s\"%s\":%lld",
+                        first ? "" : ",", phase_names[i], (long long)(phase_us[i] / 1000));
+        first = 0;
+    }
+    if (len < (int)sizeof(payload))
+        len += snprintf(payload + len, sizeof(payload) - len, "}}");
+    if (len >= (int)sizeof(payload))
+        return;
+
+    ESP_LOGI(TAG, "%s", payload);
+    enviar_al_broker(TOPIC_BOOT_TIMING, payload, len, 1, 0);
+}
+
+
+void boot_mark(enum boot_phase phase) {
+    if (phase >= BOOT_N_PHASES || phase_us[phase] != 0)
+        return;
+
+    phase_us[phase] = esp_timer_get_time();
+    ESP_LOGD(TAG, "Phase %s at %lld ms", phase_names[phase], (long long)(phase_us[phase] / 1000));
+
+    if (phase == BOOT_FIRST_PUBLISH)
+        publish_report();
+}
+
+
+void boot_fast_path_taken(void) {
+    fast_path = true;
+}
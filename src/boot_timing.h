@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Boot phases, in the order they normally happen */
+enum boot_phase {
+    BOOT_APP_MAIN,          // app_main entered
+    BOOT_STACK_READY,       // netif and default event loop
+    BOOT_NVS_READY,
+    BOOT_WIFI_STARTED,
+    BOOT_GOT_IP,
+    BOOT_MQTT_CONNECTED,
+    BOOT_TIME_VALID,        // timestamps can be published
+    BOOT_FIRST_SAMPLE,
+    BOOT_FIRST_PUBLISH,
+    BOOT_N_PHASES
+};
+
+/**
+ * @brief   Records the instant a boot phase is reached. Only the first call per phase counts
+ *
+ * Reaching BOOT_FIRST_PUBLISH publishes the whole report on the diagnostics topic.
+ */
+void boot_mark(enum boot_phase phase);
+
+/**
+ * @brief   Notes that the provisioned fast path was taken
+ */
+void boot_fast_path_taken(void);
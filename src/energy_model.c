@@ -0,0 +1,39 @@
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#include "energy_model.h"
+
+
+void energy_model_default(struct current_model *model) {
+    model->mode_ua[PM_MODE_LIGHT_SLEEP] = CONFIG_ENERGY_LIGHT_SLEEP_UA;
+    model->mode_ua[PM_MODE_APB_MIN] = CONFIG_ENERGY_APB_MIN_UA;
+    model->mode_ua[PM_MODE_APB_MAX] = CONFIG_ENERGY_APB_MAX_UA;
+    model->mode_ua[PM_MODE_CPU_MAX] = CONFIG_ENERGY_CPU_MAX_UA;
+    model->wifi_ua = CONFIG_ENERGY_WIFI_UA;
+    model->power_pin_ua = CONFIG_ENERGY_POWER_PIN_UA;
+    model->deep_sleep_ua = CONFIG_ENERGY_DEEP_SLEEP_UA;
+    model->supply_mv = CONFIG_ENERGY_SUPPLY_MV;
+}
+
+
+// uA * mV = nW, and nW * us = 1e-15 J, so the product is divided by 1e9 to get uJ
+static inline int64_t state_uj(int32_t ua, int32_t mv, int64_t us) {
+    return (int64_t)ua * mv / 1000 * us / 1000000;
+}
+
+
+int64_t energy_uj(const struct current_model *model, const struct residency *r) {
+    int64_t uj = 0;
+
+    for (int i = 0; i < PM_N_MODES; i++)
+        uj += state_uj(model->mode_ua[i], model->supply_mv, r->mode_us[i]);
+    uj += state_uj(model->wifi_ua, model->supply_mv, r->wifi_us);
+    uj += state_uj(model->power_pin_ua, model->supply_mv, r->power_pin_us);
+
+    return uj;
+}
+
+
+int64_t deep_sleep_energy_uj(const struct current_model *model, int64_t us) {
+    return state_uj(model->deep_sleep_ua, model->supply_mv, us);
+}
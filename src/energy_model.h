@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Energy estimate from the time spent in each power state. Plain C, no
+ * ESP-IDF dependency, so the same model runs on the node and on the host. */
+
+/* Power management modes, mutually exclusive while awake */
+enum pm_mode {
+    PM_MODE_LIGHT_SLEEP,
+    PM_MODE_APB_MIN,        // CONFIG_MIN_CPU_FREQ_MHZ
+    PM_MODE_APB_MAX,        // 80 MHz
+    PM_MODE_CPU_MAX,        // CONFIG_MAX_CPU_FREQ_MHZ
+    PM_N_MODES
+};
+
+/* Time spent in each state over an interval, in microseconds. Wi-Fi and the
+ * sensor supply overlap the PM modes */
+struct residency {
+    int64_t mode_us[PM_N_MODES];
+    int64_t wifi_us;
+    int64_t power_pin_us;
+};
+
+/* Current drawn in each state (uA) at the supply voltage (mV). Wi-Fi and
+ * the sensor supply are added on top of the PM mode current */
+struct current_model {
+    int32_t mode_ua[PM_N_MODES];
+    int32_t wifi_ua;
+    int32_t power_pin_ua;
+    int32_t deep_sleep_ua;
+    int32_t supply_mv;
+};
+
+/**
+ * @brief   Fills the model with the currents set in menuconfig
+ */
+void energy_model_default(struct current_model *model);
+
+/**
+ * @brief   Energy (uJ) spent over an interval
+ */
+int64_t energy_uj(const struct current_model *model, const struct residency *r);
+
+/**
+ * @brief   Energy (uJ) spent in deep sleep for `us` microseconds
+ */
+int64_t deep_sleep_energy_uj(const struct current_model *model, int64_t us);
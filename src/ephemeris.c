@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "sdkconfig.h"
+
+#include "ephemeris.h"
+
+static const char *TAG = "ephemeris";
+
+/* Q16 fixed point for magnitudes, angles in 2^20ths of a turn */
+#define FX_SHIFT    16
+#define FX_ONE      (1 << FX_SHIFT)
+#define FX(x)       ((int32_t)((x) * FX_ONE + ((x) >= 0 ? 0.5 : -0.5)))
+#define FX_PI       FX(3.14159265)
+#define FX_TWO_PI   FX(6.28318531)
+
+#define ANG_TURN    (1 << 20)
+#define ANG_QUARTER (ANG_TURN >> 2)
+
+#define SECONDS_PER_DAY 86400
+#define HALF_DAY        (SECONDS_PER_DAY / 2)
+
+/* cos(90.833 deg): refraction plus solar disc radius at the horizon */
+#define COS_ZENITH  FX(-0.014538)
+
+/* Per-day table, indexed by UTC day of the year (tm_yday). Solar noon is
+ * stored as its offset from the site mean noon (equation of time) and
+ * the day as its half length, so both fit 16 bits at one second resolution */
+struct sun_table {
+    uint32_t key;
+    int16_t noon[SUN_TABLE_DAYS];
+    uint16_t half[SUN_TABLE_DAYS];
+};
+
+RTC_DATA_ATTR static struct sun_table sun_table;
+
+
+static inline int32_t fx_mul(int32_t a, int32_t b) {
+    return (int32_t)(((int64_t)a * b) >> FX_SHIFT);
+}
+
+
+static inline int32_t rad_to_ang(int32_t rad) {
+    return (int32_t)(((int64_t)rad * ANG_TURN) / FX_TWO_PI);
+}
+
+
+static uint32_t isqrt64(uint64_t v) {
+    uint64_t res = 0, bit = (uint64_t)1 << 62;
+
+    while (bit > v)
+        bit >>= 2;
+    while (bit) {
+        if (v >= res + bit) {
+            v -= res + bit;
+            res = (res >> 1) + bit;
+        } else {
+            res >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)res;
+}
+
+
+// sine of an angle in turn units, Q16 result. Odd polynomial over one quadrant
+static int32_t fx_sin(int32_t ang) {
+    uint32_t a = (uint32_t)ang & (ANG_TURN - 1);
+    int quadrant = a / ANG_QUARTER;
+    int32_t x = a & (ANG_QUARTER - 1);
+
+    if (quadrant & 1)
+        x = ANG_QUARTER - x;
+
+    int32_t t = x >> 2; // Q16 fraction of a quarter turn
+    int32_t t2 = fx_mul(t, t);
+    int32_t r = FX(0.0001604411);
+    r = FX(0.0046817541) - fx_mul(t2, r);
+    r = FX(0.0796926262) - fx_mul(t2, r);
+    r = FX(0.6459640975) - fx_mul(t2, r);
+    r = FX(1.5707963268) - fx_mul(t2, r);
+    r = fx_mul(t, r);
+
+    return (quadrant & 2) ? -r : r;
+}
+
+
+static inline int32_t fx_cos(int32_t ang) {
+    return fx_sin(ang + ANG_QUARTER);
+}
+
+
+// arc cosine of a Q16 value, result in turn units (Abramowitz-Stegun 4.4.45)
+static int32_t fx_acos(int32_t x) {
+    int neg = x < 0;
+
+    if (neg)
+        x = -x;
+    if (x > FX_ONE)
+        x = FX_ONE;
+
+    int32_t p = FX(-0.0187293);
+    p = fx_mul(p, x) + FX(0.0742610);
+    p = fx_mul(p, x) - FX(0.2121144);
+    p = fx_mul(p, x) + FX(1.5707288);
+    int32_t s = isqrt64((uint64_t)(FX_ONE - x) << FX_SHIFT);
+    int32_t rad = fx_mul(s, p);
+
+    if (neg)
+        rad = FX_PI - rad;
+    return rad_to_ang(rad);
+}
+
+
+/* NOAA general solar position approximation, evaluated at solar noon */
+static void sun_day(int yday, int32_t lat, int16_t *noon, uint16_t *half) {
+    int32_t g = (int32_t)(((int64_t)yday * ANG_TURN) / 365);
+    int32_t c1 = fx_cos(g), s1 = fx_sin(g);
+    int32_t c2 = fx_cos(2 * g), s2 = fx_sin(2 * g);
+    int32_t c3 = fx_cos(3 * g), s3 = fx_sin(3 * g);
+
+    int32_t decl = FX(0.006918) - fx_mul(FX(0.399912), c1) + fx_mul(FX(0.070257), s1)
+                 - fx_mul(FX(0.006758), c2) + fx_mul(FX(0.000907), s2)
+                 - fx_mul(FX(0.002697), c3) + fx_mul(FX(0.001480), s3);
+    int32_t eot = FX(0.000075) + fx_mul(FX(0.001868), c1) - fx_mul(FX(0.032077), s1)
+                - fx_mul(FX(0.014615), c2) - fx_mul(FX(0.040849), s2);
+    // 229.18 minutes per radian of equation of time
+    int32_t eot_s = (int32_t)(((int64_t)eot * 13751) >> FX_SHIFT);
+
+    int32_t d = rad_to_ang(decl);
+    int32_t num = COS_ZENITH - fx_mul(fx_sin(lat), fx_sin(d));
+    int32_t den = fx_mul(fx_cos(lat), fx_cos(d));
+    int32_t cos_ha;
+
+    if (den <= 0)
+        cos_ha = (num > 0) ? FX_ONE : -FX_ONE;
+    else if (num >= den)
+        cos_ha = FX_ONE;
+    else if (-num >= den)
+        cos_ha = -FX_ONE;
+    else
+        cos_ha = (int32_t)(((int64_t)num << FX_SHIFT) / den);
+
+    int32_t ha = fx_acos(cos_ha);
+    int32_t half_s = (int32_t)(((int64_t)ha * SECONDS_PER_DAY) / ANG_TURN);
+
+    // keep a short night even under midnight sun so the schedule stays well formed
+    if (half_s > HALF_DAY - SUN_MARGIN_S - 60)
+        half_s = HALF_DAY - SUN_MARGIN_S - 60;
+    if (half_s < 0)
+        half_s = 0;
+
+    *noon = (int16_t)-eot_s;
+    *half = (uint16_t)half_s;
+}
+
+
+static uint32_t site_key(void) {
+    uint32_t key = 2166136261u;
+    int32_t params[] = { SUN_LATITUDE_MDEG, SUN_LONGITUDE_MDEG, SUN_MARGIN_S };
+
+    for (int i = 0; i < (int)(sizeof(params) / sizeof(params[0])); i++)
+        key = (key ^ (uint32_t)params[i]) * 16777619u;
+    return key;
+}
+
+
+int ephemeris_setup(void) {
+    uint32_t key = site_key();
+
+    if (sun_table.key == key) {
+        ESP_LOGD(TAG, "Sun table already in RTC memory");
+        return 0;
+    }
+
+    int32_t lat = (int32_t)(((int64_t)SUN_LATITUDE_MDEG * ANG_TURN) / 360000);
+    for (int i = 0; i < SUN_TABLE_DAYS; i++)
+        sun_day(i, lat, &sun_table.noon[i], &sun_table.half[i]);
+    sun_table.key = key;
+
+    ESP_LOGI(TAG, "Sun table built for lat %d, lon %d (mdeg)", SUN_LATITUDE_MDEG, SUN_LONGITUDE_MDEG);
+    return 0;
+}
+
+
+/* Sunrise (dir = -1) or sunset (dir = 1) of the UTC day starting at `midnight` */
+static time_t sun_event(time_t midnight, int dir) {
+    struct tm tm_utc;
+    gmtime_r(&midnight, &tm_utc);
+
+    int yday = tm_utc.tm_yday;
+    // site mean noon: 4 minutes earlier per degree east
+    int32_t mean_noon = HALF_DAY - (int32_t)(((int64_t)SUN_LONGITUDE_MDEG * 240) / 1000);
+    int32_t offset = mean_noon + sun_table.noon[yday] + dir * (sun_table.half[yday] + SUN_MARGIN_S);
+
+    return midnight + offset;
+}
+
+
+static time_t next_event(time_t from, int dir) {
+    time_t midnight = from - (from % SECONDS_PER_DAY);
+
+    if (sun_table.key != site_key())
+        ephemeris_setup();
+
+    // events of a UTC day can fall on the previous or next day far from Greenwich
+    for (int k = -1; k <= 2; k++) {
+        time_t t = sun_event(midnight + k * SECONDS_PER_DAY, dir);
+        if (t > from)
+            return t;
+    }
+    return from + SECONDS_PER_DAY;
+}
+
+
+time_t ephemeris_next_wakeup(time_t from) {
+    return next_event(from, -1);
+}
+
+
+time_t ephemeris_next_sleep(time_t from) {
+    return next_event(from, 1);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <time.h>
+#include <stdint.h>
+
+/* Site coordinates in thousandths of a degree (north and east positive) */
+#define SUN_LATITUDE_MDEG   CONFIG_SUN_LATITUDE_MDEG
+#define SUN_LONGITUDE_MDEG  CONFIG_SUN_LONGITUDE_MDEG
+
+/* Seconds the node stays awake before sunrise and after sunset */
+#define SUN_MARGIN_S        (CONFIG_SUN_MARGIN_MIN * 60)
+
+#define SUN_TABLE_DAYS 366
+
+/**
+ * @brief   Builds the per-day sunrise/sunset table
+ *
+ * The table lives in RTC memory, so it is only computed on the first
+ * boot (or when the site configuration changes) and survives deep sleep.
+ *
+ * @return 0 on success
+ */
+int ephemeris_setup(void);
+
+/**
+ * @brief   Next wake-up instant (sunrise minus margin) strictly after `from`
+ */
+time_t ephemeris_next_wakeup(time_t from);
+
+/**
+ * @brief   Next sleep instant (sunset plus margin) strictly after `from`
+ */
+time_t ephemeris_next_sleep(time_t from);
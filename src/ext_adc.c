@@ -0,0 +1,133 @@
+#include <string.h>
+#include "sdkconfig.h"
+
+#include "hal.h"
+#include "ext_adc.h"
+
+#if defined(CONFIG_EXT_ADC) || !defined(ESP_PLATFORM)
+
+#define REG_CONVERSION  0x00
+#define REG_CONFIG      0x01
+#define REG_LO_THRESH   0x02
+#define REG_HI_THRESH   0x03
+
+#define CONFIG_OS       0x8000  // start a single conversion
+#define CONFIG_MODE     0x0100  // single-shot
+// COMP_QUE = 0: ALERT/RDY asserts after every conversion, active low
+
+static const int32_t full_scale_uv[8] = { 6144000, 4096000, 2048000, 1024000, 512000, 256000, 256000, 256000 };
+
+
+int32_t ext_adc_code_to_uv(int pga, int16_t code) {
+    return (int32_t)((int64_t)code * full_scale_uv[pga & 7] / 32768);
+}
+
+
+static uint16_t config_word(const struct ext_adc *adc, int channel) {
+    const struct ext_adc_channel *c = &adc->channels[channel];
+
+    return CONFIG_OS | (c->mux & 7) << 12 | (c->pga & 7) << 9 | CONFIG_MODE | (adc->data_rate & 7) << 5;
+}
+
+
+static void put_register(uint8_t *buf, uint8_t reg, uint16_t value) {
+    buf[0] = reg;
+    buf[1] = value >> 8;
+    buf[2] = value & 0xff;
+}
+
+
+int ext_adc_setup(struct ext_adc *adc, int ready_pin) {
+    static const uint8_t pointer_config = REG_CONFIG;
+    uint8_t lo[3], hi[3], config[2];
+
+    if (adc->n_channels == 0 || adc->n_channels > EXT_ADC_MAX_CHANNELS)
+        return 1;
+
+    // thresholds with opposite MSBs turn ALERT/RDY into the conversion ready line
+    put_register(lo, REG_LO_THRESH, 0x0000);
+    put_register(hi, REG_HI_THRESH, 0x8000);
+    const struct hal_bus_segment segments[] = {
+        { .tx = lo, .len = sizeof(lo) },
+        { .tx = hi, .len = sizeof(hi) },
+        { .tx = &pointer_config, .len = 1 },
+        { .rx = config, .len = sizeof(config) },
+    };
+    if (hal_bus_transfer(adc->address, segments, sizeof(segments) / sizeof(segments[0])))
+        return 1;
+
+    adc->busy = 0;
+    return hal_gpio_on_falling(ready_pin, ext_adc_ready, adc);
+}
+
+
+int ext_adc_start(struct ext_adc *adc) {
+    uint8_t start[3];
+
+    // a lost ready edge (or a deep sleep in the host simulation) leaves a round unfinished
+    if (adc->busy) {
+        adc->busy = 0;
+        adc->stalls++;
+    }
+
+    memset(adc->sum_uv, 0, sizeof(adc->sum_uv));
+    adc->conversions = 0;
+    adc->total = adc->n_samples * adc->n_channels;
+    if (adc->total <= 0)
+        return 1;
+
+    put_register(start, REG_CONFIG, config_word(adc, 0));
+    const struct hal_bus_segment segment = { .tx = start, .len = sizeof(start) };
+    adc->busy = 1;
+    if (hal_bus_transfer(adc->address, &segment, 1)) {
+        adc->busy = 0;
+        adc->errors++;
+        return 1;
+    }
+    return 0;
+}
+
+
+/* The conversion register keeps the finished result while the next one
+ * runs, so the next start goes first in the transaction */
+void ext_adc_ready(void *arg) {
+    struct ext_adc *adc = arg;
+    static const uint8_t pointer_conversion = REG_CONVERSION;
+    struct hal_bus_segment segments[3];
+    uint8_t start[3], result[2];
+    int n = 0;
+
+    if (!adc->busy)
+        return;
+
+    int channel = adc->conversions % adc->n_channels;
+    int last = adc->conversions + 1 == adc->total;
+    if (!last) {
+        put_register(start, REG_CONFIG, config_word(adc, (adc->conversions + 1) % adc->n_channels));
+        segments[n++] = (struct hal_bus_segment){ .tx = start, .len = sizeof(start) };
+    }
+    segments[n++] = (struct hal_bus_segment){ .tx = &pointer_conversion, .len = 1 };
+    segments[n++] = (struct hal_bus_segment){ .rx = result, .len = sizeof(result) };
+
+    if (hal_bus_transfer(adc->address, segments, n)) {
+        adc->busy = 0;
+        adc->errors++;
+        adc->done(adc, 1, adc->arg);
+        return;
+    }
+
+    int16_t code = (int16_t)(result[0] << 8 | result[1]);
+    adc->sum_uv[channel] += ext_adc_code_to_uv(adc->channels[channel].pga, code);
+    if (!last) {
+        adc->conversions++;
+        return;
+    }
+
+    for (int i = 0; i < adc->n_channels; i++)
+        adc->mean_uv[i] = (int32_t)(adc->sum_uv[i] / adc->n_samples);
+    adc->rounds++;
+    adc->busy = 0;
+    adc->done(adc, 0, adc->arg);
+}
+
+#endif
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+
+/* External delta-sigma converter (TI ADS1115 register map) on the HAL bus,
+ * read in rounds: n_samples single-shot conversions per channel, channels
+ * interleaved so they are sampled at the same instants. The conversion
+ * ready line (ALERT/RDY) runs ext_adc_ready, which starts the next
+ * conversion and reads the finished one in a single bus transaction, so
+ * the converter is never idle waiting for the read. Nothing polls; at the
+ * end of a round `done` gets the channel means. */
+
+#define EXT_ADC_MAX_CHANNELS 4
+
+// input multiplexer, positive-negative
+enum ext_adc_mux {
+    EXT_ADC_AIN0_AIN1,
+    EXT_ADC_AIN0_AIN3,
+    EXT_ADC_AIN1_AIN3,
+    EXT_ADC_AIN2_AIN3,
+    EXT_ADC_AIN0,
+    EXT_ADC_AIN1,
+    EXT_ADC_AIN2,
+    EXT_ADC_AIN3,
+};
+
+struct ext_adc_channel {
+    uint8_t mux;        // enum ext_adc_mux
+    uint8_t pga;        // full scale: 0 ±6.144 V, 1 ±4.096 V, 2 ±2.048 V, 3 ±1.024 V, 4 ±0.512 V, 5 ±0.256 V
+};
+
+struct ext_adc {
+    uint8_t address;
+    uint8_t data_rate;  // 0 8 SPS, 1 16, 2 32, 3 64, 4 128, 5 250, 6 475, 7 860
+    uint8_t n_channels;
+    struct ext_adc_channel channels[EXT_ADC_MAX_CHANNELS];
+    int n_samples;      // conversions per channel and round, read at the start of a round
+    // end of a round, status 0 if mean_uv holds it, from the context of ext_adc_ready
+    void (*done)(struct ext_adc *adc, int status, void *arg);
+    void *arg;
+
+    volatile uint8_t busy;
+    int conversions, total;
+    int64_t sum_uv[EXT_ADC_MAX_CHANNELS];
+    int32_t mean_uv[EXT_ADC_MAX_CHANNELS];
+    uint32_t rounds, errors, stalls;
+};
+
+/**
+ * @brief   Checks that the converter answers, makes ALERT/RDY signal the
+ *          end of each conversion and hooks ext_adc_ready to `ready_pin`
+ */
+int ext_adc_setup(struct ext_adc *adc, int ready_pin);
+
+/**
+ * @brief   Starts a round
+ *
+ * A previous round that never finished (a lost ready edge) is dropped
+ * and counted in `stalls`.
+ *
+ * @return  0 if started, 1 on a bus error
+ */
+int ext_adc_start(struct ext_adc *adc);
+
+/**
+ * @brief   Conversion ready handler, registered by ext_adc_setup
+ */
+void ext_adc_ready(void *arg);
+
+/**
+ * @brief   Conversion result to µV at the inputs
+ */
+int32_t ext_adc_code_to_uv(int pga, int16_t code);
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "adc_reader.h"
+#include "fault_alerts.h"
+#include "ephemeris.h"
+#include "mqtt.h"
+
+/* Sensor and wiring faults, checked on every sample (fault_detect.c) and
+ * published on the sample that raises or clears them:
+ *   {"fault":"negative","state":"raised","adc":0,"value":mV,"t":ms}
+ * A transition that cannot be sent (no broker) stays pending and goes out
+ * with the current state on a later sample. The panel short check needs to
+ * know whether the sun is up, taken from the sunrise/sunset table when the
+ * solar sleep schedule builds it. Runs in the esp_timer task. */
+
+#ifdef CONFIG_FAULT_DETECT
+
+static const char *TAG = "fault";
+extern bool time_is_valid(void);
+extern const int IRRADIATION_ADC_INDEX;
+extern const int BATTERY_ADC_INDEX;
+
+#define TOPIC_ALERTS        "/ciu/lopy4/alerts"
+#define DAYLIGHT_MARGIN_S   (SUN_MARGIN_S + 2 * 3600)   // from the edges of the awake window
+
+static const struct fault_params params = {
+    .debounce = CONFIG_FAULT_DEBOUNCE_SAMPLES,
+    .clear_samples = CONFIG_FAULT_CLEAR_SAMPLES,
+    .stuck_samples = CONFIG_FAULT_STUCK_SAMPLES,
+    .negative_mv = CONFIG_FAULT_NEGATIVE_MV,
+    .noise_mv = CONFIG_FAULT_NOISE_MV,
+    .short_mv = CONFIG_FAULT_SHORT_MV,
+    .rail_low_mv = 10,
+    .rail_high_mv = 3100,
+    .bias_mv = BIAS,
+    .bias_tolerance_mv = 100,
+    .battery_min_mv = CONFIG_FAULT_BATTERY_MIN_MV,
+    .battery_max_mv = CONFIG_FAULT_BATTERY_MAX_MV,
+    .battery_jump_mv = CONFIG_FAULT_BATTERY_JUMP_MV,
+};
+
+static struct fault_state state;
+static uint32_t pending;
+
+
+/* Whether the panel must be lit: well inside the awake window */
+static int is_daylight(int64_t timestamp_ms) {
+#ifdef CONFIG_SLEEP_SCHEDULE_SOLAR
+    static int64_t daylight_minute = -1;
+    static int daylight;
+    time_t now = timestamp_ms / 1000;
+
+    if (!time_is_valid())
+        return 0;
+    if (now / 60 != daylight_minute) {
+        daylight_minute = now / 60;
+        time_t sleep = ephemeris_next_sleep(now);
+        daylight = sleep < ephemeris_next_wakeup(now)
+                   && sleep - now > DAYLIGHT_MARGIN_S
+                   && ephemeris_next_wakeup(now - DAYLIGHT_MARGIN_S) > now;
+    }
+    return daylight;
+#else
+    return 0;
+#endif
+}
+
+
+static void publish(uint32_t changed, int adc, int mv, int64_t timestamp_ms) {
+    char payload[96];
+
+    pending |= changed;
+    for (int f = 0; f < FAULT_N; f++) {
+        uint32_t bit = 1u << f;
+        if (!(pending & bit) || (f == FAULT_BATTERY) != (adc == BATTERY_ADC_INDEX))
+            continue;
+
+        const char *what = state.active & bit ? "raised" : "cleared";
+        int len = snprintf(payload, sizeof(payload), "{\"fault\":\"%s\",\"state\":\"%s\",\"adc\":%d,\"value\":%d,\"t\":%lld}",
+                           fault_name(f), what, adc, mv, (long long)timestamp_ms);
+        if (changed & bit) {
+            if (state.active & bit)
+                ESP_LOGW(TAG, "%s", payload);
+            else
+                ESP_LOGI(TAG, "%s", payload);
+        }
+        if (enviar_al_broker(TOPIC_ALERTS, payload, len, 1, 0) >= 0)
+            pending &= ~bit;
+    }
+}
+
+
+void fault_alerts_irradiation(int64_t timestamp_ms, int mv, int panel_mv, int bias_mv) {
+    uint32_t changed = fault_irradiation(&state, &params, mv, panel_mv, bias_mv, is_daylight(timestamp_ms));
+
+    if (changed | (pending & ~(1u << FAULT_BATTERY)))
+        publish(changed, IRRADIATION_ADC_INDEX, mv, timestamp_ms);
+}
+
+
+void fault_alerts_battery(int64_t timestamp_ms, int mv) {
+    uint32_t changed = fault_battery(&state, &params, mv);
+
+    if (changed | (pending & (1u << FAULT_BATTERY)))
+        publish(changed, BATTERY_ADC_INDEX, mv, timestamp_ms);
+}
+
+
+int fault_alerts_setup(void) {
+    fault_init(&state);
+    pending = 0;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "fault_detect.h"
+
+/**
+ * @brief   Clears the detector state
+ *
+ * @return 0 on success
+ */
+int fault_alerts_setup(void);
+
+/**
+ * @brief   Checks an irradiation sample (panel minus bias) and the panel and
+ *          bias readings of its burst, publishing any fault raised or cleared
+ */
+void fault_alerts_irradiation(int64_t timestamp_ms, int mv, int panel_mv, int bias_mv);
+
+/**
+ * @brief   Checks a battery sample (mV at the ADC pin), publishing any fault
+ *          raised or cleared
+ */
+void fault_alerts_battery(int64_t timestamp_ms, int mv);
@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "fault_detect.h"
+
+#define NOISE_SHIFT     5   // EWMA weight 1/32, about a minute at the default sample period
+#define MAX_STEP_MV     4096
+
+static const char *names[FAULT_N] = {
+    [FAULT_STUCK] = "stuck",
+    [FAULT_NEGATIVE] = "negative",
+    [FAULT_NOISE] = "noise",
+    [FAULT_PANEL_SHORT] = "panel_short",
+    [FAULT_BIAS] = "bias",
+    [FAULT_BATTERY] = "battery",
+};
+
+
+void fault_init(struct fault_state *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+
+const char *fault_name(enum fault f) {
+    return f < FAULT_N ? names[f] : "?";
+}
+
+
+static int32_t abs32(int32_t x) {
+    return x < 0 ? -x : x;
+}
+
+
+/* Debounces one condition; returns the fault bit if its state changed */
+static uint32_t observe(struct fault_state *s, enum fault f, int condition, int32_t raise_after, int32_t clear_after) {
+    uint32_t bit = 1u << f;
+
+    if (condition) {
+        s->good[f] = 0;
+        if (s->bad[f] < UINT16_MAX)
+            s->bad[f]++;
+        if (!(s->active & bit) && s->bad[f] >= raise_after) {
+            s->active |= bit;
+            return bit;
+        }
+    } else {
+        s->bad[f] = 0;
+        if (s->good[f] < UINT16_MAX)
+            s->good[f]++;
+        if ((s->active & bit) && s->good[f] >= clear_after) {
+            s->active &= ~bit;
+            return bit;
+        }
+    }
+    return 0;
+}
+
+
+uint32_t fault_irradiation(struct fault_state *s, const struct fault_params *p,
+                           int32_t value_mv, int32_t panel_mv, int32_t bias_mv, int daylight) {
+    uint32_t changed = 0;
+
+    if (s->have_irradiation) {
+        int32_t step = value_mv - s->last_irradiation;
+        if (step > MAX_STEP_MV)
+            step = MAX_STEP_MV;
+        else if (step < -MAX_STEP_MV)
+            step = -MAX_STEP_MV;
+        s->noise_var += ((int64_t)step * step - s->noise_var) >> NOISE_SHIFT;
+
+        // stuck needs a long run of its own; it clears on the first change
+        changed |= observe(s, FAULT_STUCK, step == 0, p->stuck_samples, 1);
+
+        // raised at noise_mv RMS, cleared at half of it
+        int64_t limit = (int64_t)p->noise_mv * p->noise_mv;
+        if (s->active & (1u << FAULT_NOISE))
+            limit /= 4;
+        changed |= observe(s, FAULT_NOISE, s->noise_var > limit, p->debounce, p->clear_samples);
+    }
+    s->last_irradiation = value_mv;
+    s->have_irradiation = 1;
+
+    changed |= observe(s, FAULT_NEGATIVE, value_mv < -p->negative_mv, p->debounce, p->clear_samples);
+    changed |= observe(s, FAULT_PANEL_SHORT,
+                       (daylight && abs32(panel_mv - bias_mv) < p->short_mv)
+                           || panel_mv <= p->rail_low_mv || panel_mv >= p->rail_high_mv,
+                       p->debounce, p->clear_samples);
+    changed |= observe(s, FAULT_BIAS, abs32(bias_mv - p->bias_mv) > p->bias_tolerance_mv, p->debounce, p->clear_samples);
+    return changed;
+}
+
+
+uint32_t fault_battery(struct fault_state *s, const struct fault_params *p, int32_t mv) {
+    int implausible = mv < p->battery_min_mv || mv > p->battery_max_mv
+                      || (s->have_battery && abs32(mv - s->last_battery) > p->battery_jump_mv);
+
+    // an out of range reading is not the reference for the next jump
+    if (mv >= p->battery_min_mv && mv <= p->battery_max_mv) {
+        s->last_battery = mv;
+        s->have_battery = 1;
+    }
+    return observe(s, FAULT_BATTERY, implausible, 1, p->clear_samples);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Wiring and sensor faults seen in the field (diario.md), detected over the
+ * sample stream with a few counters per fault: fixed memory and constant
+ * time per sample. A fault is raised after its condition holds for a number
+ * of consecutive samples and cleared after it is absent for clear_samples.
+ * Plain C, no ESP-IDF dependency, so recorded traces can be replayed
+ * through it on the host. */
+
+enum fault {
+    FAULT_STUCK,            // irradiation identical for stuck_samples
+    FAULT_NEGATIVE,         // panel below the bias: inverted or shorted to ground
+    FAULT_NOISE,            // sample to sample variation far above the sky's
+    FAULT_PANEL_SHORT,      // panel at the bias in daylight, or at a rail
+    FAULT_BIAS,             // bias away from the DAC setting
+    FAULT_BATTERY,          // battery reading out of range or jumping
+    FAULT_N
+};
+
+struct fault_params {
+    int32_t debounce;           // samples a condition must hold, unless stated otherwise
+    int32_t clear_samples;
+    int32_t stuck_samples;
+    int32_t negative_mv;
+    int32_t noise_mv;           // RMS of the sample to sample difference
+    int32_t short_mv;
+    int32_t rail_low_mv, rail_high_mv;
+    int32_t bias_mv, bias_tolerance_mv;
+    int32_t battery_min_mv, battery_max_mv, battery_jump_mv; // at the ADC pin; a jump raises at once
+};
+
+struct fault_state {
+    uint32_t active;            // bit per enum fault
+    uint16_t bad[FAULT_N];      // consecutive samples with / without the condition
+    uint16_t good[FAULT_N];
+    int32_t last_irradiation;
+    int32_t last_battery;
+    int64_t noise_var;          // EWMA of the squared difference, mV²
+    uint8_t have_irradiation, have_battery;
+};
+
+void fault_init(struct fault_state *s);
+
+/**
+ * @brief   Checks an irradiation sample: panel minus bias (the published
+ *          value) and the last panel and bias readings behind it
+ *
+ * @param   daylight    whether a working panel must read above the bias now
+ *
+ * @return  Bits of the faults raised or cleared by this sample
+ */
+uint32_t fault_irradiation(struct fault_state *s, const struct fault_params *p,
+                           int32_t value_mv, int32_t panel_mv, int32_t bias_mv, int daylight);
+
+/**
+ * @brief   Checks a battery sample (mV at the ADC pin)
+ *
+ * @return  Bits of the faults raised or cleared by this sample
+ */
+uint32_t fault_battery(struct fault_state *s, const struct fault_params *p, int32_t mv);
+
+const char *fault_name(enum fault f);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Hardware used by the sampling pipeline. hal_esp.c drives the real
+ * peripherals; hal_replay.c (host only) feeds recorded traces under a
+ * virtual clock, see sim/, and hal_mock_bus.c puts a mock converter on
+ * the bus. All functions return 0 on success. */
+
+// ADC1 channels, numbered as adc1_channel_t
+#define HAL_ADC_PANEL       0   // GPIO36
+#define HAL_ADC_BATTERY     1   // GPIO37
+#define HAL_ADC_BIAS        6   // GPIO34
+
+/**
+ * @brief   Configures an ADC1 channel (12 bits, 11 dB) and its calibration
+ */
+int hal_adc_setup(int channel);
+
+/**
+ * @brief   One calibrated conversion, in mV at the pin
+ */
+int hal_adc_read_mv(int channel, int *mv);
+
+/**
+ * @brief   Calibration step of hal_adc_read_mv: 12-bit reading to mV
+ */
+int hal_adc_raw_to_mv(int channel, int raw);
+
+/**
+ * @brief   Enables a DAC channel and sets its 8-bit output
+ */
+int hal_dac_output(int channel, uint8_t value);
+
+/**
+ * @brief   Configures a pin as a plain output, no pulls or interrupts
+ */
+int hal_gpio_output(int pin);
+
+int hal_gpio_set(int pin, int level);
+
+/**
+ * @brief   Runs `handler` after each falling edge on `pin`, from a task and
+ *          never in interrupt context, so it may use the bus
+ */
+int hal_gpio_on_falling(int pin, void (*handler)(void *arg), void *arg);
+
+/* Bus of the external converter (I2C master). A transfer is one transaction
+ * to `address` (7 bits): each segment starts with a (repeated) START and
+ * writes `tx` or reads into `rx`, and the last one ends with STOP */
+struct hal_bus_segment {
+    const uint8_t *tx;      // NULL for a read
+    uint8_t *rx;
+    uint16_t len;
+};
+
+int hal_bus_setup(void);
+
+int hal_bus_transfer(uint8_t address, const struct hal_bus_segment *segments, int n_segments);
+
+/* Periodic and one-shot timers, all run from one task so their callbacks never overlap */
+typedef struct hal_timer *hal_timer_t;
+
+struct hal_timer_args {
+    void (*callback)(void *arg);
+    void *arg;
+    const char *name;
+};
+
+int hal_timer_create(const struct hal_timer_args *args, hal_timer_t *timer);
+
+int hal_timer_start_periodic(hal_timer_t timer, int64_t period_us);
+
+int hal_timer_start_once(hal_timer_t timer, int64_t timeout_us);
+
+int hal_timer_stop(hal_timer_t timer);
+
+/**
+ * @brief   Microseconds since startup
+ */
+int64_t hal_time_us(void);
+
+/**
+ * @brief   Short critical section against the other tasks and the timer
+ *          task; only for a few field updates and timer calls, never blocks
+ */
+void hal_critical_enter(void);
+
+void hal_critical_exit(void);
@@ -0,0 +1,221 @@
+#ifdef ESP_PLATFORM
+
+#include <stdint.h>
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/adc.h"
+#include "driver/dac.h"
+#include "driver/gpio.h"
+#include "driver/i2c.h"
+#include "esp_adc_cal.h"
+#include "sdkconfig.h"
+
+#include "hal.h"
+#include "arena.h"
+
+#define ADC_VREF 1100
+#define ADC_ATTENUATION ADC_ATTEN_DB_11
+
+#define MAX_EDGE_HANDLERS   4
+#define EDGE_TASK_PRIORITY  10
+#define BUS_PORT            I2C_NUM_0
+#define BUS_CLOCK_HZ        400000
+#define BUS_TIMEOUT         pdMS_TO_TICKS(20)
+
+static esp_adc_cal_characteristics_t adc_chars[ADC1_CHANNEL_MAX];
+
+// falling edge handlers, run by edge_task; the ISR only sets the notification bit of its slot
+static struct {
+    void (*handler)(void *arg);
+    void *arg;
+} edge_handlers[MAX_EDGE_HANDLERS];
+static int n_edge_handlers;
+static TaskHandle_t edge_task;
+static portMUX_TYPE critical_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+int hal_adc_setup(int channel) {
+    int ret = 0;
+
+    ret |= adc1_config_width(ADC_WIDTH_BIT_12);
+    ret |= adc1_config_channel_atten(channel, ADC_ATTENUATION);
+    esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTENUATION, ADC_WIDTH_BIT_12, ADC_VREF, &adc_chars[channel]);
+    return ret;
+}
+
+
+int hal_adc_read_mv(int channel, int *mv) {
+    int raw = adc1_get_raw(channel);
+
+    if (raw < 0)
+        return 1;
+    *mv = hal_adc_raw_to_mv(channel, raw);
+    return 0;
+}
+
+
+int hal_adc_raw_to_mv(int channel, int raw) {
+    return esp_adc_cal_raw_to_voltage(raw, &adc_chars[channel]);
+}
+
+
+int hal_dac_output(int channel, uint8_t value) {
+    return dac_output_enable(channel) || dac_output_voltage(channel, value);
+}
+
+
+int hal_gpio_output(int pin) {
+    gpio_config_t io_conf = {
+        .intr_type = GPIO_INTR_DISABLE,
+        .mode = GPIO_MODE_OUTPUT,
+        .pin_bit_mask = (1ULL << pin),
+        .pull_down_en = 0,
+        .pull_up_en = 0,
+    };
+    return gpio_config(&io_conf);
+}
+
+
+int hal_gpio_set(int pin, int level) {
+    return gpio_set_level(pin, level);
+}
+
+
+static void IRAM_ATTR edge_isr(void *arg) {
+    BaseType_t woken = pdFALSE;
+
+    xTaskNotifyFromISR(edge_task, 1u << (uintptr_t)arg, eSetBits, &woken);
+    if (woken)
+        portYIELD_FROM_ISR();
+}
+
+
+static void edge_task_main(void *arg) {
+    uint32_t pending;
+
+    for (;;) {
+        xTaskNotifyWait(0, UINT32_MAX, &pending, portMAX_DELAY);
+        for (int i = 0; i < n_edge_handlers; i++)
+            if (pending & (1u << i))
+                edge_handlers[i].handler(edge_handlers[i].arg);
+    }
+}
+
+
+int hal_gpio_on_falling(int pin, void (*handler)(void *arg), void *arg) {
+    gpio_config_t io_conf = {
+        .intr_type = GPIO_INTR_NEGEDGE,
+        .mode = GPIO_MODE_INPUT,
+        .pin_bit_mask = (1ULL << pin),
+        .pull_down_en = 0,
+        .pull_up_en = 1,    // ALERT/RDY is open drain
+    };
+    int slot = n_edge_handlers;
+
+    if (slot == MAX_EDGE_HANDLERS)
+        return 1;
+    if (edge_task == NULL) {
+        if (xTaskCreate(edge_task_main, "hal_edge", 3072, NULL, EDGE_TASK_PRIORITY, &edge_task) != pdPASS)
+            return 1;
+        // already installed is fine
+        esp_err_t err = gpio_install_isr_service(0);
+        if (err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+            return 1;
+    }
+    edge_handlers[slot].handler = handler;
+    edge_handlers[slot].arg = arg;
+    n_edge_handlers++;
+    return gpio_config(&io_conf) || gpio_isr_handler_add(pin, edge_isr, (void *)(uintptr_t)slot);
+}
+
+
+#ifdef CONFIG_EXT_ADC
+int hal_bus_setup(void) {
+    i2c_config_t conf = {
+        .mode = I2C_MODE_MASTER,
+        .sda_io_num = CONFIG_EXT_ADC_SDA_PIN,
+        .scl_io_num = CONFIG_EXT_ADC_SCL_PIN,
+        .sda_pullup_en = GPIO_PULLUP_ENABLE,
+        .scl_pullup_en = GPIO_PULLUP_ENABLE,
+        .master.clk_speed = BUS_CLOCK_HZ,
+    };
+    // IDF 4.2 has no static command link, see hal_bus_transfer
+    arena_note_outside("i2c_cmd_link");
+    return i2c_param_config(BUS_PORT, &conf) || i2c_driver_install(BUS_PORT, I2C_MODE_MASTER, 0, 0, 0);
+}
+
+
+/* The whole transaction is queued in one command link and run by the driver
+ * without returning. The link and each command in it come from the heap:
+ * IDF 4.2 has no static link (i2c_cmd_link_create_static is 4.4), and a link
+ * cannot be built once and replayed because the driver consumes its write
+ * and read commands as it runs them. So every round of the external ADC
+ * allocates a few small blocks and frees them before returning; the arena
+ * report lists it under "outside". */
+int hal_bus_transfer(uint8_t address, const struct hal_bus_segment *segments, int n_segments) {
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    esp_err_t err;
+
+    if (cmd == NULL)
+        return 1;
+    for (int i = 0; i < n_segments; i++) {
+        const struct hal_bus_segment *seg = &segments[i];
+        i2c_master_start(cmd);
+        if (seg->tx != NULL) {
+            i2c_master_write_byte(cmd, (address << 1) | I2C_MASTER_WRITE, true);
+            i2c_master_write(cmd, (uint8_t *)seg->tx, seg->len, true);
+        } else {
+            i2c_master_write_byte(cmd, (address << 1) | I2C_MASTER_READ, true);
+            i2c_master_read(cmd, seg->rx, seg->len, I2C_MASTER_LAST_NACK);
+        }
+    }
+    i2c_master_stop(cmd);
+    err = i2c_master_cmd_begin(BUS_PORT, cmd, BUS_TIMEOUT);
+    i2c_cmd_link_delete(cmd);
+    return err != ESP_OK;
+}
+#endif
+
+
+int hal_timer_create(const struct hal_timer_args *args, hal_timer_t *timer) {
+    const esp_timer_create_args_t esp_args = {
+        .callback = args->callback,
+        .arg = args->arg,
+        .name = args->name,
+    };
+    return esp_timer_create(&esp_args, (esp_timer_handle_t *)timer);
+}
+
+
+int hal_timer_start_periodic(hal_timer_t timer, int64_t period_us) {
+    return esp_timer_start_periodic((esp_timer_handle_t)timer, period_us);
+}
+
+
+int hal_timer_start_once(hal_timer_t timer, int64_t timeout_us) {
+    return esp_timer_start_once((esp_timer_handle_t)timer, timeout_us);
+}
+
+
+int hal_timer_stop(hal_timer_t timer) {
+    return esp_timer_stop((esp_timer_handle_t)timer);
+}
+
+
+int64_t hal_time_us(void) {
+    return esp_timer_get_time();
+}
+
+
+void hal_critical_enter(void) {
+    portENTER_CRITICAL(&critical_mux);
+}
+
+
+void hal_critical_exit(void) {
+    portEXIT_CRITICAL(&critical_mux);
+}
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef ESP_PLATFORM
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hal_replay.h"
+#include "hal_mock_bus.h"
+
+#define N_REGISTERS     4
+#define REG_CONVERSION  0
+#define REG_CONFIG      1
+#define REG_LO_THRESH   2
+#define REG_HI_THRESH   3
+
+#define CONFIG_OS       0x8000
+#define CONFIG_MODE     0x0100
+#define CONFIG_DEFAULT  0x8583
+#define BUS_BIT_US_X10  25      // 2.5 µs per bit at 400 kHz
+
+static const int32_t sps[8] = { 8, 16, 32, 64, 128, 250, 475, 860 };
+static const int32_t full_scale_mv[8] = { 6144, 4096, 2048, 1024, 512, 256, 256, 256 };
+// positive and negative input of each MUX setting, -1 for ground
+static const int8_t mux_inputs[8][2] = { {0, 1}, {0, 3}, {1, 3}, {2, 3}, {0, -1}, {1, -1}, {2, -1}, {3, -1} };
+
+static struct {
+    int attached;
+    uint8_t address;
+    int ready_pin;
+    int inputs[MOCK_BUS_INPUTS];
+    uint16_t regs[N_REGISTERS];
+    uint8_t pointer;
+    int converting;
+    hal_timer_t timer;
+    struct hal_mock_bus_stats stats;
+} mock;
+
+
+static int read_input(int input) {
+    int mv = 0;
+
+    if (input >= 0 && mock.inputs[input] >= 0 && hal_adc_read_mv(mock.inputs[input], &mv))
+        mv = 0;
+    return mv;
+}
+
+
+/* The result is the input at the end of the conversion, as for a short integration */
+static void finish_conversion(void) {
+    uint16_t config = mock.regs[REG_CONFIG];
+    const int8_t *in = mux_inputs[(config >> 12) & 7];
+    int32_t mv = read_input(in[0]) - (in[1] >= 0 ? read_input(in[1]) : 0);
+    int32_t code = (int32_t)((int64_t)mv * 32768 / full_scale_mv[(config >> 9) & 7]);
+
+    if (code > 32767)
+        code = 32767;
+    else if (code < -32768)
+        code = -32768;
+    mock.regs[REG_CONVERSION] = (uint16_t)code;
+    mock.regs[REG_CONFIG] |= CONFIG_OS;
+    mock.converting = 0;
+    mock.stats.conversions++;
+
+    // conversion ready mode: hi_thresh MSB set, lo_thresh MSB clear, comparator enabled
+    if ((mock.regs[REG_HI_THRESH] & 0x8000) && !(mock.regs[REG_LO_THRESH] & 0x8000) && (config & 3) != 3)
+        hal_replay_falling_edge(mock.ready_pin);
+}
+
+
+static void conversion_callback(void *arg) {
+    if (mock.converting)
+        finish_conversion();
+}
+
+
+static void write_register(const uint8_t *data, int len) {
+    mock.pointer = data[0] & 3;
+    if (len < 3)
+        return;
+
+    uint16_t value = data[1] << 8 | data[2];
+    if (mock.pointer == REG_CONVERSION)
+        return;
+    if (mock.pointer != REG_CONFIG) {
+        mock.regs[mock.pointer] = value;
+        return;
+    }
+    mock.regs[REG_CONFIG] = value & ~CONFIG_OS;
+    if ((value & CONFIG_OS) && (value & CONFIG_MODE)) {
+        // a new start restarts a running conversion
+        hal_timer_stop(mock.timer);
+        mock.converting = 1;
+        hal_timer_start_once(mock.timer, 1000000 / sps[(value >> 5) & 7] + 1);
+    } else if (!mock.converting) {
+        mock.regs[REG_CONFIG] |= CONFIG_OS;
+    }
+}
+
+
+static void read_register(uint8_t *data, int len) {
+    uint16_t value = mock.regs[mock.pointer];
+
+    for (int i = 0; i < len; i++)
+        data[i] = i % 2 ? value & 0xff : value >> 8;
+}
+
+
+int hal_bus_setup(void) {
+    return !mock.attached;
+}
+
+
+int hal_bus_transfer(uint8_t address, const struct hal_bus_segment *segments, int n_segments) {
+    int64_t bits = 0;
+
+    if (!mock.attached)
+        return 1;
+    mock.stats.transfers++;
+    if (address != mock.address) {
+        mock.stats.nacks++;
+        hal_replay_consume(9 * BUS_BIT_US_X10 / 10);
+        return 1;
+    }
+
+    for (int i = 0; i < n_segments; i++) {
+        const struct hal_bus_segment *seg = &segments[i];
+        if (seg->tx != NULL) {
+            if (seg->len > 0)
+                write_register(seg->tx, seg->len);
+        } else {
+            read_register(seg->rx, seg->len);
+        }
+        bits += 9 * (1 + seg->len) + 1;     // address, bytes with their ack, START
+        mock.stats.bytes += seg->len;
+    }
+    hal_replay_consume(bits * BUS_BIT_US_X10 / 10);
+    return 0;
+}
+
+
+int hal_mock_bus_attach(uint8_t address, int ready_pin, const int inputs[MOCK_BUS_INPUTS]) {
+    const struct hal_timer_args timer_args = { .callback = conversion_callback, .name = "mock_bus_conversion" };
+
+    memset(&mock, 0, sizeof(mock));
+    if (hal_timer_create(&timer_args, &mock.timer))
+        return 1;
+    mock.attached = 1;
+    mock.address = address;
+    mock.ready_pin = ready_pin;
+    memcpy(mock.inputs, inputs, sizeof(mock.inputs));
+    mock.regs[REG_CONFIG] = CONFIG_DEFAULT;
+    mock.regs[REG_LO_THRESH] = 0x8000;
+    mock.regs[REG_HI_THRESH] = 0x7fff;
+    return 0;
+}
+
+
+int hal_mock_bus_complete(void) {
+    if (!mock.converting)
+        return 0;
+    hal_timer_stop(mock.timer);
+    finish_conversion();
+    return 1;
+}
+
+
+void hal_mock_bus_get_stats(struct hal_mock_bus_stats *stats) {
+    *stats = mock.stats;
+}
+
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hal.h"
+
+/* Mock of the external converter for host builds: an ADS1115 register
+ * model behind hal_bus_transfer whose inputs read ADC1 channels of the
+ * replay backend (so the trace drives them too). A single-shot conversion
+ * takes the data rate period of virtual time, then ALERT/RDY goes low
+ * through hal_replay_falling_edge; bus transactions are charged at
+ * 400 kHz. Without hal_mock_bus_attach nothing answers on the bus. */
+
+#define MOCK_BUS_INPUTS 4
+
+struct hal_mock_bus_stats {
+    uint32_t transfers, conversions, nacks;
+    uint64_t bytes;
+};
+
+/**
+ * @brief   Puts the converter at `address`, its ALERT/RDY on `ready_pin`
+ *          and AINx on replay channel inputs[x] (-1 reads 0 mV)
+ */
+int hal_mock_bus_attach(uint8_t address, int ready_pin, const int inputs[MOCK_BUS_INPUTS]);
+
+/**
+ * @brief   Ends the running conversion now, without waiting for its timer
+ *
+ * @return  1 if there was one, 0 otherwise
+ */
+int hal_mock_bus_complete(void);
+
+void hal_mock_bus_get_stats(struct hal_mock_bus_stats *stats);
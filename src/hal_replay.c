@@ -0,0 +1,416 @@
+#ifndef ESP_PLATFORM
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include "hal_replay.h"
+
+#define MAX_TIMERS      16
+#define MAX_CHANNELS    8   // ADC1
+#define MAX_PINS        40
+
+struct trace_row {
+    int64_t timestamp_ms;
+    int32_t mv[TRACE_N_COLUMNS];
+};
+
+struct hal_timer {
+    struct hal_timer_args args;
+    int64_t period_us;      // 0 for one-shot
+    int64_t due_us;         // node clock
+    int running;
+};
+
+static struct trace_row *rows;
+static size_t n_rows, cursor;
+static int bound[MAX_CHANNELS] = {-1, -1, -1, -1, -1, -1, -1, -1};
+static int gpio_levels[MAX_PINS];
+static struct {
+    void (*handler)(void *arg);
+    void *arg;
+} edge_handlers[MAX_PINS];
+static struct hal_timer timers[MAX_TIMERS];
+static int n_timers;
+static struct hal_replay_hooks hooks;
+
+/* True time since the first row, and the node's clock tied to it: the
+ * node reads base_local at base_true and then runs ppm fast */
+static int64_t true_us, end_us;
+static int64_t base_true, base_local;
+static int64_t busy_us;
+static int32_t ppm;
+
+
+static int add_row(const struct trace_row *row, size_t *capacity) {
+    if (n_rows > 0 && row->timestamp_ms < rows[n_rows - 1].timestamp_ms) {
+        fprintf(stderr, "replay: trace goes back in time at row %zu\n", n_rows);
+        return 1;
+    }
+    if (n_rows == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 4096;
+        struct trace_row *r = realloc(rows, grown * sizeof(*r));
+        if (r == NULL)
+            return 1;
+        rows = r;
+        *capacity = grown;
+    }
+    rows[n_rows++] = *row;
+    return 0;
+}
+
+
+static int load_csv(FILE *f, size_t *capacity) {
+    char line[256];
+    long long t;
+    struct trace_row row;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (!isdigit((unsigned char)line[0]))
+            continue;
+        memset(&row, 0, sizeof(row));
+        if (sscanf(line, "%lld,%d,%d,%d", &t, &row.mv[TRACE_PANEL], &row.mv[TRACE_BIAS], &row.mv[TRACE_BATTERY]) < 2)
+            continue;
+        row.timestamp_ms = t;
+        if (add_row(&row, capacity))
+            return 1;
+    }
+    return 0;
+}
+
+
+static int64_t le_field(const uint8_t *p, int bytes) {
+    uint64_t v = 0;
+
+    for (int i = bytes - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return bytes == 4 ? (int64_t)(int32_t)v : (int64_t)v;
+}
+
+
+static int load_bin(FILE *f, size_t *capacity) {
+    uint8_t rec[20];
+    struct trace_row row;
+
+    while (fread(rec, sizeof(rec), 1, f) == 1) {
+        row.timestamp_ms = le_field(rec, 8);
+        for (int c = 0; c < TRACE_N_COLUMNS; c++)
+            row.mv[c] = (int32_t)le_field(rec + 8 + 4 * c, 4);
+        if (add_row(&row, capacity))
+            return 1;
+    }
+    return 0;
+}
+
+
+int hal_replay_load(const char *path) {
+    size_t capacity = 0, len = strlen(path);
+    FILE *f = fopen(path, "rb");
+    int ret;
+
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    free(rows);
+    rows = NULL;
+    n_rows = cursor = 0;
+
+    if (len > 4 && strcmp(path + len - 4, ".bin") == 0)
+        ret = load_bin(f, &capacity);
+    else
+        ret = load_csv(f, &capacity);
+    fclose(f);
+
+    if (ret || n_rows == 0) {
+        fprintf(stderr, "replay: no usable rows in %s\n", path);
+        return 1;
+    }
+    end_us = (rows[n_rows - 1].timestamp_ms - rows[0].timestamp_ms) * 1000;
+    return 0;
+}
+
+
+int hal_replay_span(int64_t start_ms, int64_t duration_ms, const int32_t mv[TRACE_N_COLUMNS]) {
+    size_t capacity = 0;
+    struct trace_row row = { .timestamp_ms = start_ms };
+
+    free(rows);
+    rows = NULL;
+    n_rows = cursor = 0;
+
+    memcpy(row.mv, mv, sizeof(row.mv));
+    if (add_row(&row, &capacity))
+        return 1;
+    row.timestamp_ms += duration_ms;
+    if (add_row(&row, &capacity))
+        return 1;
+    end_us = duration_ms * 1000;
+    return 0;
+}
+
+
+int hal_replay_bind(int channel, enum trace_column column) {
+    if (channel < 0 || channel >= MAX_CHANNELS || column >= TRACE_N_COLUMNS)
+        return 1;
+    bound[channel] = column;
+    return 0;
+}
+
+
+int64_t hal_replay_start_ms(void) {
+    return n_rows ? rows[0].timestamp_ms : 0;
+}
+
+
+int64_t hal_replay_true_us(void) {
+    return true_us;
+}
+
+
+int64_t hal_replay_end_us(void) {
+    return end_us;
+}
+
+
+int hal_replay_gpio_level(int pin) {
+    if (pin < 0 || pin >= MAX_PINS)
+        return -1;
+    return gpio_levels[pin] - 1;
+}
+
+
+void hal_replay_set_hooks(const struct hal_replay_hooks *h) {
+    hooks = *h;
+}
+
+
+static int64_t to_local(int64_t t) {
+    return base_local + (t - base_true) * (1000000 + ppm) / 1000000;
+}
+
+
+static int64_t to_true(int64_t local) {
+    return base_true + (local - base_local) * 1000000 / (1000000 + ppm);
+}
+
+
+void hal_replay_set_clock_error(int32_t error_ppm) {
+    base_local = to_local(true_us);
+    base_true = true_us;
+    ppm = error_ppm;
+}
+
+
+void hal_replay_consume(int64_t us) {
+    if (us > 0) {
+        true_us += us;
+        busy_us += us;
+    }
+}
+
+
+int64_t hal_replay_busy_us(void) {
+    return busy_us;
+}
+
+
+void hal_replay_deep_sleep(int64_t local_us, int32_t rtc_ppm) {
+    int64_t local = to_local(true_us);
+
+    true_us += local_us * 1000000 / (1000000 + rtc_ppm);
+    base_true = true_us;
+    base_local = local + local_us;
+
+    for (int i = 0; i < n_timers; i++) {
+        if (!timers[i].running)
+            continue;
+        if (timers[i].period_us)
+            timers[i].due_us = base_local + timers[i].period_us;
+        else
+            timers[i].running = 0;
+    }
+}
+
+
+int hal_adc_setup(int channel) {
+    return channel < 0 || channel >= MAX_CHANNELS;
+}
+
+
+/* True time only moves forward, so the cursor never goes back */
+int hal_adc_read_mv(int channel, int *mv) {
+    if (channel < 0 || channel >= MAX_CHANNELS || bound[channel] < 0 || n_rows == 0)
+        return 1;
+
+    int64_t t_us = rows[0].timestamp_ms * 1000 + true_us;
+    while (cursor + 1 < n_rows && rows[cursor + 1].timestamp_ms * 1000 <= t_us)
+        cursor++;
+
+    const struct trace_row *a = &rows[cursor];
+    if (cursor + 1 == n_rows) {
+        *mv = a->mv[bound[channel]];
+        return 0;
+    }
+    const struct trace_row *b = &rows[cursor + 1];
+    int64_t span = (b->timestamp_ms - a->timestamp_ms) * 1000;
+    int64_t into = t_us - a->timestamp_ms * 1000;
+    int32_t va = a->mv[bound[channel]], vb = b->mv[bound[channel]];
+    *mv = (int)(va + (span ? (vb - va) * into / span : 0));
+    return 0;
+}
+
+
+/* Traces are already in mV; ideal 11 dB response for whoever converts */
+int hal_adc_raw_to_mv(int channel, int raw) {
+    return raw * 3900 / 4095;
+}
+
+
+int hal_dac_output(int channel, uint8_t value) {
+    return 0;
+}
+
+
+int hal_gpio_output(int pin) {
+    return pin < 0 || pin >= MAX_PINS;
+}
+
+
+int hal_gpio_set(int pin, int level) {
+    if (pin < 0 || pin >= MAX_PINS)
+        return 1;
+    gpio_levels[pin] = (level != 0) + 1;
+    return 0;
+}
+
+
+int hal_gpio_on_falling(int pin, void (*handler)(void *arg), void *arg) {
+    if (pin < 0 || pin >= MAX_PINS)
+        return 1;
+    edge_handlers[pin].handler = handler;
+    edge_handlers[pin].arg = arg;
+    return 0;
+}
+
+
+void hal_replay_falling_edge(int pin) {
+    if (pin >= 0 && pin < MAX_PINS && edge_handlers[pin].handler != NULL)
+        edge_handlers[pin].handler(edge_handlers[pin].arg);
+}
+
+
+int hal_timer_create(const struct hal_timer_args *args, hal_timer_t *timer) {
+    if (n_timers == MAX_TIMERS)
+        return 1;
+    timers[n_timers].args = *args;
+    *timer = &timers[n_timers++];
+    return 0;
+}
+
+
+static int timer_start(hal_timer_t timer, int64_t period_us, int64_t timeout_us) {
+    if (timer->running || timeout_us < 0)
+        return 1;
+    timer->period_us = period_us;
+    timer->due_us = hal_time_us() + timeout_us;
+    timer->running = 1;
+    return 0;
+}
+
+
+int hal_timer_start_periodic(hal_timer_t timer, int64_t period_us) {
+    return period_us <= 0 || timer_start(timer, period_us, period_us);
+}
+
+
+int hal_timer_start_once(hal_timer_t timer, int64_t timeout_us) {
+    return timer_start(timer, 0, timeout_us);
+}
+
+
+int hal_timer_stop(hal_timer_t timer) {
+    if (!timer->running)
+        return 1;
+    timer->running = 0;
+    return 0;
+}
+
+
+int64_t hal_time_us(void) {
+    return to_local(true_us);
+}
+
+
+// one thread runs every task here
+void hal_critical_enter(void) {
+}
+
+
+void hal_critical_exit(void) {
+}
+
+
+static void pace(const struct timespec *start, int64_t virtual_us, int speedup) {
+    int64_t real_us = virtual_us / speedup;
+    struct timespec target = {
+        .tv_sec = start->tv_sec + real_us / 1000000,
+        .tv_nsec = start->tv_nsec + (real_us % 1000000) * 1000,
+    };
+
+    if (target.tv_nsec >= 1000000000) {
+        target.tv_sec++;
+        target.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR)
+        ;
+}
+
+
+/* Earliest deadline first; ties go to the timer created first, so a run
+ * only depends on the trace, the code and the hooks */
+int64_t hal_replay_run(int speedup) {
+    struct timespec start;
+    int64_t fired = 0;
+
+    if (n_rows == 0)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (true_us <= end_us) {
+        struct hal_timer *next = NULL;
+        for (int i = 0; i < n_timers; i++)
+            if (timers[i].running && (next == NULL || timers[i].due_us < next->due_us))
+                next = &timers[i];
+        if (next == NULL)
+            break;
+
+        int64_t due = to_true(next->due_us);
+        if (due > end_us)
+            break;
+        if (due > true_us) {
+            if (speedup > 0)
+                pace(&start, due, speedup);
+            true_us = due;
+        }
+
+        if (next->period_us)
+            next->due_us += next->period_us;
+        else
+            next->running = 0;
+
+        if (hooks.dispatch)
+            hooks.dispatch(next->args.name, next->period_us, true_us - due, hooks.arg);
+        next->args.callback(next->args.arg);
+        if (hooks.cost)
+            hal_replay_consume(hooks.cost(next->args.name, hooks.arg));
+        fired++;
+    }
+    return fired;
+}
+
+#endif
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hal.h"
+
+/* Replay backend of the HAL, host builds only: a discrete-event simulation
+ * in virtual time. ADC channels read a recorded trace, linearly
+ * interpolated at the true time; timers fire one after the other as in
+ * the esp_timer task, as fast as possible or paced at a fixed speed-up.
+ *
+ * Two clocks are kept. True time drives the trace and the event order;
+ * the node's clock (hal_time_us) runs off it by a configurable error and
+ * is what timer periods are measured in. A periodic timer is re-armed at
+ * its previous deadline plus the period, so a late one fires back to back
+ * until it catches up, as esp_timer does in IDF 4.2.
+ *
+ * Traces are CSV, one row per instant in increasing time:
+ *   timestamp_ms,panel_mv,bias_mv,battery_mv
+ * (lines not starting with a digit are skipped), or, for files ending in
+ * .bin, the same four fields as little endian i64, i32, i32, i32. Values
+ * are mV at the ADC pins; a trace with the irradiation already computed
+ * can leave bias at 0. */
+
+enum trace_column {
+    TRACE_PANEL,
+    TRACE_BIAS,
+    TRACE_BATTERY,
+    TRACE_N_COLUMNS
+};
+
+/**
+ * @brief   Loads a trace; the virtual clock starts at its first row
+ */
+int hal_replay_load(const char *path);
+
+/**
+ * @brief   Uses constant readings from `start_ms` for `duration_ms` instead of a trace
+ */
+int hal_replay_span(int64_t start_ms, int64_t duration_ms, const int32_t mv[TRACE_N_COLUMNS]);
+
+/**
+ * @brief   Makes reads of an ADC channel return a trace column
+ */
+int hal_replay_bind(int channel, enum trace_column column);
+
+/**
+ * @brief   Runs the timers until the end of the trace
+ *
+ * @param   speedup  virtual seconds per real second, 0 to run unpaced
+ * @return  number of timer callbacks run
+ */
+int64_t hal_replay_run(int speedup);
+
+/**
+ * @brief   Wall clock (ms since epoch) of the first row of the trace
+ */
+int64_t hal_replay_start_ms(void);
+
+/**
+ * @brief   True time since the start of the trace
+ */
+int64_t hal_replay_true_us(void);
+
+/**
+ * @brief   True time of the last row of the trace
+ */
+int64_t hal_replay_end_us(void);
+
+/* What the simulator injects and observes */
+struct hal_replay_hooks {
+    // time the callback of `timer` takes to run, charged when it returns
+    int64_t (*cost)(const char *timer, void *arg);
+    // the callback of `timer` is about to run, `late_us` of true time after its deadline
+    void (*dispatch)(const char *timer, int64_t period_us, int64_t late_us, void *arg);
+    void *arg;
+};
+
+void hal_replay_set_hooks(const struct hal_replay_hooks *hooks);
+
+/**
+ * @brief   Makes the node's clock run `ppm` parts per million fast (negative: slow)
+ */
+void hal_replay_set_clock_error(int32_t ppm);
+
+/**
+ * @brief   The running callback blocks for `us` of true time (a publish, a flash write)
+ */
+void hal_replay_consume(int64_t us);
+
+/**
+ * @brief   True time spent inside callbacks: their cost plus what they consumed
+ */
+int64_t hal_replay_busy_us(void);
+
+/**
+ * @brief   Deep sleep for `local_us` as counted by an RTC running `rtc_ppm` fast
+ *
+ * One-shot timers are cancelled; periodic ones start over from the
+ * wake-up, as after the reboot.
+ */
+void hal_replay_deep_sleep(int64_t local_us, int32_t rtc_ppm);
+
+/**
+ * @brief   Last level set on a pin, -1 if never set
+ */
+int hal_replay_gpio_level(int pin);
+
+/**
+ * @brief   A device pulls `pin` low: runs the handler given to
+ *          hal_gpio_on_falling, in the context of the caller
+ */
+void hal_replay_falling_edge(int pin);
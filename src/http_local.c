@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+
+#include "adc_reader.h"
+#include "wake_sched.h"
+#include "http_local.h"
+
+#ifdef CONFIG_HTTP_LOCAL
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0      // lwIP never raises SIGPIPE
+#endif
+
+static const char *TAG = "http_local";
+extern int64_t sample_timestamp_us(void);
+extern struct send_sample_buffer adcs_send_buffers[N_ADC_MEASURES];
+
+#define REQUEST_SIZE    512     // request line and headers, the rest is dropped
+#define HISTORY_MS      3600000LL
+#define FRAME_HEADER    8       // room for "%x\r\n" before the chunk data
+#define WINDOW_BATCH    (HTTP_LOCAL_CHUNK_SIZE / sizeof(struct sample))   // samples copied per hand-off
+
+#define MEASURE_NAME(measure, index, ...) [index] = #measure,
+static const char *measure_names[N_ADC_MEASURES] = { ADC_CHANNELS(MEASURE_NAME) };
+
+/* The chunk being filled, sent as soon as the next piece does not fit.
+ * One response at a time */
+static struct {
+    int fd;
+    int used;
+    int failed;
+    char frame[FRAME_HEADER + HTTP_LOCAL_CHUNK_SIZE + 2];
+} out;
+
+static char request[REQUEST_SIZE];
+
+
+static int run_here(void (*fn)(void *arg), void *arg) {
+    fn(arg);
+    return 0;
+}
+
+static int (*run_with_windows)(void (*fn)(void *arg), void *arg) = run_here;
+
+
+static int send_all(int fd, const char *data, int len) {
+    while (len > 0) {
+        int sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return 1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+
+static void out_flush(void) {
+    char header[FRAME_HEADER + 1];
+
+    if (out.failed || out.used == 0)
+        return;
+    int header_len = snprintf(header, sizeof(header), "%x\r\n", out.used);
+    char *start = out.frame + FRAME_HEADER - header_len;
+    memcpy(start, header, header_len);
+    memcpy(out.frame + FRAME_HEADER + out.used, "\r\n", 2);
+    if (send_all(out.fd, start, header_len + out.used + 2)) {
+        ESP_LOGD(TAG, "Client gone, response dropped");
+        out.failed = 1;
+    }
+    out.used = 0;
+}
+
+
+static void out_printf(const char *fmt, ...) {
+    va_list args;
+
+    for (int attempt = 0; attempt < 2 && !out.failed; attempt++) {
+        int room = HTTP_LOCAL_CHUNK_SIZE - out.used;
+        va_start(args, fmt);
+        int len = vsnprintf(out.frame + FRAME_HEADER + out.used, room, fmt, args);
+        va_end(args);
+        if (len < room) {
+            out.used += len;
+            return;
+        }
+        out_flush();
+    }
+    if (!out.failed) {
+        ESP_LOGE(TAG, "A piece of the response does not fit in a chunk");
+        out.failed = 1;
+    }
+}
+
+
+/* A piece written by one of the *_report functions, straight into the chunk */
+static void out_report(int (*report)(char *buf, size_t size)) {
+    for (int attempt = 0; attempt < 2 && !out.failed; attempt++) {
+        int room = HTTP_LOCAL_CHUNK_SIZE - out.used;
+        int len = report(out.frame + FRAME_HEADER + out.used, room);
+        if (len < room) {
+            out.used += len;
+            return;
+        }
+        out_flush();
+    }
+    out_printf("null");
+}
+
+
+static void begin(int fd, int status, const char *reason) {
+    char header[160];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n"
+                       "Cache-Control: no-store\r\nConnection: close\r\n\r\n", status, reason);
+
+    out.fd = fd;
+    out.used = 0;
+    out.failed = send_all(fd, header, len);
+}
+
+
+static void end(void) {
+    out_flush();
+    if (!out.failed && send_all(out.fd, "0\r\n\r\n", 5))
+        out.failed = 1;
+}
+
+
+/* Integer value of `key` in the query string, `value` untouched if there is none */
+static int query_value(const char *path, const char *key, long long *value) {
+    const char *q = strchr(path, '?');
+    size_t key_len = strlen(key);
+
+    while (q != NULL) {
+        q++;
+        if (strncmp(q, key, key_len) == 0 && q[key_len] == '=') {
+            char *end;
+            long long v = strtoll(q + key_len + 1, &end, 10);
+            if (end == q + key_len + 1)
+                return 1;
+            *value = v;
+            return 0;
+        }
+        q = strchr(q, '&');
+    }
+    return 1;
+}
+
+
+static int path_is(const char *path, const char *name) {
+    size_t len = strlen(name);
+
+    return strncmp(path, name, len) == 0 && (path[len] == '\0' || path[len] == '?');
+}
+
+
+static int query_adc(const char *path) {
+    long long adc;
+
+    if (query_value(path, "adc", &adc) || adc < 0 || adc >= N_ADC_MEASURES)
+        return -1;
+    return (int)adc;
+}
+
+
+/* Copy of what an answer reads from the sample windows, taken where they are
+ * written (http_local_set_window_access) and sent from the server task */
+struct aggregate {
+    int n, min, max;
+    long long sum;
+    int64_t first_us, last_us;
+};
+
+struct window_batch {
+    int adc;
+    int64_t after_us;           // samples newer than this, the last one sent
+    int n;
+    struct sample samples[WINDOW_BATCH];
+};
+
+static union {
+    struct {
+        struct sample s[N_ADC_MEASURES];
+        int missing[N_ADC_MEASURES];
+    } live;
+    struct {
+        struct aggregate a[N_ADC_MEASURES];
+        char record[N_ADC_MEASURES][sizeof(adcs_send_buffers[0].payload)];
+    } aggregates;
+    struct window_batch batch;
+} snapshot;
+
+
+static void snapshot_live(void *arg) {
+    for (int i = 0; i < N_ADC_MEASURES; i++)
+        snapshot.live.missing[i] = sample_latest(i, &snapshot.live.s[i]);
+}
+
+
+static void serve_live(const char *path, int adc) {
+    if (run_with_windows(snapshot_live, NULL)) {
+        out.failed = 1;
+        return;
+    }
+    out_printf("{");
+    for (int i = 0; i < N_ADC_MEASURES; i++) {
+        const struct sample *s = &snapshot.live.s[i];
+
+        out_printf("%s\"%s\":", i ? "," : "", measure_names[i]);
+        if (snapshot.live.missing[i])
+            out_printf("null");
+        else
+            out_printf("{\"t\":%lld,\"v\":%d}", (long long)(s->timestamp_us / 1000), s->value);
+    }
+    out_printf("}");
+}
+
+
+static int copy_sample(const struct sample *s, void *arg) {
+    struct window_batch *batch = arg;
+
+    if (s->timestamp_us > batch->after_us)
+        batch->samples[batch->n++] = *s;
+    return batch->n == (int)WINDOW_BATCH;
+}
+
+
+static void snapshot_batch(void *arg) {
+    snapshot.batch.n = 0;
+    sample_window_walk(snapshot.batch.adc, copy_sample, &snapshot.batch);
+}
+
+
+/* A batch of samples at a time, so the window is never copied whole; the
+ * walk goes on from the newest sample sent, so a window that moves on in
+ * between is neither repeated nor skipped */
+static void serve_window(const char *path, int adc) {
+    int n = 0;
+
+    out_printf("{\"adc\":%d,\"measure\":\"%s\",\"samples\":[", adc, measure_names[adc]);
+    snapshot.batch.adc = adc;
+    snapshot.batch.after_us = INT64_MIN;
+    do {
+        if (run_with_windows(snapshot_batch, NULL)) {
+            out.failed = 1;
+            return;
+        }
+        for (int i = 0; i < snapshot.batch.n; i++) {
+            const struct sample *s = &snapshot.batch.samples[i];
+            out_printf("%s[%lld,%d]", n++ ? "," : "", (long long)(s->timestamp_us / 1000), s->value);
+        }
+        if (snapshot.batch.n > 0)
+            snapshot.batch.after_us = snapshot.batch.samples[snapshot.batch.n - 1].timestamp_us;
+    } while (snapshot.batch.n == (int)WINDOW_BATCH && !out.failed);
+    out_printf("]}");
+}
+
+
+static int add_sample(const struct sample *s, void *arg) {
+    struct aggregate *a = arg;
+
+    if (a->n == 0 || s->value < a->min)
+        a->min = s->value;
+    if (a->n == 0 || s->value > a->max)
+        a->max = s->value;
+    if (a->n == 0)
+        a->first_us = s->timestamp_us;
+    a->last_us = s->timestamp_us;
+    a->sum += s->value;
+    a->n++;
+    return 0;
+}
+
+
+static void snapshot_aggregates(void *arg) {
+    for (int i = 0; i < N_ADC_MEASURES; i++) {
+        memset(&snapshot.aggregates.a[i], 0, sizeof(snapshot.aggregates.a[i]));
+        sample_window_walk(i, add_sample, &snapshot.aggregates.a[i]);
+        memcpy(snapshot.aggregates.record[i], adcs_send_buffers[i].payload, sizeof(snapshot.aggregates.record[i]));
+        snapshot.aggregates.record[i][sizeof(snapshot.aggregates.record[i]) - 1] = '\0';
+    }
+}
+
+
+static void serve_aggregates(const char *path, int adc) {
+    if (run_with_windows(snapshot_aggregates, NULL)) {
+        out.failed = 1;
+        return;
+    }
+    out_printf("{");
+    for (int i = 0; i < N_ADC_MEASURES; i++) {
+        const struct aggregate *a = &snapshot.aggregates.a[i];
+        const char *record = snapshot.aggregates.record[i];
+
+        out_printf("%s\"%s\":{\"n\":%d", i ? "," : "", measure_names[i], a->n);
+        if (a->n)
+            out_printf(",\"mean\":%d,\"min\":%d,\"max\":%d,\"from\":%lld,\"to\":%lld", (int)(a->sum / a->n), a->min,
+                       a->max, (long long)(a->first_us / 1000), (long long)(a->last_us / 1000));
+        // the payload of the last send is already JSON
+        out_printf(",\"record\":%s}", record[0] == '{' ? record : "null");
+    }
+    out_printf("}");
+}
+
+
+#ifdef CONFIG_TSDB
+static int print_stored(int channel, uint32_t seq, int64_t timestamp_ms, int32_t value, void *arg) {
+    int *n = arg;
+
+    out_printf("%s[%u,%lld,%d]", (*n)++ ? "," : "", seq, (long long)timestamp_ms, value);
+    return out.failed;
+}
+
+
+/* Raw samples, or with records=1 the means that were published */
+static void serve_history(const char *path, int adc) {
+    long long to_ms = sample_timestamp_us() / 1000, from_ms, records = 0;
+    int n = 0;
+
+    query_value(path, "to", &to_ms);
+    if (query_value(path, "from", &from_ms))
+        from_ms = to_ms - HISTORY_MS;
+    query_value(path, "records", &records);
+
+    out_printf("{\"adc\":%d,\"measure\":\"%s\",\"from\":%lld,\"to\":%lld,\"r\":[", adc, measure_names[adc], from_ms, to_ms);
+    int found = tsdb_query(records ? RECORD_CHANNEL(adc) : adc, from_ms, to_ms, print_stored, &n);
+    out_printf("],\"n\":%d%s}", n, found < 0 && !out.failed ? ",\"error\":\"store\"" : "");
+}
+#endif
+
+
+static int wake_report(char *buf, size_t size) {
+    struct wake_sched_stats stats;
+
+    wake_sched_get_stats(&stats);
+    return snprintf(buf, size, "{\"wakes\":%u,\"runs\":%u,\"pulled\":%u}", stats.wakes, stats.runs, stats.pulled);
+}
+
+
+static void serve_diagnostics(const char *path, int adc) {
+    out_printf("{\"uptime_s\":%lld,\"arena\":", (long long)(hal_time_us() / 1000000));
+    out_report(arena_report);
+    out_printf(",\"wake_sched\":");
+    out_report(wake_report);
+    out_printf("}");
+}
+
+
+static const struct route {
+    const char *path;
+    int needs_adc;
+    void (*serve)(const char *path, int adc);
+} routes[] = {
+    { "/live", 0, serve_live },
+    { "/window", 1, serve_window },
+    { "/aggregates", 0, serve_aggregates },
+#ifdef CONFIG_TSDB
+    { "/history", 1, serve_history },
+#endif
+    { "/diagnostics", 0, serve_diagnostics },
+};
+
+
+static const struct route *find_route(const char *path) {
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++)
+        if (path_is(path, routes[i].path))
+            return &routes[i];
+    return NULL;
+}
+
+
+static void serve_error(int fd, int status, const char *reason) {
+    begin(fd, status, reason);
+    out_printf("{\"error\":\"%s\"}", reason);
+    end();
+}
+
+
+int http_local_listen(int port, int loopback_only) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(loopback_only ? INADDR_LOOPBACK : INADDR_ANY),
+    };
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 2)) {
+        ESP_LOGE(TAG, "Cannot listen on port %d", port);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+int http_local_accept(int listen_fd, int timeout_ms) {
+    struct timeval timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+    fd_set ready;
+
+    FD_ZERO(&ready);
+    FD_SET(listen_fd, &ready);
+    if (select(listen_fd + 1, &ready, NULL, NULL, timeout_ms < 0 ? NULL : &timeout) <= 0)
+        return -1;
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return -1;
+    timeout.tv_sec = HTTP_LOCAL_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (HTTP_LOCAL_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+
+int http_local_read_request(int fd, struct http_request *req) {
+    int len = 0;
+
+    // up to the blank line after the headers; a GET has no body
+    while (len < REQUEST_SIZE - 1) {
+        int got = recv(fd, request + len, REQUEST_SIZE - 1 - len, 0);
+        if (got <= 0)
+            return 1;
+        len += got;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+            break;
+    }
+
+    char method[8];
+    if (sscanf(request, "%7s %95s", method, req->path) != 2)
+        return 1;
+    req->method_get = strcmp(method, "GET") == 0;
+    return 0;
+}
+
+
+void http_local_set_window_access(int (*run)(void (*fn)(void *arg), void *arg)) {
+    run_with_windows = run != NULL ? run : run_here;
+}
+
+
+void http_local_respond(int fd, const struct http_request *req) {
+    const struct route *r = find_route(req->path);
+    int adc = query_adc(req->path);
+
+    ESP_LOGD(TAG, "%s %s", req->method_get ? "GET" : "?", req->path);
+    if (r == NULL)
+        serve_error(fd, 404, "Not Found");
+    else if (!req->method_get)
+        serve_error(fd, 405, "Method Not Allowed");
+    else if (r->needs_adc && adc < 0)
+        serve_error(fd, 400, "Bad Request");
+    else {
+        begin(fd, 200, "OK");
+        r->serve(req->path, adc);
+        end();
+    }
+}
+
+#endif
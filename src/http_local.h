@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Read-only HTTP endpoint for commissioning, when a laptop shares the
+ * node's network but there is no broker. Plain BSD sockets, so the same
+ * code runs on lwIP and, in the host build, over loopback. Every response
+ * is JSON sent with chunked encoding, written piece by piece as the sample
+ * windows and the store are walked; nothing holds a whole response.
+ *
+ *   GET /live                  newest sample of each measure
+ *   GET /window?adc=N          samples of the current window, oldest first
+ *   GET /aggregates            count, mean, min and max of each window, last record sent
+ *   GET /history?adc=N&from=ms&to=ms
+ *                              stored samples (CONFIG_TSDB), the last hour by default
+ *   GET /diagnostics           uptime, arena and wake-up counts
+ *
+ * Everything runs in the task that took the connection, sockets included.
+ * What the answers read from the sample windows is copied where the windows
+ * are written, through http_local_set_window_access, a batch at a time; a
+ * slow client only holds the server task. The store has its own lock. */
+
+#define HTTP_LOCAL_PATH_LEN     96
+#define HTTP_LOCAL_CHUNK_SIZE   256
+#define HTTP_LOCAL_TIMEOUT_MS   2000    // to receive the request and for every send
+
+struct http_request {
+    char path[HTTP_LOCAL_PATH_LEN];     // query string included
+    int method_get;
+};
+
+/**
+ * @brief   Listening TCP socket on `port`, all interfaces or only loopback
+ *
+ * @return  the socket, -1 on error
+ */
+int http_local_listen(int port, int loopback_only);
+
+/**
+ * @brief   Takes a connection if one is waiting, or waits up to `timeout_ms`
+ *          (-1 forever), and sets the send and receive timeouts on it
+ *
+ * @return  the connected socket, -1 if none
+ */
+int http_local_accept(int listen_fd, int timeout_ms);
+
+/**
+ * @brief   Reads the request line and headers
+ *
+ * @return  0 on success; the connection only needs closing otherwise
+ */
+int http_local_read_request(int fd, struct http_request *req);
+
+/**
+ * @brief   How to run `fn` where the sample windows are written and wait for
+ *          it, 0 on success. By default it runs right away, as in the host
+ *          simulation where there is a single task.
+ */
+void http_local_set_window_access(int (*run)(void (*fn)(void *arg), void *arg));
+
+/**
+ * @brief   Writes the whole response
+ */
+void http_local_respond(int fd, const struct http_request *req);
@@ -0,0 +1,90 @@
+#include <unistd.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+
+#include "hal.h"
+#include "pm_policy.h"
+#include "http_local.h"
+
+#ifdef CONFIG_HTTP_LOCAL
+
+/* Server task of http_local.h. It sits in accept with no PM lock, so light
+ * sleep goes on while nobody asks; a request wakes the node like any other
+ * packet. Every answer goes out from here; only the copies of the sample
+ * windows are taken in the timer task, through a one-shot timer, so a slow
+ * client never holds the sampling back. */
+
+static const char *TAG = "http_server";
+
+#define SERVER_STACK        4096
+#define SERVER_PRIORITY     2   // below the MQTT client
+
+static hal_timer_t snapshot_timer;
+static SemaphoreHandle_t snapshot_taken;
+static int listen_fd;
+static struct http_request request;
+
+// what the timer task runs for the server task
+static void (*snapshot_fn)(void *arg);
+static void *snapshot_arg;
+
+
+static void snapshot_callback(void *args) {
+    snapshot_fn(snapshot_arg);
+    xSemaphoreGive(snapshot_taken);
+}
+
+
+static int run_in_timer_task(void (*fn)(void *arg), void *arg) {
+    snapshot_fn = fn;
+    snapshot_arg = arg;
+    if (hal_timer_start_once(snapshot_timer, 0))
+        return 1;
+    xSemaphoreTake(snapshot_taken, portMAX_DELAY);
+    return 0;
+}
+
+
+static void http_server_task(void *args) {
+    for (;;) {
+        int conn_fd = http_local_accept(listen_fd, -1);
+        if (conn_fd < 0) {
+            vTaskDelay(pdMS_TO_TICKS(1000));
+            continue;
+        }
+        if (http_local_read_request(conn_fd, &request) == 0) {
+            pm_policy_acquire(PM_ACTIVITY_PUBLISH);
+            http_local_respond(conn_fd, &request);
+            pm_policy_release(PM_ACTIVITY_PUBLISH);
+        }
+        close(conn_fd);
+    }
+}
+
+
+int http_server_start(void) {
+    const struct hal_timer_args snapshot_args = {
+        .callback = snapshot_callback,
+        .name = "http_snapshot",
+    };
+
+    snapshot_taken = xSemaphoreCreateBinary();
+    if (snapshot_taken == NULL || hal_timer_create(&snapshot_args, &snapshot_timer))
+        return 1;
+    http_local_set_window_access(run_in_timer_task);
+
+    listen_fd = http_local_listen(CONFIG_HTTP_LOCAL_PORT, 0);
+    if (listen_fd < 0)
+        return 1;
+    if (xTaskCreate(http_server_task, "http_local", SERVER_STACK, NULL, SERVER_PRIORITY, NULL) != pdPASS) {
+        close(listen_fd);
+        return 1;
+    }
+    ESP_LOGI(TAG, "Samples and diagnostics on port %d", CONFIG_HTTP_LOCAL_PORT);
+    return 0;
+}
+
+#endif
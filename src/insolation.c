@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "sdkconfig.h"
+
+#include "insolation.h"
+#include "mqtt.h"
+
+/* Energy yield on the node: every irradiation sample goes through the
+ * trapezoidal integral (insolation_model.c), so dropped messages no longer
+ * bias the energy computed downstream. At the first sample of each
+ * CONFIG_INSOLATION_PERIOD_S interval (aligned to the wall clock) it
+ * publishes
+ *   {"t":end_ms,"interval":{totals},"day":{totals}}
+ * and at the first sample of a UTC day the final totals of the previous one
+ *   {"t":end_ms,"day":{totals},"final":true}
+ * with totals {"wh":Wh/m²,"peak":W/m²,"peak_t":ms,"above_s":s,"gap_s":s}.
+ * The daily totals live in RTC memory. Runs in the esp_timer task. */
+
+#ifdef CONFIG_INSOLATION
+
+static const char *TAG = "insolation";
+
+#define TOPIC_ENERGY    "/ciu/lopy4/irradiation/1/energy"
+#define PERIOD_MS       (CONFIG_INSOLATION_PERIOD_S * 1000LL)
+#define DAY_MS          86400000LL
+
+static const struct insolation_params params = {
+    .mwm2_per_mv = CONFIG_INSOLATION_MWM2_PER_MV,
+    .threshold_mwm2 = CONFIG_INSOLATION_THRESHOLD_WM2 * 1000,
+    .max_gap_ms = CONFIG_INSOLATION_MAX_GAP_S * 1000,
+};
+
+RTC_DATA_ATTR static struct insolation_state state;
+
+
+static int format_totals(char *buf, size_t size, const struct insolation_totals *t) {
+    long long mwh = t->energy_uj / 3600000; // 1 mWh = 3.6e6 µJ
+
+    return snprintf(buf, size, "{\"wh\":%lld.%03lld,\"peak\":%d,\"peak_t\":%lld,\"above_s\":%lld,\"gap_s\":%lld}",
+                    mwh / 1000, mwh % 1000, t->peak_mwm2 / 1000, (long long)t->peak_ms,
+                    (long long)(t->above_ms / 1000), (long long)(t->gap_ms / 1000));
+}
+
+
+static void publish(const char *payload, int len) {
+    ESP_LOGI(TAG, "%s", payload);
+    if (enviar_al_broker(TOPIC_ENERGY, payload, len, 1, 0) < 0)
+        ESP_LOGD(TAG, "Energy report not sent, the next one carries the day so far");
+}
+
+
+static void publish_interval(int64_t end_ms) {
+    char interval[112], day[112], payload[256];
+
+    format_totals(interval, sizeof(interval), &state.interval);
+    format_totals(day, sizeof(day), &state.daily);
+    int len = snprintf(payload, sizeof(payload), "{\"t\":%lld,\"interval\":%s,\"day\":%s}", (long long)end_ms, interval, day);
+    if (len < (int)sizeof(payload))
+        publish(payload, len);
+}
+
+
+static void publish_day(int64_t end_ms, const struct insolation_totals *totals) {
+    char day[112], payload[160];
+
+    format_totals(day, sizeof(day), totals);
+    int len = snprintf(payload, sizeof(payload), "{\"t\":%lld,\"day\":%s,\"final\":true}", (long long)end_ms, day);
+    if (len < (int)sizeof(payload))
+        publish(payload, len);
+}
+
+
+void insolation_sample(int64_t timestamp_ms, int mv) {
+    struct insolation_totals finished;
+
+    // the totals so far belong to the interval that just ended
+    if (state.last_ms > 0 && timestamp_ms / PERIOD_MS != state.last_ms / PERIOD_MS) {
+        publish_interval(timestamp_ms / PERIOD_MS * PERIOD_MS);
+        insolation_interval_reset(&state);
+    }
+    if (insolation_update(&state, &params, timestamp_ms, mv, &finished))
+        publish_day(timestamp_ms / DAY_MS * DAY_MS, &finished);
+}
+
+
+int insolation_setup(void) {
+    if (!insolation_valid(&state)) {
+        insolation_init(&state);
+    } else if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) {
+        // the night is not a gap; the evening interval is only in the day totals
+        insolation_break(&state);
+        insolation_interval_reset(&state);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "insolation_model.h"
+
+/**
+ * @brief   Restores the daily totals kept across deep sleep and resets
+ *
+ * @return 0 on success
+ */
+int insolation_setup(void);
+
+/**
+ * @brief   Feeds an irradiation sample (mV of the sensor) and publishes the
+ *          interval and daily totals when their period is over
+ */
+void insolation_sample(int64_t timestamp_ms, int mv);
@@ -0,0 +1,96 @@
+#include <string.h>
+
+#include "insolation_model.h"
+
+#define INSOLATION_MAGIC    0x494e534cu // "INSL"
+#define DAY_MS              86400000LL
+
+
+void insolation_init(struct insolation_state *s) {
+    memset(s, 0, sizeof(*s));
+    s->magic = INSOLATION_MAGIC;
+    s->day = -1;
+}
+
+
+int insolation_valid(const struct insolation_state *s) {
+    return s->magic == INSOLATION_MAGIC;
+}
+
+
+int32_t insolation_mwm2(const struct insolation_params *p, int32_t mv) {
+    return mv > 0 ? mv * p->mwm2_per_mv : 0;
+}
+
+
+/* Part of a segment from g1 to g2 (linear) above the threshold */
+static int64_t time_above(int64_t dt, int32_t g1, int32_t g2, int32_t threshold) {
+    int32_t low = g1 < g2 ? g1 : g2, high = g1 < g2 ? g2 : g1;
+
+    if (low >= threshold)
+        return dt;
+    if (high < threshold)
+        return 0;
+    return dt * (high - threshold) / (high - low);
+}
+
+
+static void add_segment(struct insolation_totals *t, int64_t energy, int64_t above) {
+    t->energy_uj += energy;
+    t->above_ms += above;
+}
+
+
+static void add_peak(struct insolation_totals *t, int64_t now_ms, int32_t g) {
+    if (g > t->peak_mwm2) {
+        t->peak_mwm2 = g;
+        t->peak_ms = now_ms;
+    }
+}
+
+
+int insolation_update(struct insolation_state *s, const struct insolation_params *p, int64_t now_ms, int32_t mv,
+                      struct insolation_totals *finished) {
+    int32_t g = insolation_mwm2(p, mv);
+    int64_t day = now_ms / DAY_MS;
+    int closed = 0;
+
+    if (day != s->day) {
+        if (s->day >= 0) {
+            *finished = s->daily;
+            closed = 1;
+        }
+        memset(&s->daily, 0, sizeof(s->daily));
+        s->day = day;
+    }
+
+    if (s->last_ms > 0 && now_ms > s->last_ms) {
+        int64_t dt = now_ms - s->last_ms;
+        if (dt > p->max_gap_ms) {
+            s->interval.gap_ms += dt;
+            s->daily.gap_ms += dt;
+        } else {
+            // mW/m² x ms = µJ/m²
+            int64_t energy = ((int64_t)s->last_mwm2 + g) * dt / 2;
+            int64_t above = time_above(dt, s->last_mwm2, g, p->threshold_mwm2);
+            add_segment(&s->interval, energy, above);
+            add_segment(&s->daily, energy, above);
+        }
+    }
+    add_peak(&s->interval, now_ms, g);
+    add_peak(&s->daily, now_ms, g);
+
+    s->last_ms = now_ms;
+    s->last_mwm2 = g;
+    return closed;
+}
+
+
+void insolation_break(struct insolation_state *s) {
+    s->last_ms = 0;
+}
+
+
+void insolation_interval_reset(struct insolation_state *s) {
+    memset(&s->interval, 0, sizeof(s->interval));
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Energy received per m² from the irradiance samples, integrated with the
+ * trapezoidal rule between consecutive samples at their exact timestamps.
+ * Plain C, no ESP-IDF dependency, so recorded traces can be replayed
+ * through it on the host. */
+
+struct insolation_params {
+    int32_t mwm2_per_mv;        // sensor calibration
+    int32_t threshold_mwm2;     // for the time above threshold
+    int32_t max_gap_ms;         // longer gaps (deep sleep, lost samples) are not integrated
+};
+
+struct insolation_totals {
+    int64_t energy_uj;          // µJ/m²
+    int64_t above_ms;           // time above the threshold, linear between samples
+    int64_t gap_ms;             // time left out of the integral
+    int32_t peak_mwm2;
+    int64_t peak_ms;
+};
+
+struct insolation_state {
+    uint32_t magic;
+    int64_t day;                // UTC day of the daily totals
+    int64_t last_ms;            // previous sample, 0 if there is none
+    int32_t last_mwm2;
+    struct insolation_totals interval, daily;
+};
+
+void insolation_init(struct insolation_state *s);
+
+/**
+ * @brief   Whether `s` holds totals started by insolation_init
+ */
+int insolation_valid(const struct insolation_state *s);
+
+/**
+ * @brief   Irradiance in mW/m² for a sensor reading, never negative
+ */
+int32_t insolation_mwm2(const struct insolation_params *p, int32_t mv);
+
+/**
+ * @brief   Adds a sample taken at `now_ms` (wall clock)
+ *
+ * A segment belongs to the day its end sample is in. When `now_ms` starts
+ * a new UTC day the totals of the previous one are copied to `finished`
+ * before being cleared.
+ *
+ * @return  1 if a day was finished, 0 otherwise
+ */
+int insolation_update(struct insolation_state *s, const struct insolation_params *p, int64_t now_ms, int32_t mv,
+                      struct insolation_totals *finished);
+
+/**
+ * @brief   The next sample starts a new segment; for waking up from deep
+ *          sleep, where the time since the last sample is not a loss
+ */
+void insolation_break(struct insolation_state *s);
+
+/**
+ * @brief   Starts a new reporting interval
+ */
+void insolation_interval_reset(struct insolation_state *s);
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "hal.h"
+#include "latency.h"
+
+#ifdef CONFIG_LATENCY_STATS
+
+static struct latency paths[LATENCY_MAX_PATHS];
+static int n_paths;
+
+
+struct latency *latency_path(const char *name) {
+    for (int i = 0; i < n_paths; i++)
+        if (strcmp(paths[i].name, name) == 0)
+            return &paths[i];
+    if (n_paths == LATENCY_MAX_PATHS)
+        return NULL;
+    paths[n_paths].name = name;
+    return &paths[n_paths++];
+}
+
+
+void latency_arm(struct latency *l, int64_t first_us, int64_t period_us) {
+    if (l == NULL)
+        return;
+    // a second arm racing with the pick up can only tear this one schedule
+    l->next_due_us = hal_time_us() + first_us;
+    l->next_period_us = period_us;
+    atomic_store_explicit(&l->rearmed, true, memory_order_release);
+}
+
+
+static int bucket(uint32_t us) {
+    int b = us ? 32 - __builtin_clz(us) : 0;
+    return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+
+static uint32_t saturate(int64_t us) {
+    return us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+
+static void raise_max(atomic_uint *max, uint32_t value) {
+    unsigned current = atomic_load_explicit(max, memory_order_relaxed);
+
+    while (value > current
+           && !atomic_compare_exchange_weak_explicit(max, &current, value, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+
+int64_t latency_enter(struct latency *l) {
+    int64_t now = hal_time_us();
+
+    if (l == NULL)
+        return now;
+    atomic_fetch_add_explicit(&l->count, 1, memory_order_relaxed);
+    if (atomic_exchange_explicit(&l->rearmed, false, memory_order_acquire)) {
+        l->due_us = l->next_due_us;
+        l->period_us = l->next_period_us;
+        l->scheduled = true;
+    }
+    if (l->due_us == 0)
+        return now;
+
+    int64_t late = now - l->due_us;
+    if (l->period_us > 0 && late >= l->period_us) {
+        atomic_fetch_add_explicit(&l->skipped, 1, memory_order_relaxed);
+        l->due_us = now + l->period_us;
+        return now;
+    }
+    if (late < 0)
+        atomic_fetch_add_explicit(&l->early, 1, memory_order_relaxed);
+    uint32_t us = saturate(late < 0 ? -late : late);
+    atomic_fetch_add_explicit(&l->late[bucket(us)], 1, memory_order_relaxed);
+    raise_max(&l->late_max, us);
+    atomic_store_explicit(&l->drift_us, late < INT32_MIN ? INT32_MIN : late > INT32_MAX ? INT32_MAX : (int32_t)late,
+                          memory_order_relaxed);
+
+    l->due_us = l->period_us > 0 ? l->due_us + l->period_us : 0;
+    return now;
+}
+
+
+void latency_exit(struct latency *l, int64_t start_us) {
+    if (l == NULL)
+        return;
+    uint32_t us = saturate(hal_time_us() - start_us);
+    atomic_fetch_add_explicit(&l->run[bucket(us)], 1, memory_order_relaxed);
+    raise_max(&l->run_max, us);
+}
+
+
+static int drain_buckets(char *buf, size_t size, atomic_uint *buckets) {
+    int len = snprintf(buf, size, "[");
+
+    for (int b = 0; b < LATENCY_BUCKETS && len < (int)size; b++) {
+        unsigned n = atomic_exchange_explicit(&buckets[b], 0, memory_order_relaxed);
+        if (n)
+            len += snprintf(buf + len, size - len, "%s[%d,%u]", len > 1 ? "," : "", b, n);
+    }
+    if (len < (int)size)
+        len += snprintf(buf + len, size - len, "]");
+    return len;
+}
+
+
+static int drain(char *buf, size_t size, struct latency *l, unsigned count) {
+    int len = snprintf(buf, size, "\"%s\":{\"n\":%u", l->name, count);
+
+    if (l->scheduled) {
+        len += snprintf(buf + len, size - len, ",\"late\":");
+        len += drain_buckets(buf + len, len < (int)size ? size - len : 0, l->late);
+        len += snprintf(buf + len, len < (int)size ? size - len : 0,
+                        ",\"early\":%u,\"skipped\":%u,\"max\":%u,\"drift\":%d",
+                        atomic_exchange_explicit(&l->early, 0, memory_order_relaxed),
+                        atomic_exchange_explicit(&l->skipped, 0, memory_order_relaxed),
+                        atomic_exchange_explicit(&l->late_max, 0, memory_order_relaxed),
+                        atomic_load_explicit(&l->drift_us, memory_order_relaxed));
+    }
+    len += snprintf(buf + len, len < (int)size ? size - len : 0, ",\"run\":");
+    len += drain_buckets(buf + len, len < (int)size ? size - len : 0, l->run);
+    len += snprintf(buf + len, len < (int)size ? size - len : 0, ",\"run_max\":%u}",
+                    atomic_exchange_explicit(&l->run_max, 0, memory_order_relaxed));
+    return len;
+}
+
+
+int latency_report(char *buf, size_t size) {
+    char entry[320];
+    int len = snprintf(buf, size, "{");
+    bool first = true;
+
+    for (int i = 0; i < n_paths; i++) {
+        unsigned count = atomic_exchange_explicit(&paths[i].count, 0, memory_order_relaxed);
+        if (count == 0)
+            continue;
+        int entry_len = drain(entry, sizeof(entry), &paths[i], count);
+        // keep room for the closing brace
+        if (entry_len >= (int)sizeof(entry) || len + entry_len + 3 > (int)size)
+            continue;
+        len += snprintf(buf + len, size - len, "%s%s", first ? "" : ",", entry);
+        first = false;
+    }
+    if (len < (int)size)
+        len += snprintf(buf + len, size - len, "}");
+    return len;
+}
+
+#endif
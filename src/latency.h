@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "sdkconfig.h"
+
+/* How late the timer callbacks run against their schedule and how long the
+ * hot paths hold their task, per named path, in log2 histograms of
+ * microseconds: bucket b counts values in [2^(b-1), 2^b), bucket 0 the
+ * zeros, the last one everything above. Each callback brackets its work
+ * with latency_enter/latency_exit; the counters are atomics updated without
+ * locks, so paths in different tasks never wait on each other and the
+ * report can drain them from a third one.
+ *
+ * A periodic schedule is a fixed grid from the instant it was armed: a
+ * timer that slips a little every period shows up as a growing `drift`
+ * instead of a flat lateness. A callback a whole period late or more
+ * counts as `skipped` and the grid starts again from it. Without
+ * CONFIG_LATENCY_STATS every call compiles to nothing. */
+
+#define LATENCY_BUCKETS     24      // the last one from 2^22 us, about 4 s
+#define LATENCY_MAX_PATHS   12
+
+struct latency {
+    const char *name;
+
+    // handed over by latency_arm, taken by the next latency_enter
+    int64_t next_due_us, next_period_us;
+    atomic_bool rearmed;
+    // owned by the task the callback runs in
+    int64_t due_us, period_us;
+    bool scheduled;                 // armed at least once
+
+    atomic_uint count, early, skipped;
+    atomic_uint late[LATENCY_BUCKETS], late_max;
+    atomic_int drift_us;            // signed lateness of the last call
+    atomic_uint run[LATENCY_BUCKETS], run_max;
+};
+
+#ifdef CONFIG_LATENCY_STATS
+
+/**
+ * @brief   The path called `name`, created on first use
+ *
+ * Meant for setup; `name` must outlive the program.
+ *
+ * @return  NULL if LATENCY_MAX_PATHS are taken; the other calls accept it
+ */
+struct latency *latency_path(const char *name);
+
+/**
+ * @brief   The timer of the path was started: first call due in `first_us`
+ *          from now, then every `period_us` (0 for a one-shot timer)
+ */
+void latency_arm(struct latency *path, int64_t first_us, int64_t period_us);
+
+/**
+ * @brief   First thing in the callback
+ *
+ * @return  the start time, for latency_exit
+ */
+int64_t latency_enter(struct latency *path);
+
+void latency_exit(struct latency *path, int64_t start_us);
+
+/**
+ * @brief   {"path":{"n":calls,"late":[[b,n],...],"early":n,"skipped":n,"max":us,"drift":us,
+ *          "run":[[b,n],...],"run_max":us},...}
+ *
+ * Only the paths called since the last report, with their non-empty buckets;
+ * the schedule fields only for armed paths. Every call is counted in exactly
+ * one report, paths that do not fit are counted in none.
+ *
+ * @return  length written, as snprintf
+ */
+int latency_report(char *buf, size_t size);
+
+#else
+
+static inline struct latency *latency_path(const char *name) { return NULL; }
+static inline void latency_arm(struct latency *path, int64_t first_us, int64_t period_us) {}
+static inline int64_t latency_enter(struct latency *path) { return 0; }
+static inline void latency_exit(struct latency *path, int64_t start_us) {}
+
+#endif
@@ -20,19 +20,30 @@
 
 #include "freertos/task.h"
 
+#include "boot_timing.h"
+#include "pm_stats.h"
+#include "pm_policy.h"
+#include "sys_stats.h"
+#include "bench.h"
+#include "arena.h"
+#include "ota.h"
+
 extern void provisioning(void);
 extern void redireccionaLogs(void);
+extern void inicializaReloj(void);
 
 extern int setup_adc_reader();
+extern int http_server_start(void);
 
 static const char *TAG = "main";
 
 void app_main(void)
 {   
-    //Just redirect error logs
-    //esp_log_level_set("*", ESP_LOG_ERROR);
-    esp_log_level_set("*", ESP_LOG_VERBOSE);
-    //redireccionaLogs();
+    boot_mark(BOOT_APP_MAIN);
+
+    //Per-tag levels can be changed later over MQTT
+    esp_log_level_set("*", CONFIG_LOG_RUNTIME_LEVEL);
+    redireccionaLogs();
 
     // Configuramos el gestor de energia
     esp_pm_config_esp32_t config = {
@@ -41,6 +52,8 @@ void app_main(void)
         .light_sleep_enable = true
     };
     esp_pm_configure(&config);
+    if (pm_policy_setup())
+        ESP_LOGE(TAG, "PM locks not available, DFS decides alone");
 
     /* Initialize networking stack */
     ESP_ERROR_CHECK(esp_netif_init());
@@ -48,13 +61,47 @@ void app_main(void)
     /* Create default event loop needed by the
      * main app and the provisioning service */
     ESP_ERROR_CHECK(esp_event_loop_create_default());
+    boot_mark(BOOT_STACK_READY);
+    if (pm_stats_setup())
+        ESP_LOGE(TAG, "Energy accounting not available");
 
     /* Initialize NVS needed by Wi-Fi */
     ESP_ERROR_CHECK(nvs_flash_init());
+    boot_mark(BOOT_NVS_READY);
+#ifdef CONFIG_OTA
+    // a new image has CONFIG_OTA_CONFIRM_TIMEOUT_S from here to reach the broker
+    if (ota_setup())
+        ESP_LOGE(TAG, "Rollback timer not armed, the new image stays");
+#endif
+
+#ifdef CONFIG_BENCH
+    // before any timer is running
+    if (bench_run())
+        ESP_LOGE(TAG, "Benchmarks failed");
+#endif
+
+    // Sampling starts right away, whatever the state of the network
+    inicializaReloj();
+    if (setup_adc_reader())
+        ESP_LOGE(TAG, "Failed to create adc_reader module.");
+
+    // the sampling pipeline has all its buffers, later requests are bugs
+    char arena[224];
+    arena_seal();
+    arena_report(arena, sizeof(arena));
+    ESP_LOGI(TAG, "Arena: %s", arena);
+#ifdef CONFIG_SYS_STATS
+    if (sys_stats_setup())
+        ESP_LOGE(TAG, "Task and heap statistics not available");
+#endif
 
     //wifi provisioning
     ESP_LOGI(TAG, "Starting WiFi SoftAP provisioning");
     provisioning();
+#ifdef CONFIG_HTTP_LOCAL
+    if (http_server_start())
+        ESP_LOGE(TAG, "Local HTTP endpoint not available");
+#endif
     
     vTaskSuspend(NULL);
 }
\ No newline at end of file
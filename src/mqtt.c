@@ -7,10 +7,20 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 
+#include "mqtt_client.h"
+#include "esp_log.h"
+
 #include "mqtt.h"
+#include "boot_timing.h"
+#include "pm_policy.h"
+#include "mqtt_cmd.h"
+#include "ota.h"
+#include "latency.h"
 
 static esp_mqtt_client_handle_t client;
-bool first_conexion_mqtt = true;
+static volatile bool mqtt_conectado = false;
+static bool handshake_boost = false;
+static struct latency *event_latency;
 
 static const char *TAG = "MQTTS";
 
@@ -23,6 +33,11 @@ static const char * TOPIC_SAMPLE_FREQ_BATTERY_LEVEL = "/ciu/lopy4/battery_level/
 static const char * TOPIC_SEND_FREQ_BATTERY_LEVEL = "/ciu/lopy4/battery_level/1/send_frequency";
 static const char * TOPIC_N_SAMPLES_BATTERY_LEVEL = "/ciu/lopy4/battery_level/1/sample_number";
 
+static const char * TOPIC_LOG_LEVEL = "/ciu/lopy4/log_level";
+
+static const char * TOPIC_BACKFILL_IRRADIATION = "/ciu/lopy4/irradiation/1/backfill";
+static const char * TOPIC_BACKFILL_BATTERY_LEVEL = "/ciu/lopy4/battery_level/1/backfill";
+
 
 // #if CONFIG_BROKER_CERTIFICATE_OVERRIDDEN == 1
 // static const uint8_t mqtt_eclipse_org_pem_start[]  = "-----BEGIN CERTIFICATE-----\n" CONFIG_BROKER_CERTIFICATE_OVERRIDE "\n-----END CERTIFICATE-----";
@@ -31,52 +46,156 @@ static const char * TOPIC_N_SAMPLES_BATTERY_LEVEL = "/ciu/lopy4/battery_level/1/
 // #endif
 // extern const uint8_t mqtt_eclipse_org_pem_end[]   asm("_binary_mqtt_eclipse_org_pem_end");
 
-extern int setup_adc_reader();
-extern int start_broker_send_timers();
-extern int stop_broker_send_timers();
 extern int change_sample_frequency(int sample_freq, int adc);
 extern int change_broker_sender_frequency(int send_freq, int adc);
 extern int change_sample_number(int n_samples, int adc);
+extern int set_log_level(const char *data, int len);
+extern int backfill_setup(void);
+extern int backfill_request(int adc, const char *data, int len);
+
+extern const int IRRADIATION_ADC_INDEX;
+
+/* El broker no guarda las suscripciones de una sesión limpia, así que se
+ * repiten en cada conexión */
+static void subscribe_topics(void)
+{
+    esp_mqtt_client_subscribe(client, TOPIC_SAMPLE_FREQ_IRRADIATION, 1);
+    esp_mqtt_client_subscribe(client, TOPIC_SEND_FREQ_IRRADIATION, 1);
+    esp_mqtt_client_subscribe(client, TOPIC_N_SAMPLES_IRRADIATION, 1);
+
+    esp_mqtt_client_subscribe(client, TOPIC_SAMPLE_FREQ_BATTERY_LEVEL, 1);
+    esp_mqtt_client_subscribe(client, TOPIC_SEND_FREQ_BATTERY_LEVEL, 1);
+    esp_mqtt_client_subscribe(client, TOPIC_N_SAMPLES_BATTERY_LEVEL, 1);
+
+    esp_mqtt_client_subscribe(client, TOPIC_LOG_LEVEL, 1);
+
+#ifdef CONFIG_BACKFILL
+    if (backfill_setup() == 0) {
+        esp_mqtt_client_subscribe(client, TOPIC_BACKFILL_IRRADIATION, 1);
+        esp_mqtt_client_subscribe(client, TOPIC_BACKFILL_BATTERY_LEVEL, 1);
+    }
+#endif
+
+#ifdef CONFIG_OTA
+    esp_mqtt_client_subscribe(client, OTA_TOPIC_BEGIN, 1);
+    esp_mqtt_client_subscribe(client, OTA_TOPIC_CHUNK, 1);
+#endif
+}
+
+
+/* Los envíos solo se intentan con conexión; mientras tanto se acumulan */
+bool mqtt_is_connected(void)
+{
+    return mqtt_conectado;
+}
+
+
+static void end_handshake_boost(void)
+{
+    if (handshake_boost) {
+        pm_policy_release(PM_ACTIVITY_HANDSHAKE);
+        handshake_boost = false;
+    }
+}
+
+
+static void handle_log_level(const struct mqtt_message *msg, const struct mqtt_cmd *cmd)
+{
+    if (set_log_level(msg->data, msg->data_len))
+        ESP_LOGW(TAG, "log_level no válido, se espera tag=nivel (N, E, W, I, D o V)");
+}
+
+
+static void handle_backfill(const struct mqtt_message *msg, const struct mqtt_cmd *cmd)
+{
+#ifdef CONFIG_BACKFILL
+    if (backfill_request(cmd->adc, msg->data, msg->data_len))
+        ESP_LOGW(TAG, "backfill no válido, se espera primero-último (números de secuencia)");
+#endif
+}
+
+
+static void handle_sample_frequency(const struct mqtt_message *msg, const struct mqtt_cmd *cmd)
+{
+    change_sample_frequency(cmd->value, cmd->adc);
+}
+
+
+static void handle_send_frequency(const struct mqtt_message *msg, const struct mqtt_cmd *cmd)
+{
+    change_broker_sender_frequency(cmd->value, cmd->adc);
+}
+
+
+static void handle_sample_number(const struct mqtt_message *msg, const struct mqtt_cmd *cmd)
+{
+    change_sample_number(cmd->value, cmd->adc);
+}
+
+
+/*Un manejador por comando, indexado por enum mqtt_cmd_kind*/
+static void (*const handlers[])(const struct mqtt_message *, const struct mqtt_cmd *) = {
+    [MQTT_CMD_LOG_LEVEL] = handle_log_level,
+    [MQTT_CMD_BACKFILL] = handle_backfill,
+    [MQTT_CMD_SAMPLE_FREQUENCY] = handle_sample_frequency,
+    [MQTT_CMD_SEND_FREQUENCY] = handle_send_frequency,
+    [MQTT_CMD_SAMPLE_NUMBER] = handle_sample_number,
+};
+
+
+static void dispatch_command(const struct mqtt_message *msg)
+{
+    struct mqtt_cmd cmd;
+
+    switch (mqtt_cmd_parse(msg, &cmd)) {
+        case 0:
+            break;
+        case 2:
+            ESP_LOGW(TAG, "Valor no válido para %s: %.*s", mqtt_cmd_name(cmd.kind), msg->data_len, msg->data);
+            return;
+        default:
+            ESP_LOGW(TAG, "Topic desconocido: %.*s", msg->topic_len, msg->topic);
+            return;
+    }
+    if (cmd.adc >= 0 && cmd.kind != MQTT_CMD_BACKFILL)
+        ESP_LOGI(TAG, "Recibido un cambio de %s a %d para %s.", mqtt_cmd_name(cmd.kind), cmd.value,
+                 cmd.adc == IRRADIATION_ADC_INDEX ? "irradiation" : "battery_level");
+    handlers[cmd.kind](msg, &cmd);
+}
 
-extern int IRRADIATION_ADC_INDEX;
-extern int BATTERY_ADC_INDEX;
-extern int BIAS_ADC_INDEX;
 
 static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 {
+    const struct mqtt_message *msg;
+
     client = event->client;
     // your_context_t *context = event->context;
     switch (event->event_id) {
+        case MQTT_EVENT_BEFORE_CONNECT:
+            /*El handshake TLS va a CPU_MAX hasta que conecta o falla*/
+            if (!handshake_boost) {
+                pm_policy_acquire(PM_ACTIVITY_HANDSHAKE);
+                handshake_boost = true;
+            }
+            break;
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+            boot_mark(BOOT_MQTT_CONNECTED);
+            end_handshake_boost();
 
-            if (first_conexion_mqtt){
-                /*Iniciamos los timers de lectura y envio*/
-                if(setup_adc_reader()) {
-                    ESP_LOGE(TAG, "Failed to create adc_reader module.");
-                    return 1;
-                }
-
-                first_conexion_mqtt = false;
-
-                esp_mqtt_client_subscribe(client, TOPIC_SAMPLE_FREQ_IRRADIATION, 1);
-                esp_mqtt_client_subscribe(client, TOPIC_SEND_FREQ_IRRADIATION, 1);
-                esp_mqtt_client_subscribe(client, TOPIC_N_SAMPLES_IRRADIATION, 1);
-
-                esp_mqtt_client_subscribe(client, TOPIC_SAMPLE_FREQ_BATTERY_LEVEL, 1);
-                esp_mqtt_client_subscribe(client, TOPIC_SEND_FREQ_BATTERY_LEVEL, 1);
-                esp_mqtt_client_subscribe(client, TOPIC_N_SAMPLES_BATTERY_LEVEL, 1);
-            } else {
-                /*Activamos los timers de envio de los sensores*/
-                start_broker_send_timers();
-            }
-            
-
+            subscribe_topics();
+            /*Los envíos de los sensores se reanudan solos, con lo acumulado*/
+            mqtt_conectado = true;
+#ifdef CONFIG_OTA
+            /*Llegar al broker es lo que confirma una imagen nueva*/
+            ota_connected();
+#endif
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
-            /*Paramos los envios de los datos de los sensores*/
-            stop_broker_send_timers();
+            end_handshake_boost();
+            /*El muestreo sigue; los envíos esperan a la reconexión*/
+            mqtt_conectado = false;
             break;
 
         case MQTT_EVENT_SUBSCRIBED:
@@ -89,36 +208,18 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
             ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
             break;
         case MQTT_EVENT_DATA:
-            ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-            event->data[event->data_len] = '\0'; //Necesario para que no sea el buffer más grande y añada 0 que no queremos al usar atoi()
-            if (strstr(event->topic, "sample_frequency") != NULL) {
-                if (strstr(event->topic, "irradiation")){
-                    change_sample_frequency(atoi(event->data), IRRADIATION_ADC_INDEX);
-                    ESP_LOGI(TAG, "Recibido un cambio de sample_frequency a %d segundos para irradiation.", atoi(event->data));
-                } else if (strstr(event->topic, "battery_level")){
-                    change_sample_frequency(atoi(event->data), BATTERY_ADC_INDEX);
-                    ESP_LOGI(TAG, "Recibido un cambio de sample_frequency a %d segundos para battery_level.", atoi(event->data));
-                }
-            } else if (strstr(event->topic, "send_frequency")){
-                if (strstr(event->topic, "irradiation")){
-                    change_broker_sender_frequency(atoi(event->data), IRRADIATION_ADC_INDEX);
-                    ESP_LOGI(TAG, "Recibido un cambio de send_frequency a %d para irradiation.", atoi(event->data));
-                } else if (strstr(event->topic, "battery_level")){
-                    change_broker_sender_frequency(atoi(event->data), BATTERY_ADC_INDEX);
-                    ESP_LOGI(TAG, "Recibido un cambio de send_frequency a %d para battery_level.", atoi(event->data));
-                }
-            } else if (strstr(event->topic, "sample_number")){
-                if (strstr(event->topic, "irradiation")){
-                    change_sample_number(atoi(event->data), IRRADIATION_ADC_INDEX);
-                    ESP_LOGI(TAG, "Recibido un cambio de sample_number a %d para irradiation.", atoi(event->data));
-                } else if (strstr(event->topic, "battery_level")){
-                    change_sample_number(atoi(event->data), BATTERY_ADC_INDEX);
-                    ESP_LOGI(TAG, "Recibido un cambio de sample_number a %d para battery_level.", atoi(event->data));
-                }
-            }
-            //printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-            //printf("DATA=%.*s\r\n", event->data_len, event->data);
-
+            ESP_LOGD(TAG, "MQTT_EVENT_DATA");
+#ifdef CONFIG_OTA
+            /*Las actualizaciones se aplican trozo a trozo, sin reensamblar*/
+            if (ota_mqtt_data(event->topic, event->topic_len, event->data, event->data_len,
+                              event->current_data_offset, event->total_data_len))
+                break;
+#endif
+            /*Los mensajes que no caben en el buffer del cliente llegan en trozos*/
+            msg = mqtt_cmd_feed(event->topic, event->topic_len, event->data, event->data_len,
+                                event->current_data_offset, event->total_data_len);
+            if (msg != NULL)
+                dispatch_command(msg);
             break;
         case MQTT_EVENT_ERROR:
             ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -133,26 +234,31 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data) {
+    int64_t inicio = latency_enter(event_latency);
+
     ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%d", base, event_id);
     mqtt_event_handler_cb(event_data);
+    latency_exit(event_latency, inicio);
 }
 
 
 void mqtt_app_start(void)
 {
     esp_mqtt_client_config_t mqtt_cfg = {
-        //.uri = BROKER_URI, //BROKER_URL
         .uri =  "mqtt://broker.hivemq.com",
         //.cert_pem = (const char *)mqtt_eclipse_org_pem_start,
     };
 
+    event_latency = latency_path("mqtt_event");
     client = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
     esp_mqtt_client_start(client);
 }
 
 
-void enviar_al_broker(const char *topic, char *data, int len, int qos, int retain){
-    esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+int enviar_al_broker(const char *topic, const char *data, int len, int qos, int retain){
+    if (client == NULL)
+        return -1;
+    return esp_mqtt_client_publish(client, topic, data, len, qos, retain);
 }
     
\ No newline at end of file
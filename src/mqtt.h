@@ -1,4 +1,9 @@
-#include "mqtt_client.h"
-#include "esp_log.h"
+#pragma once
 
-#define BROKER_URI CONFIG_BROKER_URL
\ No newline at end of file
+/**
+ * @brief   Publishes `len` bytes of `data` on `topic` (the whole string when
+ *          `len` is 0), from the caller's task
+ *
+ * @return  the message id, 0 for QoS 0, -1 without a client or on error
+ */
+int enviar_al_broker(const char *topic, const char *data, int len, int qos, int retain);
@@ -0,0 +1,165 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "mqtt_cmd.h"
+
+/* The topics form a small trie: the node prefix, then optionally a sensor,
+ * then the parameter. Each level is a table compared by length first, so a
+ * topic costs a few memcmp at most and nothing is scanned twice */
+
+#define NODE_PREFIX     "/ciu/lopy4/"
+#define LITERAL(s)      s, sizeof(s) - 1
+
+extern const int IRRADIATION_ADC_INDEX;
+extern const int BATTERY_ADC_INDEX;
+
+struct sensor {
+    const char *name;
+    int len;
+    const int *adc;
+};
+
+struct parameter {
+    const char *name;
+    int len;
+    enum mqtt_cmd_kind kind;
+    bool per_sensor;
+    int min, max;       // accepted values; min > max when the payload is not a number
+};
+
+static const struct sensor sensors[] = {
+    { LITERAL("irradiation/1/"), &IRRADIATION_ADC_INDEX },
+    { LITERAL("battery_level/1/"), &BATTERY_ADC_INDEX },
+};
+
+static const struct parameter parameters[] = {
+    { LITERAL("sample_frequency"), MQTT_CMD_SAMPLE_FREQUENCY, true, 1, 86400 },
+    { LITERAL("send_frequency"), MQTT_CMD_SEND_FREQUENCY, true, 1, 86400 },
+    { LITERAL("sample_number"), MQTT_CMD_SAMPLE_NUMBER, true, 1, 1000 },
+    { LITERAL("backfill"), MQTT_CMD_BACKFILL, true, 1, 0 },
+    { LITERAL("log_level"), MQTT_CMD_LOG_LEVEL, false, 1, 0 },
+};
+
+// chunks of the message being reassembled; total 0 when there is none
+static struct {
+    char topic[MQTT_CMD_MAX_TOPIC];
+    char data[MQTT_CMD_MAX_DATA];
+    int topic_len, received, total;
+} pending;
+static struct mqtt_message message;
+
+
+const struct mqtt_message *mqtt_cmd_feed(const char *topic, int topic_len, const char *data, int data_len,
+                                         int offset, int total_len) {
+    if (offset == 0) {
+        if (data_len == total_len) {
+            pending.total = 0;
+            message = (struct mqtt_message){ topic, topic_len, data, data_len };
+            return &message;
+        }
+        // a new message drops whatever was left of the previous one
+        pending.total = 0;
+        if (topic_len <= 0 || topic_len > MQTT_CMD_MAX_TOPIC || total_len > MQTT_CMD_MAX_DATA)
+            return NULL;
+        memcpy(pending.topic, topic, topic_len);
+        pending.topic_len = topic_len;
+        pending.received = 0;
+        pending.total = total_len;
+    }
+
+    if (pending.total == 0 || offset != pending.received || total_len != pending.total || data_len < 0
+            || data_len > pending.total - offset) {
+        pending.total = 0;
+        return NULL;
+    }
+    memcpy(pending.data + offset, data, data_len);
+    pending.received += data_len;
+    if (pending.received < pending.total)
+        return NULL;
+
+    message = (struct mqtt_message){ pending.topic, pending.topic_len, pending.data, pending.total };
+    pending.total = 0;
+    return &message;
+}
+
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+int mqtt_cmd_parse_uint(const char *s, int len, uint32_t min, uint32_t max, uint32_t *value) {
+    const char *end = s + (len > 0 ? len : 0);
+    uint32_t v = 0;
+
+    while (s < end && is_space(*s))
+        s++;
+    while (end > s && is_space(end[-1]))
+        end--;
+    if (s == end)
+        return 1;
+
+    for (; s < end; s++) {
+        if (*s < '0' || *s > '9')
+            return 1;
+        uint32_t digit = *s - '0';
+        if (v > max / 10 || digit > max - v * 10)
+            return 1;
+        v = v * 10 + digit;
+    }
+    if (v < min)
+        return 1;
+    *value = v;
+    return 0;
+}
+
+
+int mqtt_cmd_parse(const struct mqtt_message *msg, struct mqtt_cmd *cmd) {
+    const char *p = msg->topic, *end = msg->topic + msg->topic_len;
+    const struct sensor *sensor = NULL;
+    const struct parameter *parameter = NULL;
+
+    if (msg->topic_len < (int)sizeof(NODE_PREFIX) - 1 || memcmp(p, LITERAL(NODE_PREFIX)) != 0)
+        return 1;
+    p += sizeof(NODE_PREFIX) - 1;
+
+    for (size_t i = 0; i < sizeof(sensors) / sizeof(sensors[0]); i++) {
+        if (end - p > sensors[i].len && memcmp(p, sensors[i].name, sensors[i].len) == 0) {
+            sensor = &sensors[i];
+            p += sensor->len;
+            break;
+        }
+    }
+    for (size_t i = 0; i < sizeof(parameters) / sizeof(parameters[0]); i++) {
+        if (end - p == parameters[i].len && memcmp(p, parameters[i].name, parameters[i].len) == 0) {
+            parameter = &parameters[i];
+            break;
+        }
+    }
+    if (parameter == NULL || parameter->per_sensor != (sensor != NULL))
+        return 1;
+
+    cmd->kind = parameter->kind;
+    cmd->adc = sensor ? *sensor->adc : -1;
+    cmd->value = 0;
+    if (parameter->min <= parameter->max) {
+        uint32_t value;
+        if (mqtt_cmd_parse_uint(msg->data, msg->data_len, parameter->min, parameter->max, &value))
+            return 2;
+        cmd->value = value;
+    }
+    return 0;
+}
+
+
+const char *mqtt_cmd_name(enum mqtt_cmd_kind kind) {
+    switch (kind) {
+        case MQTT_CMD_LOG_LEVEL: return "log_level";
+        case MQTT_CMD_BACKFILL: return "backfill";
+        case MQTT_CMD_SAMPLE_FREQUENCY: return "sample_frequency";
+        case MQTT_CMD_SEND_FREQUENCY: return "send_frequency";
+        case MQTT_CMD_SAMPLE_NUMBER: return "sample_number";
+    }
+    return "?";
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Configuration messages from the broker, told apart by their topic
+ * (/ciu/lopy4/[<sensor>/1/]<parameter>). No ESP-IDF dependencies, so the
+ * parser also runs on the host, see bench.c and sim/fuzz_mqtt_cmd.c */
+
+enum mqtt_cmd_kind {
+    MQTT_CMD_LOG_LEVEL,
+    MQTT_CMD_BACKFILL,
+    MQTT_CMD_SAMPLE_FREQUENCY,
+    MQTT_CMD_SEND_FREQUENCY,
+    MQTT_CMD_SAMPLE_NUMBER,
+};
+
+struct mqtt_cmd {
+    enum mqtt_cmd_kind kind;
+    int adc;    // ADC index, -1 for log_level
+    int value;  // integer payload, for the frequencies and sample number
+};
+
+// largest reassembled message, all the commands fit with room to spare
+#define MQTT_CMD_MAX_TOPIC  64
+#define MQTT_CMD_MAX_DATA   64
+
+// a whole message; neither topic nor data are NUL terminated
+struct mqtt_message {
+    const char *topic;
+    int topic_len;
+    const char *data;
+    int data_len;
+};
+
+/**
+ * @brief   Gathers the chunks of a message larger than the MQTT client buffer
+ *
+ * Takes the fields of one MQTT_EVENT_DATA event. Only the first chunk has the
+ * topic; the rest come with topic_len 0. Messages in a single chunk are not
+ * copied.
+ *
+ * @return  The message once its last chunk is in, NULL until then or if it
+ *          does not fit (MQTT_CMD_MAX_TOPIC, MQTT_CMD_MAX_DATA) or a chunk
+ *          is missing
+ */
+const struct mqtt_message *mqtt_cmd_feed(const char *topic, int topic_len, const char *data, int data_len,
+                                         int offset, int total_len);
+
+/**
+ * @brief   Classifies a message and parses its value when it is a number
+ *
+ * @return  0 if it is a known command, 1 for an unknown topic, 2 if the value
+ *          is not a decimal number in the range of the parameter
+ */
+int mqtt_cmd_parse(const struct mqtt_message *msg, struct mqtt_cmd *cmd);
+
+/**
+ * @brief   Decimal digits only, blanks around them allowed: no sign, no
+ *          base prefix, nothing past `len`
+ *
+ * @return  0 if the number is in [min, max]
+ */
+int mqtt_cmd_parse_uint(const char *s, int len, uint32_t min, uint32_t max, uint32_t *value);
+
+const char *mqtt_cmd_name(enum mqtt_cmd_kind kind);
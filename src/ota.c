@@ -0,0 +1,416 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "esp_image_format.h"
+#include "esp_spi_flash.h"
+#include "esp32/rom/miniz.h"
+#include "sdkconfig.h"
+
+#include "ota.h"
+#include "ota_delta.h"
+#include "mqtt.h"
+
+/* Runs in the MQTT client task, one chunk at a time: the server only sends
+ * the next chunk after the "next" status, so nothing queues up. RAM while
+ * an update is in progress is the inflate state of the ROM miniz (~11 KB)
+ * plus a 2^window_bits circular window, both freed at the end; the base
+ * image is read back from its partition as the delta refers to it. The
+ * slot is erased sector by sector ahead of the writes, so no chunk holds
+ * the client for longer than the few sectors its output spans.
+ *
+ * The digests in the header only say which image the delta goes from and
+ * to; anyone who can publish on the topics can forge them. What makes an
+ * image bootable is its signature, checked against the key built into the
+ * running one before the slot is switched. */
+
+#ifdef CONFIG_OTA
+
+#ifndef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+#error "CONFIG_OTA needs CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE, or a bad image would stay"
+#endif
+
+#ifndef CONFIG_SECURE_SIGNED_ON_UPDATE
+#error "CONFIG_OTA needs signed images (CONFIG_SECURE_SIGNED_ON_UPDATE_NO_SECURE_BOOT), or anyone on the broker could flash the node"
+#endif
+
+static const char *TAG = "ota";
+extern void tsdb_flush(void);
+extern void log_ring_flush(void);
+
+#define HEADER_MAGIC        "SIDL"
+#define HEADER_VERSION      1
+#define HEADER_SIZE         80
+#define CHUNK_HEADER        4
+#define DIGEST_SIZE         32
+#define IDLE_US             (300 * 1000000LL)   // an update stalled this long no longer holds deep sleep off
+#define RESTART_DELAY_US    (2 * 1000000LL)     // for the "done" status to go out
+
+struct header {
+    uint8_t window_bits;
+    uint32_t image_size, stream_size;
+    uint8_t base_digest[DIGEST_SIZE], image_digest[DIGEST_SIZE];
+};
+
+static struct {
+    volatile bool active;
+    struct header header;
+    const esp_partition_t *base, *target;
+    esp_ota_handle_t handle;
+    uint32_t erased;            // bytes of the slot ready to be written
+    uint32_t received;          // bytes of the deflated stream applied
+    volatile int64_t last_us;
+    tinfl_decompressor *inflate;
+    uint8_t *window;
+    size_t window_pos;
+    struct ota_delta delta;
+    int status;                 // last from ota_delta_feed
+} update;
+
+// the MQTT message being delivered in pieces
+static enum { MESSAGE_OTHER, MESSAGE_CHUNK, MESSAGE_SKIP } message;
+
+static volatile bool on_trial;
+static bool confirmed, reported;
+static esp_timer_handle_t trial_timer, restart_timer;
+
+
+static void report(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void report(const char *format, ...) {
+    char status[80];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(status, sizeof(status), format, args);
+    va_end(args);
+    if (len >= (int)sizeof(status))
+        len = sizeof(status) - 1;
+    if (enviar_al_broker(OTA_TOPIC_STATUS, status, len, 1, 0) < 0)
+        ESP_LOGW(TAG, "Status not sent: %s", status);
+}
+
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+static void release(void) {
+    if (update.handle) {
+        esp_ota_end(update.handle);     // frees the handle; the half written image is never booted
+        update.handle = 0;
+    }
+    free(update.inflate);
+    free(update.window);
+    update.inflate = NULL;
+    update.window = NULL;
+    update.active = false;
+}
+
+
+static void fail(const char *reason) {
+    ESP_LOGE(TAG, "Update dropped at %u bytes: %s", update.received, reason);
+    release();
+    report("error %s", reason);
+}
+
+
+static int read_base(uint32_t offset, void *buf, size_t len, void *arg) {
+    return esp_partition_read(update.base, offset, buf, len) != ESP_OK;
+}
+
+
+static int write_image(const void *buf, size_t len, void *arg) {
+    // ota_delta counts the bytes once they are written
+    while (update.erased < update.delta.written + len) {
+        if (esp_partition_erase_range(update.target, update.erased, SPI_FLASH_SEC_SIZE) != ESP_OK)
+            return 1;
+        update.erased += SPI_FLASH_SEC_SIZE;
+    }
+    return esp_ota_write(update.handle, buf, len) != ESP_OK;
+}
+
+
+/* Image format, SHA-256 and signature, all from the slot */
+static int check_image(const esp_partition_t *partition) {
+    const esp_partition_pos_t pos = { .offset = partition->address, .size = partition->size };
+    esp_image_metadata_t metadata;
+
+    return esp_image_verify(ESP_IMAGE_VERIFY, &pos, &metadata) != ESP_OK;
+}
+
+
+static int parse_header(const uint8_t *p, int len, struct header *h) {
+    if (len != HEADER_SIZE || memcmp(p, HEADER_MAGIC, 4) != 0 || p[4] != HEADER_VERSION)
+        return 1;
+    h->window_bits = p[5];
+    h->image_size = get_le32(p + 8);
+    h->stream_size = get_le32(p + 12);
+    memcpy(h->base_digest, p + 16, DIGEST_SIZE);
+    memcpy(h->image_digest, p + 16 + DIGEST_SIZE, DIGEST_SIZE);
+    return h->image_size == 0 || h->stream_size == 0;
+}
+
+
+static void begin(const char *data, int len) {
+    struct header h;
+    uint8_t digest[DIGEST_SIZE];
+    const esp_partition_t *base = esp_ota_get_running_partition();
+
+    memset(&h, 0, sizeof(h));   // compared whole to spot a resume
+
+    if (data == NULL || parse_header((const uint8_t *)data, len, &h)) {
+        report("error header");
+        return;
+    }
+    if (update.active && memcmp(&h, &update.header, sizeof(h)) == 0) {
+        ESP_LOGI(TAG, "Update resumed at %u of %u bytes", update.received, h.stream_size);
+        update.last_us = esp_timer_get_time();
+        report("next %u", update.received);
+        return;
+    }
+    if (update.active)
+        fail("replaced");
+
+    if (h.window_bits < 9 || h.window_bits > CONFIG_OTA_WINDOW_BITS) {
+        report("error window");
+        return;
+    }
+    if (esp_partition_get_sha256(base, digest) != ESP_OK || memcmp(digest, h.base_digest, DIGEST_SIZE) != 0) {
+        report("error base");
+        return;
+    }
+    update.target = esp_ota_get_next_update_partition(NULL);
+    if (update.target == NULL || h.image_size > update.target->size) {
+        report("error size");
+        return;
+    }
+
+    update.header = h;
+    update.base = base;
+    update.inflate = malloc(sizeof(tinfl_decompressor));
+    update.window = malloc((size_t)1 << h.window_bits);
+    if (update.inflate == NULL || update.window == NULL) {
+        fail("memory");
+        return;
+    }
+    // erases the first sector only, write_image the rest as the image grows
+    if (esp_ota_begin(update.target, SPI_FLASH_SEC_SIZE, &update.handle) != ESP_OK) {
+        update.handle = 0;
+        fail("begin");
+        return;
+    }
+    update.erased = SPI_FLASH_SEC_SIZE;
+    tinfl_init(update.inflate);
+    update.window_pos = 0;
+    update.delta = (struct ota_delta){
+        .read_base = read_base,
+        .write = write_image,
+        .base_size = base->size,
+        .image_size = h.image_size,
+    };
+    ota_delta_init(&update.delta);
+    update.status = OTA_DELTA_OK;
+    update.received = 0;
+    update.last_us = esp_timer_get_time();
+    update.active = true;
+
+    ESP_LOGI(TAG, "Update of %u bytes from %u into %s", h.image_size, h.stream_size, update.target->label);
+    report("next 0");
+}
+
+
+/* Inflates a piece of the stream into the window and applies what comes out */
+static int apply(const uint8_t *data, size_t len) {
+    size_t window_size = (size_t)1 << update.header.window_bits;
+    bool last = update.received + len == update.header.stream_size;
+
+    update.received += len;
+    for (;;) {
+        size_t in = len, out = window_size - update.window_pos;
+        tinfl_status status = tinfl_decompress(update.inflate, data, &in, update.window,
+                                               update.window + update.window_pos, &out,
+                                               last ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+        data += in;
+        len -= in;
+        if (out > 0) {
+            update.status = ota_delta_feed(&update.delta, update.window + update.window_pos, out);
+            if (update.status > OTA_DELTA_DONE) {
+                fail(ota_delta_status_name(update.status));
+                return 1;
+            }
+        }
+        update.window_pos = (update.window_pos + out) & (window_size - 1);
+
+        if (status < TINFL_STATUS_DONE) {
+            fail("inflate");
+            return 1;
+        }
+        if (status == TINFL_STATUS_DONE || (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0))
+            return 0;
+    }
+}
+
+
+static void restart_callback(void *arg) {
+#ifdef CONFIG_TSDB
+    tsdb_flush();
+#endif
+#ifdef CONFIG_LOG_RING
+    log_ring_flush();
+#endif
+    esp_restart();
+}
+
+
+static void finish(void) {
+    uint8_t digest[DIGEST_SIZE];
+    esp_ota_handle_t handle = update.handle;
+
+    if (update.status != OTA_DELTA_DONE || update.delta.written != update.header.image_size) {
+        fail("short");
+        return;
+    }
+    // checks the image, its checksum and appended digest
+    update.handle = 0;
+    if (esp_ota_end(handle) != ESP_OK) {
+        fail("image");
+        return;
+    }
+    if (esp_partition_get_sha256(update.target, digest) != ESP_OK
+            || memcmp(digest, update.header.image_digest, DIGEST_SIZE) != 0) {
+        fail("digest");
+        return;
+    }
+    // the only check an attacker on the broker cannot pass
+    if (check_image(update.target)) {
+        fail("signature");
+        return;
+    }
+    if (esp_ota_set_boot_partition(update.target) != ESP_OK) {
+        fail("boot");
+        return;
+    }
+    ESP_LOGW(TAG, "Update written to %s, restarting", update.target->label);
+    release();
+    report("done");
+
+    const esp_timer_create_args_t args = { .callback = restart_callback, .name = "ota_restart" };
+    if (esp_timer_create(&args, &restart_timer) != ESP_OK || esp_timer_start_once(restart_timer, RESTART_DELAY_US) != ESP_OK)
+        restart_callback(NULL);
+}
+
+
+static bool is_topic(const char *topic, int topic_len, const char *name) {
+    return topic_len == (int)strlen(name) && memcmp(topic, name, topic_len) == 0;
+}
+
+
+int ota_mqtt_data(const char *topic, int topic_len, const char *data, int data_len, int offset, int total_len) {
+    bool end = offset + data_len == total_len;
+
+    if (offset == 0) {
+        message = MESSAGE_OTHER;
+        if (is_topic(topic, topic_len, OTA_TOPIC_BEGIN)) {
+            // the header always fits the client buffer
+            begin(data_len == total_len ? data : NULL, data_len);
+            return 1;
+        }
+        if (!is_topic(topic, topic_len, OTA_TOPIC_CHUNK))
+            return 0;
+
+        message = MESSAGE_SKIP;
+        if (update.active && data_len >= CHUNK_HEADER
+                && get_le32((const uint8_t *)data) == update.received
+                && (uint32_t)(total_len - CHUNK_HEADER) <= update.header.stream_size - update.received) {
+            message = MESSAGE_CHUNK;
+            data += CHUNK_HEADER;
+            data_len -= CHUNK_HEADER;
+        }
+    } else if (message == MESSAGE_OTHER) {
+        return 0;
+    }
+
+    if (message == MESSAGE_CHUNK) {
+        update.last_us = esp_timer_get_time();
+        if (data_len > 0 && apply((const uint8_t *)data, data_len))
+            message = MESSAGE_SKIP;
+    }
+    if (!end || !update.active)
+        return 1;
+
+    // duplicates and gaps get the offset the node is waiting for
+    if (message == MESSAGE_CHUNK && update.received == update.header.stream_size)
+        finish();
+    else
+        report("next %u", update.received);
+    return 1;
+}
+
+
+static void trial_timeout(void *arg) {
+    ESP_LOGE(TAG, "No broker within %d s of the first boot of this image, rolling back", CONFIG_OTA_CONFIRM_TIMEOUT_S);
+#ifdef CONFIG_TSDB
+    tsdb_flush();
+#endif
+#ifdef CONFIG_LOG_RING
+    log_ring_flush();
+#endif
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+}
+
+
+int ota_setup(void) {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_ota_img_states_t state;
+
+    if (esp_ota_get_state_partition(running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY)
+        return 0;
+
+    const esp_timer_create_args_t args = { .callback = trial_timeout, .name = "ota_trial" };
+    if (esp_timer_create(&args, &trial_timer) != ESP_OK
+            || esp_timer_start_once(trial_timer, CONFIG_OTA_CONFIRM_TIMEOUT_S * 1000000LL) != ESP_OK)
+        return 1;
+    on_trial = true;
+    ESP_LOGW(TAG, "First boot of the image in %s, rolled back unless the broker is reached within %d s",
+             running->label, CONFIG_OTA_CONFIRM_TIMEOUT_S);
+    return 0;
+}
+
+
+void ota_connected(void) {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    uint8_t digest[DIGEST_SIZE];
+
+    if (on_trial) {
+        esp_timer_stop(trial_timer);
+        if (esp_ota_mark_app_valid_cancel_rollback() == ESP_OK) {
+            on_trial = false;
+            confirmed = true;
+            ESP_LOGW(TAG, "Image in %s confirmed", running->label);
+        } else {
+            ESP_LOGE(TAG, "Image in %s could not be confirmed", running->label);
+        }
+    }
+    if (reported)
+        return;
+    reported = true;
+
+    if (esp_partition_get_sha256(running, digest) != ESP_OK)
+        memset(digest, 0, sizeof(digest));
+    report("running %02x%02x%02x%02x%02x%02x%02x%02x %s%s", digest[0], digest[1], digest[2], digest[3],
+           digest[4], digest[5], digest[6], digest[7], esp_ota_get_app_description()->version,
+           confirmed ? " confirmed" : esp_ota_get_last_invalid_partition() != NULL ? " rolled_back" : "");
+}
+
+
+bool ota_busy(void) {
+    return on_trial || (update.active && esp_timer_get_time() - update.last_us < IDLE_US);
+}
+
+#endif
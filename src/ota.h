@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Firmware updates over the MQTT session, as deltas against the running
+ * image (ota_delta.h) written to the other OTA slot. The server publishes
+ * the 80 byte header of a tools/ota_delta.py file on OTA_TOPIC_BEGIN, then
+ * the deflated stream in chunks on OTA_TOPIC_CHUNK, each one prefixed with
+ * its offset in the stream (4 bytes, little endian), and waits for
+ *   next <offset>      send the chunk at offset (also after a duplicate or a gap)
+ *   done               image checked and set for the next boot, restarting
+ *   error <reason>     update dropped
+ * on OTA_TOPIC_STATUS. A begin with the header of the update in progress
+ * resumes it. The new image reports "running <digest> <version> confirmed"
+ * once it reaches the broker; if it does not within
+ * CONFIG_OTA_CONFIRM_TIMEOUT_S, or resets first, the bootloader goes back
+ * to the previous one. tools/ota_push.py plays the server. */
+
+#define OTA_TOPIC_BEGIN     "/ciu/lopy4/ota/begin"
+#define OTA_TOPIC_CHUNK     "/ciu/lopy4/ota/chunk"
+#define OTA_TOPIC_STATUS    "/ciu/lopy4/ota/status"
+
+/**
+ * @brief   At boot: arms the rollback timer if this image is on trial
+ *
+ * @return  0 on success
+ */
+int ota_setup(void);
+
+/**
+ * @brief   On every broker connection: confirms an image on trial and, once
+ *          per boot, reports the running image
+ */
+void ota_connected(void);
+
+/**
+ * @brief   Takes the fields of one MQTT_EVENT_DATA event
+ *
+ * Chunks are applied piece by piece as the client delivers them, never
+ * reassembled.
+ *
+ * @return  1 if the event belonged to an update, 0 to pass it on
+ */
+int ota_mqtt_data(const char *topic, int topic_len, const char *data, int data_len, int offset, int total_len);
+
+/**
+ * @brief   An update is coming in or the running image is on trial: a deep
+ *          sleep now would lose it
+ */
+bool ota_busy(void);
@@ -0,0 +1,149 @@
+#include "ota_delta.h"
+
+enum { OP_END, OP_COPY, OP_ADD, OP_INSERT, OP_SEEK };
+enum { STATE_OP, STATE_VALUE, STATE_PAYLOAD, STATE_END };
+
+
+void ota_delta_init(struct ota_delta *d) {
+    d->state = STATE_OP;
+    d->remaining = 0;
+    d->cursor = 0;
+    d->written = 0;
+}
+
+
+static int in_base(const struct ota_delta *d, uint32_t len) {
+    return len <= d->base_size && d->cursor <= d->base_size - len;
+}
+
+
+static int emit(struct ota_delta *d, const uint8_t *buf, size_t len) {
+    if (len > d->image_size - d->written)
+        return OTA_DELTA_BAD_RANGE;
+    if (d->write(buf, len, d->arg))
+        return OTA_DELTA_IO;
+    d->written += len;
+    return OTA_DELTA_OK;
+}
+
+
+/* COPY with diff NULL, ADD otherwise */
+static int from_base(struct ota_delta *d, const uint8_t *diff, uint32_t len) {
+    uint8_t buf[OTA_DELTA_BUFFER];
+
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+
+        if (d->read_base(d->cursor, buf, n, d->arg))
+            return OTA_DELTA_IO;
+        if (diff != NULL) {
+            for (size_t i = 0; i < n; i++)
+                buf[i] += diff[i];
+            diff += n;
+        }
+        int status = emit(d, buf, n);
+        if (status)
+            return status;
+        d->cursor += n;
+        len -= n;
+    }
+    return OTA_DELTA_OK;
+}
+
+
+/* An operation with its value read */
+static int run(struct ota_delta *d) {
+    int64_t cursor;
+
+    switch (d->op) {
+        case OP_COPY:
+            if (!in_base(d, d->value))
+                return OTA_DELTA_BAD_RANGE;
+            return from_base(d, NULL, d->value);
+        case OP_SEEK:
+            cursor = (int64_t)d->cursor + ((int32_t)(d->value >> 1) ^ -(int32_t)(d->value & 1));
+            if (cursor < 0 || cursor > d->base_size)
+                return OTA_DELTA_BAD_RANGE;
+            d->cursor = (uint32_t)cursor;
+            return OTA_DELTA_OK;
+        case OP_ADD:
+            if (!in_base(d, d->value))
+                return OTA_DELTA_BAD_RANGE;
+            // fall through
+        case OP_INSERT:
+            d->remaining = d->value;
+            if (d->remaining > 0)
+                d->state = STATE_PAYLOAD;
+            return OTA_DELTA_OK;
+    }
+    return OTA_DELTA_BAD_OP;
+}
+
+
+int ota_delta_feed(struct ota_delta *d, const uint8_t *data, size_t len) {
+    const uint8_t *end = data + len;
+    int status;
+
+    while (data < end) {
+        switch (d->state) {
+            case STATE_OP:
+                d->op = *data++;
+                if (d->op == OP_END) {
+                    d->state = STATE_END;
+                    break;
+                }
+                if (d->op > OP_SEEK)
+                    return OTA_DELTA_BAD_OP;
+                d->value = 0;
+                d->shift = 0;
+                d->state = STATE_VALUE;
+                break;
+
+            case STATE_VALUE: {
+                uint8_t byte = *data++;
+
+                // 32 bits at most
+                if (d->shift == 28 && (byte & 0xf0))
+                    return OTA_DELTA_BAD_OP;
+                d->value |= (uint32_t)(byte & 0x7f) << d->shift;
+                d->shift += 7;
+                if (byte & 0x80)
+                    break;
+                d->state = STATE_OP;
+                status = run(d);
+                if (status)
+                    return status;
+                break;
+            }
+
+            case STATE_PAYLOAD: {
+                uint32_t n = (uint32_t)(end - data) < d->remaining ? (uint32_t)(end - data) : d->remaining;
+
+                status = d->op == OP_ADD ? from_base(d, data, n) : emit(d, data, n);
+                if (status)
+                    return status;
+                data += n;
+                d->remaining -= n;
+                if (d->remaining == 0)
+                    d->state = STATE_OP;
+                break;
+            }
+
+            default:
+                return OTA_DELTA_BAD_OP;
+        }
+    }
+    return d->state == STATE_END ? OTA_DELTA_DONE : OTA_DELTA_OK;
+}
+
+
+const char *ota_delta_status_name(int status) {
+    switch (status) {
+        case OTA_DELTA_OK: return "ok";
+        case OTA_DELTA_DONE: return "done";
+        case OTA_DELTA_BAD_OP: return "bad_op";
+        case OTA_DELTA_BAD_RANGE: return "bad_range";
+        case OTA_DELTA_IO: return "io";
+    }
+    return "?";
+}
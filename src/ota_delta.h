@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary delta against the running image, applied as it streams in. Once
+ * inflated, an update is a list of operations on a cursor into the base
+ * (running) image, lengths as LEB128 varints:
+ *   0x01 COPY   len         len base bytes from the cursor, cursor += len
+ *   0x02 ADD    len bytes   base bytes from the cursor plus `bytes` (mod 256), cursor += len
+ *   0x03 INSERT len bytes   new bytes, cursor unchanged
+ *   0x04 SEEK   delta       cursor += delta (zigzag encoded)
+ *   0x00 END
+ * ADD carries code that moved with its relocated addresses, mostly zeros
+ * that the deflate layer squeezes away. tools/ota_delta.py builds the
+ * stream. No ESP-IDF dependencies; besides this struct the only RAM is an
+ * OTA_DELTA_BUFFER bytes buffer on the stack. */
+
+#define OTA_DELTA_BUFFER    256
+
+enum ota_delta_status {
+    OTA_DELTA_OK,           // everything fed was applied, more is expected
+    OTA_DELTA_DONE,         // END reached
+    OTA_DELTA_BAD_OP,       // unknown operation or data after END
+    OTA_DELTA_BAD_RANGE,    // outside the base image or past the new image size
+    OTA_DELTA_IO,           // read_base or write failed
+};
+
+struct ota_delta {
+    // non-zero returns abort the update
+    int (*read_base)(uint32_t offset, void *buf, size_t len, void *arg);
+    int (*write)(const void *buf, size_t len, void *arg);
+    void *arg;
+    uint32_t base_size;
+    uint32_t image_size;
+
+    uint8_t state, op, shift;
+    uint32_t value;         // varint being read
+    uint32_t remaining;     // bytes left of an ADD or INSERT
+    uint32_t cursor, written;
+};
+
+/**
+ * @brief   Ready for a new stream; callbacks and sizes are set by the caller
+ */
+void ota_delta_init(struct ota_delta *delta);
+
+/**
+ * @brief   Applies the next inflated bytes, in pieces of any size
+ *
+ * @return  enum ota_delta_status; after an error the stream is lost
+ */
+int ota_delta_feed(struct ota_delta *delta, const uint8_t *data, size_t len);
+
+const char *ota_delta_status_name(int status);
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "sdkconfig.h"
+
+#include "pm_policy.h"
+
+/* PM locks per activity. ESP-IDF has no lock that pins the lowest frequency:
+ * APB_MIN is simply what DFS runs at when nobody holds a frequency lock. The
+ * ADC burst therefore only keeps light sleep away (it is busy-waiting on the
+ * SAR anyway) and leaves the frequency down, while encoding, publishing and
+ * the TLS handshake hold CPU_MAX so they end sooner and the node gets back
+ * to sleep. Wi-Fi still holds its own APB_MAX lock while it is awake */
+
+static const char *TAG = "pm_policy";
+
+#define NO_LOCK (-1)
+
+#if defined(CONFIG_PM_POLICY_SPLIT)
+static const int lock_types[PM_N_ACTIVITIES] = {
+    [PM_ACTIVITY_ADC_BURST] = ESP_PM_NO_LIGHT_SLEEP,
+    [PM_ACTIVITY_PUBLISH] = ESP_PM_CPU_FREQ_MAX,
+    [PM_ACTIVITY_HANDSHAKE] = ESP_PM_CPU_FREQ_MAX,
+};
+#define POLICY_NAME "split"
+#elif defined(CONFIG_PM_POLICY_BOOST)
+static const int lock_types[PM_N_ACTIVITIES] = {
+    [PM_ACTIVITY_ADC_BURST] = ESP_PM_CPU_FREQ_MAX,
+    [PM_ACTIVITY_PUBLISH] = ESP_PM_CPU_FREQ_MAX,
+    [PM_ACTIVITY_HANDSHAKE] = ESP_PM_CPU_FREQ_MAX,
+};
+#define POLICY_NAME "boost"
+#else
+static const int lock_types[PM_N_ACTIVITIES] = {
+    [PM_ACTIVITY_ADC_BURST] = NO_LOCK,
+    [PM_ACTIVITY_PUBLISH] = NO_LOCK,
+    [PM_ACTIVITY_HANDSHAKE] = NO_LOCK,
+};
+#define POLICY_NAME "dfs"
+#endif
+
+static const char *lock_names[PM_N_ACTIVITIES] = {
+    [PM_ACTIVITY_ADC_BURST] = "adc_burst",
+    [PM_ACTIVITY_PUBLISH] = "publish",
+    [PM_ACTIVITY_HANDSHAKE] = "handshake",
+};
+
+static esp_pm_lock_handle_t locks[PM_N_ACTIVITIES];
+
+
+int pm_policy_setup(void) {
+    for (int i = 0; i < PM_N_ACTIVITIES; i++) {
+        if (lock_types[i] == NO_LOCK || locks[i] != NULL)
+            continue;
+        if (esp_pm_lock_create(lock_types[i], 0, lock_names[i], &locks[i]) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed creating the %s lock", lock_names[i]);
+            return 1;
+        }
+    }
+    ESP_LOGI(TAG, "PM lock policy: %s", POLICY_NAME);
+    return 0;
+}
+
+
+void pm_policy_acquire(enum pm_activity activity) {
+    if (locks[activity] != NULL)
+        esp_pm_lock_acquire(locks[activity]);
+}
+
+
+void pm_policy_release(enum pm_activity activity) {
+    if (locks[activity] != NULL)
+        esp_pm_lock_release(locks[activity]);
+}
+
+
+const char *pm_policy_name(void) {
+    return POLICY_NAME;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+/* What the node is doing, each mapped to a PM lock by the build profile
+ * (CONFIG_PM_POLICY_*). Outside of these no lock is held and DFS and
+ * light sleep are free to act */
+enum pm_activity {
+    PM_ACTIVITY_ADC_BURST,      // power up, n_samples conversions, power down
+    PM_ACTIVITY_PUBLISH,        // encoding a payload and handing it to the client
+    PM_ACTIVITY_HANDSHAKE,      // TCP/TLS and MQTT connection to the broker
+    PM_N_ACTIVITIES
+};
+
+/**
+ * @brief   Creates the locks of the selected profile. Call after esp_pm_configure
+ *
+ * @return 0 on success
+ */
+int pm_policy_setup(void);
+
+/**
+ * @brief   Takes the lock of the activity. Calls nest; no-op before setup
+ */
+void pm_policy_acquire(enum pm_activity activity);
+
+/**
+ * @brief   Releases the lock taken by pm_policy_acquire
+ */
+void pm_policy_release(enum pm_activity activity);
+
+/**
+ * @brief   Name of the build profile, reported with the energy figures
+ */
+const char *pm_policy_name(void);
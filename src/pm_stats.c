@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_event.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+#include "pm_stats.h"
+#include "pm_policy.h"
+#include "wake_sched.h"
+#include "mqtt.h"
+
+/* Power state residency and energy estimate. Every
+ * CONFIG_ENERGY_REPORT_PERIOD_S the node publishes a report on the
+ * diagnostics topic, tagged with the PM lock policy of the build. It holds
+ * the residency of the period, its energy, the energy per published record
+ * and the energy per day.
+ *
+ * The time per PM mode needs the IDF profiling counters
+ * (CONFIG_PM_PROFILING). Without them the report has no light sleep: all
+ * the time goes to APB_MAX and is charged at its current, so the energy is
+ * an upper bound. Wi-Fi and power pin times are kept either way.
+ *
+ * A day runs from wake-up to wake-up: the night before plus the awake
+ * time. The wake-ups of the channel timers (wake_sched.h) go along with the
+ * sleep residency they break. */
+
+static const char *TAG = "pm_stats";
+
+#define TOPIC_ENERGY    "/ciu/lopy4/diagnostics/energy"
+#define ENERGY_MAGIC    0x454e5247 // "ENRG"
+
+static const char *mode_names[PM_N_MODES] = {
+    [PM_MODE_LIGHT_SLEEP] = "SLEEP",
+    [PM_MODE_APB_MIN] = "APB_MIN",
+    [PM_MODE_APB_MAX] = "APB_MAX",
+    [PM_MODE_CPU_MAX] = "CPU_MAX",
+};
+
+static const char *mode_keys[PM_N_MODES] = {
+    [PM_MODE_LIGHT_SLEEP] = "sleep",
+    [PM_MODE_APB_MIN] = "apb_min",
+    [PM_MODE_APB_MAX] = "apb_max",
+    [PM_MODE_CPU_MAX] = "cpu_max",
+};
+
+/* Energy of the last night and of the last whole day, kept across deep sleep */
+struct day_energy {
+    uint32_t magic;
+    int64_t night_uj;
+    int64_t last_day_uj;
+};
+
+RTC_DATA_ATTR static struct day_energy day_energy;
+
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+static int64_t wifi_since, wifi_total;
+static int64_t power_pin_since, power_pin_total;
+static int wifi_users; // STA and AP count separately
+
+static struct current_model model;
+static struct residency last;
+static int64_t awake_uj;
+static int published;
+static uint32_t last_wakes;
+static esp_timer_handle_t report_timer;
+
+
+/* Cumulative time per PM mode, parsed from the "Mode stats" part of the dump */
+static int read_pm_modes(int64_t *mode_us) {
+#ifdef CONFIG_PM_PROFILING
+    static char text[1024];
+    char name[16], *line, *save;
+    long long us;
+    int in_modes = 0, found = 0;
+
+    FILE *f = fmemopen(text, sizeof(text) - 1, "w");
+    if (f == NULL)
+        return 1;
+    esp_pm_dump_locks(f);
+    fclose(f);
+    text[sizeof(text) - 1] = '\0';
+
+    for (line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        if (strstr(line, "Mode stats") != NULL) {
+            in_modes = 1;
+            continue;
+        }
+        if (!in_modes || sscanf(line, "%15s %*d M %lld", name, &us) != 2)
+            continue;
+        for (int i = 0; i < PM_N_MODES; i++) {
+            if (strcmp(name, mode_names[i]) == 0) {
+                mode_us[i] = us;
+                found = 1;
+            }
+        }
+    }
+    return !found;
+#else
+    return 1;
+#endif
+}
+
+
+void pm_stats_residency(struct residency *r) {
+    int64_t now = esp_timer_get_time();
+
+    memset(r, 0, sizeof(*r));
+    if (read_pm_modes(r->mode_us))
+        r->mode_us[PM_MODE_APB_MAX] = now;
+
+    portENTER_CRITICAL(&stats_mux);
+    r->wifi_us = wifi_total + (wifi_since ? now - wifi_since : 0);
+    r->power_pin_us = power_pin_total + (power_pin_since ? now - power_pin_since : 0);
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+
+void pm_stats_power_pin(bool on) {
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&stats_mux);
+    if (on && power_pin_since == 0) {
+        power_pin_since = now;
+    } else if (!on && power_pin_since != 0) {
+        power_pin_total += now - power_pin_since;
+        power_pin_since = 0;
+    }
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+
+void pm_stats_published(void) {
+    published++;
+}
+
+
+static void wifi_event_handler(void *arg, esp_event_base_t base, int32_t id, void *data) {
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&stats_mux);
+    if (id == WIFI_EVENT_STA_START || id == WIFI_EVENT_AP_START) {
+        if (wifi_users++ == 0)
+            wifi_since = now;
+    } else if ((id == WIFI_EVENT_STA_STOP || id == WIFI_EVENT_AP_STOP) && wifi_users > 0) {
+        if (--wifi_users == 0) {
+            wifi_total += now - wifi_since;
+            wifi_since = 0;
+        }
+    }
+    portEXIT_CRITICAL(&stats_mux);
+}
+
+
+static inline long long mj_int(int64_t uj) {
+    return uj / 1000;
+}
+
+
+static inline int mj_frac(int64_t uj) {
+    return (int)((uj < 0 ? -uj : uj) % 1000);
+}
+
+
+/* Closes the period since the last call: returns its residency and energy */
+static int64_t close_period(struct residency *delta) {
+    struct residency now;
+
+    pm_stats_residency(&now);
+    for (int i = 0; i < PM_N_MODES; i++)
+        delta->mode_us[i] = now.mode_us[i] - last.mode_us[i];
+    delta->wifi_us = now.wifi_us - last.wifi_us;
+    delta->power_pin_us = now.power_pin_us - last.power_pin_us;
+    last = now;
+
+    int64_t uj = energy_uj(&model, delta);
+    awake_uj += uj;
+    return uj;
+}
+
+
+static void report_timer_callback(void *args) {
+    struct residency delta;
+    struct wake_sched_stats wakes;
+    char payload[352];
+    int len;
+
+    int64_t uj = close_period(&delta);
+    int n = published;
+    published = 0;
+    wake_sched_get_stats(&wakes);
+    uint32_t period_wakes = wakes.wakes - last_wakes;
+    last_wakes = wakes.wakes;
+    int64_t per_sample = n ? uj / n : 0;
+    int64_t today = day_energy.night_uj + awake_uj;
+
+    len = snprintf(payload, sizeof(payload), "{\"policy\":\"%s\",\"period_s\":%d,\"ms\":{",
+                   pm_policy_name(), CONFIG_ENERGY_REPORT_PERIOD_S);
+    for (int i = 0; i < PM_N_MODES; i++)
+        len += snprintf(payload + len, sizeof(payload) - len, "\"%s\":%lld,", mode_keys[i], (long long)(delta.mode_us[i] / 1000));
+    len += snprintf(payload + len, sizeof(payload) - len,
+                    "\"wifi\":%lld,\"power_pin\":%lld},\"wakes\":%u,\"wakes_h\":%u,\"mj\":%lld.%03d,\"records\":%d,"
+                    "\"mj_record\":%lld.%03d,\"today_mj\":%lld.%03d,\"last_day_mj\":%lld.%03d}",
+                    (long long)(delta.wifi_us / 1000), (long long)(delta.power_pin_us / 1000),
+                    period_wakes, (unsigned)((uint64_t)period_wakes * 3600 / CONFIG_ENERGY_REPORT_PERIOD_S),
+                    mj_int(uj), mj_frac(uj), n, mj_int(per_sample), mj_frac(per_sample),
+                    mj_int(today), mj_frac(today), mj_int(day_energy.last_day_uj), mj_frac(day_energy.last_day_uj));
+    if (len >= (int)sizeof(payload))
+        return;
+
+    ESP_LOGI(TAG, "%s", payload);
+    enviar_al_broker(TOPIC_ENERGY, payload, len, 0, 0);
+}
+
+
+void pm_stats_deep_sleep(int64_t sleep_us) {
+    struct residency delta;
+
+    close_period(&delta);
+    day_energy.last_day_uj = day_energy.night_uj + awake_uj;
+    day_energy.night_uj = deep_sleep_energy_uj(&model, sleep_us);
+    ESP_LOGI(TAG, "Awake period: %lld mJ, night ahead: %lld mJ", mj_int(awake_uj), mj_int(day_energy.night_uj));
+}
+
+
+int pm_stats_setup(void) {
+    energy_model_default(&model);
+    if (day_energy.magic != ENERGY_MAGIC) {
+        memset(&day_energy, 0, sizeof(day_energy));
+        day_energy.magic = ENERGY_MAGIC;
+    }
+
+    if (esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_event_handler, NULL) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed registering the Wi-Fi event handler");
+        return 1;
+    }
+
+    const esp_timer_create_args_t report_timer_args = {
+        .callback = &report_timer_callback,
+        .name = "energy_report"
+    };
+    if (esp_timer_create(&report_timer_args, &report_timer) != ESP_OK
+            || esp_timer_start_periodic(report_timer, (int64_t)CONFIG_ENERGY_REPORT_PERIOD_S * 1000000) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed starting the energy report");
+        return 1;
+    }
+    return 0;
+}
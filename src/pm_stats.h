@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "energy_model.h"
+
+/**
+ * @brief   Starts tracking Wi-Fi and the periodic energy report. Needs the default event loop
+ *
+ * @return 0 on success
+ */
+int pm_stats_setup(void);
+
+/**
+ * @brief   Notes a change of the sensor supply (POWER_PIN)
+ */
+void pm_stats_power_pin(bool on);
+
+/**
+ * @brief   Counts a record published to the broker
+ */
+void pm_stats_published(void);
+
+/**
+ * @brief   Closes the awake period before deep sleep; the night is charged to the next day
+ */
+void pm_stats_deep_sleep(int64_t sleep_us);
+
+/**
+ * @brief   Time spent in each state since boot
+ */
+void pm_stats_residency(struct residency *r);
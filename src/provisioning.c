@@ -13,11 +13,14 @@
 #include <esp_event.h>
 #include <esp_log.h>
 #include <nvs_flash.h>
+#include <esp_attr.h>
+#include <esp_sleep.h>
 
 #include <lwip/err.h>
 #include <lwip/sys.h>
 
 #include "app_prov.h"
+#include "boot_timing.h"
 
 #define EXAMPLE_AP_RECONN_ATTEMPTS  CONFIG_EXAMPLE_AP_RECONN_ATTEMPTS
 
@@ -26,6 +29,11 @@ static const char *TAG = "provisionamiento";
 extern void mqtt_app_start(void);
 extern void sincTimeAndSleep(void);
 
+#ifdef CONFIG_FAST_BOOT
+/* Se conserva en deep sleep: ya se comprobó que hay credenciales guardadas */
+RTC_DATA_ATTR static bool provisionado_rtc = false;
+#endif
+
 static void event_handler(void* arg, esp_event_base_t event_base,
                           int32_t event_id, void* event_data)
 {
@@ -43,6 +51,7 @@ static void event_handler(void* arg, esp_event_base_t event_base,
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+        boot_mark(BOOT_GOT_IP);
         s_retry_num = 0;
     }
 }
@@ -56,6 +65,7 @@ static void wifi_init_sta(void)
     /* Start Wi-Fi in station mode with credentials set during provisioning */
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_start());
+    boot_mark(BOOT_WIFI_STARTED);
 
     /*Si se conecta automáticamente porque tiene guardadas las credenciales*/
     mqtt_app_start();
@@ -105,10 +115,20 @@ void provisioning(void)
 {
     /* Initialize Wi-Fi including netif with default config */
     esp_netif_create_default_wifi_sta();
-    esp_netif_create_default_wifi_ap();
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
+#ifdef CONFIG_FAST_BOOT
+    /* Camino rápido al despertar de deep sleep: las credenciales ya se
+     * comprobaron en el arranque anterior */
+    if (provisionado_rtc && esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) {
+        ESP_LOGI(TAG, "Starting WiFi station (fast path)");
+        boot_fast_path_taken();
+        wifi_init_sta();
+        return;
+    }
+#endif
+
     /* Check if device is provisioned */
     bool provisioned;
     if (app_prov_is_provisioned(&provisioned) != ESP_OK) {
@@ -119,10 +139,15 @@ void provisioning(void)
     if (!provisioned) {
         /* If not provisioned, start provisioning via soft AP */
         ESP_LOGI(TAG, "Starting WiFi SoftAP provisioning");
+        /* La interfaz AP solo hace falta para provisionar */
+        esp_netif_create_default_wifi_ap();
         start_softap_provisioning();
     } else {
         /* Start WiFi station with credentials set during provisioning */
         ESP_LOGI(TAG, "Starting WiFi station");
+#ifdef CONFIG_FAST_BOOT
+        provisionado_rtc = true;
+#endif
         wifi_init_sta();
     }
 }
\ No newline at end of file
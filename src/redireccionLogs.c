@@ -1,107 +1,736 @@
 #include <stdio.h>
 #include "esp_log.h"
-#include "mqtt_client.h"
 
 #include "esp_system.h"
-#include "nvs_flash.h"
-#include "esp_event.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "soc/soc.h"
+#include "sdkconfig.h"
 
 #include <stdint.h>
 #include <string.h>
-#include "esp_vfs.h"
-#include "esp_vfs_fat.h"
+#include <stdarg.h>
+#include <stdatomic.h>
 
-static const char *TAG = "LOGS";
+/* Log backend. esp_log hands every line to _log_vprintf, which does not
+ * format it: it encodes the address of the format string and the raw
+ * arguments into a record and pushes it to a lock-free queue. A low
+ * priority writer task pops the records, prints them on the UART and
+ * appends them to the binary log ring, so timer callbacks never wait on I/O.
+ *
+ * Log ring: the first LOG_RING_SIZE bytes of the `storage` partition.
+ * tools/logring_decode.py renders it back against the ELF.
+ *
+ * Sector:  [magic u32][generation u32] record record ... 0xFF padding
+ * Record:  [len u16][crc16 u16][seq u32][fmt u32][args ...]
+ *
+ * len counts the whole record, 0xFFFF means erased flash. The CRC covers
+ * everything after itself. Records never cross a sector; sectors are reused
+ * round-robin so every sector sees the same number of erases. */
+
+#define LOG_RING_SIZE       (CONFIG_LOG_RING_SIZE_KB * 1024)
+#define LOG_RING_SECTORS    (LOG_RING_SIZE / SPI_FLASH_SEC_SIZE)
+#define LOG_RING_BUFFER     CONFIG_LOG_RING_BUFFER_SIZE
+#define LOG_RING_FLUSH_MS   CONFIG_LOG_RING_FLUSH_MS
+#define LOG_QUEUE_SLOTS     CONFIG_LOG_QUEUE_SLOTS
+#define LOG_STATS_PERIOD_US ((int64_t)CONFIG_LOG_STATS_PERIOD_S * 1000000)
+
+#define SECTOR_MAGIC        0x474f4c52 // "RLOG"
+#define SECTOR_HEADER_SIZE  8
+#define RECORD_HEADER_SIZE  12
+#define RECORD_ERASED       0xFFFF
+#define MAX_RECORD_SIZE     128
+#define MAX_STORED_RECORD   256 // the synchronous ring wrote records up to this size, still read back
+#define MAX_INLINE_STRING   48
+#define MAX_LINE            256
+#define LOCK_WAIT_MS        10  // synchronous backend: a line waits this long for the writer, then is dropped
 
-// Handle of the wear levelling library instance
-static wl_handle_t s_wl_handle = WL_INVALID_HANDLE;
+#define IN_DROM(p) ((uintptr_t)(p) >= SOC_DROM_LOW && (uintptr_t)(p) < SOC_DROM_HIGH)
 
-// Mount path for the partition
-const char *base_path = "/spiflash";
+_Static_assert((LOG_QUEUE_SLOTS & (LOG_QUEUE_SLOTS - 1)) == 0, "LOG_QUEUE_SLOTS must be a power of two");
 
-/*Redirección salida*/
-static FILE * f;
+static const char *TAG = "LOGS";
+
+static const esp_partition_t *partition;
+static SemaphoreHandle_t writer_lock; // single consumer: writer task or an explicit flush
 static vprintf_like_t default_vprintf;
 
-/*Timer*/
-esp_timer_handle_t timer_sensor_logs;
+static uint8_t staging[LOG_RING_BUFFER];
+static size_t staged;
+
+static uint32_t sector;         // sector being written
+static uint32_t sector_offset;  // next free byte inside it
+static uint32_t generation;     // generation of the current sector
+
+/* Bounded MPSC queue (Vyukov): each slot's sequence tells producers and the
+ * consumer whose turn it is, so enqueue is a single CAS on enqueue_pos */
+struct log_slot {
+    atomic_uint seq;
+    uint8_t record[MAX_RECORD_SIZE];
+};
+
+static struct log_slot queue[LOG_QUEUE_SLOTS];
+static atomic_uint enqueue_pos;
+static uint32_t dequeue_pos;
+static atomic_bool writer_pending;
+static TaskHandle_t writer_task;
+
+static atomic_uint next_seq;
+
+/* Cost of logging, to compare the async and synchronous backends */
+static atomic_uint stat_records;
+static atomic_uint stat_dropped;
+static atomic_uint stat_producer_us;
+static uint32_t stat_io_us;
+static uint32_t stat_io_max_us;
+
+static esp_log_level_t default_level = CONFIG_LOG_RUNTIME_LEVEL;   // last "*" level asked for
+
+
+static uint16_t crc16(const uint8_t *data, size_t len) {
+    uint16_t crc = 0xFFFF;
+
+    while (len--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+
+static inline void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+
+static inline void put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, v);
+    put_u16(p + 2, v >> 16);
+}
+
+
+static inline uint16_t get_u16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+
+static inline uint32_t get_u32(const uint8_t *p) {
+    return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+
+enum arg_length { LEN_INT, LEN_LONG, LEN_LLONG, LEN_SIZE, LEN_LDOUBLE };
+
+/* One printf conversion: the spec text [start, end) and how to fetch it */
+struct conversion {
+    const char *start;
+    const char *end;
+    char type;
+    enum arg_length length;
+    int star_width;
+    int star_precision;
+    int precision;      // -1 if none, or given with '*'
+};
+
+
+/* Finds the next conversion from `p` on. Returns NULL when there is none */
+static const char *next_conversion(const char *p, struct conversion *c) {
+    for (; *p; p++) {
+        if (*p != '%')
+            continue;
+        if (p[1] == '%') {
+            p++;
+            continue;
+        }
+
+        memset(c, 0, sizeof(*c));
+        c->precision = -1;
+        c->start = p++;
+        while (*p && strchr("-+ #0", *p))
+            p++;
+        if (*p == '*') {
+            c->star_width = 1;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p == '.') {
+            p++;
+            if (*p == '*') {
+                c->star_precision = 1;
+                p++;
+            } else {
+                c->precision = 0;
+            }
+            while (*p >= '0' && *p <= '9')
+                c->precision = c->precision * 10 + *p++ - '0';
+        }
+
+        if (*p == 'h') {
+            p += (p[1] == 'h') ? 2 : 1;
+        } else if (*p == 'l') {
+            c->length = (p[1] == 'l') ? LEN_LLONG : LEN_LONG;
+            p += (p[1] == 'l') ? 2 : 1;
+        } else if (*p == 'j') {
+            c->length = LEN_LLONG;
+            p++;
+        } else if (*p == 'z' || *p == 't') {
+            c->length = LEN_SIZE;
+            p++;
+        } else if (*p == 'L') {
+            c->length = LEN_LDOUBLE;
+            p++;
+        }
+
+        if (*p == '\0')
+            return NULL;
+        c->type = *p;
+        c->end = p + 1;
+        return c->end;
+    }
+    return NULL;
+}
+
+
+/* Serializes the arguments of `fmt` as the conversions will consume them.
+ * Returns the bytes written, or -1 if they do not fit */
+static int encode_args(uint8_t *out, size_t size, const char *fmt, va_list args) {
+    struct conversion c;
+    size_t n = 0;
+
+#define NEED(k) do { if (n + (k) > size) return -1; } while (0)
+#define PUT32(v) do { NEED(4); put_u32(out + n, (v)); n += 4; } while (0)
+#define PUT64(v) do { uint64_t _v = (v); NEED(8); put_u32(out + n, _v); put_u32(out + n + 4, _v >> 32); n += 8; } while (0)
+
+    for (const char *p = fmt; (p = next_conversion(p, &c)) != NULL; ) {
+        if (c.star_width)
+            PUT32(va_arg(args, int));
+        if (c.star_precision) {
+            c.precision = va_arg(args, int);    // negative means none, as in printf
+            PUT32(c.precision);
+        }
+
+        switch (c.type) {
+            case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+                if (c.length == LEN_LLONG)
+                    PUT64(va_arg(args, long long));
+                else if (c.length == LEN_LONG)
+                    PUT32(va_arg(args, long));
+                else if (c.length == LEN_SIZE)
+                    PUT32(va_arg(args, size_t));
+                else
+                    PUT32(va_arg(args, int));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+                double d = (c.length == LEN_LDOUBLE) ? (double)va_arg(args, long double) : va_arg(args, double);
+                uint64_t v;
+                memcpy(&v, &d, sizeof(v));
+                PUT64(v);
+                break;
+            }
+            case 'p':
+                PUT32((uint32_t)(uintptr_t)va_arg(args, void *));
+                break;
+            case 's': {
+                // strings in flash go by address, the rest are copied (truncated);
+                // with a precision the buffer need not be terminated, %.*s of MQTT topics
+                const char *s = va_arg(args, const char *);
+                if (s != NULL && IN_DROM(s)) {
+                    PUT32((uint32_t)(uintptr_t)s);
+                } else {
+                    size_t limit = (c.precision >= 0 && c.precision < MAX_INLINE_STRING) ? c.precision : MAX_INLINE_STRING;
+                    size_t len = s ? strnlen(s, limit) : 0;
+                    NEED(5 + len); put_u32(out + n, 0); out[n + 4] = len; n += 5;
+                    memcpy(out + n, s, len); n += len;
+                }
+                break;
+            }
+            case 'n':
+                (void)va_arg(args, void *);
+                break;
+        }
+    }
+#undef PUT64
+#undef PUT32
+#undef NEED
+    return n;
+}
+
+
+static size_t append_literal(char *line, size_t n, size_t size, const char *from, const char *to) {
+    for (const char *q = from; q < to; q++) {
+        if (n + 1 < size)
+            line[n++] = *q;
+        if (q[0] == '%' && q[1] == '%')
+            q++;
+    }
+    return n;
+}
+
+
+/* Formats a record back to text, as vprintf would have printed it */
+static int render_record(const uint8_t *record, char *line, size_t size) {
+    const char *fmt = (const char *)(uintptr_t)get_u32(record + 8);
+    const uint8_t *arg = record + RECORD_HEADER_SIZE;
+    struct conversion c;
+    char spec[16];
+    size_t n = 0;
+
+#define ROOM (n < size ? size - n : 0)
+#define EMIT(...) do { \
+        int _w = c.star_width + c.star_precision; \
+        int r = (_w == 2) ? snprintf(line + n, ROOM, spec, stars[0], stars[1], __VA_ARGS__) \
+              : (_w == 1) ? snprintf(line + n, ROOM, spec, stars[0], __VA_ARGS__) \
+              : snprintf(line + n, ROOM, spec, __VA_ARGS__); \
+        n += (r > 0) ? r : 0; \
+    } while (0)
+
+    const char *lit = fmt, *p;
+    while ((p = next_conversion(lit, &c)) != NULL) {
+        int stars[2] = { 0, 0 };
+        int nstars = 0;
+
+        n = append_literal(line, n, size, lit, c.start);
+        lit = p;
+
+        size_t len = c.end - c.start;
+        if (len >= sizeof(spec))
+            len = sizeof(spec) - 1;
+        memcpy(spec, c.start, len);
+        spec[len] = '\0';
+
+        if (c.star_width) {
+            stars[nstars++] = (int32_t)get_u32(arg);
+            arg += 4;
+        }
+        if (c.star_precision) {
+            stars[nstars++] = (int32_t)get_u32(arg);
+            arg += 4;
+        }
+
+        switch (c.type) {
+            case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+                if (c.length == LEN_LLONG) {
+                    uint64_t v = get_u32(arg) | ((uint64_t)get_u32(arg + 4) << 32);
+                    EMIT((long long)v);
+                    arg += 8;
+                } else {
+                    if (c.length == LEN_LONG)
+                        EMIT((long)(int32_t)get_u32(arg));
+                    else if (c.length == LEN_SIZE)
+                        EMIT((size_t)get_u32(arg));
+                    else
+                        EMIT((int)get_u32(arg));
+                    arg += 4;
+                }
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+                uint64_t v = get_u32(arg) | ((uint64_t)get_u32(arg + 4) << 32);
+                double d;
+                memcpy(&d, &v, sizeof(d));
+                if (c.length == LEN_LDOUBLE)
+                    EMIT((long double)d);
+                else
+                    EMIT(d);
+                arg += 8;
+                break;
+            }
+            case 'p':
+                EMIT((void *)(uintptr_t)get_u32(arg));
+                arg += 4;
+                break;
+            case 's': {
+                const char *str = (const char *)(uintptr_t)get_u32(arg);
+                char inline_str[MAX_INLINE_STRING + 1];
+                arg += 4;
+                if (str == NULL) {
+                    size_t l = *arg++;
+                    memcpy(inline_str, arg, l);
+                    inline_str[l] = '\0';
+                    arg += l;
+                    str = inline_str;
+                }
+                EMIT(str);
+                break;
+            }
+        }
+    }
+
+    n = append_literal(line, n, size, lit, lit + strlen(lit));
+#undef EMIT
+#undef ROOM
+    if (n >= size)
+        n = size - 1;
+    line[n] = '\0';
+    return n;
+}
+
+
+static esp_err_t start_sector(uint32_t next) {
+    uint8_t header[SECTOR_HEADER_SIZE];
+    esp_err_t err;
+
+    sector = next % LOG_RING_SECTORS;
+    generation++;
+    err = esp_partition_erase_range(partition, sector * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+    if (err != ESP_OK)
+        return err;
+
+    put_u32(header, SECTOR_MAGIC);
+    put_u32(header + 4, generation);
+    sector_offset = SECTOR_HEADER_SIZE;
+    return esp_partition_write(partition, sector * SPI_FLASH_SEC_SIZE, header, sizeof(header));
+}
+
+
+/* Writes the staged records to flash. Called with writer_lock held */
+static void flush_locked(void) {
+    size_t done = 0;
+
+    while (done < staged) {
+        // take as many whole records as fit in the current sector
+        size_t run = 0;
+        while (done + run < staged) {
+            uint16_t len = get_u16(&staging[done + run]);
+            if (sector_offset + run + len > SPI_FLASH_SEC_SIZE)
+                break;
+            run += len;
+        }
+
+        if (run == 0) {
+            if (start_sector(sector + 1) != ESP_OK)
+                break;
+            continue;
+        }
+
+        if (esp_partition_write(partition, sector * SPI_FLASH_SEC_SIZE + sector_offset, &staging[done], run) != ESP_OK)
+            break;
+        sector_offset += run;
+        done += run;
+    }
+    staged = 0;
+}
+
+
+/* Appends one record to the RAM staging buffer. Called with writer_lock held */
+static void ring_append(uint8_t *record, uint16_t len) {
+#ifdef CONFIG_LOG_RING
+    if (partition == NULL)
+        return;
+
+    put_u16(record + 2, crc16(record + 4, len - 4));
+    if (staged + len > sizeof(staging))
+        flush_locked();
+    memcpy(&staging[staged], record, len);
+    staged += len;
+#endif
+}
+
+
+/* Does the I/O of one record: UART and log ring. Called with writer_lock held */
+static void write_record(uint8_t *record) {
+    int64_t start = esp_timer_get_time();
+    uint16_t len = get_u16(record);
+
+#ifdef CONFIG_LOG_UART
+    char line[MAX_LINE];
+    render_record(record, line, sizeof(line));
+    fputs(line, stdout);
+#endif
+    ring_append(record, len);
+
+    uint32_t elapsed = esp_timer_get_time() - start;
+    stat_io_us += elapsed;
+    if (elapsed > stat_io_max_us)
+        stat_io_max_us = elapsed;
+}
+
+
+static bool enqueue(const uint8_t *record, uint16_t len) {
+    unsigned pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    struct log_slot *slot;
+
+    for (;;) {
+        slot = &queue[pos & (LOG_QUEUE_SLOTS - 1)];
+        unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(slot->record, record, len);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+
+/* Pops and writes everything queued. Called with writer_lock held */
+static void drain_locked(void) {
+    for (;;) {
+        struct log_slot *slot = &queue[dequeue_pos & (LOG_QUEUE_SLOTS - 1)];
+        unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if ((int)(seq - (dequeue_pos + 1)) < 0)
+            return; // empty
+
+        write_record(slot->record);
+        atomic_store_explicit(&slot->seq, dequeue_pos + LOG_QUEUE_SLOTS, memory_order_release);
+        dequeue_pos++;
+    }
+}
+
+
+void log_ring_flush(void) {
+    if (writer_lock == NULL)
+        return;
+
+    xSemaphoreTake(writer_lock, portMAX_DELAY);
+    drain_locked();
+#ifdef CONFIG_LOG_RING
+    if (partition != NULL)
+        flush_locked();
+#endif
+    xSemaphoreGive(writer_lock);
+}
+
 
 int _log_vprintf(const char *fmt, va_list args) {
-    int iresult;
+    int64_t start = esp_timer_get_time();
+    uint8_t record[MAX_RECORD_SIZE];
+    int len;
+
+    len = encode_args(record + RECORD_HEADER_SIZE, sizeof(record) - RECORD_HEADER_SIZE, fmt, args);
+    if (len < 0) {
+        atomic_fetch_add(&stat_dropped, 1);
+        return 0;
+    }
+    len += RECORD_HEADER_SIZE;
 
-    // Write to log.txt file
-    if (f == NULL) {
-        ESP_LOGE(TAG, "File handler is null\n");
-        return -1;
+    put_u16(record, len);
+    put_u32(record + 4, atomic_fetch_add(&next_seq, 1));
+    put_u32(record + 8, (uint32_t)(uintptr_t)fmt);
+
+#ifdef CONFIG_LOG_ASYNC
+    // never block the caller: if the writer is behind, the line is lost and counted
+    if (!enqueue(record, len)) {
+        atomic_fetch_add(&stat_dropped, 1);
+        return 0;
     }
-    iresult = vfprintf(f, fmt, args);
-    if (iresult < 0) {
-        ESP_LOGE(TAG, "Failed vfprintf() \n");       
+    if (!atomic_exchange(&writer_pending, true))
+        xTaskNotifyGive(writer_task);
+#else
+    // bounded: a line logged while the lock is held, from inside the flash driver say, is dropped
+    if (xSemaphoreTake(writer_lock, pdMS_TO_TICKS(LOCK_WAIT_MS)) != pdTRUE) {
+        atomic_fetch_add(&stat_dropped, 1);
+        return 0;
     }
+    write_record(record);
+    xSemaphoreGive(writer_lock);
+#endif
 
-    return iresult;
+    atomic_fetch_add(&stat_records, 1);
+    atomic_fetch_add(&stat_producer_us, (unsigned)(esp_timer_get_time() - start));
+    return len;
 }
 
-static void timer_callback_logs(void * args){
-    //Desredireccionamos los logs y mostramos algo del fichero
-    //Cambio la salida a la estandar
-    esp_log_set_vprintf(default_vprintf);
 
-    //printf("Cierro el fichero\n");
-    //Cierro el fichero abierto para escritura
-    fclose(f);
+/* Reports what logging costs: time spent in the caller per line, and the
+ * I/O per line that the synchronous backend would add to the caller */
+static void log_stats_report(void) {
+    unsigned records = atomic_exchange(&stat_records, 0);
+    unsigned dropped = atomic_exchange(&stat_dropped, 0);
+    unsigned producer_us = atomic_exchange(&stat_producer_us, 0);
+    uint32_t io_us = stat_io_us, io_max_us = stat_io_max_us;
 
-    // Open file for reading
-    //printf("Abrimos el fichero para lectura\n");
-    f = fopen("/spiflash/logs.txt", "rb");
-    if (f == NULL) {
-        printf("Failed to open file for reading");
+    stat_io_us = 0;
+    stat_io_max_us = 0;
+    if (records == 0)
         return;
+
+    ESP_LOGI(TAG, "%u lines (%u dropped): %u us/line in caller, %u us/line of I/O (max %u us)",
+             records, dropped, producer_us / records, io_us / records, io_max_us);
+}
+
+
+static void log_writer_task(void *args) {
+    int64_t next_flush = esp_timer_get_time() + (int64_t)LOG_RING_FLUSH_MS * 1000;
+    int64_t next_stats = esp_timer_get_time() + LOG_STATS_PERIOD_US;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOG_RING_FLUSH_MS));
+        atomic_store(&writer_pending, false);
+
+        xSemaphoreTake(writer_lock, portMAX_DELAY);
+        drain_locked();
+#ifdef CONFIG_LOG_RING
+        if (partition != NULL && esp_timer_get_time() >= next_flush) {
+            flush_locked();
+            next_flush = esp_timer_get_time() + (int64_t)LOG_RING_FLUSH_MS * 1000;
+        }
+#endif
+        xSemaphoreGive(writer_lock);
+
+        if (esp_timer_get_time() >= next_stats) {
+            log_stats_report();
+            next_stats = esp_timer_get_time() + LOG_STATS_PERIOD_US;
+        }
     }
-    //printf("Leemos las 5 primeras lineas\n");
-    for(int i = 0; i < 5; i++){
-        char line[128];
-        fgets(line, sizeof(line), f);
-        // strip newline
-        char *pos = strchr(line, '\n');
-        if (pos) {
-            *pos = '\0';
+}
+
+
+static esp_log_level_t parse_level(char c) {
+    switch (c) {
+        case 'N': case 'n': case '0': return ESP_LOG_NONE;
+        case 'E': case 'e': case '1': return ESP_LOG_ERROR;
+        case 'W': case 'w': case '2': return ESP_LOG_WARN;
+        case 'I': case 'i': case '3': return ESP_LOG_INFO;
+        case 'D': case 'd': case '4': return ESP_LOG_DEBUG;
+        case 'V': case 'v': case '5': return ESP_LOG_VERBOSE;
+    }
+    return -1;
+}
+
+
+/* Runtime level change, "tag=level" with level one of N E W I D V (or 0-5).
+ * "*" sets every tag. Returns 0 on success */
+int set_log_level(const char *data, int len) {
+    char tag[32];
+    const char *eq = memchr(data, '=', len);
+
+    if (eq == NULL || eq == data || eq - data >= (int)sizeof(tag) || eq + 1 >= data + len)
+        return 1;
+
+    esp_log_level_t level = parse_level(eq[1]);
+    if ((int)level < 0)
+        return 1;
+
+    memcpy(tag, data, eq - data);
+    tag[eq - data] = '\0';
+    esp_log_level_set(tag, level);
+    if (strcmp(tag, "*") == 0)
+        default_level = level;
+    ESP_LOGI(TAG, "Log level of '%s' set to %d", tag, level);
+    return 0;
+}
+
+
+/* Level of every tag as set at boot or by the last "*" command, whatever
+ * was lowered on top of it since */
+esp_log_level_t get_log_level(void) {
+    return default_level;
+}
+
+
+/* Walks the records of sector `i` up to the first erased or torn one.
+ * Returns the offset where the walk stopped and, in `last_seq`, the
+ * sequence number of the last intact record (`*found` set if there was one) */
+static uint32_t scan_sector(uint32_t i, bool *torn, uint32_t *last_seq, bool *found) {
+    uint8_t record[MAX_STORED_RECORD];
+    uint32_t offset = SECTOR_HEADER_SIZE;
+
+    *torn = false;
+    while (offset + RECORD_HEADER_SIZE <= SPI_FLASH_SEC_SIZE) {
+        esp_partition_read(partition, i * SPI_FLASH_SEC_SIZE + offset, record, RECORD_HEADER_SIZE);
+        uint16_t len = get_u16(record);
+        if (len == RECORD_ERASED)
+            break;
+        if (len < RECORD_HEADER_SIZE || len > MAX_STORED_RECORD || offset + len > SPI_FLASH_SEC_SIZE
+                || esp_partition_read(partition, i * SPI_FLASH_SEC_SIZE + offset, record, len) != ESP_OK
+                || crc16(record + 4, len - 4) != get_u16(record + 2)) {
+            *torn = true;
+            break;
+        }
+        *last_seq = get_u32(record + 4);
+        *found = true;
+        offset += len;
+    }
+    return offset;
+}
+
+
+/* Finds where the previous boot stopped: the sector with the highest
+ * generation, and the end of its last intact record */
+static void recover(void) {
+    uint8_t header[SECTOR_HEADER_SIZE];
+    uint32_t last_seq = 0;
+    bool found = false, has_seq = false, torn;
+
+    generation = 0;
+    for (uint32_t i = 0; i < LOG_RING_SECTORS; i++) {
+        if (esp_partition_read(partition, i * SPI_FLASH_SEC_SIZE, header, SECTOR_HEADER_SIZE) != ESP_OK)
+            continue;
+        if (get_u32(header) != SECTOR_MAGIC)
+            continue;
+        if (!found || (int32_t)(get_u32(header + 4) - generation) > 0) {
+            generation = get_u32(header + 4);
+            sector = i;
+            found = true;
         }
-        //printf("Read from file: '%s'\n", line);
     }
 
-    fclose(f);
+    if (!found) {
+        ESP_LOGI(TAG, "Empty log ring, starting at sector 0");
+        start_sector(0);
+        return;
+    }
+
+    sector_offset = scan_sector(sector, &torn, &last_seq, &has_seq);
+    if (!has_seq) {
+        // a sector started just before the reset: the numbering goes on from the one before it
+        uint32_t previous = (sector + LOG_RING_SECTORS - 1) % LOG_RING_SECTORS;
+        bool previous_torn;
+        if (esp_partition_read(partition, previous * SPI_FLASH_SEC_SIZE, header, SECTOR_HEADER_SIZE) == ESP_OK
+                && get_u32(header) == SECTOR_MAGIC && get_u32(header + 4) == generation - 1)
+            scan_sector(previous, &previous_torn, &last_seq, &has_seq);
+    }
+    if (has_seq)
+        atomic_store(&next_seq, last_seq + 1);
+
+    if (torn) {
+        // a half written record: never append after it, move on to a fresh sector
+        ESP_LOGW(TAG, "Torn record in sector %u at %u, skipping sector", sector, sector_offset);
+        start_sector(sector + 1);
+        return;
+    }
+    ESP_LOGI(TAG, "Log ring resumed at sector %u offset %u, seq %u", sector, sector_offset, atomic_load(&next_seq));
+}
+
+
+uint32_t log_ring_dropped(void) {
+    return atomic_load(&stat_dropped);
 }
 
+
 void redireccionaLogs(){
-    /*Cambiamos a la partición spiflash*/
-    ESP_LOGI(TAG, "Mounting FAT filesystem\n");
-    const esp_vfs_fat_mount_config_t mount_config = {
-            .max_files = 4,
-            .format_if_mount_failed = true,
-            .allocation_unit_size = CONFIG_WL_SECTOR_SIZE
-    };
-    ESP_ERROR_CHECK(esp_vfs_fat_spiflash_mount(base_path, "storage", &mount_config, &s_wl_handle));
+    writer_lock = xSemaphoreCreateMutex();
+    for (int i = 0; i < LOG_QUEUE_SLOTS; i++)
+        atomic_init(&queue[i].seq, i);
 
-    /*Redireccionamos la salida de los logs*/
-    ESP_LOGI(TAG, "Opening file");
-    f = fopen("/spiflash/logs.txt", "wb");
-    if (f == NULL) {
-        ESP_LOGE(TAG, "Failed to open file for writing");
-        return;
+#ifdef CONFIG_LOG_RING
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "storage");
+    if (partition == NULL || partition->size < LOG_RING_SIZE) {
+        ESP_LOGE(TAG, "No storage partition for the log ring");
+        partition = NULL;
+    } else {
+        recover();
     }
+#endif
 
-    //printf("Redireccionamos los logs\n");
-    default_vprintf = esp_log_set_vprintf(&_log_vprintf);
+    // also flushes the ring and reports stats when logging synchronously
+    xTaskCreate(&log_writer_task, "log_writer", 3072, NULL, tskIDLE_PRIORITY + 1, &writer_task);
 
-    //Creamos un timer para dentro de 30 segundos, para salir de la redirección de logs
-    ESP_LOGD(TAG, "Timer para salir de la redirección\n");
-    const esp_timer_create_args_t timer_args = {
-        .callback = &timer_callback_logs,
-        .name = "periodic"
-    }; 
-    esp_timer_create(&timer_args, &timer_sensor_logs);
-    esp_timer_start_once(timer_sensor_logs, 10*1000000);
-}
\ No newline at end of file
+    /*Redireccionamos la salida de los logs*/
+    default_vprintf = esp_log_set_vprintf(&_log_vprintf);
+}
@@ -19,17 +19,38 @@
 #include "esp_sleep.h"
 #include "nvs_flash.h"
 #include "esp_sntp.h"
+#include "ephemeris.h"
+#include "boot_timing.h"
+#include "ota.h"
+#include "latency.h"
+#include "sys_stats.h"
 
+#define LOCAL_TIMEZONE CONFIG_LOCAL_TIMEZONE
+#define SNTP_SYNC_TIMEOUT_S CONFIG_SNTP_SYNC_TIMEOUT_S
+#define OTA_SLEEP_RETRY_S 60
 
 static int32_t HOUR_TO_SLEEP = CONFIG_HOUR_TO_SLEEP;
 static int32_t HOUR_TO_WAKEUP = CONFIG_HOUR_TO_WAKEUP;
 
 extern esp_err_t power_pin_down(void);
+extern void shift_sample_timestamps(int64_t delta_us);
+extern void log_ring_flush(void);
+extern void tsdb_flush(void);
+extern void pm_stats_deep_sleep(int64_t sleep_us);
 
 static const char *TAG = "sntp";
 esp_timer_handle_t deep_sleep_timer;
+static esp_timer_handle_t sync_timer;
+static esp_timer_handle_t sync_fallback_timer;
+static struct latency *deep_sleep_latency;
+
+/* Hora de pared = esp_timer_get_time() + offset_reloj_us. Hasta la primera
+ * sincronización el offset es provisional (reloj RTC, quizá 1970) */
+static int64_t offset_reloj_us;
+static int64_t offset_sntp_us;
+static volatile bool hora_sincronizada = false;
+static volatile bool hora_aceptada = false;
 
-static void obtain_time(void);
 static void initialize_sntp(void);
 
 #ifdef CONFIG_SNTP_TIME_SYNC_METHOD_CUSTOM
@@ -41,24 +62,69 @@ void sntp_sync_time(struct timeval *tv)
 }
 #endif
 
-struct tiempo {
-    int horas;
-    int minutos;
-};
-
-struct tiempo tiempoHastaDormir(struct tm timeinfo){
-    struct tiempo tiempo;
-    tiempo.horas = 0;
-    tiempo.minutos = 60 - timeinfo.tm_min;
-    if (timeinfo.tm_hour < HOUR_TO_SLEEP){
-        //Aún duermo hoy
-        tiempo.horas = HOUR_TO_SLEEP - timeinfo.tm_hour - 1;
-    } else {
-        //Duermo mañana
-        tiempo.horas = 24 - timeinfo.tm_hour + HOUR_TO_SLEEP - 1;
+/* Siguiente instante estrictamente posterior a `desde` en que el reloj local
+ * marca hora:00:00. mktime resuelve el cambio de horario (tm_isdst = -1) */
+static time_t siguienteHoraLocal(time_t desde, int hora){
+    struct tm timeinfo;
+    time_t instante;
+
+    localtime_r(&desde, &timeinfo);
+    for (int dias = 0; dias < 2; dias++) {
+        struct tm candidato = timeinfo;
+        candidato.tm_mday += dias;
+        candidato.tm_hour = hora;
+        candidato.tm_min = 0;
+        candidato.tm_sec = 0;
+        candidato.tm_isdst = -1;
+        instante = mktime(&candidato);
+        if (instante > desde)
+            return instante;
     }
+    return instante;
+}
+
+static time_t siguienteDespertar(time_t desde){
+#ifdef CONFIG_SLEEP_SCHEDULE_SOLAR
+    return ephemeris_next_wakeup(desde);
+#else
+    return siguienteHoraLocal(desde, HOUR_TO_WAKEUP);
+#endif
+}
+
+static time_t siguienteDormir(time_t desde){
+#ifdef CONFIG_SLEEP_SCHEDULE_SOLAR
+    return ephemeris_next_sleep(desde);
+#else
+    return siguienteHoraLocal(desde, HOUR_TO_SLEEP);
+#endif
+}
 
-    return tiempo;
+/* Microsegundos hasta la próxima hora de dormir. Si ya es de noche
+ * (despertamos antes de volver a dormir) se duerme inmediatamente */
+static int64_t usHastaDormir(void){
+    struct timeval ahora;
+    gettimeofday(&ahora, NULL);
+
+    time_t dormir = siguienteDormir(ahora.tv_sec);
+    if (siguienteDespertar(ahora.tv_sec) < dormir)
+        return 0;
+
+    return (int64_t)(dormir - ahora.tv_sec) * 1000000 - ahora.tv_usec;
+}
+
+static void configuraZonaHoraria(void){
+    setenv("TZ", LOCAL_TIMEZONE, 1);
+    tzset();
+}
+
+static void logInstante(const char *que, int64_t us_desde_ahora){
+    time_t instante = time(NULL) + us_desde_ahora / 1000000;
+    struct tm timeinfo;
+    char strftime_buf[64];
+
+    localtime_r(&instante, &timeinfo);
+    strftime(strftime_buf, sizeof(strftime_buf), "%c %Z", &timeinfo);
+    ESP_LOGI(TAG, "%s: %s (en %lld s)", que, strftime_buf, (long long)(us_desde_ahora / 1000000));
 }
 
 
@@ -72,133 +138,202 @@ void modificaWakeupHour(int wakeup){
 
 void updateDeepSleepTimer(){
     esp_timer_stop(deep_sleep_timer);
+    configuraZonaHoraria();
+    int64_t us_hasta_dormir = usHastaDormir();
+    ESP_LOGI(TAG, "Cambio: hora de dormir = %d, hora de despertar = %d", HOUR_TO_SLEEP, HOUR_TO_WAKEUP);
+    logInstante("Iniciamos el timer de deep sleep", us_hasta_dormir);
+    esp_timer_start_once(deep_sleep_timer, us_hasta_dormir);
+    latency_arm(deep_sleep_latency, us_hasta_dormir, 0);
+}
+
+static int64_t relojPared_us(void){
+    struct timeval ahora;
+    gettimeofday(&ahora, NULL);
+    return (int64_t)ahora.tv_sec * 1000000 + ahora.tv_usec;
+}
+
+static bool relojPlausible(void){
     time_t now;
     struct tm timeinfo;
     time(&now);
-    setenv("TZ", "Europe/Madrid", 1);
-    tzset();
     localtime_r(&now, &timeinfo);
-    struct tiempo tiempo  = tiempoHastaDormir(timeinfo);
-    long long int us_hasta_dormir = 1000000*60*(tiempo.minutos + 60*tiempo.horas);
-    ESP_LOGI(TAG, "Cambio: hora de dormir = %d, hora de despertar = %d", HOUR_TO_SLEEP, HOUR_TO_WAKEUP);
-    ESP_LOGI(TAG, "Iniciamos el timer de deep sleep %d horas y %d minutos", tiempo.horas, tiempo.minutos);
-    esp_timer_start_once(deep_sleep_timer, us_hasta_dormir);
+    // Is time set? If not, tm_year will be (1970 - 1900).
+    return timeinfo.tm_year >= (2020 - 1900);
+}
+
+static void armaTimerDeepSleep(void){
+#ifdef CONFIG_DEEP_SLEEP
+    updateDeepSleepTimer();
+#endif
+}
+
+/* Marca temporal (us desde epoch) para una muestra tomada ahora */
+int64_t sample_timestamp_us(void){
+    return esp_timer_get_time() + offset_reloj_us;
+}
+
+/* Indica si las marcas temporales ya se pueden publicar */
+bool time_is_valid(void){
+    return hora_aceptada;
+}
+
+/* Se ejecuta en la tarea de esp_timer, la misma que muestrea y envía,
+ * así que puede tocar los buffers de muestras sin más sincronización */
+static void sync_timer_callback(void * args){
+    int64_t delta = offset_sntp_us - offset_reloj_us;
+    offset_reloj_us = offset_sntp_us;
+
+    if (!hora_sincronizada) {
+        ESP_LOGI(TAG, "Primera sincronización: corregimos las muestras pendientes en %lld ms", (long long)(delta / 1000));
+        shift_sample_timestamps(delta);
+        hora_sincronizada = true;
+        hora_aceptada = true;
+        boot_mark(BOOT_TIME_VALID);
+        esp_timer_stop(sync_fallback_timer);
+    }
+    // Re-armamos siempre con la hora corregida (SNTP resincroniza periódicamente)
+    armaTimerDeepSleep();
+}
+
+static void sync_fallback_timer_callback(void * args){
+    if (hora_sincronizada)
+        return;
+
+    if (relojPlausible()) {
+        ESP_LOGW(TAG, "Sin SNTP tras %d s, usamos el reloj RTC", SNTP_SYNC_TIMEOUT_S);
+        shift_sample_timestamps(0);
+        hora_aceptada = true;
+        boot_mark(BOOT_TIME_VALID);
+        armaTimerDeepSleep();
+    } else {
+        ESP_LOGW(TAG, "Sin SNTP tras %d s y sin hora válida: no se programa el deep sleep hasta sincronizar", SNTP_SYNC_TIMEOUT_S);
+    }
 }
 
 void time_sync_notification_cb(struct timeval *tv)
 {
     ESP_LOGI(TAG, "Notification of a time synchronization event");
+    // Corre en la tarea de lwIP: solo anotamos el offset y delegamos en la tarea de timers
+    offset_sntp_us = relojPared_us() - esp_timer_get_time();
+    esp_timer_start_once(sync_timer, 0);
 }
 
 static void deep_sleep_timer_callback(void * args){
-    int32_t horas = 0;
-    //Calculo cuanto tiempo duermo
-    if (HOUR_TO_SLEEP < HOUR_TO_WAKEUP){
-        //En el mismo día
-        horas = HOUR_TO_WAKEUP - HOUR_TO_SLEEP;
-    } else {
-        horas = 24 - HOUR_TO_SLEEP + HOUR_TO_WAKEUP;
+    struct timeval ahora;
+    int64_t inicio = latency_enter(deep_sleep_latency);
+
+#ifdef CONFIG_OTA
+    // Dormir perdería la descarga en curso o devolvería la imagen en prueba a la anterior
+    if (ota_busy()) {
+        ESP_LOGW(TAG, "Actualización en curso, retrasamos el deep sleep %d s", OTA_SLEEP_RETRY_S);
+        esp_timer_start_once(deep_sleep_timer, OTA_SLEEP_RETRY_S * 1000000LL);
+        latency_arm(deep_sleep_latency, OTA_SLEEP_RETRY_S * 1000000LL, 0);
+        latency_exit(deep_sleep_latency, inicio);
+        return;
     }
-    ESP_LOGI(TAG, "Voy a dormir %d horas", horas);
-    long long int sleep_time = horas * 60 * 60 * 1000 * 1000;
+#endif
+    gettimeofday(&ahora, NULL);
+
+    //Calculo cuanto tiempo duermo, al segundo
+    time_t despertar = siguienteDespertar(ahora.tv_sec);
+    int64_t sleep_time = (int64_t)(despertar - ahora.tv_sec) * 1000000 - ahora.tv_usec;
+    logInstante("Voy a dormir hasta", sleep_time);
+    pm_stats_deep_sleep(sleep_time);
 
 #ifdef CONFIG_SHUT_DOWN_POWER_PIN
     power_pin_down();
 #endif
+#ifdef CONFIG_TSDB
+    tsdb_flush();
+#endif
+#ifdef CONFIG_LOG_RING
+    log_ring_flush();
+#endif
+    latency_exit(deep_sleep_latency, inicio);
+#ifdef CONFIG_LATENCY_STATS
+    // Lo medido desde el último informe, este timer incluido, se perdería al dormir
+    sys_stats_publish_latency();
+#endif
 
     esp_sleep_enable_timer_wakeup(sleep_time);
     esp_deep_sleep_start();
 }
 
-void sincTimeAndSleep(void) {
-#ifndef CONFIG_DEEP_SLEEP
+/* Base de tiempos de las muestras: zona horaria, offset entre el reloj de
+ * pared y esp_timer y, al despertar de deep sleep por timer, la hora del RTC
+ * como válida hasta que llegue SNTP. Se llama en el arranque antes de empezar
+ * a muestrear, sin red; sincTimeAndSleep la llama también por si acaso y solo
+ * la primera llamada hace algo */
+void inicializaReloj(void) {
+    static bool inicializado = false;
+    if (inicializado)
         return;
-#endif
+    inicializado = true;
+
+    offset_reloj_us = relojPared_us() - esp_timer_get_time();
 
+    char strftime_buf[64];
     time_t now;
     struct tm timeinfo;
+
+    // Set local timezone (POSIX rule, DST aware) and print local time
+    configuraZonaHoraria();
     time(&now);
     localtime_r(&now, &timeinfo);
-    // Is time set? If not, tm_year will be (1970 - 1900).
-    if (timeinfo.tm_year < (2020 - 1900)) {
-        ESP_LOGI(TAG, "Time is not set yet. Connecting to WiFi and getting time over NTP.");
-        obtain_time();
-        // update 'now' variable with current time
-        time(&now);
-    }
-#ifdef CONFIG_SNTP_TIME_SYNC_METHOD_SMOOTH
-    else {
-        // add 500 ms error to the current system time.
-        // Only to demonstrate a work of adjusting method!
-        {
-            ESP_LOGI(TAG, "Add a error for test adjtime");
-            struct timeval tv_now;
-            gettimeofday(&tv_now, NULL);
-            int64_t cpu_time = (int64_t)tv_now.tv_sec * 1000000L + (int64_t)tv_now.tv_usec;
-            int64_t error_time = cpu_time + 500 * 1000L;
-            struct timeval tv_error = { .tv_sec = error_time / 1000000L, .tv_usec = error_time % 1000000L };
-            settimeofday(&tv_error, NULL);
-        }
-
-        ESP_LOGI(TAG, "Time was set, now just adjusting it. Use SMOOTH SYNC method.");
-        obtain_time();
-        // update 'now' variable with current time
-        time(&now);
-    }
-#endif
+    strftime(strftime_buf, sizeof(strftime_buf), "%c %Z", &timeinfo);
+    ESP_LOGI(TAG, "The current local date/time (not yet synchronized) is: %s", strftime_buf);
 
-    char strftime_buf[64];
+#ifdef CONFIG_SLEEP_SCHEDULE_SOLAR
+    ephemeris_setup();
+#endif
 
-    // Set timezone to Eastern Standard Time and print local time
-    setenv("TZ", "Europe/Madrid", 1);
-    tzset();
-    localtime_r(&now, &timeinfo);
-    strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-    ESP_LOGI(TAG, "The current date/time in Madrid is: %s", strftime_buf);
-
-    if (sntp_get_sync_mode() == SNTP_SYNC_MODE_SMOOTH) {
-        struct timeval outdelta;
-        while (sntp_get_sync_status() == SNTP_SYNC_STATUS_IN_PROGRESS) {
-            adjtime(NULL, &outdelta);
-            ESP_LOGI(TAG, "Waiting for adjusting time ... outdelta = %li sec: %li ms: %li us",
-                        (long)outdelta.tv_sec,
-                        outdelta.tv_usec/1000,
-                        outdelta.tv_usec%1000);
-            vTaskDelay(2000 / portTICK_PERIOD_MS);
-        }
+    // Tras un deep sleep el RTC ha seguido contando: nos fiamos de él hasta que
+    // llegue SNTP, así no se pierden las muestras de la mañana si no hay red
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER && relojPlausible()) {
+        ESP_LOGI(TAG, "Despertamos de deep sleep, usamos la hora del RTC hasta sincronizar");
+        shift_sample_timestamps(0);
+        hora_aceptada = true;
+        boot_mark(BOOT_TIME_VALID);
     }
+}
+
+/* Crea los timers de sincronización y de deep sleep y arranca SNTP sin
+ * bloquear. El deep sleep se programa ya si inicializaReloj aceptó la hora del
+ * RTC; si no, con la primera sincronización o, como tarde, tras
+ * SNTP_SYNC_TIMEOUT_S si el RTC tiene una hora plausible. Se llama desde el
+ * arranque en modo estación y desde el provisionamiento; solo cuenta la primera */
+void sincTimeAndSleep(void) {
+    if (sync_timer != NULL)
+        return;
+
+    inicializaReloj();
+
+    const esp_timer_create_args_t sync_timer_args = {
+        .callback = &sync_timer_callback,
+        .name = "sntp_sync"
+    };
+    esp_timer_create(&sync_timer_args, &sync_timer);
 
-    //Calculo cuánto queda hasta la hora de dormir y pongo un timer
-    struct tiempo tiempo = tiempoHastaDormir(timeinfo);
-    ESP_LOGI(TAG, "Iniciamos el timer de deep sleep %d horas y %d minutos", tiempo.horas, tiempo.minutos);
+    const esp_timer_create_args_t sync_fallback_timer_args = {
+        .callback = &sync_fallback_timer_callback,
+        .name = "sntp_fallback"
+    };
+    esp_timer_create(&sync_fallback_timer_args, &sync_fallback_timer);
+    esp_timer_start_once(sync_fallback_timer, (int64_t)SNTP_SYNC_TIMEOUT_S * 1000000);
+
+#ifdef CONFIG_DEEP_SLEEP
     const esp_timer_create_args_t deep_sleep_timer_args = {
         .callback = &deep_sleep_timer_callback,
-        .name = "periodic"
+        .name = "deep_sleep"
     }; 
     esp_timer_create(&deep_sleep_timer_args, &deep_sleep_timer);
-    long long int segundos_dormir = (long long int)(tiempo.minutos + 60*tiempo.horas);
-    long long int us_hasta_dormir = (long long int) 1000000*60*segundos_dormir;
-    ESP_LOGI(TAG, "Iniciamos el timer de deep sleep en %lld us",us_hasta_dormir);
-
-    //ESP_LOGI(TAG,"Programado timer para deep sleep en %d us\n",us_hasta_dormir);
-    esp_timer_start_once(deep_sleep_timer, us_hasta_dormir);
-}
+    deep_sleep_latency = latency_path("deep_sleep");
+#endif
+    if (hora_aceptada)
+        armaTimerDeepSleep();
 
-static void obtain_time(void)
-{
+    // Siempre forzamos SNTP, aunque el RTC conserve la hora tras el deep sleep
     initialize_sntp();
-
-    // wait for time to be set
-    time_t now = 0;
-    struct tm timeinfo = { 0 };
-    int retry = 0;
-    const int retry_count = 10;
-    while (sntp_get_sync_status() == SNTP_SYNC_STATUS_RESET && ++retry < retry_count) {
-        ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
-        vTaskDelay(2000 / portTICK_PERIOD_MS);
-    }
-    time(&now);
-    localtime_r(&now, &timeinfo);
 }
 
 static void initialize_sntp(void)
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include "sys_stats.h"
+#include "arena.h"
+#include "latency.h"
+#include "mqtt.h"
+
+/* Task CPU share, stack high-water marks and heap state, published every
+ * CONFIG_SYS_STATS_PERIOD_S as
+ *   {"up":s,"heap":[free,min_free,largest],"arena":{arena_report},"tasks":[["name",cpu,stack],...]}
+ * cpu is permille of both cores over the period, stack the bytes never
+ * used. Runs in its own task at idle priority so the sampling timers are
+ * never delayed by it; uxTaskGetSystemState only suspends the scheduler
+ * for the copy. Tasks that do not fit in the payload are left out. With
+ * CONFIG_LATENCY_STATS the histograms of latency.h follow on their own
+ * topic, drained by each report. */
+
+#ifdef CONFIG_SYS_STATS
+
+static const char *TAG = "sys_stats";
+
+#define TOPIC_SYS_STATS     "/ciu/lopy4/diagnostics/system"
+#define TOPIC_LATENCY       "/ciu/lopy4/diagnostics/latency"
+#define SPARE_TASKS         4 // room for tasks created after setup
+#define PAYLOAD_SIZE        1024
+
+struct task_runtime {
+    UBaseType_t number;
+    uint32_t runtime;
+};
+
+static TaskStatus_t *status;
+static struct task_runtime *prev;
+static UBaseType_t capacity, n_prev;
+static uint32_t prev_total;
+static char payload[PAYLOAD_SIZE];
+#ifdef CONFIG_LATENCY_STATS
+static char latency_payload[PAYLOAD_SIZE];
+static atomic_flag latency_busy = ATOMIC_FLAG_INIT;
+#endif
+
+
+static uint32_t previous_runtime(UBaseType_t number) {
+    for (UBaseType_t i = 0; i < n_prev; i++)
+        if (prev[i].number == number)
+            return prev[i].runtime;
+    return 0;
+}
+
+
+static int grow(UBaseType_t needed) {
+    TaskStatus_t *s = realloc(status, needed * sizeof(*s));
+    if (s == NULL)
+        return 1;
+    status = s;
+
+    struct task_runtime *p = realloc(prev, needed * sizeof(*p));
+    if (p == NULL)
+        return 1;
+    prev = p;
+
+    capacity = needed;
+    return 0;
+}
+
+
+static int encode(UBaseType_t n, uint32_t total) {
+    uint64_t period = (uint64_t)(uint32_t)(total - prev_total) * portNUM_PROCESSORS;
+    int len;
+
+    len = snprintf(payload, sizeof(payload), "{\"up\":%lld,\"heap\":[%u,%u,%u],\"arena\":",
+                   (long long)(esp_timer_get_time() / 1000000),
+                   (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+                   (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+                   (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    len += arena_report(payload + len, sizeof(payload) - len);
+    len += snprintf(payload + len, sizeof(payload) - len, ",\"tasks\":[");
+
+    for (UBaseType_t i = 0; i < n; i++) {
+        uint32_t used = status[i].ulRunTimeCounter - previous_runtime(status[i].xTaskNumber);
+        int cpu = period ? (int)((uint64_t)used * 1000 / period) : 0;
+        char entry[48];
+        int entry_len = snprintf(entry, sizeof(entry), "%s[\"%s\",%d,%u]", i ? "," : "",
+                                 status[i].pcTaskName, cpu, (unsigned)status[i].usStackHighWaterMark);
+        // keep room for the closing brackets
+        if (len + entry_len + 3 > (int)sizeof(payload))
+            break;
+        memcpy(payload + len, entry, entry_len);
+        len += entry_len;
+    }
+    len += snprintf(payload + len, sizeof(payload) - len, "]}");
+    return len;
+}
+
+
+#ifdef CONFIG_LATENCY_STATS
+void sys_stats_publish_latency(void) {
+    // the periodic report and the one before a deep sleep run in different tasks
+    if (atomic_flag_test_and_set(&latency_busy))
+        return;
+    int len = latency_report(latency_payload, sizeof(latency_payload));
+    ESP_LOGD(TAG, "%s", latency_payload);
+    enviar_al_broker(TOPIC_LATENCY, latency_payload, len, 0, 0);
+    atomic_flag_clear(&latency_busy);
+}
+#endif
+
+
+static void sys_stats_task(void *args) {
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_SYS_STATS_PERIOD_S * 1000));
+
+        UBaseType_t tasks = uxTaskGetNumberOfTasks();
+        if (tasks > capacity && grow(tasks + SPARE_TASKS)) {
+            ESP_LOGW(TAG, "No memory for the status of %u tasks", (unsigned)tasks);
+            continue;
+        }
+
+        uint32_t total;
+        UBaseType_t n = uxTaskGetSystemState(status, capacity, &total);
+        if (n == 0)
+            continue;
+
+        int len = encode(n, total);
+        ESP_LOGD(TAG, "%s", payload);
+        enviar_al_broker(TOPIC_SYS_STATS, payload, len, 0, 0);
+
+        for (UBaseType_t i = 0; i < n; i++) {
+            prev[i].number = status[i].xTaskNumber;
+            prev[i].runtime = status[i].ulRunTimeCounter;
+        }
+        n_prev = n;
+        prev_total = total;
+#ifdef CONFIG_LATENCY_STATS
+        sys_stats_publish_latency();
+#endif
+    }
+}
+
+
+int sys_stats_setup(void) {
+    if (grow(uxTaskGetNumberOfTasks() + SPARE_TASKS)
+            || xTaskCreate(sys_stats_task, "sys_stats", 3072, NULL, tskIDLE_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed creating the statistics task");
+        return 1;
+    }
+    return 0;
+}
+
+#endif
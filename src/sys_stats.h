@@ -0,0 +1,16 @@
+#pragma once
+
+/**
+ * @brief   Starts the low priority task that publishes task and heap statistics
+ *
+ * @return 0 on success
+ */
+int sys_stats_setup(void);
+
+/**
+ * @brief   Publishes the latency histograms gathered since the last report
+ *
+ * Also called right before a deep sleep. Skipped if a report is already
+ * being sent from another task.
+ */
+void sys_stats_publish_latency(void);
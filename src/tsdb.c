@@ -0,0 +1,733 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_partition.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+
+#include "tsdb.h"
+#include "arena.h"
+
+static const char *TAG = "tsdb";
+
+#ifdef CONFIG_LOG_RING
+#define TSDB_OFFSET (CONFIG_LOG_RING_SIZE_KB * 1024)
+#else
+#define TSDB_OFFSET 0
+#endif
+
+#define BLOCK_MAGIC         0x31425354 // "TSB1"
+#define BLOCK_VERSION       2
+#define BLOCKS_PER_SECTOR   (SPI_FLASH_SEC_SIZE / TSDB_BLOCK_SIZE)
+#define PAYLOAD_BITS        ((TSDB_BLOCK_SIZE - TSDB_HEADER_SIZE) * 8)
+#define MAX_SAMPLE_BITS     72 // worst case: 36 bits timestamp + 36 bits value
+
+#define SEQ_MAGIC           0x51455354 // "TSEQ"
+#define SEQ_LEASE           256 // sequence numbers handed out between NVS writes
+
+#define SEALED_SLOTS        2   // full blocks waiting for the writer task
+#define WRITER_STACK        3072
+#define WRITER_PRIORITY     (tskIDLE_PRIORITY + 1)
+
+/* Time range, in seconds, and sequence range of the blocks of one sector.
+ * Both span every channel in it. channels == 0: empty */
+struct sector_index {
+    uint32_t first_s;
+    uint32_t last_s;
+    uint32_t first_seq;
+    uint32_t last_seq;
+    uint8_t channels;
+};
+
+/* Block being filled for a channel */
+struct open_block {
+    uint8_t data[TSDB_BLOCK_SIZE];
+    uint32_t bits;
+    uint16_t count;
+    uint32_t first_seq;
+    int64_t first_ms;
+    int64_t last_ms;
+    int64_t last_delta;
+    int32_t last_value;
+};
+
+/* A range query, by time (ms) or by sequence number */
+struct query {
+    int channel;
+    int by_seq;
+    int64_t from;
+    int64_t to;
+    tsdb_sample_cb_t cb;
+    void *arg;
+};
+
+/* Next sequence number per channel. RTC memory keeps it exact across deep
+ * sleep and resets; after a power loss the NVS lease is used instead, which
+ * skips at most SEQ_LEASE numbers but never repeats one */
+struct seq_state {
+    uint32_t magic;
+    uint32_t next[TSDB_MAX_CHANNELS];
+};
+
+/* A full block, with its header, handed to the writer task. It keeps its
+ * place in RAM until it is on flash and indexed, so queries always find it */
+struct sealed_block {
+    uint8_t data[TSDB_BLOCK_SIZE];
+    uint32_t slot;
+    int channel;
+    int64_t first_ms;
+    int64_t last_ms;
+    uint32_t first_seq;
+    uint32_t last_seq;
+};
+
+struct bit_reader {
+    const uint8_t *data;
+    uint32_t pos;
+    uint32_t size;
+};
+
+static const esp_partition_t *partition;
+static SemaphoreHandle_t tsdb_lock;
+static SemaphoreHandle_t query_lock;    // one query at a time, they share query_block
+static SemaphoreHandle_t writer_lock;   // one writer of the sealed blocks: the task or tsdb_flush
+static TaskHandle_t writer_task;
+static uint8_t *query_block;
+static struct sector_index *sectors;
+static uint32_t n_sectors;
+static uint32_t next_slot;  // next block slot to write
+static uint32_t block_seq;  // sequence number of the next block
+static struct open_block open_blocks[TSDB_MAX_CHANNELS];
+static uint32_t seq_lease[TSDB_MAX_CHANNELS];
+static bool lease_wanted;
+static struct sealed_block sealed[SEALED_SLOTS];
+static uint32_t sealed_head, sealed_tail;   // FIFO, in slot order
+RTC_DATA_ATTR static struct seq_state seq_state;
+
+
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len) {
+    while (len--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+
+static inline void put_le(uint8_t *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        p[i] = v >> (8 * i);
+}
+
+
+static inline uint64_t get_le(const uint8_t *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+
+static void put_bits(struct open_block *b, uint32_t value, int n) {
+    uint8_t *payload = b->data + TSDB_HEADER_SIZE;
+
+    while (n--) {
+        if (value & (1u << n))
+            payload[b->bits >> 3] |= 0x80 >> (b->bits & 7);
+        b->bits++;
+    }
+}
+
+
+static uint32_t get_bits(struct bit_reader *r, int n) {
+    uint32_t v = 0;
+
+    while (n--) {
+        int bit = 0;
+        if (r->pos < r->size)
+            bit = (r->data[r->pos >> 3] >> (7 - (r->pos & 7))) & 1;
+        v = (v << 1) | bit;
+        r->pos++;
+    }
+    return v;
+}
+
+
+static inline uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+
+static inline int32_t unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+
+/* Prefix code shared by timestamps and values: '0' for zero, then
+ * '10', '110', '1110' with growing payloads, '1111' + 32 bits */
+struct bucket {
+    int prefix_bits;
+    uint32_t prefix;
+    int payload_bits;
+};
+
+static const struct bucket dod_buckets[] = {
+    { 2, 0x2, 4 }, { 3, 0x6, 7 }, { 4, 0xe, 12 }, { 4, 0xf, 32 },
+};
+
+static const struct bucket value_buckets[] = {
+    { 2, 0x2, 6 }, { 3, 0x6, 10 }, { 4, 0xe, 16 }, { 4, 0xf, 32 },
+};
+
+
+static void encode(struct open_block *b, const struct bucket *buckets, uint32_t zz) {
+    if (zz == 0) {
+        put_bits(b, 0, 1);
+        return;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (buckets[i].payload_bits == 32 || zz < (1u << buckets[i].payload_bits)) {
+            put_bits(b, buckets[i].prefix, buckets[i].prefix_bits);
+            put_bits(b, zz, buckets[i].payload_bits);
+            return;
+        }
+    }
+}
+
+
+static uint32_t decode(struct bit_reader *r, const struct bucket *buckets) {
+    int ones = 0;
+
+    if (get_bits(r, 1) == 0)
+        return 0;
+    while (ones < 3 && get_bits(r, 1) == 1)
+        ones++;
+    return get_bits(r, buckets[ones].payload_bits);
+}
+
+
+static void fill_header(struct open_block *b, int channel, uint32_t seq) {
+    uint16_t payload = (b->bits + 7) / 8;
+
+    put_le(b->data, BLOCK_MAGIC, 4);
+    put_le(b->data + 4, seq, 4);
+    b->data[8] = channel;
+    b->data[9] = BLOCK_VERSION;
+    put_le(b->data + 10, b->count, 2);
+    put_le(b->data + 12, b->first_ms, 8);
+    put_le(b->data + 20, b->last_ms, 8);
+    put_le(b->data + 30, payload, 2);
+    put_le(b->data + 32, b->first_seq, 4);
+    put_le(b->data + 36, 0xFFFFFFFF, 4);
+    uint16_t crc = crc16(0xFFFF, b->data, 28);
+    crc = crc16(crc, b->data + 30, TSDB_HEADER_SIZE - 30 + payload);
+    put_le(b->data + 28, crc, 2);
+}
+
+
+static void index_block(uint32_t slot, int channel, int64_t first_ms, int64_t last_ms, uint32_t first_seq, uint32_t last_seq) {
+    struct sector_index *s = &sectors[slot / BLOCKS_PER_SECTOR];
+    uint32_t first_s = first_ms / 1000, last_s = (last_ms + 999) / 1000;
+
+    if (s->channels == 0 || first_s < s->first_s)
+        s->first_s = first_s;
+    if (s->channels == 0 || last_s > s->last_s)
+        s->last_s = last_s;
+    if (s->channels == 0 || first_seq < s->first_seq)
+        s->first_seq = first_seq;
+    if (s->channels == 0 || last_seq > s->last_seq)
+        s->last_seq = last_seq;
+    s->channels |= 1 << channel;
+}
+
+
+/* Hands the open block of `channel` to the writer task, with the next slot,
+ * and starts a new one. RAM only: the flash is written by write_sealed.
+ * Called with tsdb_lock held */
+static int seal_block(int channel) {
+    struct open_block *b = &open_blocks[channel];
+    uint32_t slot = next_slot;
+    int ret = 0;
+
+    if (b->count == 0)
+        return 0;
+
+    if (sealed_tail - sealed_head == SEALED_SLOTS) {
+        ESP_LOGE(TAG, "Writer behind, block of channel %d lost", channel);
+        ret = 1;
+    } else {
+        struct sealed_block *out = &sealed[sealed_tail % SEALED_SLOTS];
+
+        // entering a sector recycles it: the oldest blocks are dropped before it is erased
+        if (slot % BLOCKS_PER_SECTOR == 0)
+            sectors[slot / BLOCKS_PER_SECTOR].channels = 0;
+        fill_header(b, channel, block_seq);
+        memcpy(out->data, b->data, TSDB_BLOCK_SIZE);
+        out->slot = slot;
+        out->channel = channel;
+        out->first_ms = b->first_ms;
+        out->last_ms = b->last_ms;
+        out->first_seq = b->first_seq;
+        out->last_seq = b->first_seq + b->count - 1;
+        sealed_tail++;
+        if (writer_task != NULL)
+            xTaskNotifyGive(writer_task);
+    }
+
+    // the slot is consumed anyway so a bad sector does not stall the store
+    next_slot = (slot + 1) % (n_sectors * BLOCKS_PER_SECTOR);
+    block_seq++;
+    memset(b, 0, sizeof(*b));
+    return ret;
+}
+
+
+static void save_lease(const uint32_t *lease) {
+    nvs_handle_t handle;
+
+    if (nvs_open("tsdb", NVS_READWRITE, &handle) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed opening NVS, sequence numbers will not survive a power loss");
+        return;
+    }
+    nvs_set_blob(handle, "seq_lease", lease, sizeof(seq_lease));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+
+/* Renews the lease if take_seq asked, then writes the sealed blocks to
+ * flash, oldest first, and indexes them. The NVS commit, the erase and the
+ * write go without tsdb_lock, so appends never wait on flash */
+static void write_sealed(void) {
+    uint32_t lease[TSDB_MAX_CHANNELS];
+
+    xSemaphoreTake(writer_lock, portMAX_DELAY);
+
+    xSemaphoreTake(tsdb_lock, portMAX_DELAY);
+    while (lease_wanted) {
+        lease_wanted = false;
+        for (int i = 0; i < TSDB_MAX_CHANNELS; i++)
+            lease[i] = seq_state.next[i] + SEQ_LEASE > seq_lease[i] ? seq_state.next[i] + SEQ_LEASE : seq_lease[i];
+        xSemaphoreGive(tsdb_lock);
+        save_lease(lease);
+        xSemaphoreTake(tsdb_lock, portMAX_DELAY);
+        for (int i = 0; i < TSDB_MAX_CHANNELS; i++)
+            if (lease[i] > seq_lease[i])
+                seq_lease[i] = lease[i];
+    }
+    xSemaphoreGive(tsdb_lock);
+
+    for (;;) {
+        xSemaphoreTake(tsdb_lock, portMAX_DELAY);
+        struct sealed_block *b = sealed_head != sealed_tail ? &sealed[sealed_head % SEALED_SLOTS] : NULL;
+        xSemaphoreGive(tsdb_lock);
+        if (b == NULL)
+            break;
+
+        int ok = 1;
+        if (b->slot % BLOCKS_PER_SECTOR == 0
+                && esp_partition_erase_range(partition, TSDB_OFFSET + b->slot * TSDB_BLOCK_SIZE, SPI_FLASH_SEC_SIZE) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed erasing sector %u", b->slot / BLOCKS_PER_SECTOR);
+            ok = 0;
+        }
+        if (ok && esp_partition_write(partition, TSDB_OFFSET + b->slot * TSDB_BLOCK_SIZE, b->data, TSDB_BLOCK_SIZE) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed writing block %u", b->slot);
+            ok = 0;
+        }
+
+        // indexed and out of RAM at once, so a query finds it in one place or the other
+        xSemaphoreTake(tsdb_lock, portMAX_DELAY);
+        if (ok)
+            index_block(b->slot, b->channel, b->first_ms, b->last_ms, b->first_seq, b->last_seq);
+        sealed_head++;
+        xSemaphoreGive(tsdb_lock);
+    }
+
+    xSemaphoreGive(writer_lock);
+}
+
+
+static void tsdb_writer_task(void *args) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        write_sealed();
+    }
+}
+
+
+/* Hands out the next sequence number of `channel`. Called with tsdb_lock held */
+static uint32_t take_seq(int channel) {
+    uint32_t seq = seq_state.next[channel]++;
+
+    // the writer task renews the lease half way through; saved here only if it fell behind
+    if (seq_state.next[channel] > seq_lease[channel]) {
+        seq_lease[channel] = seq_state.next[channel] + SEQ_LEASE;
+        save_lease(seq_lease);
+        // a save of the writer task may have been under way with the older lease
+        lease_wanted = true;
+        if (writer_task != NULL)
+            xTaskNotifyGive(writer_task);
+    } else if (seq_state.next[channel] + SEQ_LEASE / 2 > seq_lease[channel] && !lease_wanted) {
+        lease_wanted = true;
+        if (writer_task != NULL)
+            xTaskNotifyGive(writer_task);
+    }
+    return seq;
+}
+
+
+int tsdb_append(int channel, int64_t timestamp_ms, int32_t value, uint32_t *seq) {
+    if (tsdb_lock == NULL || channel < 0 || channel >= TSDB_MAX_CHANNELS)
+        return 1;
+
+    xSemaphoreTake(tsdb_lock, portMAX_DELAY);
+    uint32_t n = take_seq(channel);
+    if (seq != NULL)
+        *seq = n;
+
+    // numbered but not kept
+    if (partition == NULL) {
+        xSemaphoreGive(tsdb_lock);
+        return 1;
+    }
+
+    struct open_block *b = &open_blocks[channel];
+    int ret = 0;
+
+    // a new block when full, on clock steps backwards and on gaps too long for 32 bit deltas
+    if (b->count > 0 && (timestamp_ms < b->last_ms || timestamp_ms - b->last_ms > INT32_MAX / 2
+            || b->bits + MAX_SAMPLE_BITS > PAYLOAD_BITS || b->count == UINT16_MAX))
+        ret = seal_block(channel);
+
+    if (b->count == 0) {
+        b->first_seq = n;
+        b->first_ms = timestamp_ms;
+        b->last_ms = timestamp_ms;
+    }
+
+    int64_t delta = timestamp_ms - b->last_ms;
+    int64_t dod = delta - b->last_delta;
+    encode(b, dod_buckets, zigzag((int32_t)dod));
+    encode(b, value_buckets, zigzag(value - b->last_value));
+
+    b->last_delta = delta;
+    b->last_ms = timestamp_ms;
+    b->last_value = value;
+    b->count++;
+    xSemaphoreGive(tsdb_lock);
+
+    return ret;
+}
+
+
+void tsdb_flush(void) {
+    if (partition == NULL)
+        return;
+
+    // one block at a time, so the sealed FIFO never overflows
+    write_sealed();
+    for (int i = 0; i < TSDB_MAX_CHANNELS; i++) {
+        xSemaphoreTake(tsdb_lock, portMAX_DELAY);
+        seal_block(i);
+        xSemaphoreGive(tsdb_lock);
+        write_sealed();
+    }
+}
+
+
+/* Whether a block holding [first_ms, last_ms] and [first_seq, last_seq] can match */
+static inline int block_matches(const struct query *q, int64_t first_ms, int64_t last_ms, uint32_t first_seq, uint32_t last_seq) {
+    if (q->by_seq)
+        return last_seq >= q->from && first_seq <= q->to;
+    return last_ms >= q->from && first_ms <= q->to;
+}
+
+
+/* Decodes a block, handing the samples inside the query range to its callback.
+ * Returns the samples delivered, or -1 if the callback asked to stop */
+static int decode_block(const struct query *q, const uint8_t *payload, uint32_t payload_bytes,
+                        uint16_t count, int64_t first_ms, uint32_t first_seq) {
+    struct bit_reader r = { .data = payload, .pos = 0, .size = payload_bytes * 8 };
+    int64_t t = first_ms, delta = 0;
+    int32_t v = 0;
+    int delivered = 0;
+
+    for (int i = 0; i < count; i++) {
+        delta += (int32_t)unzigzag(decode(&r, dod_buckets));
+        t += delta;
+        v += unzigzag(decode(&r, value_buckets));
+
+        int64_t key = q->by_seq ? (int64_t)(first_seq + i) : t;
+        if (key > q->to)
+            break;
+        if (key < q->from)
+            continue;
+        if (q->cb(q->channel, first_seq + i, t, v, q->arg))
+            return -1;
+        delivered++;
+    }
+    return delivered;
+}
+
+
+/* Whether the header in `block` is a block of the query channel that can match */
+static int header_matches(const struct query *q, const uint8_t *block) {
+    uint16_t count = get_le(block + 10, 2);
+    uint32_t first_seq = get_le(block + 32, 4);
+
+    return get_le(block, 4) == BLOCK_MAGIC && block[9] == BLOCK_VERSION && block[8] == q->channel && count > 0
+        && block_matches(q, get_le(block + 12, 8), get_le(block + 20, 8), first_seq, first_seq + count - 1);
+}
+
+
+/* Reads the block in `slot` if it can match, from flash. Called with tsdb_lock held */
+static int read_block(const struct query *q, uint32_t slot, uint8_t *block) {
+    esp_partition_read(partition, TSDB_OFFSET + slot * TSDB_BLOCK_SIZE, block, TSDB_HEADER_SIZE);
+    if (!header_matches(q, block))
+        return 0;
+    esp_partition_read(partition, TSDB_OFFSET + slot * TSDB_BLOCK_SIZE + TSDB_HEADER_SIZE,
+                       block + TSDB_HEADER_SIZE, get_le(block + 30, 2));
+    return 1;
+}
+
+
+/* The sealed block waiting for `slot`, NULL if it is on flash already. Called with tsdb_lock held */
+static const struct sealed_block *find_sealed(uint32_t slot) {
+    for (uint32_t i = sealed_head; i != sealed_tail; i++)
+        if (sealed[i % SEALED_SLOTS].slot == slot)
+            return &sealed[i % SEALED_SLOTS];
+    return NULL;
+}
+
+
+/* Checks and decodes a block read by the query.
+ * Returns the samples delivered, or -1 if the callback asked to stop */
+static int deliver_block(const struct query *q, uint32_t slot, const uint8_t *block) {
+    uint16_t payload = get_le(block + 30, 2);
+    uint16_t crc = crc16(crc16(0xFFFF, block, 28), block + 30, TSDB_HEADER_SIZE - 30 + payload);
+
+    if (crc != get_le(block + 28, 2)) {
+        ESP_LOGW(TAG, "Corrupted block %u", slot);
+        return 0;
+    }
+    return decode_block(q, block + TSDB_HEADER_SIZE, payload, get_le(block + 10, 2), get_le(block + 12, 8),
+                        get_le(block + 32, 4));
+}
+
+
+/* Walks the blocks on flash oldest first up to the first one still sealed
+ * in RAM, then those from there on, each from RAM or from flash if the
+ * writer got to it meanwhile, and last the open block. A block is indexed
+ * and leaves RAM under the same lock, so none is missed or seen twice */
+static int run_query(const struct query *q) {
+    uint8_t *block = query_block;
+    uint32_t n_slots = n_sectors * BLOCKS_PER_SECTOR;
+    int total = 0, n;
+
+    if (partition == NULL || q->channel < 0 || q->channel >= TSDB_MAX_CHANNELS)
+        return -1;
+    xSemaphoreTake(query_lock, portMAX_DELAY);
+
+    // the lock is held per block, so sampling is only delayed by one block read
+    xSemaphoreTake(tsdb_lock, portMAX_DELAY);
+    uint32_t oldest = next_slot / BLOCKS_PER_SECTOR;
+    // a sector being filled holds the newest blocks, otherwise next_slot points to the oldest
+    if (next_slot % BLOCKS_PER_SECTOR != 0)
+        oldest = (oldest + 1) % n_sectors;
+    uint32_t written_end = sealed_head != sealed_tail ? sealed[sealed_head % SEALED_SLOTS].slot : next_slot;
+    xSemaphoreGive(tsdb_lock);
+
+    for (uint32_t k = 0; k < n_sectors; k++) {
+        uint32_t s = (oldest + k) % n_sectors;
+
+        for (int j = 0; j < BLOCKS_PER_SECTOR; j++) {
+            uint32_t slot = s * BLOCKS_PER_SECTOR + j;
+
+            // also where the walk starts when nothing waits and the next block recycles the oldest sector
+            if (slot == written_end && (k > 0 || j > 0))
+                goto newest;
+            xSemaphoreTake(tsdb_lock, portMAX_DELAY);
+            struct sector_index idx = sectors[s];
+            if (!(idx.channels & (1 << q->channel))
+                    || (q->by_seq && (idx.last_seq < q->from || idx.first_seq > q->to))
+                    || (!q->by_seq && (idx.last_s < q->from / 1000 || idx.first_s > q->to / 1000))) {
+                xSemaphoreGive(tsdb_lock);
+                break;
+            }
+            int found = read_block(q, slot, block);
+            xSemaphoreGive(tsdb_lock);
+
+            if (!found)
+                continue;
+            if ((n = deliver_block(q, slot, block)) < 0)
+                goto done;
+            total += n;
+        }
+    }
+
+newest:
+    for (uint32_t slot = written_end; ; slot = (slot + 1) % n_slots) {
+        int found;
+
+        xSemaphoreTake(tsdb_lock, portMAX_DELAY);
+        if (slot == next_slot)
+            break;  // with tsdb_lock held
+        const struct sealed_block *sb = find_sealed(slot);
+        if (sb != NULL) {
+            found = header_matches(q, sb->data);
+            if (found)
+                memcpy(block, sb->data, TSDB_BLOCK_SIZE);
+        } else {
+            found = read_block(q, slot, block);
+        }
+        xSemaphoreGive(tsdb_lock);
+
+        if (!found)
+            continue;
+        if ((n = deliver_block(q, slot, block)) < 0)
+            goto done;
+        total += n;
+    }
+
+    // and the samples still in the open block
+    struct open_block *b = &open_blocks[q->channel];
+    uint16_t count = b->count;
+    uint32_t first_seq = b->first_seq;
+    int64_t first_ms = b->first_ms;
+    uint32_t payload = (b->bits + 7) / 8;
+    memcpy(block, b->data + TSDB_HEADER_SIZE, payload);
+    xSemaphoreGive(tsdb_lock);
+
+    if (count > 0) {
+        n = decode_block(q, block, payload, count, first_ms, first_seq);
+        if (n > 0)
+            total += n;
+    }
+done:
+    xSemaphoreGive(query_lock);
+    return total;
+}
+
+
+int tsdb_query(int channel, int64_t from_ms, int64_t to_ms, tsdb_sample_cb_t cb, void *arg) {
+    struct query q = { .channel = channel, .by_seq = 0, .from = from_ms, .to = to_ms, .cb = cb, .arg = arg };
+    return run_query(&q);
+}
+
+
+int tsdb_query_seq(int channel, uint32_t from_seq, uint32_t to_seq, tsdb_sample_cb_t cb, void *arg) {
+    struct query q = { .channel = channel, .by_seq = 1, .from = from_seq, .to = to_seq, .cb = cb, .arg = arg };
+    return run_query(&q);
+}
+
+
+uint32_t tsdb_next_seq(int channel) {
+    if (channel < 0 || channel >= TSDB_MAX_CHANNELS)
+        return 0;
+    return seq_state.next[channel];
+}
+
+
+/* Sequence numbers go on from RTC memory if it survived, otherwise from
+ * the NVS lease; never below what the blocks on flash already used */
+static void restore_seq(const uint32_t *flash_next) {
+    nvs_handle_t handle;
+    size_t len = sizeof(seq_lease);
+
+    memset(seq_lease, 0, sizeof(seq_lease));
+    if (nvs_open("tsdb", NVS_READONLY, &handle) == ESP_OK) {
+        if (nvs_get_blob(handle, "seq_lease", seq_lease, &len) != ESP_OK)
+            memset(seq_lease, 0, sizeof(seq_lease));
+        nvs_close(handle);
+    }
+
+    if (seq_state.magic != SEQ_MAGIC) {
+        ESP_LOGI(TAG, "Sequence numbers resumed from the NVS lease");
+        memcpy(seq_state.next, seq_lease, sizeof(seq_state.next));
+        seq_state.magic = SEQ_MAGIC;
+    }
+    for (int i = 0; i < TSDB_MAX_CHANNELS; i++)
+        if (flash_next[i] > seq_state.next[i])
+            seq_state.next[i] = flash_next[i];
+}
+
+
+int tsdb_setup(void) {
+    uint8_t header[TSDB_HEADER_SIZE];
+    uint32_t flash_next[TSDB_MAX_CHANNELS] = { 0 };
+    int found = 0;
+    uint32_t last_seq = 0, last_slot = 0;
+
+    if (tsdb_lock != NULL)
+        return partition == NULL;
+    if ((tsdb_lock = xSemaphoreCreateMutex()) == NULL || (query_lock = xSemaphoreCreateMutex()) == NULL
+            || (writer_lock = xSemaphoreCreateMutex()) == NULL)
+        return 1;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "storage");
+    if (partition == NULL || partition->size <= TSDB_OFFSET + SPI_FLASH_SEC_SIZE) {
+        ESP_LOGE(TAG, "No room for the time-series store in the storage partition");
+        partition = NULL;
+        restore_seq(flash_next);
+        return 1;
+    }
+
+    n_sectors = (partition->size - TSDB_OFFSET) / SPI_FLASH_SEC_SIZE;
+    sectors = arena_alloc(n_sectors * sizeof(struct sector_index), "tsdb_index");
+    query_block = arena_alloc(TSDB_BLOCK_SIZE, "tsdb_query");
+    if (sectors == NULL || query_block == NULL) {
+        ESP_LOGE(TAG, "No room in the arena for the store index, see CONFIG_ARENA_SIZE");
+        partition = NULL;
+        restore_seq(flash_next);
+        return 1;
+    }
+
+    // rebuild the index from the block headers and find the newest block
+    for (uint32_t slot = 0; slot < n_sectors * BLOCKS_PER_SECTOR; slot++) {
+        esp_partition_read(partition, TSDB_OFFSET + slot * TSDB_BLOCK_SIZE, header, sizeof(header));
+        if (get_le(header, 4) != BLOCK_MAGIC || header[9] != BLOCK_VERSION || header[8] >= TSDB_MAX_CHANNELS)
+            continue;
+
+        int channel = header[8];
+        uint32_t first_seq = get_le(header + 32, 4);
+        uint32_t end = first_seq + get_le(header + 10, 2);
+        if (end > flash_next[channel])
+            flash_next[channel] = end;
+
+        index_block(slot, channel, get_le(header + 12, 8), get_le(header + 20, 8), first_seq, end - 1);
+        uint32_t seq = get_le(header + 4, 4);
+        if (!found || (int32_t)(seq - last_seq) > 0) {
+            last_seq = seq;
+            last_slot = slot;
+            found = 1;
+        }
+    }
+
+    if (found) {
+        next_slot = (last_slot + 1) % (n_sectors * BLOCKS_PER_SECTOR);
+        block_seq = last_seq + 1;
+        // the rest of the current sector is erased, so appending there is safe
+        if (next_slot % BLOCKS_PER_SECTOR != 0) {
+            esp_partition_read(partition, TSDB_OFFSET + next_slot * TSDB_BLOCK_SIZE, header, sizeof(header));
+            if (get_le(header, 4) != 0xFFFFFFFF)
+                next_slot = (next_slot + BLOCKS_PER_SECTOR - next_slot % BLOCKS_PER_SECTOR) % (n_sectors * BLOCKS_PER_SECTOR);
+        }
+    }
+    restore_seq(flash_next);
+
+    if (xTaskCreate(tsdb_writer_task, "tsdb_writer", WRITER_STACK, NULL, WRITER_PRIORITY, &writer_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed creating the writer task");
+        writer_task = NULL;
+        partition = NULL;
+        return 1;
+    }
+    ESP_LOGI(TAG, "Time-series store: %u sectors, next block %u (seq %u)", n_sectors, next_slot, block_seq);
+    return 0;
+}
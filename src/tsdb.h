@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Append-only time-series store on the `storage` partition, after the log ring.
+ *
+ * Samples are packed per channel into 1 KB blocks: timestamps as
+ * delta-of-delta (Gorilla), values as zigzag deltas, both with variable
+ * length prefixes. A full block is handed to a low priority writer task,
+ * so tsdb_append stays in RAM; tsdb_flush writes everything from
+ * the caller. Sectors are recycled oldest first, so the store always holds
+ * the most recent history.
+ *
+ * Every sample gets a per-channel sequence number that keeps growing across
+ * reboots, so gaps seen by the server can be asked for by number.
+ *
+ * Block (little endian):
+ *   0  u32 magic "TSB1"      12 i64 first timestamp (ms)
+ *   4  u32 block sequence    20 i64 last timestamp (ms)
+ *   8  u8  channel           28 u16 crc16 (rest of header + payload)
+ *   9  u8  version (2)       30 u16 payload bytes
+ *  10  u16 sample count      32 u32 sequence number of the first sample
+ *                            36 u32 reserved (0xFFFFFFFF)
+ *                            40 bitstream ...
+ */
+
+#define TSDB_BLOCK_SIZE     1024
+#define TSDB_HEADER_SIZE    40
+#define TSDB_MAX_CHANNELS   8
+
+/**
+ * @brief   Called for every sample found by tsdb_query, in time order
+ *
+ * @return 0 to go on, anything else stops the query
+ */
+typedef int (*tsdb_sample_cb_t)(int channel, uint32_t seq, int64_t timestamp_ms, int32_t value, void *arg);
+
+/**
+ * @brief   Finds the store region and rebuilds the index from the block headers
+ *
+ * @return 0 on success
+ */
+int tsdb_setup(void);
+
+/**
+ * @brief   Appends a sample. Timestamps of a channel must not go backwards
+ *
+ * @param seq   if not NULL, gets the sequence number given to the sample. It is
+ *              assigned even if the sample could not be stored
+ *
+ * @return 0 on success
+ */
+int tsdb_append(int channel, int64_t timestamp_ms, int32_t value, uint32_t *seq);
+
+/**
+ * @brief   Writes the open blocks to flash (e.g. before deep sleep)
+ */
+void tsdb_flush(void);
+
+/**
+ * @brief   Reads the samples of `channel` in [from_ms, to_ms]
+ *
+ * Only blocks whose time range overlaps the query are read from flash.
+ *
+ * @return number of samples delivered, or -1 on error
+ */
+int tsdb_query(int channel, int64_t from_ms, int64_t to_ms, tsdb_sample_cb_t cb, void *arg);
+
+/**
+ * @brief   Reads the samples of `channel` with sequence numbers in [from_seq, to_seq]
+ *
+ * Only sectors whose sequence range overlaps the query are read from flash.
+ *
+ * @return number of samples delivered, or -1 on error
+ */
+int tsdb_query_seq(int channel, uint32_t from_seq, uint32_t to_seq, tsdb_sample_cb_t cb, void *arg);
+
+/**
+ * @brief   Sequence number the next sample of `channel` will get
+ */
+uint32_t tsdb_next_seq(int channel);
@@ -0,0 +1,124 @@
+#include <stddef.h>
+
+#include "wake_sched.h"
+
+static struct wake_event *events[WAKE_SCHED_MAX_EVENTS];
+static int n_events;
+static int64_t slack_us;
+static int64_t idle_since_us;   // end of the last event run
+static struct wake_sched_stats stats;
+
+
+/* Every event due within the slack runs right behind `trigger`, in the order they were added */
+static void pull_due(const struct wake_event *trigger, int64_t now) {
+    for (int i = 0; i < n_events; i++) {
+        struct wake_event *e = events[i];
+
+        // the overdue ones fire by themselves next
+        if (e == trigger || e->period_us == 0 || e->pulled || e->due_us <= now || e->due_us > now + slack_us)
+            continue;
+        hal_timer_stop(e->timer);
+        e->pulled = true;
+        hal_timer_start_once(e->timer, 0);
+        stats.pulled++;
+    }
+}
+
+
+static void event_fired(void *arg) {
+    struct wake_event *event = arg;
+    int64_t now;
+
+    hal_critical_enter();
+    now = hal_time_us();
+    // stopped, or restarted after this expiry was dispatched: the new deadline is still a period ahead
+    if (event->period_us == 0 || (!event->pulled && event->due_us - now > event->period_us / 2)) {
+        hal_critical_exit();
+        return;
+    }
+    // a deadline after the end of the last run found the CPU idle
+    if (!event->pulled && event->due_us > idle_since_us)
+        stats.wakes++;
+    // the grid goes on from the deadline, like a periodic timer: a late event catches up back to back
+    event->due_us += event->period_us;
+    hal_timer_start_once(event->timer, event->due_us > now ? event->due_us - now : 0);
+    if (event->pulled)
+        event->pulled = false;
+    else
+        pull_due(event, now);
+    stats.runs++;
+    hal_critical_exit();
+
+    event->args.callback(event->args.arg);
+    idle_since_us = hal_time_us();
+}
+
+
+int wake_sched_add(struct wake_event *event, const struct hal_timer_args *args) {
+    const struct hal_timer_args timer_args = {
+        .callback = event_fired,
+        .arg = event,
+        .name = args->name,
+    };
+
+    if (n_events == WAKE_SCHED_MAX_EVENTS || hal_timer_create(&timer_args, &event->timer))
+        return 1;
+    event->args = *args;
+    event->period_us = 0;
+    event->pulled = false;
+    events[n_events++] = event;
+    return 0;
+}
+
+
+int wake_sched_start(struct wake_event *event, int64_t period_us) {
+    int ret;
+
+    if (period_us <= 0)
+        return 1;
+    hal_critical_enter();
+    if (event->period_us != 0) {
+        hal_critical_exit();
+        return 1;
+    }
+    hal_timer_stop(event->timer);
+    event->pulled = false;
+    event->due_us = hal_time_us() + period_us;
+    event->period_us = period_us;
+    ret = hal_timer_start_once(event->timer, period_us);
+    hal_critical_exit();
+    return ret;
+}
+
+
+int wake_sched_stop(struct wake_event *event) {
+    hal_critical_enter();
+    if (event->period_us == 0) {
+        hal_critical_exit();
+        return 1;
+    }
+    event->period_us = 0;
+    hal_timer_stop(event->timer);
+    hal_critical_exit();
+    return 0;
+}
+
+
+void wake_sched_set_slack(int64_t slack) {
+    slack_us = slack > 0 ? slack : 0;
+}
+
+
+void wake_sched_restart(void) {
+    for (int i = 0; i < n_events; i++) {
+        int64_t period_us = events[i]->period_us;
+
+        if (period_us && wake_sched_stop(events[i]) == 0)
+            wake_sched_start(events[i], period_us);
+    }
+}
+
+
+void wake_sched_get_stats(struct wake_sched_stats *s) {
+    *s = stats;
+}
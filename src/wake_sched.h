@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hal.h"
+
+/* Periodic events sharing their wake-ups. Each event keeps its own
+ * one-shot HAL timer, named as it would be alone, and a fixed grid of
+ * deadlines: period after period from the moment it was started. When an
+ * event fires on its own deadline, every other event due within the slack
+ * is pulled forward to run right behind it, so the CPU leaves light sleep
+ * once for all of them; the pulled ones keep their grid and fire on it
+ * again unless pulled once more. The pulled events, and events due at the
+ * same instant, run in the order they were added, so adding the samplings
+ * before the sends flushes the sends after every channel has been sampled.
+ * A slack of 0 only joins events due at the same instant, the way separate
+ * periodic timers behave.
+ *
+ * Start and stop may come from another task, as the configuration
+ * commands do; they and the re-arm of a fired event run in a HAL critical
+ * section. Everything else runs in the timer task. */
+
+#define WAKE_SCHED_MAX_EVENTS   8
+
+struct wake_event {
+    hal_timer_t timer;
+    struct hal_timer_args args;     // what runs on each deadline
+    int64_t period_us;              // 0 while stopped
+    int64_t due_us;                 // next deadline, node clock
+    bool pulled;                    // armed to run now, behind another event
+};
+
+struct wake_sched_stats {
+    uint32_t wakes;                 // events that fired on their own deadline
+    uint32_t runs;                  // all events run
+    uint32_t pulled;                // events run ahead of their deadline
+};
+
+/**
+ * @brief   Creates the timer of `event`, which will run `args`
+ *
+ * `event` must outlive the program.
+ *
+ * @return  0 on success
+ */
+int wake_sched_add(struct wake_event *event, const struct hal_timer_args *args);
+
+/**
+ * @brief   First deadline in `period_us` from now, then every `period_us`
+ */
+int wake_sched_start(struct wake_event *event, int64_t period_us);
+
+/**
+ * @return  1 if it was not started
+ */
+int wake_sched_stop(struct wake_event *event);
+
+/**
+ * @brief   How far ahead of its deadline an event may run to share a wake-up
+ */
+void wake_sched_set_slack(int64_t slack_us);
+
+/**
+ * @brief   Starts every started event again from now, as the reboot after
+ *          a deep sleep does (host simulation)
+ */
+void wake_sched_restart(void);
+
+/**
+ * @brief   Counts since boot
+ */
+void wake_sched_get_stats(struct wake_sched_stats *stats);
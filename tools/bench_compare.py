@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""Compare two runs of the hot path benchmarks (src/bench.c).
+
+Each run is the JSON lines the suite prints, from the host build or from the
+node console (other lines, such as logs, are skipped):
+
+    .pio/build/bench/program > new.jsonl
+    tools/bench_compare.py base.jsonl new.jsonl --threshold 10
+
+Prints the median cost per call of every step in both runs and exits with 1
+when any of them got slower by more than the threshold, so it can gate a CI
+job. Runs with different units, platforms or settings are refused.
+"""
+
+import argparse
+import json
+import sys
+
+SETTINGS = ("platform", "unit", "n_samples", "window_size")
+
+
+def read_run(path):
+    header, steps = None, {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith("{"):
+                continue
+            try:
+                record = json.loads(line)
+            except ValueError:
+                continue
+            if "bench" in record:
+                steps[record["bench"]] = record
+            elif "platform" in record:
+                header = record
+    if header is None:
+        sys.exit("%s: no benchmark header" % path)
+    return header, steps
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("base", help="reference run")
+    parser.add_argument("new", help="run to check")
+    parser.add_argument("--threshold", type=float, default=5.0, help="slowdown allowed on the median (%%)")
+    args = parser.parse_args()
+
+    base_header, base = read_run(args.base)
+    new_header, new = read_run(args.new)
+    for key in SETTINGS:
+        if base_header.get(key) != new_header.get(key):
+            sys.exit("runs differ in %s: %s vs %s" % (key, base_header.get(key), new_header.get(key)))
+
+    unit = base_header["unit"]
+    regressed = False
+    print("%-16s %12s %12s %8s" % ("step", "base " + unit, "new " + unit, "change"))
+    for name, record in new.items():
+        if name not in base:
+            print("%-16s %12s %12.1f %8s" % (name, "-", record["p50"], "new"))
+            continue
+        before, after = base[name]["p50"], record["p50"]
+        change = (after - before) * 100 / before if before else 0.0
+        mark = ""
+        if change > args.threshold:
+            mark = "  <-- slower"
+            regressed = True
+        print("%-16s %12.1f %12.1f %+7.1f%%%s" % (name, before, after, change, mark))
+    sys.exit(1 if regressed else 0)
+
+
+if __name__ == "__main__":
+    main()
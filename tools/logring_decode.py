@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""Render the binary log ring kept on the `storage` partition.
+
+The node stores, for every log line, the address of its format string and the
+raw arguments (see src/redireccionLogs.c). This tool reads a dump of the
+partition (or of just the ring region) and formats the records again using the
+strings found in the firmware ELF.
+
+    esptool.py read_flash 0x312000 0x40000 ring.bin
+    tools/logring_decode.py build/Proyecto.elf ring.bin
+
+Records are printed in sequence order. Gaps in the sequence (overwritten or
+torn records) are reported.
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+SECTOR_SIZE = 4096
+SECTOR_MAGIC = 0x474F4C52
+SECTOR_HEADER_SIZE = 8
+RECORD_HEADER_SIZE = 12
+RECORD_ERASED = 0xFFFF
+
+SPEC = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?(hh|h|ll|l|j|z|t|L)?([diuxXocfFeEgGaApsn%])")
+ANSI = re.compile(r"\x1b\[[0-9;]*m")
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+class Elf:
+    """Just enough of an ELF reader to fetch C strings by address."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF":
+            raise ValueError("%s is not an ELF file" % path)
+        is64 = self.data[4] == 2
+        if is64:
+            shoff, = struct.unpack_from("<Q", self.data, 0x28)
+            shentsize, shnum = struct.unpack_from("<HH", self.data, 0x3A)
+            fmt = "<IIQQQQIIQQ"
+        else:
+            shoff, = struct.unpack_from("<I", self.data, 0x20)
+            shentsize, shnum = struct.unpack_from("<HH", self.data, 0x2E)
+            fmt = "<IIIIIIIIII"
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, _, addr, offset, size = struct.unpack_from(fmt, self.data, shoff + i * shentsize)[:6]
+            if sh_type != 8 and addr:  # skip SHT_NOBITS and non-allocated sections
+                self.sections.append((addr, offset, size))
+
+    def string(self, addr):
+        for base, offset, size in self.sections:
+            if base <= addr < base + size:
+                start = offset + addr - base
+                end = self.data.index(b"\0", start)
+                return self.data[start:end].decode("utf-8", "replace")
+        return None
+
+
+def read_sectors(dump):
+    for base in range(0, len(dump) - SECTOR_HEADER_SIZE + 1, SECTOR_SIZE):
+        magic, generation = struct.unpack_from("<II", dump, base)
+        if magic == SECTOR_MAGIC:
+            yield generation, base
+
+
+def read_records(dump, base):
+    offset = base + SECTOR_HEADER_SIZE
+    end = base + SECTOR_SIZE
+    while offset + RECORD_HEADER_SIZE <= min(end, len(dump)):
+        length, crc = struct.unpack_from("<HH", dump, offset)
+        if length == RECORD_ERASED:
+            return
+        if length < RECORD_HEADER_SIZE or offset + length > end:
+            print("# sector 0x%x: bad record length at 0x%x" % (base, offset), file=sys.stderr)
+            return
+        record = dump[offset:offset + length]
+        if crc16(record[4:]) != crc:
+            print("# sector 0x%x: torn record at 0x%x" % (base, offset), file=sys.stderr)
+            return
+        seq, fmt = struct.unpack_from("<II", record, 4)
+        yield seq, fmt, record[RECORD_HEADER_SIZE:]
+        offset += length
+
+
+def render(elf, fmt_addr, args):
+    fmt = elf.string(fmt_addr)
+    if fmt is None:
+        return "<unknown format 0x%08x, %d arg bytes>" % (fmt_addr, len(args))
+
+    pos = 0
+    out = []
+    last = 0
+
+    def take(size, code):
+        nonlocal pos
+        value, = struct.unpack_from(code, args, pos)
+        pos += size
+        return value
+
+    for m in SPEC.finditer(fmt):
+        out.append(fmt[last:m.start()])
+        last = m.end()
+        flags, width, precision, length, conv = m.groups()
+        if conv == "%":
+            out.append("%")
+            continue
+        if width == "*":
+            width = str(take(4, "<i"))
+        if precision == "*":
+            precision = str(take(4, "<i"))
+        spec = "%" + flags + (width or "") + ("." + precision if precision else "")
+        wide = length in ("ll", "j", "L")
+
+        if conv in "diuxXoc":
+            if wide:
+                value = take(8, "<q" if conv in "di" else "<Q")
+            else:
+                value = take(4, "<i" if conv in "dic" else "<I")
+            if conv == "u":
+                conv = "d"
+            if conv == "c":
+                value = chr(value & 0xFF)
+            out.append((spec + conv) % value)
+        elif conv in "fFeEgGaA":
+            value = take(8, "<d")
+            out.append((spec + ("f" if conv in "aA" else conv)) % value)
+        elif conv == "p":
+            out.append("0x%08x" % take(4, "<I"))
+        elif conv == "s":
+            addr = take(4, "<I")
+            if addr:
+                text = elf.string(addr) or "<0x%08x>" % addr
+            else:
+                size = args[pos]
+                text = args[pos + 1:pos + 1 + size].decode("utf-8", "replace")
+                pos += 1 + size
+            out.append((spec + "s") % text)
+    out.append(fmt[last:])
+    return "".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("elf", help="firmware ELF matching the dumped node")
+    parser.add_argument("dump", help="raw dump of the storage partition or of the log ring")
+    parser.add_argument("--size-kb", type=int, default=0,
+                        help="ring size (CONFIG_LOG_RING_SIZE_KB) if the dump holds the whole partition")
+    parser.add_argument("--keep-colors", action="store_true", help="keep ANSI color codes")
+    args = parser.parse_args()
+
+    elf = Elf(args.elf)
+    with open(args.dump, "rb") as f:
+        dump = f.read()
+    if args.size_kb:
+        dump = dump[:args.size_kb * 1024]
+
+    records = []
+    for _, base in sorted(read_sectors(dump)):
+        records.extend(read_records(dump, base))
+    records.sort(key=lambda r: r[0])
+
+    previous = None
+    for seq, fmt, payload in records:
+        if previous is not None and seq != previous + 1:
+            print("# %d records lost (seq %d..%d)" % (seq - previous - 1, previous + 1, seq - 1))
+        previous = seq
+        line = render(elf, fmt, payload).rstrip("\n")
+        if not args.keep_colors:
+            line = ANSI.sub("", line)
+        print("%8d %s" % (seq, line))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+"""Build the delta updates the node applies over MQTT (see src/ota.h).
+
+A delta turns the image running on the node (the base) into a new one. It is
+a list of COPY, ADD, INSERT and SEEK operations on the base (src/ota_delta.h),
+deflated with a small window so the node inflates it in a few KB of RAM, after
+an 80 byte header that is also the payload of the begin message:
+
+    magic "SIDL", version, window bits, 2 reserved, image size, stream size,
+    SHA-256 of the base image, SHA-256 of the new image
+
+The digests are the ones esp-idf appends to every image, the same the node
+reads from its partitions.
+
+    tools/ota_delta.py make running.bin firmware.bin -o update.delta
+    tools/ota_delta.py apply running.bin update.delta -o check.bin
+    tools/ota_push.py --broker localhost update.delta
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = b"SIDL"
+VERSION = 1
+HEADER = struct.Struct("<4sBBHII32s32s")
+
+OP_END, OP_COPY, OP_ADD, OP_INSERT, OP_SEEK = range(5)
+
+BLOCK = 16          # bytes hashed to find a match
+STRIDE = 4          # base positions indexed
+MIN_MATCH = 32      # shorter matches cost more than the bytes they save
+
+
+def image_digest(image):
+    """SHA-256 appended by esp-idf, checked by the bootloader"""
+    if len(image) < 56 or image[0] != 0xE9 or image[23] != 1:
+        raise ValueError("not an esp32 app image with an appended SHA-256")
+    return image[-32:]
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        byte = n & 0x7F
+        n >>= 7
+        if n:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+
+def zigzag(n):
+    return (n << 1) ^ (n >> 63)
+
+
+class Ops:
+    def __init__(self, base):
+        self.base = base
+        self.cursor = 0
+        self.out = bytearray()
+        self.counts = {}
+
+    def op(self, code, value, payload=b""):
+        self.out.append(code)
+        self.out += varint(value)
+        self.out += payload
+        self.counts[code] = self.counts.get(code, 0) + 1
+
+    def seek(self, to):
+        if to != self.cursor:
+            self.op(OP_SEEK, zigzag(to - self.cursor))
+            self.cursor = to
+
+    def copy(self, n):
+        self.op(OP_COPY, n)
+        self.cursor += n
+
+    def gap(self, data):
+        """New bytes between matches: a difference against the base where it
+        still lines up (moved code), as they are where it does not"""
+        if not data:
+            return
+        old = self.base[self.cursor:self.cursor + len(data)]
+        if len(old) == len(data):
+            diff = bytes((a - b) & 0xFF for a, b in zip(data, old))
+            if diff.count(0) * 2 >= len(diff):
+                self.op(OP_ADD, len(diff), diff)
+                self.cursor += len(diff)
+                return
+        self.op(OP_INSERT, len(data), data)
+
+
+def make_ops(base, new):
+    index = {}
+    for i in range(0, len(base) - BLOCK + 1, STRIDE):
+        index.setdefault(base[i:i + BLOCK], i)
+
+    ops = Ops(base)
+    pending = 0         # start of the new bytes not yet covered
+    i = 0
+    while i + BLOCK <= len(new):
+        key = new[i:i + BLOCK]
+        # keep following the base where the last match ended
+        j = ops.cursor + (i - pending)
+        if base[j:j + BLOCK] != key:
+            j = index.get(key)
+            if j is None:
+                i += 1
+                continue
+        back = 0
+        while i - back > pending and j - back > 0 and new[i - back - 1] == base[j - back - 1]:
+            back += 1
+        length = BLOCK
+        while i + length < len(new) and j + length < len(base) and new[i + length] == base[j + length]:
+            length += 1
+        if back + length < MIN_MATCH:
+            i += 1
+            continue
+        ops.gap(new[pending:i - back])
+        ops.seek(j - back)
+        ops.copy(back + length)
+        i += length
+        pending = i
+    ops.gap(new[pending:])
+    ops.out.append(OP_END)
+    return ops
+
+
+def make(base, new, window_bits):
+    ops = make_ops(base, new)
+    deflate = zlib.compressobj(9, zlib.DEFLATED, -window_bits, 9)
+    stream = deflate.compress(bytes(ops.out)) + deflate.flush()
+    header = HEADER.pack(MAGIC, VERSION, window_bits, 0, len(new), len(stream),
+                         image_digest(base), image_digest(new))
+    return header + stream, ops
+
+
+def parse(delta):
+    magic, version, window_bits, _, image_size, stream_size, base_digest, digest = HEADER.unpack_from(delta)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a delta update")
+    stream = delta[HEADER.size:]
+    if len(stream) != stream_size:
+        raise ValueError("truncated delta: %d of %d bytes" % (len(stream), stream_size))
+    return window_bits, image_size, base_digest, digest, stream
+
+
+def read_varint(data, pos):
+    value = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+def apply(base, delta):
+    """Reference decoder, same checks as the node"""
+    window_bits, image_size, base_digest, digest, stream = parse(delta)
+    if image_digest(base) != base_digest:
+        raise ValueError("the delta is for another base image")
+    ops = zlib.decompress(stream, -window_bits)
+    new = bytearray()
+    cursor = pos = 0
+    while True:
+        code = ops[pos]
+        pos += 1
+        if code == OP_END:
+            break
+        value, pos = read_varint(ops, pos)
+        if code == OP_COPY:
+            new += base[cursor:cursor + value]
+            cursor += value
+        elif code == OP_ADD:
+            new += bytes((a + b) & 0xFF for a, b in zip(base[cursor:cursor + value], ops[pos:pos + value]))
+            cursor += value
+            pos += value
+        elif code == OP_INSERT:
+            new += ops[pos:pos + value]
+            pos += value
+        elif code == OP_SEEK:
+            cursor += (value >> 1) ^ -(value & 1)
+        else:
+            raise ValueError("bad operation %d" % code)
+    if len(new) != image_size or image_digest(bytes(new)) != digest:
+        raise ValueError("the delta does not rebuild the image")
+    return bytes(new)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+    p = sub.add_parser("make", help="delta from the running image to a new one")
+    p.add_argument("base")
+    p.add_argument("new")
+    p.add_argument("-o", "--output", required=True)
+    p.add_argument("--window-bits", type=int, default=12,
+                   help="deflate window, at most CONFIG_OTA_WINDOW_BITS of the node (default 12)")
+    p = sub.add_parser("apply", help="rebuild the new image, as the node does")
+    p.add_argument("base")
+    p.add_argument("delta")
+    p.add_argument("-o", "--output")
+    args = parser.parse_args()
+
+    with open(args.base, "rb") as f:
+        base = f.read()
+    if args.command == "make":
+        if not 9 <= args.window_bits <= 15:
+            parser.error("--window-bits goes from 9 to 15")
+        with open(args.new, "rb") as f:
+            new = f.read()
+        delta, ops = make(base, new, args.window_bits)
+        apply(base, delta)
+        with open(args.output, "wb") as f:
+            f.write(delta)
+        print("%d -> %d bytes (%.1f%%), %d copy, %d add, %d insert, %d seek" % (
+            len(new), len(delta), 100.0 * len(delta) / len(new), ops.counts.get(OP_COPY, 0),
+            ops.counts.get(OP_ADD, 0), ops.counts.get(OP_INSERT, 0), ops.counts.get(OP_SEEK, 0)),
+            file=sys.stderr)
+    else:
+        with open(args.delta, "rb") as f:
+            new = apply(base, f.read())
+        print("rebuilt %d bytes" % len(new), file=sys.stderr)
+        if args.output:
+            with open(args.output, "wb") as f:
+                f.write(new)
+
+
+if __name__ == "__main__":
+    main()
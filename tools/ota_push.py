@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Send a delta update (tools/ota_delta.py) to the node through the broker.
+
+Publishes the header on /ciu/lopy4/ota/begin and then the stream in chunks
+on /ciu/lopy4/ota/chunk, one at a time, each after the node asks for it with
+"next <offset>" on /ciu/lopy4/ota/status. A chunk that gets no answer is sent
+again, and after a lost connection the begin message resumes the update where
+the node left it. Ends when the node reports "done" and, with --wait-running,
+when the new image reports in after its restart.
+
+    mosquitto -v &
+    tools/ota_push.py --broker localhost update.delta --wait-running
+
+Needs paho-mqtt (pip install paho-mqtt).
+"""
+
+import argparse
+import queue
+import sys
+import time
+
+import paho.mqtt.client as mqtt
+
+from ota_delta import HEADER, parse
+
+TOPIC_BEGIN = "/ciu/lopy4/ota/begin"
+TOPIC_CHUNK = "/ciu/lopy4/ota/chunk"
+TOPIC_STATUS = "/ciu/lopy4/ota/status"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("delta")
+    parser.add_argument("--broker", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--chunk", type=int, default=2048, help="stream bytes per message (default 2048)")
+    parser.add_argument("--timeout", type=float, default=30, help="seconds to wait for an answer (default 30)")
+    parser.add_argument("--retries", type=int, default=10)
+    parser.add_argument("--wait-running", action="store_true", help="wait for the new image to report in")
+    args = parser.parse_args()
+
+    with open(args.delta, "rb") as f:
+        delta = f.read()
+    _, image_size, _, digest, stream = parse(delta)
+    header = delta[:HEADER.size]
+
+    status = queue.Queue()
+    client = mqtt.Client()
+    client.on_connect = lambda c, userdata, flags, rc: c.subscribe(TOPIC_STATUS, qos=1)
+    client.on_message = lambda c, userdata, msg: status.put(msg.payload.decode(errors="replace"))
+    client.connect(args.broker, args.port)
+    client.loop_start()
+    time.sleep(1)
+
+    def wait():
+        try:
+            return status.get(timeout=args.timeout)
+        except queue.Empty:
+            return None
+
+    print("%d bytes rebuilding an image of %d" % (len(stream), image_size), file=sys.stderr)
+    client.publish(TOPIC_BEGIN, header, qos=1)
+    sent = None
+    retries = 0
+    start = time.time()
+    while True:
+        answer = wait()
+        if answer is None:
+            retries += 1
+            if retries > args.retries:
+                sys.exit("no answer from the node")
+            # also restarts the update if the node lost it
+            client.publish(TOPIC_BEGIN, header, qos=1)
+            continue
+        words = answer.split()
+        if words[0] == "next":
+            offset = int(words[1])
+            if offset == sent:
+                retries += 1
+            else:
+                retries = 0
+            sent = offset
+            chunk = stream[offset:offset + args.chunk]
+            client.publish(TOPIC_CHUNK, offset.to_bytes(4, "little") + chunk, qos=1)
+            print("\r%d / %d" % (offset + len(chunk), len(stream)), end="", file=sys.stderr)
+        elif words[0] == "done":
+            print("\nwritten in %.0f s, the node restarts" % (time.time() - start), file=sys.stderr)
+            break
+        elif words[0] == "error":
+            sys.exit("\nnode: %s" % answer)
+
+    if args.wait_running:
+        deadline = time.time() + 600
+        while time.time() < deadline:
+            answer = wait()
+            if answer and answer.startswith("running"):
+                print(answer, file=sys.stderr)
+                if answer.split()[1] != digest[:8].hex():
+                    sys.exit("the node is not running the new image")
+                break
+        else:
+            sys.exit("the node did not report in")
+    client.loop_stop()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""Extract the samples kept in the time-series store of the `storage` partition.
+
+The store follows the log ring (CONFIG_LOG_RING_SIZE_KB) on the partition and
+packs the samples of each channel into 1 KB blocks (see src/tsdb.h). This tool
+reads a dump of the whole partition and prints the samples as CSV.
+
+    esptool.py read_flash 0x312000 0xEE000 storage.bin
+    tools/tsdb_decode.py storage.bin --channel 0 --from 2021-06-01 > irradiation.csv
+
+Channels 0 and 1 hold the raw samples of the irradiation and battery ADCs, 2 and
+3 the records published for them (the "s" field of the MQTT payload is the seq
+column). Samples still in RAM when the dump was taken (the open block of each
+channel) are not included.
+"""
+
+import argparse
+import datetime
+import struct
+import sys
+
+BLOCK_SIZE = 1024
+HEADER = struct.Struct("<IIBBHqqHHII")
+BLOCK_MAGIC = 0x31425354
+BLOCK_VERSION = 2
+
+DOD_BITS = (4, 7, 12, 32)
+VALUE_BITS = (6, 10, 16, 32)
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+class BitReader:
+    def __init__(self, data):
+        self.value = int.from_bytes(data, "big")
+        self.size = len(data) * 8
+        self.pos = 0
+
+    def get(self, n):
+        if n == 0:
+            return 0
+        self.pos += n
+        if self.pos > self.size:
+            raise EOFError
+        return (self.value >> (self.size - self.pos)) & ((1 << n) - 1)
+
+    def code(self, widths):
+        if self.get(1) == 0:
+            return 0
+        ones = 0
+        while ones < 3 and self.get(1) == 1:
+            ones += 1
+        return self.get(widths[ones])
+
+
+def unzigzag(v):
+    return (v >> 1) ^ -(v & 1)
+
+
+def to_int32(v):
+    v &= 0xFFFFFFFF
+    return v - (1 << 32) if v & 0x80000000 else v
+
+
+def read_blocks(region):
+    for offset in range(0, len(region) - BLOCK_SIZE + 1, BLOCK_SIZE):
+        block = region[offset:offset + BLOCK_SIZE]
+        magic, seq, channel, version, count, first_ms, last_ms, crc, payload, first_seq, _ = HEADER.unpack_from(block)
+        if magic != BLOCK_MAGIC or version != BLOCK_VERSION:
+            continue
+        if payload > BLOCK_SIZE - HEADER.size or crc16(block[:28] + block[30:HEADER.size + payload]) != crc:
+            print("# corrupted block at 0x%x" % offset, file=sys.stderr)
+            continue
+        yield seq, channel, count, first_ms, last_ms, first_seq, block[HEADER.size:HEADER.size + payload]
+
+
+def decode_block(count, first_ms, payload):
+    bits = BitReader(payload)
+    t, delta, v = first_ms, 0, 0
+    for _ in range(count):
+        delta = to_int32(delta + unzigzag(bits.code(DOD_BITS)))
+        t += delta
+        v = to_int32(v + unzigzag(bits.code(VALUE_BITS)))
+        yield t, v
+
+
+def parse_time(text):
+    try:
+        return int(float(text) * 1000)
+    except ValueError:
+        moment = datetime.datetime.fromisoformat(text)
+        if moment.tzinfo is None:
+            moment = moment.replace(tzinfo=datetime.timezone.utc)
+        return int(moment.timestamp() * 1000)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("dump", help="raw dump of the storage partition")
+    parser.add_argument("--offset-kb", type=int, default=256,
+                        help="start of the store in the dump (CONFIG_LOG_RING_SIZE_KB, 0 without log ring)")
+    parser.add_argument("--channel", type=int, help="only this channel")
+    parser.add_argument("--from", dest="start", type=parse_time, default=None,
+                        help="first instant, epoch seconds or ISO 8601 (UTC if no zone)")
+    parser.add_argument("--to", dest="end", type=parse_time, default=None, help="last instant, same format")
+    args = parser.parse_args()
+
+    with open(args.dump, "rb") as f:
+        region = f.read()[args.offset_kb * 1024:]
+
+    blocks = sorted(read_blocks(region), key=lambda b: b[0])
+    print("channel,seq,timestamp_ms,utc,value")
+    for seq, channel, count, first_ms, last_ms, first_seq, payload in blocks:
+        if args.channel is not None and channel != args.channel:
+            continue
+        if (args.start is not None and last_ms < args.start) or (args.end is not None and first_ms > args.end):
+            continue
+        try:
+            for i, (t, v) in enumerate(decode_block(count, first_ms, payload)):
+                if (args.start is not None and t < args.start) or (args.end is not None and t > args.end):
+                    continue
+                utc = datetime.datetime.fromtimestamp(t / 1000, datetime.timezone.utc)
+                print("%d,%d,%d,%s,%d" % (channel, first_seq + i, t, utc.strftime("%Y-%m-%dT%H:%M:%S.%f")[:-3] + "Z", v))
+        except EOFError:
+            print("# block %d ends early" % seq, file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()